@@ -0,0 +1,145 @@
+/**
+ * @file AicInfo.c
+ * @author amarioguy (Arminder Singh)
+ *
+ * Prints how often each AIC interrupt source was dispatched and how long its handlers took,
+ * as counted by AppleAicDxe when it's built with PcdAppleAicStats.
+ *
+ * Usage: AicInfo [-h] [-r]
+ *   -h  also print the handler duration histogram of each source
+ *   -r  zero the counters after printing them
+ *
+ * @copyright Copyright (c) amarioguy (Arminder Singh), 2022.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause-Patent
+ *
+ */
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/ShellCEntryLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/UefiLib.h>
+
+#include <Protocol/AppleAicDiagnostics.h>
+
+/**
+ * Converts generic timer ticks to nanoseconds without overflowing for long totals.
+ */
+STATIC UINT64 AicInfoTicksToNs(IN UINT64 Ticks, IN UINT64 Frequency)
+{
+    UINT64 Remainder;
+    UINT64 Seconds;
+
+    if(Frequency == 0)
+    {
+        return 0;
+    }
+    Seconds = DivU64x64Remainder(Ticks, Frequency, &Remainder);
+    return MultU64x32(Seconds, 1000000000) + DivU64x64Remainder(MultU64x32(Remainder, 1000000000), Frequency, NULL);
+}
+
+STATIC VOID AicInfoPrintHistogram(IN APPLE_AIC_DIAGNOSTICS_IRQ_STATS *Stats, IN UINT64 Frequency)
+{
+    UINTN Bucket;
+
+    for(Bucket = 0; Bucket < APPLE_AIC_DIAGNOSTICS_HISTOGRAM_BUCKETS; Bucket++)
+    {
+        if(Stats->Histogram[Bucket] == 0)
+        {
+            continue;
+        }
+        if(Bucket == APPLE_AIC_DIAGNOSTICS_HISTOGRAM_BUCKETS - 1)
+        {
+            Print(L"      >= %8lu ns: %lu\n", AicInfoTicksToNs(LShiftU64(1, Bucket), Frequency), Stats->Histogram[Bucket]);
+        }
+        else
+        {
+            Print(L"      <  %8lu ns: %lu\n", AicInfoTicksToNs(LShiftU64(1, Bucket + 1), Frequency), Stats->Histogram[Bucket]);
+        }
+    }
+}
+
+INTN EFIAPI ShellAppMain(IN UINTN Argc, IN CHAR16 **Argv)
+{
+    APPLE_AIC_DIAGNOSTICS_PROTOCOL *Diagnostics;
+    APPLE_AIC_DIAGNOSTICS_SUMMARY Summary;
+    APPLE_AIC_DIAGNOSTICS_IRQ_STATS *Stats;
+    BOOLEAN Histogram = FALSE;
+    BOOLEAN Reset = FALSE;
+    UINT64 TotalTicks = 0;
+    UINTN Count = 0;
+    UINTN Index;
+    EFI_STATUS Status;
+
+    for(Index = 1; Index < Argc; Index++)
+    {
+        if(StrCmp(Argv[Index], L"-h") == 0)
+        {
+            Histogram = TRUE;
+        }
+        else if(StrCmp(Argv[Index], L"-r") == 0)
+        {
+            Reset = TRUE;
+        }
+        else
+        {
+            Print(L"usage: AicInfo [-h] [-r]\n");
+            return 1;
+        }
+    }
+
+    Status = gBS->LocateProtocol(&gAppleAicDiagnosticsProtocolGuid, NULL, (VOID **)&Diagnostics);
+    if(EFI_ERROR(Status))
+    {
+        Print(L"AIC interrupt accounting not available (build with PcdAppleAicStats): %r\n", Status);
+        return 1;
+    }
+
+    Diagnostics->GetSummary(Diagnostics, &Summary);
+    Status = Diagnostics->GetIrqStats(Diagnostics, &Count, NULL);
+    if(Status == EFI_BUFFER_TOO_SMALL)
+    {
+        //leave room for sources that fire between the two calls
+        Count += 8;
+        Stats = AllocatePool(Count * sizeof(APPLE_AIC_DIAGNOSTICS_IRQ_STATS));
+        if(Stats == NULL)
+        {
+            return 1;
+        }
+        Status = Diagnostics->GetIrqStats(Diagnostics, &Count, Stats);
+        if(EFI_ERROR(Status))
+        {
+            Print(L"failed to read AIC counters: %r\n", Status);
+            FreePool(Stats);
+            return 1;
+        }
+
+        Print(L"source        count   total us     avg ns     max ns\n");
+        for(Index = 0; Index < Count; Index++)
+        {
+            Print(L"%6u %12lu %10lu %10lu %10lu%s\n", Stats[Index].Source, Stats[Index].Count,
+                AicInfoTicksToNs(Stats[Index].TotalTicks, Summary.CounterFrequency) / 1000,
+                AicInfoTicksToNs(Stats[Index].TotalTicks, Summary.CounterFrequency) / Stats[Index].Count,
+                AicInfoTicksToNs(Stats[Index].MaxTicks, Summary.CounterFrequency),
+                (Stats[Index].Source == 17) ? L"  (physical timer)" : (Stats[Index].Source == 18) ? L"  (virtual timer)" : L"");
+            if(Histogram)
+            {
+                AicInfoPrintHistogram(&Stats[Index], Summary.CounterFrequency);
+            }
+            TotalTicks += Stats[Index].TotalTicks;
+        }
+        FreePool(Stats);
+    }
+
+    Print(L"%lu us in interrupt handlers\n", AicInfoTicksToNs(TotalTicks, Summary.CounterFrequency) / 1000);
+    Print(L"%lu spurious, %lu unassigned\n", Summary.Spurious, Summary.Unassigned);
+    Print(L"ignored FIQs: %lu fast IPI, %lu PMC, %lu uncore PMC\n", Summary.FastIpisIgnored, Summary.PmcIgnored, Summary.UncorePmcIgnored);
+
+    if(Reset)
+    {
+        Diagnostics->Reset(Diagnostics);
+    }
+    return 0;
+}
@@ -0,0 +1,121 @@
+/**
+ * Copyright (c) 2024, AppleWOA authors.
+ *
+ * Module Name:
+ *     DartInfo.c
+ *
+ * Abstract:
+ *     Prints what AppleDartIoMmuDxe knows about each DART: how it's set up, how much mapping and
+ *     flushing it has done and the last fault it reported.
+ *
+ *     Usage: DartInfo [-p] [-r]
+ *       -p  check the DARTs for faults first instead of waiting for the next poll
+ *       -r  zero the counters after printing them
+ *
+ * Environment:
+ *     UEFI Shell.
+ *
+ * License:
+ *     SPDX-License-Identifier: (BSD-2-Clause-Patent OR MIT) AND GPL-2.0
+*/
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/ShellCEntryLib.h>
+#include <Library/TimerLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/UefiLib.h>
+
+#include <Protocol/AppleDartDiagnostics.h>
+
+STATIC CONST CHAR16 *DartInfoMode(APPLE_DART_DIAGNOSTICS_STATS *Stats) {
+    if(!Stats->Managed) {
+        return L"firmware";
+    }
+    if(Stats->Bypass) {
+        return L"bypass";
+    }
+    return Stats->Translating ? L"translate" : L"off";
+}
+
+STATIC VOID DartInfoPrintFault(APPLE_DART_DIAGNOSTICS_STATS *Stats) {
+    Print(L"    last fault: SID %u, IOVA 0x%lx, error 0x%08x%a%a%a%a%a%a\n",
+        Stats->LastFaultSid, Stats->LastFaultIova, Stats->LastFaultError,
+        (Stats->LastFaultKind & APPLE_DART_FAULT_READ) ? " read" : "",
+        (Stats->LastFaultKind & APPLE_DART_FAULT_WRITE) ? " write" : "",
+        (Stats->LastFaultKind & APPLE_DART_FAULT_NO_PTE) ? " no-PTE" : "",
+        (Stats->LastFaultKind & APPLE_DART_FAULT_NO_L2) ? " no-L2" : "",
+        (Stats->LastFaultKind & APPLE_DART_FAULT_NO_L1) ? " no-L1" : "",
+        (Stats->LastFaultKind & APPLE_DART_FAULT_NO_TTBR) ? " no-TTBR" : "");
+}
+
+INTN EFIAPI ShellAppMain(IN UINTN Argc, IN CHAR16 **Argv) {
+    APPLE_DART_DIAGNOSTICS_PROTOCOL *Diagnostics;
+    APPLE_DART_DIAGNOSTICS_STATS *Stats;
+    BOOLEAN Poll = FALSE;
+    BOOLEAN Reset = FALSE;
+    UINTN Count = 0;
+    EFI_STATUS Status;
+
+    for(UINTN i = 1; i < Argc; i++) {
+        if(StrCmp(Argv[i], L"-p") == 0) {
+            Poll = TRUE;
+        }
+        else if(StrCmp(Argv[i], L"-r") == 0) {
+            Reset = TRUE;
+        }
+        else {
+            Print(L"usage: DartInfo [-p] [-r]\n");
+            return 1;
+        }
+    }
+
+    Status = gBS->LocateProtocol(&gAppleDartDiagnosticsProtocolGuid, NULL, (VOID **)&Diagnostics);
+    if(EFI_ERROR(Status)) {
+        Print(L"DART diagnostics not available: %r\n", Status);
+        return 1;
+    }
+
+    if(Poll) {
+        Diagnostics->PollFaults(Diagnostics);
+    }
+
+    Status = Diagnostics->GetStats(Diagnostics, &Count, NULL);
+    if(Status != EFI_BUFFER_TOO_SMALL) {
+        Print(L"no DARTs: %r\n", Status);
+        return 1;
+    }
+    Stats = AllocatePool(Count * sizeof(APPLE_DART_DIAGNOSTICS_STATS));
+    if(Stats == NULL) {
+        return 1;
+    }
+    Status = Diagnostics->GetStats(Diagnostics, &Count, Stats);
+    if(EFI_ERROR(Status)) {
+        Print(L"failed to read DART counters: %r\n", Status);
+        FreePool(Stats);
+        return 1;
+    }
+
+    for(UINTN i = 0; i < Count; i++) {
+        Print(L"%a reg[%u] at 0x%lx: %s, %u streams\n", Stats[i].Name, Stats[i].RegIndex, Stats[i].BaseAddress,
+            DartInfoMode(&Stats[i]), Stats[i].Nsid);
+        if(Stats[i].Translating) {
+            Print(L"    %lu maps (%lu pages), %lu unmaps\n", Stats[i].Maps, Stats[i].MappedPages, Stats[i].Unmaps);
+        }
+        if(Stats[i].Flushes != 0) {
+            Print(L"    %lu TLB flushes, %lu ns waiting (%lu ns each)\n", Stats[i].Flushes,
+                GetTimeInNanoSecond(Stats[i].FlushWaitTicks), GetTimeInNanoSecond(Stats[i].FlushWaitTicks) / Stats[i].Flushes);
+        }
+        if(Stats[i].Faults != 0) {
+            Print(L"    %lu faults\n", Stats[i].Faults);
+            DartInfoPrintFault(&Stats[i]);
+        }
+    }
+    FreePool(Stats);
+
+    if(Reset) {
+        Diagnostics->ResetStats(Diagnostics);
+    }
+    return 0;
+}
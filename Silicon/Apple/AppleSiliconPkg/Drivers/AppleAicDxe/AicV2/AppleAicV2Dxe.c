@@ -14,12 +14,15 @@
  */
 
 #include <Library/AppleAicLib.h>
+#include <Library/BaseLib.h>
 #include "AppleAicDxe.h"
 #include <Library/AppleSysRegs.h>
 #include <Library/ArmGenericTimerCounterLib.h>
 #include <Library/AppleDTLib.h>
+#include <Protocol/AppleAicMask.h>
 
-#define APPLE_FAST_IPI_STATUS_PENDING BIT(0)
+//IRQ numbers 17, 18 and 19 are reserved for the timer FIQs, these bits are never masked/unmasked through AIC.
+#define AIC_V2_TIMER_FIQ_BITS (BIT(17) | BIT(18) | BIT(19))
 
 STATIC UINT64 AicV2Base;
 AIC_INFO_STRUCT *AicInfoStruct;
@@ -29,6 +32,24 @@ STATIC UINT64 mAicV2IrqMaskClearOffset, mAicV2HwStateOffset;
 STATIC UINT64 mAicV2EventReg;
 STATIC APPLE_AIC_VERSION mAicVersion;
 
+/**
+ * Where each IRQ's bit lives in the MASK_SET, MASK_CLR and HW_STATE arrays.
+ * 
+ * Offset is relative to the start of the array (die stride included), Mask is the bit to write.
+ * This is worked out once at init so the mask/unmask/EOI paths don't divide by MaxIrqs on every call.
+ * A Mask of 0 means the IRQ isn't masked through AIC at all (the timer FIQs).
+ */
+typedef struct {
+    UINT32 Offset;
+    UINT32 Mask;
+} AIC_V2_IRQ_REG;
+
+STATIC AIC_V2_IRQ_REG *mAicV2IrqRegs;
+
+//one bit per IRQ (all CPU dies), IRQs in neither bitmap are level high triggered
+STATIC UINT32 *mAicV2EdgeTriggered, *mAicV2LevelLowTriggered;
+STATIC UINT64 mAicV2MaskSetBase, mAicV2MaskClearBase, mAicV2HwStateBase;
+
 STATIC EFI_STATUS EFIAPI AppleAicV2CalculateRegisterOffsets(IN VOID);
 
 extern EFI_HARDWARE_INTERRUPT_PROTOCOL   gHardwareInterruptAicV2Protocol;
@@ -54,7 +75,9 @@ STATIC EFI_STATUS EFIAPI AppleAicV2MaskInterrupt(
         return EFI_UNSUPPORTED;
     }
 
-    AppleAicMaskInterrupt(AicV2Base, Source, mAicV2IrqMaskSetOffset);
+    if(mAicV2IrqRegs[Source].Mask != 0) {
+        MmioWrite32(mAicV2MaskSetBase + mAicV2IrqRegs[Source].Offset, mAicV2IrqRegs[Source].Mask);
+    }
     return EFI_SUCCESS;
 }
 
@@ -78,7 +101,9 @@ STATIC EFI_STATUS EFIAPI AppleAicV2UnmaskInterrupt(
         return EFI_UNSUPPORTED;
     }
 
-    AppleAicUnmaskInterrupt(AicV2Base, Source, mAicV2IrqMaskClearOffset);
+    if(mAicV2IrqRegs[Source].Mask != 0) {
+        MmioWrite32(mAicV2MaskClearBase + mAicV2IrqRegs[Source].Offset, mAicV2IrqRegs[Source].Mask);
+    }
     return EFI_SUCCESS;
 }
 
@@ -103,7 +128,7 @@ STATIC EFI_STATUS EFIAPI AppleAicV2GetInterruptState(
         ASSERT(FALSE);
         return EFI_UNSUPPORTED;
     }
-    *State = AppleAicReadInterruptState(AicV2Base, Source, mAicV2HwStateOffset);
+    *State = (MmioRead32(mAicV2HwStateBase + mAicV2IrqRegs[Source].Offset) & mAicV2IrqRegs[Source].Mask) != 0;
     return EFI_SUCCESS;
 }
 
@@ -129,9 +154,15 @@ STATIC EFI_STATUS EFIAPI AppleAicV2EndOfInterrupt(
         return EFI_SUCCESS;
     }
 
+    if(Source >= AicInfoStruct->MaxIrqs)
+    {
+        ASSERT(FALSE);
+        return EFI_UNSUPPORTED;
+    }
+
     //reading the interrupt source in the event register acks and masks it at the same time
     //all we need to do is unmask it here. (note that for hardware IRQs, this assumes the hardware interrupt source has been cleared)
-    AppleAicUnmaskInterrupt(AicV2Base, Source, mAicV2IrqMaskClearOffset);
+    MmioWrite32(mAicV2MaskClearBase + mAicV2IrqRegs[Source].Offset, mAicV2IrqRegs[Source].Mask);
 
     return EFI_SUCCESS;
 }
@@ -140,7 +171,7 @@ STATIC EFI_STATUS EFIAPI AppleAicV2EndOfInterrupt(
 /**
  * Calculate the AIC register offsets on the platform.
  * 
- * @return EFI_SUCCESS if successful, EFI_ERROR(-1) if an error occurred.
+ * @return EFI_SUCCESS if successful, EFI_NOT_FOUND if the ADT has no usable "aic" node.
  */
 STATIC EFI_STATUS EFIAPI AppleAicV2CalculateRegisterOffsets(IN VOID)
 {
@@ -148,6 +179,7 @@ STATIC EFI_STATUS EFIAPI AppleAicV2CalculateRegisterOffsets(IN VOID)
     if (!InterruptControllerNode) {
         DEBUG((EFI_D_INFO | EFI_D_LOAD | EFI_D_ERROR, "no ADT supplied, exiting\n"));
         ASSERT(FALSE);
+        return EFI_NOT_FOUND;
     }
 
 
@@ -161,7 +193,10 @@ STATIC EFI_STATUS EFIAPI AppleAicV2CalculateRegisterOffsets(IN VOID)
      * 
      */
     
-    dt_node_reg(InterruptControllerNode, 0, &AicV2Base, NULL);
+    if(dt_node_reg(InterruptControllerNode, 0, &AicV2Base, NULL) != 0) {
+        DEBUG((DEBUG_ERROR, "%a: no AIC registers in the ADT\n", __FUNCTION__));
+        return EFI_NOT_FOUND;
+    }
     AicInfoStruct->NumIrqs = AppleAicGetNumInterrupts(AicV2Base);
     AicInfoStruct->MaxIrqs = AppleAicGetMaxInterrupts(AicV2Base);
 
@@ -217,11 +252,187 @@ STATIC EFI_STATUS EFIAPI AppleAicV2CalculateRegisterOffsets(IN VOID)
     mAicV2HwStateOffset = CurrentOffset;
     AicInfoStruct->DieStride = CurrentOffset - StartOffset;
     AicInfoStruct->RegSize = (mAicV2EventReg - AicV2Base) + 4;
+
+    mAicV2MaskSetBase = AicV2Base + mAicV2IrqMaskSetOffset;
+    mAicV2MaskClearBase = AicV2Base + mAicV2IrqMaskClearOffset;
+    mAicV2HwStateBase = AicV2Base + mAicV2HwStateOffset;
     
     return EFI_SUCCESS;
 
 }
 
+/**
+ * Builds the per-IRQ register/bit table for every IRQ on every CPU die.
+ * 
+ * IRQ numbers past MaxIrqs belong to the next die, whose registers are DieStride further along.
+ * 
+ * @return EFI_SUCCESS if successful, EFI_OUT_OF_RESOURCES if the table couldn't be allocated.
+ */
+STATIC EFI_STATUS EFIAPI AppleAicV2BuildIrqRegTable(IN VOID)
+{
+    UINT32 Die;
+    UINT32 IrqNum;
+    AIC_V2_IRQ_REG *Entry;
+
+    mAicV2IrqRegs = AllocatePool(sizeof(AIC_V2_IRQ_REG) * AicInfoStruct->MaxIrqs * AicInfoStruct->NumCpuDies);
+    if(mAicV2IrqRegs == NULL)
+    {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    Entry = mAicV2IrqRegs;
+    for(Die = 0; Die < AicInfoStruct->NumCpuDies; Die++)
+    {
+        for(IrqNum = 0; IrqNum < AicInfoStruct->MaxIrqs; IrqNum++, Entry++)
+        {
+            Entry->Offset = Die * AicInfoStruct->DieStride + AIC_MASK_REG(IrqNum);
+            Entry->Mask = AIC_MASK_BIT(IrqNum);
+        }
+    }
+
+    //IRQ numbers 17, 18 and 19 are reserved for the timer FIQs, which are enabled/disabled independently.
+    mAicV2IrqRegs[17].Mask = 0;
+    mAicV2IrqRegs[18].Mask = 0;
+    mAicV2IrqRegs[19].Mask = 0;
+
+    return EFI_SUCCESS;
+}
+
+/**
+ * Marks the IRQs of a device in Bitmap.
+ * 
+ * @param Irqs - the device's "interrupts" property
+ * @param Length - length of the property in bytes
+ * @param Bitmap - trigger type bitmap to mark the IRQs in
+ */
+STATIC VOID AppleAicV2MarkDeviceIrqs(IN CONST UINT32 *Irqs, IN UINTN Length, IN UINT32 *Bitmap)
+{
+    UINTN Index;
+
+    for(Index = 0; Index < Length / sizeof(UINT32); Index++)
+    {
+        if(Irqs[Index] < AicInfoStruct->MaxIrqs * AicInfoStruct->NumCpuDies)
+        {
+            Bitmap[AIC_MASK_REG(Irqs[Index]) / 4] |= AIC_MASK_BIT(Irqs[Index]);
+        }
+    }
+}
+
+/**
+ * Works out the trigger type of every IRQ once, so GetTriggerType doesn't have to search the ADT.
+ * 
+ * AIC does not have a facility to see if a given IRQ is level or edge triggered,
+ * however, other than PCIe MSIs, every other IRQ is a level triggered interrupt.
+ * 
+ * So the PCIe MSI range from the apcie node is marked edge rising, and the interrupts of I2C controllers,
+ * which are level low, are picked out of a single pass over the ADT. Only interrupts whose
+ * interrupt-parent is AIC are AIC IRQ numbers, the rest (GPIO pins for example) are skipped.
+ * Everything else is level high.
+ * 
+ * @return EFI_SUCCESS if successful, EFI_OUT_OF_RESOURCES if the bitmaps couldn't be allocated.
+ */
+STATIC EFI_STATUS EFIAPI AppleAicV2BuildTriggerTypeBitmaps(IN VOID)
+{
+    CONST UINTN BitmapSize = sizeof(UINT32) * DIV_ROUND_UP(AicInfoStruct->MaxIrqs * AicInfoStruct->NumCpuDies, 32);
+    STATIC CONST CHAR8 * CONST Keys[] = { "name", "interrupts", "interrupt-parent" };
+    dt_node_t *InterruptControllerNode = dt_get("aic");
+    dt_node_t *ApcieNode = dt_get("apcie");
+    dt_node_t *Node;
+    dt_cursor_t Cursor;
+    UINT32 AicPhandle;
+    UINT32 EdgeTriggeredIrqNumStart = 0;
+    UINT32 EdgeTriggeredIrqNums = 0;
+    UINT32 IrqNum;
+
+    mAicV2EdgeTriggered = AllocateZeroPool(BitmapSize);
+    mAicV2LevelLowTriggered = AllocateZeroPool(BitmapSize);
+    if(mAicV2EdgeTriggered == NULL || mAicV2LevelLowTriggered == NULL)
+    {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    if(ApcieNode != NULL)
+    {
+        dt_prop_desc_t MsiProps[] = {
+            { "msi-vector-offset", DT_PROP_U32, 1, &EdgeTriggeredIrqNumStart, 0 },
+            { "msi-vectors", DT_PROP_U32, 1, &EdgeTriggeredIrqNums, 0 },
+        };
+        if (dt_node_props_decode(ApcieNode, MsiProps, ARRAY_SIZE(MsiProps)) != 0) {
+            DEBUG((DEBUG_ERROR, "%a - PCIe MSI vector range missing from ADT\n", __FUNCTION__));
+            EdgeTriggeredIrqNums = 0;
+        }
+    }
+    DEBUG((DEBUG_VERBOSE, "Edge triggered IRQ numbers: %u-%u\n", EdgeTriggeredIrqNumStart, EdgeTriggeredIrqNumStart + EdgeTriggeredIrqNums));
+    for(IrqNum = EdgeTriggeredIrqNumStart; IrqNum < EdgeTriggeredIrqNumStart + EdgeTriggeredIrqNums; IrqNum++)
+    {
+        if(IrqNum < AicInfoStruct->MaxIrqs * AicInfoStruct->NumCpuDies)
+        {
+            mAicV2EdgeTriggered[AIC_MASK_REG(IrqNum) / 4] |= AIC_MASK_BIT(IrqNum);
+        }
+    }
+
+    AicPhandle = dt_node_u32(InterruptControllerNode, "AAPL,phandle", 0);
+    dt_cursor_init(&Cursor, (dt_node_t *)FixedPcdGet64(PcdAdtPointer), 0);
+    while((Node = dt_cursor_next(&Cursor)) != NULL)
+    {
+        VOID *Values[ARRAY_SIZE(Keys)];
+        size_t Lengths[ARRAY_SIZE(Keys)];
+
+        if(dt_node_props(Node, Keys, Values, Lengths, ARRAY_SIZE(Keys)) != ARRAY_SIZE(Keys) || *(UINT32 *)Values[2] != AicPhandle)
+        {
+            continue;
+        }
+        if(Lengths[0] >= 3 && AsciiStrnCmp(Values[0], "i2c", 3) == 0)
+        {
+            AppleAicV2MarkDeviceIrqs(Values[1], Lengths[1], mAicV2LevelLowTriggered);
+        }
+    }
+    return EFI_SUCCESS;
+}
+
+/**
+ * Masks every implemented IRQ on every CPU die, one MASK_SET word (32 IRQs) at a time.
+ * 
+ * Unlike AppleAicV2MaskInterrupt, this also masks IRQs 17-19, nothing should be left unmasked here.
+ */
+STATIC VOID AppleAicV2MaskAllInterrupts(VOID)
+{
+    UINT32 Die;
+    UINT32 Word;
+
+    for(Die = 0; Die < AicInfoStruct->NumCpuDies; Die++)
+    {
+        for(Word = 0; Word < DIV_ROUND_UP(AicInfoStruct->NumIrqs, 32); Word++)
+        {
+            MmioWrite32(mAicV2MaskSetBase + Die * AicInfoStruct->DieStride + AIC_MASK_REG(Word * 32), MAX_UINT32);
+        }
+    }
+}
+
+/**
+ * Returns the bits of mask word Word that fall in the IRQ range [First, End),
+ * leaving out the timer FIQ numbers like the single IRQ mask/unmask paths do.
+ */
+STATIC UINT32 AppleAicV2WordBits(UINTN Word, UINTN First, UINTN End)
+{
+    UINTN Base = Word * 32;
+    UINT32 Bits = MAX_UINT32;
+
+    if(First > Base)
+    {
+        Bits &= ~(UINT32)(BIT(First - Base) - 1);
+    }
+    if(End < Base + 32)
+    {
+        Bits &= (UINT32)(BIT(End - Base) - 1);
+    }
+    if(Word == 0)
+    {
+        Bits &= ~AIC_V2_TIMER_FIQ_BITS;
+    }
+    return Bits;
+}
+
 /**
  * EFI_CPU_INTERRUPT_HANDLER entered when a processor interrupt is taken.
  * 
@@ -243,6 +454,8 @@ STATIC VOID EFIAPI AppleAicV2InterruptHandler(
     HARDWARE_INTERRUPT_HANDLER TimerInterruptHandlerVirt;
     UINT64 PmcStatus;
     UINT64 UncorePmcStatus;
+    UINT64 StartTicks = 0;
+    BOOLEAN FiqHandled = FALSE;
 
     AicInterrupt = AppleAicAcknowledgeInterrupt(mAicV2EventReg);
     HwInterruptHandler = AicRegisteredInterruptHandlers[AicInterrupt];
@@ -258,13 +471,17 @@ STATIC VOID EFIAPI AppleAicV2InterruptHandler(
     if (InterruptType == EXCEPT_AARCH64_FIQ) {
         /**
          * 
-         * Fast IPIs are not implemented yet, acknowledge but do not act upon them.
-         * (Ideally, they won't be necessary at all given the nature of the firmware)
+         * The firmware only runs on the boot core and never sends fast IPIs, so one showing up here
+         * was left pending by an earlier boot stage. Acknowledge it so it doesn't fire again.
          * 
          */
         if (AppleAicV2ReadIpiStatusRegister() & APPLE_FAST_IPI_STATUS_PENDING) {
-            DEBUG((DEBUG_INFO, "Fast IPIs not supported yet, acking\n"));
+            DEBUG((DEBUG_INFO, "Unexpected fast IPI, acking\n"));
             AppleAicV2WriteIpiStatusRegister(APPLE_FAST_IPI_STATUS_PENDING);
+            FiqHandled = TRUE;
+            if(FeaturePcdGet(PcdAppleAicStats)) {
+                AicStatsSummary.FastIpisIgnored++;
+            }
         }
 
         /**
@@ -286,7 +503,13 @@ STATIC VOID EFIAPI AppleAicV2InterruptHandler(
             {
 
                 //for now we hardcode the timer interrupt to 17.
+                if(FeaturePcdGet(PcdAppleAicStats)) {
+                    StartTicks = ArmGenericTimerGetSystemCount();
+                }
                 TimerInterruptHandlerPhys(17, SystemContext);
+                if(FeaturePcdGet(PcdAppleAicStats)) {
+                    AppleAicStatsRecord(17, StartTicks);
+                }
             }
             else
             {
@@ -294,6 +517,7 @@ STATIC VOID EFIAPI AppleAicV2InterruptHandler(
                 DEBUG((DEBUG_ERROR, "Physical timer interrupt not assigned!\n"));
                 ASSERT(FALSE);
             }
+            FiqHandled = TRUE;
 
         }
         else if ((ArmReadCntvCtl() & (ARM_ARCH_TIMER_ENABLE | ARM_ARCH_TIMER_IMASK | ARM_ARCH_TIMER_ISTATUS)) == (ARM_ARCH_TIMER_ENABLE | ARM_ARCH_TIMER_ISTATUS))
@@ -302,7 +526,13 @@ STATIC VOID EFIAPI AppleAicV2InterruptHandler(
             if(TimerInterruptHandlerVirt != NULL)
             {
                 //ditto for the virtual timer.
+                if(FeaturePcdGet(PcdAppleAicStats)) {
+                    StartTicks = ArmGenericTimerGetSystemCount();
+                }
                 TimerInterruptHandlerVirt(18, SystemContext);
+                if(FeaturePcdGet(PcdAppleAicStats)) {
+                    AppleAicStatsRecord(18, StartTicks);
+                }
             }
             else
             {
@@ -310,6 +540,7 @@ STATIC VOID EFIAPI AppleAicV2InterruptHandler(
                 DEBUG((DEBUG_ERROR, "Virtual timer interrupt not assigned!\n"));
                 ASSERT(FALSE);
             }
+            FiqHandled = TRUE;
         }
 
         /**
@@ -325,6 +556,10 @@ STATIC VOID EFIAPI AppleAicV2InterruptHandler(
             PmcStatus = PmcStatus & ~(BIT18 | BIT17 | BIT16);
             PmcStatus |= (BIT18 | BIT17 | BIT16 | BIT0);
             AppleAicV2WritePmcControlRegister(PmcStatus);   
+            FiqHandled = TRUE;
+            if(FeaturePcdGet(PcdAppleAicStats)) {
+                AicStatsSummary.PmcIgnored++;
+            }
         }
         else if (FIELD_GET(APPLE_UPMCR0_IMODE, UncorePmcStatus) == APPLE_UPMCR_FIQ_IMODE && (AppleAicV2ReadUncorePmcStatusRegister() & APPLE_UPMSR_IACT))
         {
@@ -332,6 +567,14 @@ STATIC VOID EFIAPI AppleAicV2InterruptHandler(
             UncorePmcStatus = UncorePmcStatus & ~(APPLE_UPMCR0_IMODE);
             UncorePmcStatus |= APPLE_UPMCR_OFF_IMODE;
             AppleAicV2WriteUncorePmcControlRegister(UncorePmcStatus);
+            FiqHandled = TRUE;
+            if(FeaturePcdGet(PcdAppleAicStats)) {
+                AicStatsSummary.UncorePmcIgnored++;
+            }
+        }
+
+        if(FeaturePcdGet(PcdAppleAicStats) && !FiqHandled) {
+            AicStatsSummary.Spurious++;
         }
     }
 
@@ -345,13 +588,27 @@ STATIC VOID EFIAPI AppleAicV2InterruptHandler(
      * 
      */
     else if (InterruptType == EXCEPT_AARCH64_IRQ) {
+
+        //the event register reads 0 when there was nothing pending
+        if(FeaturePcdGet(PcdAppleAicStats) && AicInterrupt == 0) {
+            AicStatsSummary.Spurious++;
+        }
         
         if(HwInterruptHandler != NULL) {
+            if(FeaturePcdGet(PcdAppleAicStats)) {
+                StartTicks = ArmGenericTimerGetSystemCount();
+            }
             HwInterruptHandler(AicInterrupt, SystemContext);
+            if(FeaturePcdGet(PcdAppleAicStats)) {
+                AppleAicStatsRecord(AicInterrupt, StartTicks);
+            }
         }
         else
         {
             //if an interrupt is unassigned, ack it and exit.
+            if(FeaturePcdGet(PcdAppleAicStats)) {
+                AicStatsSummary.Unassigned++;
+            }
             DEBUG((DEBUG_ERROR, "Unassigned AIC IRQ: 0x%x\n", AicInterrupt));
             AppleAicV2EndOfInterrupt(&gHardwareInterruptAicV2Protocol, AicInterrupt);
         }
@@ -370,12 +627,12 @@ EFI_HARDWARE_INTERRUPT_PROTOCOL gHardwareInterruptAicV2Protocol = {
 
 
 /**
- * Gets the type of trigger for a given IRQ.
+ * Gets the type of trigger for a given IRQ, as worked out by AppleAicV2BuildTriggerTypeBitmaps at init.
  * 
- * @param This 
- * @param Source 
- * @param TriggerType 
- * @return STATIC 
+ * @param This - HardwareInterrupt2 protocol instance pointer
+ * @param Source - IRQ number
+ * @param TriggerType - trigger type of the IRQ
+ * @return EFI_SUCCESS if successful, ASSERTs if Source >= MAX_IRQs
  */
 STATIC EFI_STATUS EFIAPI AppleAicV2GetIrqTriggerType(
     IN EFI_HARDWARE_INTERRUPT2_PROTOCOL *This,
@@ -383,40 +640,19 @@ STATIC EFI_STATUS EFIAPI AppleAicV2GetIrqTriggerType(
     OUT EFI_HARDWARE_INTERRUPT2_TRIGGER_TYPE *TriggerType
 )
 {
-    dt_node_t *ApcieNode = dt_get("apcie");
-    if (!ApcieNode) {
-        DEBUG((EFI_D_ERROR, "no ADT supplied, exiting\n"));
+    if(Source >= AicInfoStruct->MaxIrqs)
+    {
         ASSERT(FALSE);
+        return EFI_UNSUPPORTED;
     }
 
-
-    UINT32 EdgeTriggeredIrqNumStart = dt_node_u32(ApcieNode, "msi-vector-offset", 0);
-    UINT32 EdgeTriggeredIrqNums = dt_node_u32(ApcieNode, "msi-vectors", 0);
-    BOOLEAN IsEdgeTriggeredIrq = FALSE;
-    /**
-     * AIC does not have a facility to see if a given IRQ is level or edge triggered,
-     * however, other than PCIe MSIs, every other IRQ is a level triggered interrupt.
-     * 
-     * As such, get the PCIe MSI IRQ number range from the DT, compare it to Source, and if it matches any of the IRQ numbers,
-     * state that this is a edge rising triggered interrupt. In all other cases, unconditionally indicate
-     * a level triggered interrupt.
-     * 
-     * TODO: some interrupts are level low triggered (namely I2C interrupts), account for these.
-     */
-
-    DEBUG((DEBUG_VERBOSE, "Edge triggered IRQ number start: %d", EdgeTriggeredIrqNumStart));
-    for(UINT64 IrqNum = EdgeTriggeredIrqNumStart; IrqNum < (EdgeTriggeredIrqNumStart + EdgeTriggeredIrqNums); IrqNum++)
+    if(mAicV2EdgeTriggered[AIC_MASK_REG(Source) / 4] & AIC_MASK_BIT(Source))
     {
-        if(Source == IrqNum)
-        {
-            DEBUG((DEBUG_VERBOSE, "%d is an edge triggered IRQ\n", (UINT32)Source));
-            IsEdgeTriggeredIrq = TRUE;
-            break;
-        }
+        *TriggerType = EFI_HARDWARE_INTERRUPT2_TRIGGER_EDGE_RISING;
     }
-    if(IsEdgeTriggeredIrq)
+    else if(mAicV2LevelLowTriggered[AIC_MASK_REG(Source) / 4] & AIC_MASK_BIT(Source))
     {
-        *TriggerType = EFI_HARDWARE_INTERRUPT2_TRIGGER_EDGE_RISING;
+        *TriggerType = EFI_HARDWARE_INTERRUPT2_TRIGGER_LEVEL_LOW;
     }
     else {
         *TriggerType = EFI_HARDWARE_INTERRUPT2_TRIGGER_LEVEL_HIGH;
@@ -448,6 +684,103 @@ EFI_HARDWARE_INTERRUPT2_PROTOCOL gHardwareInterrupt2AicV2Protocol = {
 
 
 
+/**
+ * Masks every IRQ on every CPU die.
+ * 
+ * @param This - mask protocol instance pointer
+ * @return EFI_SUCCESS
+ */
+STATIC EFI_STATUS EFIAPI AppleAicV2MaskAll(
+    IN APPLE_AIC_MASK_PROTOCOL *This
+)
+{
+    AppleAicV2MaskAllInterrupts();
+    return EFI_SUCCESS;
+}
+
+/**
+ * Unmasks Count IRQs starting at First, writing each MASK_CLR word once.
+ * 
+ * @param This - mask protocol instance pointer
+ * @param First - first IRQ number
+ * @param Count - number of IRQs
+ * @return EFI_SUCCESS if successful, EFI_INVALID_PARAMETER if the range goes past the last IRQ.
+ */
+STATIC EFI_STATUS EFIAPI AppleAicV2UnmaskRange(
+    IN APPLE_AIC_MASK_PROTOCOL *This,
+    IN UINTN First,
+    IN UINTN Count
+)
+{
+    UINTN End = First + Count;
+    UINTN Word;
+
+    if(End < First || End > AicInfoStruct->MaxIrqs * AicInfoStruct->NumCpuDies)
+    {
+        return EFI_INVALID_PARAMETER;
+    }
+
+    for(Word = First / 32; Word < DIV_ROUND_UP(End, 32); Word++)
+    {
+        UINT32 Bits = AppleAicV2WordBits(Word, First, End);
+
+        if(Bits != 0)
+        {
+            //the table entry of the word's first IRQ has the word offset, die stride included
+            MmioWrite32(mAicV2MaskClearBase + mAicV2IrqRegs[Word * 32].Offset, Bits);
+        }
+    }
+    return EFI_SUCCESS;
+}
+
+/**
+ * Sets the mask state of IRQs 0 to NumIrqs - 1 from a bitmap, a set bit masks the IRQ.
+ * 
+ * Every word costs at most one MASK_SET and one MASK_CLR write.
+ * 
+ * @param This - mask protocol instance pointer
+ * @param MaskBitmap - DIV_ROUND_UP(NumIrqs, 32) words
+ * @param NumIrqs - number of IRQs covered by MaskBitmap
+ * @return EFI_SUCCESS if successful, EFI_INVALID_PARAMETER if MaskBitmap is NULL or NumIrqs goes past the last IRQ.
+ */
+STATIC EFI_STATUS EFIAPI AppleAicV2SetMaskState(
+    IN APPLE_AIC_MASK_PROTOCOL *This,
+    IN CONST UINT32 *MaskBitmap,
+    IN UINTN NumIrqs
+)
+{
+    UINTN Word;
+
+    if(MaskBitmap == NULL || NumIrqs > AicInfoStruct->MaxIrqs * AicInfoStruct->NumCpuDies)
+    {
+        return EFI_INVALID_PARAMETER;
+    }
+
+    for(Word = 0; Word < DIV_ROUND_UP(NumIrqs, 32); Word++)
+    {
+        UINT32 Bits = AppleAicV2WordBits(Word, 0, NumIrqs);
+        UINT32 Offset = mAicV2IrqRegs[Word * 32].Offset;
+
+        if((MaskBitmap[Word] & Bits) != 0)
+        {
+            MmioWrite32(mAicV2MaskSetBase + Offset, MaskBitmap[Word] & Bits);
+        }
+        if((~MaskBitmap[Word] & Bits) != 0)
+        {
+            MmioWrite32(mAicV2MaskClearBase + Offset, ~MaskBitmap[Word] & Bits);
+        }
+    }
+    return EFI_SUCCESS;
+}
+
+// AIC bulk mask protocol instance
+STATIC APPLE_AIC_MASK_PROTOCOL mAppleAicV2MaskProtocol = {
+  APPLE_AIC_MASK_PROTOCOL_REVISION,
+  AppleAicV2MaskAll,
+  AppleAicV2UnmaskRange,
+  AppleAicV2SetMaskState
+};
+
 /**
  * The ExitBootServices event. Will disable interrupts and shut down AIC hardware in handoff from DXE core to OS.
  * 
@@ -460,7 +793,6 @@ VOID EFIAPI AppleAicV2ExitBootServicesEvent(
     IN VOID *Context
 )
 {
-    UINTN InterruptIndex;
     UINT32 AicConfigValue = (UINT32)(AIC_V2_CFG_ENABLE);
     AicConfigValue = ~AicConfigValue;
 
@@ -469,10 +801,7 @@ VOID EFIAPI AppleAicV2ExitBootServicesEvent(
     AppleAicAcknowledgeInterrupt(mAicV2EventReg);
 
     //mask all other interrupts by writing to MASK_SET
-    for(InterruptIndex = 0; InterruptIndex < AicInfoStruct->NumIrqs; InterruptIndex++)
-    {
-        AppleAicV2MaskInterrupt(&gHardwareInterruptAicV2Protocol, InterruptIndex);
-    }
+    AppleAicV2MaskAllInterrupts();
 
     //disable the AIC controller
     MmioAnd32(AicV2Base + AIC_V2_CONFIG, AicConfigValue);
@@ -492,7 +821,6 @@ EFI_STATUS AppleAicV2DxeInit(IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE *Sys
 
     mAicVersion = aicVersion;
 
-    UINTN InterruptIndex;
     EFI_STATUS Status;
     UINT32 AicV2NumInterrupts;
     UINT32 AicV2MaxInterrupts;
@@ -506,6 +834,23 @@ EFI_STATUS AppleAicV2DxeInit(IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE *Sys
 
     //set up and collect variables in global variables that will get passed to functions that need them.
     Status = AppleAicV2CalculateRegisterOffsets();
+    if(EFI_ERROR(Status))
+    {
+        DEBUG((DEBUG_ERROR, "%a: failed to calculate the AIC register offsets\n", __FUNCTION__));
+        return Status;
+    }
+    Status = AppleAicV2BuildIrqRegTable();
+    if(EFI_ERROR(Status))
+    {
+        DEBUG((DEBUG_ERROR, "%a: failed to allocate the IRQ register table\n", __FUNCTION__));
+        return Status;
+    }
+    Status = AppleAicV2BuildTriggerTypeBitmaps();
+    if(EFI_ERROR(Status))
+    {
+        DEBUG((DEBUG_ERROR, "%a: failed to allocate the IRQ trigger type bitmaps\n", __FUNCTION__));
+        return Status;
+    }
     AicV2NumInterrupts = AicInfoStruct->NumIrqs;
     AicV2MaxInterrupts = AicInfoStruct->MaxIrqs;
     
@@ -535,10 +880,7 @@ EFI_STATUS AppleAicV2DxeInit(IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE *Sys
     MmioOr32(AicV2Base + AIC_V2_CONFIG, AIC_V2_CFG_ENABLE);
 
     //start from a clean state by disabling all interrupts
-    for(InterruptIndex = 0; InterruptIndex < AicV2NumInterrupts; InterruptIndex++)
-    {
-        AppleAicV2MaskInterrupt(&gHardwareInterruptAicV2Protocol, InterruptIndex);
-    }
+    AppleAicV2MaskAllInterrupts();
 
     /**
      * 
@@ -568,5 +910,26 @@ EFI_STATUS AppleAicV2DxeInit(IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE *Sys
         AppleAicV2InterruptHandler,
         AppleAicV2ExitBootServicesEvent
     );
-    return Status;
+    if(EFI_ERROR(Status))
+    {
+        return Status;
+    }
+
+    Status = gBS->InstallMultipleProtocolInterfaces(
+        &ImageHandle,
+        &gAppleAicMaskProtocolGuid,
+        &mAppleAicV2MaskProtocol,
+        NULL
+    );
+    if(EFI_ERROR(Status))
+    {
+        return Status;
+    }
+
+    //interrupt accounting is only there for debugging, the driver works fine without it
+    if(FeaturePcdGet(PcdAppleAicStats) && EFI_ERROR(AppleAicStatsInstall(ImageHandle, AicInfoStruct->NumIrqs)))
+    {
+        DEBUG((DEBUG_ERROR, "%a: failed to set up interrupt accounting\n", __FUNCTION__));
+    }
+    return EFI_SUCCESS;
 }
\ No newline at end of file
@@ -21,10 +21,12 @@
 #include <Library/UefiLib.h>
 #include <Library/ArmLib.h>
 #include <Library/AppleAicLib.h>
+#include <Library/PcdLib.h>
 
 #include <Protocol/Cpu.h>
 #include <Protocol/HardwareInterrupt.h>
 #include <Protocol/HardwareInterrupt2.h>
+#include <Protocol/AppleAicDiagnostics.h>
 
 
 extern HARDWARE_INTERRUPT_HANDLER  *AicRegisteredInterruptHandlers;
@@ -47,6 +49,15 @@ RegisterInterruptSource (
   );
 
 
+// Interrupt accounting, only used when PcdAppleAicStats is set
+
+extern APPLE_AIC_DIAGNOSTICS_SUMMARY AicStatsSummary;
+
+VOID AppleAicStatsRecord(IN UINTN Source, IN UINT64 StartTicks);
+
+EFI_STATUS AppleAicStatsInstall(IN EFI_HANDLE ImageHandle, IN UINT32 NumIrqs);
+
+
 //TODO: AICv1 API
 
 EFI_STATUS AppleAicV1DxeInit(IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE *SystemTable);
@@ -0,0 +1,176 @@
+/**
+ * @file AppleAicStats.c
+ * @author amarioguy (Arminder Singh)
+ *
+ * Interrupt accounting for the AIC DXE driver, only built in when PcdAppleAicStats is set.
+ *
+ * The interrupt handler counts dispatches per source and times each handler against the generic
+ * timer counter (CNTPCT). The counters are read out through APPLE_AIC_DIAGNOSTICS_PROTOCOL,
+ * which the AicInfo shell application prints.
+ *
+ * @copyright Copyright (c) amarioguy (Arminder Singh), 2022.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause-Patent
+ *
+ */
+
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/ArmGenericTimerCounterLib.h>
+#include <Protocol/AppleAicDiagnostics.h>
+
+#include "AppleAicDxe.h"
+
+APPLE_AIC_DIAGNOSTICS_SUMMARY AicStatsSummary;
+
+STATIC APPLE_AIC_DIAGNOSTICS_IRQ_STATS *mAicIrqStats;
+STATIC UINT32 mAicIrqStatsCount;
+
+/**
+ * Accounts for one dispatch of an interrupt handler. Called from the interrupt handler.
+ *
+ * @param Source - IRQ number the handler was called for
+ * @param StartTicks - generic timer count when the handler was called
+ */
+VOID AppleAicStatsRecord(
+    IN UINTN Source,
+    IN UINT64 StartTicks
+)
+{
+    APPLE_AIC_DIAGNOSTICS_IRQ_STATS *Stats;
+    UINT64 Ticks;
+    UINTN Bucket;
+
+    if(mAicIrqStats == NULL || Source >= mAicIrqStatsCount)
+    {
+        return;
+    }
+
+    Ticks = ArmGenericTimerGetSystemCount() - StartTicks;
+    Bucket = (Ticks == 0) ? 0 : (UINTN)HighBitSet64(Ticks);
+
+    Stats = &mAicIrqStats[Source];
+    Stats->Count++;
+    Stats->TotalTicks += Ticks;
+    Stats->MaxTicks = MAX(Stats->MaxTicks, Ticks);
+    Stats->Histogram[MIN(Bucket, APPLE_AIC_DIAGNOSTICS_HISTOGRAM_BUCKETS - 1)]++;
+}
+
+STATIC EFI_STATUS EFIAPI AppleAicDiagnosticsGetSummary(
+    IN APPLE_AIC_DIAGNOSTICS_PROTOCOL *This,
+    OUT APPLE_AIC_DIAGNOSTICS_SUMMARY *Summary
+)
+{
+    EFI_TPL OldTpl;
+
+    if(Summary == NULL)
+    {
+        return EFI_INVALID_PARAMETER;
+    }
+
+    //the interrupt handler updates these, keep it out while copying
+    OldTpl = gBS->RaiseTPL(TPL_HIGH_LEVEL);
+    CopyMem(Summary, &AicStatsSummary, sizeof(*Summary));
+    gBS->RestoreTPL(OldTpl);
+    return EFI_SUCCESS;
+}
+
+STATIC EFI_STATUS EFIAPI AppleAicDiagnosticsGetIrqStats(
+    IN APPLE_AIC_DIAGNOSTICS_PROTOCOL *This,
+    IN OUT UINTN *Count,
+    OUT APPLE_AIC_DIAGNOSTICS_IRQ_STATS *Stats OPTIONAL
+)
+{
+    EFI_TPL OldTpl;
+    UINTN Found = 0;
+    UINT32 Source;
+
+    if(Count == NULL || (Stats == NULL && *Count != 0))
+    {
+        return EFI_INVALID_PARAMETER;
+    }
+
+    OldTpl = gBS->RaiseTPL(TPL_HIGH_LEVEL);
+    for(Source = 0; Source < mAicIrqStatsCount; Source++)
+    {
+        if(mAicIrqStats[Source].Count == 0)
+        {
+            continue;
+        }
+        if(Found < *Count)
+        {
+            CopyMem(&Stats[Found], &mAicIrqStats[Source], sizeof(*Stats));
+        }
+        Found++;
+    }
+    gBS->RestoreTPL(OldTpl);
+
+    if(Found > *Count)
+    {
+        *Count = Found;
+        return EFI_BUFFER_TOO_SMALL;
+    }
+    *Count = Found;
+    return EFI_SUCCESS;
+}
+
+STATIC EFI_STATUS EFIAPI AppleAicDiagnosticsReset(
+    IN APPLE_AIC_DIAGNOSTICS_PROTOCOL *This
+)
+{
+    EFI_TPL OldTpl = gBS->RaiseTPL(TPL_HIGH_LEVEL);
+    UINT64 CounterFrequency = AicStatsSummary.CounterFrequency;
+    UINT32 Source;
+
+    ZeroMem(&AicStatsSummary, sizeof(AicStatsSummary));
+    AicStatsSummary.CounterFrequency = CounterFrequency;
+    ZeroMem(mAicIrqStats, sizeof(APPLE_AIC_DIAGNOSTICS_IRQ_STATS) * mAicIrqStatsCount);
+    for(Source = 0; Source < mAicIrqStatsCount; Source++)
+    {
+        mAicIrqStats[Source].Source = Source;
+    }
+    gBS->RestoreTPL(OldTpl);
+    return EFI_SUCCESS;
+}
+
+// AIC diagnostics protocol instance
+STATIC APPLE_AIC_DIAGNOSTICS_PROTOCOL mAppleAicDiagnosticsProtocol = {
+  APPLE_AIC_DIAGNOSTICS_PROTOCOL_REVISION,
+  AppleAicDiagnosticsGetSummary,
+  AppleAicDiagnosticsGetIrqStats,
+  AppleAicDiagnosticsReset
+};
+
+/**
+ * Sets up the per-source counters and installs the diagnostics protocol.
+ *
+ * @param ImageHandle - handle to install the protocol on
+ * @param NumIrqs - number of IRQ numbers to keep counters for
+ * @return EFI_SUCCESS if successful, EFI_OUT_OF_RESOURCES if the counters couldn't be allocated.
+ */
+EFI_STATUS AppleAicStatsInstall(
+    IN EFI_HANDLE ImageHandle,
+    IN UINT32 NumIrqs
+)
+{
+    UINT32 Source;
+
+    mAicIrqStats = AllocateZeroPool(sizeof(APPLE_AIC_DIAGNOSTICS_IRQ_STATS) * NumIrqs);
+    if(mAicIrqStats == NULL)
+    {
+        return EFI_OUT_OF_RESOURCES;
+    }
+    for(Source = 0; Source < NumIrqs; Source++)
+    {
+        mAicIrqStats[Source].Source = Source;
+    }
+    AicStatsSummary.CounterFrequency = ArmGenericTimerGetTimerFreq();
+    mAicIrqStatsCount = NumIrqs;
+
+    return gBS->InstallMultipleProtocolInterfaces(
+        &ImageHandle,
+        &gAppleAicDiagnosticsProtocolGuid,
+        &mAppleAicDiagnosticsProtocol,
+        NULL
+    );
+}
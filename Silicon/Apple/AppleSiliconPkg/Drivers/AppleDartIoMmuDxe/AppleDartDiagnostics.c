@@ -0,0 +1,223 @@
+/**
+ * Copyright (c) 2024, AppleWOA authors.
+ *
+ * Module Name:
+ *     AppleDartDiagnostics.c
+ *
+ * Abstract:
+ *     DART fault reporting and counters.
+ *
+ *     A DMA access that misses the page tables used to show up as nothing more than a hung USB
+ *     transfer. The error registers of every DART are polled from the driver's periodic timer, and
+ *     each fault is decoded (stream, IOVA, what was missing) and logged. Together with map, unmap
+ *     and TLB flush counters, these are handed out through APPLE_DART_DIAGNOSTICS_PROTOCOL so the
+ *     DartInfo shell application can show them.
+ *
+ *     The DART error interrupt isn't used: the AIC driver is only built in some configurations,
+ *     and a fault is rare enough that finding out about it 10ms later changes nothing.
+ *
+ * Environment:
+ *     UEFI DXE (Driver Execution Environment).
+ *
+ * License:
+ *     SPDX-License-Identifier: (BSD-2-Clause-Patent OR MIT) AND GPL-2.0
+*/
+
+#include <PiDxe.h>
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/DebugLib.h>
+#include <Library/IoLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/AppleDTLib.h>
+
+#include <Protocol/AppleDartDiagnostics.h>
+
+#include <Drivers/AppleDartIoMmuDxe.h>
+
+//
+// Description:
+//   Translates the fault bits of a T8020 or T8110 error register into APPLE_DART_FAULT_* flags.
+//
+
+STATIC UINT32 AppleDartDecodeFault(APPLE_DART_INFO *Dart, UINT32 Error) {
+    UINT32 Kind = 0;
+
+    if(Dart->Type == AppleDartT8110Compatible) {
+        Kind |= (Error & DART_T8110_ERROR_READ_FAULT) ? APPLE_DART_FAULT_READ : 0;
+        Kind |= (Error & DART_T8110_ERROR_WRITE_FAULT) ? APPLE_DART_FAULT_WRITE : 0;
+        Kind |= (Error & DART_T8110_ERROR_NO_PTE) ? APPLE_DART_FAULT_NO_PTE : 0;
+        Kind |= (Error & DART_T8110_ERROR_NO_PMD) ? APPLE_DART_FAULT_NO_L2 : 0;
+        Kind |= (Error & DART_T8110_ERROR_NO_PGD) ? APPLE_DART_FAULT_NO_L1 : 0;
+        Kind |= (Error & DART_T8110_ERROR_NO_TTBR) ? APPLE_DART_FAULT_NO_TTBR : 0;
+    }
+    else {
+        Kind |= (Error & DART_T8020_ERROR_READ_FAULT) ? APPLE_DART_FAULT_READ : 0;
+        Kind |= (Error & DART_T8020_ERROR_WRITE_FAULT) ? APPLE_DART_FAULT_WRITE : 0;
+        Kind |= (Error & DART_T8020_ERROR_NO_PTE) ? APPLE_DART_FAULT_NO_PTE : 0;
+        Kind |= (Error & DART_T8020_ERROR_NO_PMD) ? APPLE_DART_FAULT_NO_L2 : 0;
+        Kind |= (Error & DART_T8020_ERROR_NO_TTBR) ? APPLE_DART_FAULT_NO_TTBR : 0;
+    }
+    return Kind;
+}
+
+//
+// Description:
+//   Reads the error register of a DART, and if it latched a fault, records and logs it and clears it.
+//
+// Return values:
+//   TRUE - the DART reported a fault.
+//   FALSE - nothing to report.
+//
+
+BOOLEAN AppleDartCheckErrors(APPLE_DART_INFO *Dart) {
+    APPLE_DART_COUNTERS *Counters = &Dart->Counters;
+    UINT32 ErrorReg, AddrLoReg, AddrHiReg, ErrorFlag;
+    UINT32 Error;
+
+    if(Dart->Type == AppleDartT8110Compatible) {
+        ErrorReg = DART_T8110_ERROR;
+        AddrLoReg = DART_T8110_ERROR_ADDR_LO;
+        AddrHiReg = DART_T8110_ERROR_ADDR_HI;
+        ErrorFlag = DART_T8110_ERROR_FLAG;
+    }
+    else {
+        ErrorReg = DART_T8020_ERROR;
+        AddrLoReg = DART_T8020_ERROR_ADDR_LO;
+        AddrHiReg = DART_T8020_ERROR_ADDR_HI;
+        ErrorFlag = DART_T8020_ERROR_FLAG;
+    }
+
+    Error = MmioRead32(Dart->BaseAddress + ErrorReg);
+    if((Error & ErrorFlag) == 0) {
+        return FALSE;
+    }
+
+    Counters->Faults++;
+    Counters->LastFaultError = Error;
+    Counters->LastFaultKind = AppleDartDecodeFault(Dart, Error);
+    if(Dart->Type == AppleDartT8110Compatible) {
+        Counters->LastFaultSid = FIELD_GET(DART_T8110_ERROR_STREAM, Error);
+    }
+    else {
+        Counters->LastFaultSid = FIELD_GET(DART_T8020_ERROR_STREAM, Error);
+    }
+    Counters->LastFaultIova = ((UINT64)MmioRead32(Dart->BaseAddress + AddrHiReg) << 32) | MmioRead32(Dart->BaseAddress + AddrLoReg);
+
+    //
+    // The error bits are write-one-to-clear.
+    //
+    MmioWrite32(Dart->BaseAddress + ErrorReg, Error);
+
+    DEBUG((DEBUG_ERROR, "DART %a reg[%d] fault: error 0x%08x, SID %u, IOVA 0x%llx%a%a%a%a%a%a\n",
+        dt_node_prop(Dart->Node, "name", NULL), Dart->RegIndex, Error, Counters->LastFaultSid, Counters->LastFaultIova,
+        (Counters->LastFaultKind & APPLE_DART_FAULT_READ) ? " read" : "",
+        (Counters->LastFaultKind & APPLE_DART_FAULT_WRITE) ? " write" : "",
+        (Counters->LastFaultKind & APPLE_DART_FAULT_NO_PTE) ? " no-PTE" : "",
+        (Counters->LastFaultKind & APPLE_DART_FAULT_NO_L2) ? " no-L2" : "",
+        (Counters->LastFaultKind & APPLE_DART_FAULT_NO_L1) ? " no-L1" : "",
+        (Counters->LastFaultKind & APPLE_DART_FAULT_NO_TTBR) ? " no-TTBR" : ""));
+    return TRUE;
+}
+
+//
+// Description:
+//   Checks every DART this driver set up for faults. The ones left to the firmware before us are
+//   none of our business. Callers must be at TPL_NOTIFY.
+//
+
+VOID AppleDartCheckAllErrors(VOID) {
+    for(UINT32 i = 0; i < DartCount; i++) {
+        if(DartInfo[i].Managed) {
+            AppleDartCheckErrors(&DartInfo[i]);
+        }
+    }
+}
+
+STATIC EFI_STATUS EFIAPI AppleDartDiagnosticsGetStats(IN APPLE_DART_DIAGNOSTICS_PROTOCOL *This, IN OUT UINTN *Count, OUT APPLE_DART_DIAGNOSTICS_STATS *Stats) {
+    EFI_TPL OldTpl;
+
+    if(Count == NULL || (Stats == NULL && *Count != 0)) {
+        return EFI_INVALID_PARAMETER;
+    }
+    if(*Count < DartCount) {
+        *Count = DartCount;
+        return EFI_BUFFER_TOO_SMALL;
+    }
+
+    OldTpl = gBS->RaiseTPL(TPL_NOTIFY);
+    for(UINT32 i = 0; i < DartCount; i++) {
+        APPLE_DART_INFO *Dart = &DartInfo[i];
+        APPLE_DART_DIAGNOSTICS_STATS *Entry = &Stats[i];
+        CHAR8 *NodeName = dt_node_prop(Dart->Node, "name", NULL);
+
+        ZeroMem(Entry, sizeof(*Entry));
+        Entry->BaseAddress = Dart->BaseAddress;
+        if(NodeName != NULL) {
+            AsciiStrnCpyS(Entry->Name, sizeof(Entry->Name), NodeName, sizeof(Entry->Name) - 1);
+        }
+        Entry->RegIndex = Dart->RegIndex;
+        Entry->Nsid = Dart->Nsid;
+        Entry->Managed = Dart->Managed;
+        Entry->Bypass = Dart->BypassMode;
+        Entry->Translating = (Dart->Domain != NULL);
+        if(Dart->Domain != NULL) {
+            Entry->Maps = Dart->Domain->Table.Maps;
+            Entry->MappedPages = Dart->Domain->Table.MappedPages;
+            Entry->Unmaps = Dart->Domain->Table.Unmaps;
+        }
+        Entry->Flushes = Dart->Counters.Flushes;
+        Entry->FlushWaitTicks = Dart->Counters.FlushWaitTicks;
+        Entry->Faults = Dart->Counters.Faults;
+        Entry->LastFaultError = Dart->Counters.LastFaultError;
+        Entry->LastFaultKind = Dart->Counters.LastFaultKind;
+        Entry->LastFaultSid = Dart->Counters.LastFaultSid;
+        Entry->LastFaultIova = Dart->Counters.LastFaultIova;
+    }
+    gBS->RestoreTPL(OldTpl);
+
+    *Count = DartCount;
+    return EFI_SUCCESS;
+}
+
+STATIC EFI_STATUS EFIAPI AppleDartDiagnosticsPollFaults(IN APPLE_DART_DIAGNOSTICS_PROTOCOL *This) {
+    EFI_TPL OldTpl = gBS->RaiseTPL(TPL_NOTIFY);
+
+    AppleDartCheckAllErrors();
+    gBS->RestoreTPL(OldTpl);
+    return EFI_SUCCESS;
+}
+
+STATIC EFI_STATUS EFIAPI AppleDartDiagnosticsResetStats(IN APPLE_DART_DIAGNOSTICS_PROTOCOL *This) {
+    EFI_TPL OldTpl = gBS->RaiseTPL(TPL_NOTIFY);
+
+    for(UINT32 i = 0; i < DartCount; i++) {
+        APPLE_DART_INFO *Dart = &DartInfo[i];
+
+        ZeroMem(&Dart->Counters, sizeof(Dart->Counters));
+        if(Dart->Domain != NULL) {
+            Dart->Domain->Table.Maps = 0;
+            Dart->Domain->Table.MappedPages = 0;
+            Dart->Domain->Table.Unmaps = 0;
+        }
+    }
+    gBS->RestoreTPL(OldTpl);
+    return EFI_SUCCESS;
+}
+
+STATIC APPLE_DART_DIAGNOSTICS_PROTOCOL mAppleDartDiagnosticsProtocol = {
+    APPLE_DART_DIAGNOSTICS_PROTOCOL_REVISION,
+    AppleDartDiagnosticsGetStats,
+    AppleDartDiagnosticsPollFaults,
+    AppleDartDiagnosticsResetStats,
+};
+
+EFI_STATUS AppleDartDiagnosticsInstall(EFI_HANDLE *Handle) {
+    return gBS->InstallMultipleProtocolInterfaces (
+                    Handle,
+                    &gAppleDartDiagnosticsProtocolGuid,
+                    &mAppleDartDiagnosticsProtocol,
+                    NULL
+                    );
+}
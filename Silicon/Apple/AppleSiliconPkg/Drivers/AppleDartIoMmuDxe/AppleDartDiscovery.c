@@ -0,0 +1,214 @@
+/**
+ * Copyright (c) 2024, AppleWOA authors.
+ *
+ * Module Name:
+ *     AppleDartDiscovery.c
+ *
+ * Abstract:
+ *     Finds every DART in the ADT and which device streams are wired to them.
+ *
+ *     DARTs are found by compatible rather than by name, so new SoCs and new kinds of DART users
+ *     (PCIe ports, ANS, display) show up without changes here. Every reg entry of a DART node is
+ *     a DART of its own, e.g. each DWC3 has two behind one "dart-usbN" node.
+ *
+ * Environment:
+ *     UEFI DXE (Driver Execution Environment).
+ *
+ * License:
+ *     SPDX-License-Identifier: (BSD-2-Clause-Patent OR MIT) AND GPL-2.0
+*/
+
+#include <PiDxe.h>
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/DebugLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/PcdLib.h>
+#include <Library/AppleDTLib.h>
+
+#include <Drivers/AppleDartIoMmuDxe.h>
+
+STATIC CONST CHAR8 *mDartCompatibles[] = { "dart,t8020", "dart,t6000", "dart,t8110" };
+
+STATIC APPLE_DART_STREAM *mDartStreams;
+STATIC UINT32 mDartStreamCount;
+
+//
+// Description:
+//   Fills in what can be known about a DART without touching it.
+//
+
+STATIC VOID AppleDartDescribe(APPLE_DART_INFO *Dart, dt_node_t *Node, UINT32 RegIndex, UINT64 BaseAddress) {
+    CHAR8 *CompatibleStr = dt_node_prop(Node, "compatible", NULL);
+
+    Dart->BaseAddress = BaseAddress;
+    Dart->Node = Node;
+    Dart->RegIndex = RegIndex;
+    //
+    // The ADT doesn't say whether the table walker snoops, that's known per SoC family.
+    //
+    Dart->CoherentWalk = FeaturePcdGet(PcdAppleDartCoherentWalk);
+    if(CompatibleStr != NULL && AsciiStrCmp(CompatibleStr, "dart,t8110") == 0) {
+        Dart->Type = AppleDartT8110Compatible;
+    }
+    else {
+        Dart->Type = AppleDartT8020Compatible;
+    }
+
+    //
+    // t6000 and later put physical addresses in the PTEs shifted down by 4.
+    //
+    if(CompatibleStr != NULL && (AsciiStrCmp(CompatibleStr, "dart,t8110") == 0 || AsciiStrCmp(CompatibleStr, "dart,t6000") == 0)) {
+        Dart->Shift = 4;
+    }
+}
+
+//
+// Description:
+//   Records the mapper children of a DART node as streams of its DARTs.
+//
+// Return values:
+//   Number of streams found, only counted if Streams is NULL.
+//
+
+STATIC UINT32 AppleDartCollectStreams(dt_node_t *Node, UINT32 DartIndex, UINT32 DartCount, APPLE_DART_STREAM *Streams) {
+    UINT32 MapperCount = dt_foreach_name_prefix(Node, "mapper", NULL, 0);
+    dt_node_t **Mappers;
+    UINT32 Found = 0;
+
+    if(Streams == NULL || MapperCount == 0) {
+        return MapperCount;
+    }
+    Mappers = AllocatePool(MapperCount * sizeof(dt_node_t *));
+    if(Mappers == NULL) {
+        return 0;
+    }
+    dt_foreach_name_prefix(Node, "mapper", Mappers, MapperCount);
+
+    for(UINT32 i = 0; i < MapperCount; i++) {
+        UINT32 Sid = 0;
+        UINT32 Phandle = 0;
+        dt_prop_desc_t Desc[] = {
+            { "reg", DT_PROP_U32, 1, &Sid, 0 },
+            { "AAPL,phandle", DT_PROP_U32, 1, &Phandle, 0 },
+        };
+        if(dt_node_props_decode(Mappers[i], Desc, ARRAY_SIZE(Desc)) != 0) {
+            continue;
+        }
+        Streams[Found].Mapper = Mappers[i];
+        Streams[Found].Phandle = Phandle;
+        Streams[Found].Sid = Sid;
+        Streams[Found].DartIndex = DartIndex;
+        Streams[Found].DartCount = DartCount;
+        Found++;
+    }
+    FreePool(Mappers);
+    return Found;
+}
+
+//
+// Description:
+//   Builds the DART table from every DART compatible node in the ADT, and the stream table
+//   AppleDartDeviceStreams() looks devices up in. Nothing is read from or written to the DARTs.
+//
+// Return values:
+//   EFI_SUCCESS - *Info has *Count entries.
+//   EFI_NOT_FOUND - no DARTs in the ADT.
+//   EFI_OUT_OF_RESOURCES - allocation failed.
+//
+
+EFI_STATUS AppleDartDiscover(APPLE_DART_INFO **Info, UINT32 *Count) {
+    dt_node_t **DartNode;
+    struct memmap *DartReg;
+    APPLE_DART_INFO *Darts;
+    UINT32 DartNodeCount;
+    UINT32 Total = 0;
+    UINT32 StreamTotal = 0;
+    INT32 RegCount;
+
+    DartNodeCount = dt_foreach_compatible_list(NULL, mDartCompatibles, ARRAY_SIZE(mDartCompatibles), NULL, 0);
+    if(DartNodeCount == 0) {
+        DEBUG((DEBUG_ERROR, "%a - no DARTs in the ADT\n", __FUNCTION__));
+        return EFI_NOT_FOUND;
+    }
+    DartNode = AllocatePool(DartNodeCount * sizeof(dt_node_t *));
+    if(DartNode == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+    dt_foreach_compatible_list(NULL, mDartCompatibles, ARRAY_SIZE(mDartCompatibles), DartNode, DartNodeCount);
+
+    //
+    // A node can describe more than one DART (one per reg entry), count those to size the table.
+    //
+    for(UINT32 i = 0; i < DartNodeCount; i++) {
+        RegCount = dt_node_regs(DartNode[i], NULL, 0);
+        if(RegCount > 0) {
+            Total += RegCount;
+        }
+        StreamTotal += AppleDartCollectStreams(DartNode[i], 0, 0, NULL);
+    }
+
+    DartReg = AllocatePool(MAX(Total, 1) * sizeof(struct memmap));
+    Darts = AllocateZeroPool(MAX(Total, 1) * sizeof(APPLE_DART_INFO));
+    mDartStreams = AllocateZeroPool(MAX(StreamTotal, 1) * sizeof(APPLE_DART_STREAM));
+    if(DartReg == NULL || Darts == NULL || mDartStreams == NULL) {
+        FreePool(DartNode);
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    Total = 0;
+    mDartStreamCount = 0;
+    for(UINT32 i = 0; i < DartNodeCount; i++) {
+        CHAR8 *NodeName = dt_node_prop(DartNode[i], "name", NULL);
+
+        RegCount = dt_node_regs(DartNode[i], DartReg, MAX_UINT32);
+        if(RegCount <= 0) {
+            DEBUG((DEBUG_ERROR, "%a - no usable reg for %a\n", __FUNCTION__, NodeName));
+            continue;
+        }
+        for(INT32 RegIndex = 0; RegIndex < RegCount; RegIndex++) {
+            DEBUG((DEBUG_INFO, "DART reg[%d] for %a is 0x%llx \n", RegIndex, NodeName, DartReg[RegIndex].addr));
+            AppleDartDescribe(&Darts[Total + RegIndex], DartNode[i], RegIndex, DartReg[RegIndex].addr);
+        }
+        mDartStreamCount += AppleDartCollectStreams(DartNode[i], Total, RegCount, &mDartStreams[mDartStreamCount]);
+        Total += RegCount;
+    }
+    FreePool(DartNode);
+    FreePool(DartReg);
+
+    DEBUG((DEBUG_INFO, "%a - %u DARTs, %u device streams\n", __FUNCTION__, Total, mDartStreamCount));
+    *Info = Darts;
+    *Count = Total;
+    return EFI_SUCCESS;
+}
+
+//
+// Description:
+//   Finds the DART streams a device is wired to, from its "iommu-parent" phandles.
+//
+// Return values:
+//   Number of streams the device has. Up to Max of them are stored to Streams.
+//
+
+UINT32 AppleDartDeviceStreams(dt_node_t *Device, CONST APPLE_DART_STREAM **Streams, UINT32 Max) {
+    size_t Length = 0;
+    UINT32 *Parents = dt_node_prop(Device, "iommu-parent", &Length);
+    UINT32 Found = 0;
+
+    if(Parents == NULL) {
+        return 0;
+    }
+    for(UINT32 i = 0; i < Length / sizeof(UINT32); i++) {
+        for(UINT32 j = 0; j < mDartStreamCount; j++) {
+            if(mDartStreams[j].Phandle != Parents[i]) {
+                continue;
+            }
+            if(Found < Max) {
+                Streams[Found] = &mDartStreams[j];
+            }
+            Found++;
+            break;
+        }
+    }
+    return Found;
+}
@@ -0,0 +1,188 @@
+/**
+ * Copyright (c) 2024, AppleWOA authors.
+ *
+ * Module Name:
+ *     AppleDartDmaPool.c
+ *
+ * Abstract:
+ *     DMA buffer pool for devices behind translating DARTs.
+ *
+ *     EFI pages are 4KB but the DART maps 16KB pages, so every common buffer used to be its own
+ *     16KB allocation plus a page table update and TLB flush. Instead, 16KB aligned slabs are
+ *     allocated and mapped once, and common buffers are handed out from them in a few size classes:
+ *     one EFI page (XHCI rings, TRB segments, device contexts), one DART page, and 64KB for bulk
+ *     buffers. Anything bigger than that gets its own allocation.
+ *
+ * Environment:
+ *     UEFI DXE (Driver Execution Environment).
+ *
+ * License:
+ *     SPDX-License-Identifier: (BSD-2-Clause-Patent OR MIT) AND GPL-2.0
+*/
+
+#include <PiDxe.h>
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/DebugLib.h>
+#include <Library/MemoryAllocationLib.h>
+
+#include <Drivers/AppleDartIoMmuDxe.h>
+
+//
+// Chunk sizes of each class in EFI pages, smallest first.
+//
+STATIC CONST UINTN mDartDmaClassPages[DART_DMA_POOL_CLASSES] = { 1, EFI_SIZE_TO_PAGES(DART_PAGE_SIZE), EFI_SIZE_TO_PAGES(SIZE_64KB) };
+
+#define DART_DMA_SLAB_PAGES(Class)	((Class)->ChunkPages * DART_DMA_SLAB_CHUNKS)
+#define DART_DMA_SLAB_FULL		((UINT32)((1ULL << DART_DMA_SLAB_CHUNKS) - 1))
+
+VOID AppleDartDmaPoolInit(APPLE_DART_DMA_POOL *Pool) {
+    ZeroMem(Pool, sizeof(*Pool));
+    for(UINT32 i = 0; i < DART_DMA_POOL_CLASSES; i++) {
+        Pool->Class[i].ChunkPages = mDartDmaClassPages[i];
+        ASSERT((EFI_PAGES_TO_SIZE(DART_DMA_SLAB_PAGES(&Pool->Class[i])) & DART_PAGE_MASK) == 0);
+    }
+}
+
+//
+// Description:
+//   Allocates a new slab for Class and maps it into Table.
+//
+
+STATIC APPLE_DART_DMA_SLAB *AppleDartDmaPoolGrow(APPLE_DART_DMA_CLASS *Class, APPLE_DART_PAGE_TABLE *Table) {
+    APPLE_DART_DMA_SLAB *Slab;
+    UINTN Pages = DART_DMA_SLAB_PAGES(Class);
+    UINTN DartPages = EFI_PAGES_TO_SIZE(Pages) / DART_PAGE_SIZE;
+
+    Slab = AllocateZeroPool(sizeof(APPLE_DART_DMA_SLAB));
+    if(Slab == NULL) {
+        return NULL;
+    }
+    Slab->Base = AllocateAlignedPages(Pages, DART_PAGE_SIZE);
+    if(Slab->Base == NULL) {
+        goto fail;
+    }
+    if(EFI_ERROR(AppleDartIovaAlloc(Table, DartPages, &Slab->Iova))) {
+        goto fail;
+    }
+    if(EFI_ERROR(AppleDartPageTableMap(Table, Slab->Iova, (PHYSICAL_ADDRESS)(UINTN)Slab->Base, DartPages))) {
+        AppleDartIovaFree(Table, Slab->Iova, DartPages);
+        goto fail;
+    }
+
+    Slab->Next = Class->Slabs;
+    Class->Slabs = Slab;
+    DEBUG((DEBUG_INFO, "%a - new %lu page slab at 0x%p, IOVA 0x%llx\n", __FUNCTION__, (UINT64)Pages, Slab->Base, Slab->Iova));
+    return Slab;
+
+fail:
+    if(Slab->Base != NULL) {
+        FreeAlignedPages(Slab->Base, Pages);
+    }
+    FreePool(Slab);
+    return NULL;
+}
+
+//
+// Description:
+//   Hands out a buffer of Pages EFI pages from the smallest class that fits.
+//   *Grew is set if a new slab had to be mapped, the caller has to flush the TLBs before the
+//   device uses the buffer then.
+//
+// Return values:
+//   EFI_SUCCESS - *HostAddress is the buffer, already mapped.
+//   EFI_UNSUPPORTED - too big for the pool, allocate it directly.
+//   EFI_OUT_OF_RESOURCES - no memory or IOVA space for a new slab.
+//
+
+EFI_STATUS AppleDartDmaPoolAlloc(APPLE_DART_DMA_POOL *Pool, APPLE_DART_PAGE_TABLE *Table, UINTN Pages, VOID **HostAddress, BOOLEAN *Grew) {
+    APPLE_DART_DMA_CLASS *Class = NULL;
+    APPLE_DART_DMA_SLAB *Slab;
+    UINT32 Chunk;
+
+    *Grew = FALSE;
+    for(UINT32 i = 0; i < DART_DMA_POOL_CLASSES; i++) {
+        if(Pages <= Pool->Class[i].ChunkPages) {
+            Class = &Pool->Class[i];
+            break;
+        }
+    }
+    if(Class == NULL || Pages == 0) {
+        return EFI_UNSUPPORTED;
+    }
+
+    for(Slab = Class->Slabs; Slab != NULL; Slab = Slab->Next) {
+        if(Slab->InUse != DART_DMA_SLAB_FULL) {
+            break;
+        }
+    }
+    if(Slab == NULL) {
+        Slab = AppleDartDmaPoolGrow(Class, Table);
+        if(Slab == NULL) {
+            return EFI_OUT_OF_RESOURCES;
+        }
+        *Grew = TRUE;
+    }
+
+    for(Chunk = 0; (Slab->InUse & (1U << Chunk)) != 0; Chunk++) {
+        continue;
+    }
+    Slab->InUse |= (1U << Chunk);
+    *HostAddress = (UINT8 *)Slab->Base + EFI_PAGES_TO_SIZE(Chunk * Class->ChunkPages);
+    return EFI_SUCCESS;
+}
+
+//
+// Description:
+//   Returns a buffer to the pool. Slabs stay allocated and mapped for the next user.
+//
+// Return values:
+//   TRUE - the buffer belonged to the pool and is free again.
+//   FALSE - not a pool buffer.
+//
+
+BOOLEAN AppleDartDmaPoolFree(APPLE_DART_DMA_POOL *Pool, VOID *HostAddress, UINTN Pages) {
+    UINTN Addr = (UINTN)HostAddress;
+
+    for(UINT32 i = 0; i < DART_DMA_POOL_CLASSES; i++) {
+        APPLE_DART_DMA_CLASS *Class = &Pool->Class[i];
+        UINTN ChunkSize = EFI_PAGES_TO_SIZE(Class->ChunkPages);
+
+        for(APPLE_DART_DMA_SLAB *Slab = Class->Slabs; Slab != NULL; Slab = Slab->Next) {
+            UINTN Base = (UINTN)Slab->Base;
+            if(Addr < Base || Addr >= Base + ChunkSize * DART_DMA_SLAB_CHUNKS) {
+                continue;
+            }
+            ASSERT(((Addr - Base) % ChunkSize) == 0 && Pages <= Class->ChunkPages);
+            Slab->InUse &= ~(1U << ((Addr - Base) / ChunkSize));
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+//
+// Description:
+//   Looks up the IOVA of a host range that lies within a pool slab.
+//
+// Return values:
+//   TRUE - *Iova is the device address of HostAddr.
+//   FALSE - not (entirely) pool memory, it needs a mapping of its own.
+//
+
+BOOLEAN AppleDartDmaPoolLookup(APPLE_DART_DMA_POOL *Pool, PHYSICAL_ADDRESS HostAddr, UINTN NumBytes, PHYSICAL_ADDRESS *Iova) {
+    for(UINT32 i = 0; i < DART_DMA_POOL_CLASSES; i++) {
+        APPLE_DART_DMA_CLASS *Class = &Pool->Class[i];
+        UINTN SlabSize = EFI_PAGES_TO_SIZE(DART_DMA_SLAB_PAGES(Class));
+
+        for(APPLE_DART_DMA_SLAB *Slab = Class->Slabs; Slab != NULL; Slab = Slab->Next) {
+            PHYSICAL_ADDRESS Base = (PHYSICAL_ADDRESS)(UINTN)Slab->Base;
+            if(HostAddr >= Base && HostAddr + NumBytes <= Base + SlabSize) {
+                *Iova = Slab->Iova + (HostAddr - Base);
+                return TRUE;
+            }
+        }
+    }
+    return FALSE;
+}
@@ -0,0 +1,175 @@
+/**
+ * Copyright (c) 2024, AppleWOA authors.
+ *
+ * Module Name:
+ *     AppleDartDomain.c
+ *
+ * Abstract:
+ *     The IOMMU domain: one set of page tables shared by every DART stream attached to it.
+ *
+ *     EDKII_IOMMU_PROTOCOL doesn't say which device a mapping is for, so there is a single domain
+ *     and every translating DART is attached to it whole. Building the same mappings in a set of
+ *     tables per DART would cost memory and cache maintenance for nothing. Instead every DART/SID
+ *     pair has its TTBR pointed at the domain's L1 table, so a mapping is written once, and a flush
+ *     only touches the streams that were attached.
+ *
+ * Environment:
+ *     UEFI DXE (Driver Execution Environment).
+ *
+ * License:
+ *     SPDX-License-Identifier: (BSD-2-Clause-Patent OR MIT) AND GPL-2.0
+*/
+
+#include <PiDxe.h>
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/DebugLib.h>
+#include <Library/IoLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/AppleDTLib.h>
+
+#include <Drivers/AppleDartIoMmuDxe.h>
+
+//
+// Description:
+//   Sets up the page tables of a domain that up to MaxDarts DARTs can be attached to.
+//
+// Return values:
+//   EFI_SUCCESS - domain is ready, nothing is attached yet.
+//   EFI_OUT_OF_RESOURCES - not enough memory.
+//
+
+EFI_STATUS AppleDartDomainInit(APPLE_DART_DOMAIN *Domain, INT32 Shift, BOOLEAN Coherent, PHYSICAL_ADDRESS DmaVirtAddrBase, PHYSICAL_ADDRESS DmaVirtAddrEnd, UINT32 MaxDarts) {
+    EFI_STATUS Status;
+
+    ZeroMem(Domain, sizeof(*Domain));
+    Status = AppleDartPageTableInit(&Domain->Table, Shift, Coherent, DmaVirtAddrBase, DmaVirtAddrEnd);
+    if(EFI_ERROR(Status)) {
+        return Status;
+    }
+    Domain->Attach = AllocateZeroPool(MAX(MaxDarts, 1) * sizeof(APPLE_DART_DOMAIN_ATTACH));
+    if(Domain->Attach == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+    Domain->AttachMax = MaxDarts;
+    Domain->Ready = TRUE;
+    return EFI_SUCCESS;
+}
+
+//
+// Description:
+//   Points the streams in SidMap of a DART at the domain's tables and turns on translation for them.
+//   Attaching streams that are already attached is harmless.
+//
+// Return values:
+//   EFI_SUCCESS - the streams are translating through the domain.
+//   EFI_UNSUPPORTED - the DART's PTE format doesn't match the one the tables were built for.
+//   EFI_OUT_OF_RESOURCES - more DARTs than the domain was set up for.
+//
+
+EFI_STATUS AppleDartDomainAttach(APPLE_DART_DOMAIN *Domain, APPLE_DART_INFO *Dart, CONST UINT32 *SidMap) {
+    APPLE_DART_DOMAIN_ATTACH *Attach = NULL;
+    PHYSICAL_ADDRESS Address = (PHYSICAL_ADDRESS)(UINTN)Domain->Table.L1;
+    INT32 sid, i;
+
+    if(Domain->Table.Shift != Dart->Shift) {
+        DEBUG((DEBUG_ERROR, "%a - DART at 0x%llx has a different PTE layout, leaving it off\n", __FUNCTION__, Dart->BaseAddress));
+        return EFI_UNSUPPORTED;
+    }
+
+    for(UINT32 j = 0; j < Domain->AttachCount; j++) {
+        if(Domain->Attach[j].Dart == Dart) {
+            Attach = &Domain->Attach[j];
+            break;
+        }
+    }
+    if(Attach == NULL) {
+        if(Domain->AttachCount == Domain->AttachMax) {
+            return EFI_OUT_OF_RESOURCES;
+        }
+        Attach = &Domain->Attach[Domain->AttachCount++];
+        Attach->Dart = Dart;
+    }
+
+    //
+    // A DART that doesn't snoop has to see the tables in memory, so from now on every update gets cleaned.
+    //
+    if(Domain->Table.Coherent && !Dart->CoherentWalk) {
+        DEBUG((DEBUG_INFO, "%a - DART at 0x%llx isn't coherent, cleaning page table updates\n", __FUNCTION__, Dart->BaseAddress));
+        AppleDartPageTableMakeNonCoherent(&Domain->Table);
+    }
+
+    //
+    // One L1 page covers the whole IOVA space, so only the first TTBR of each stream is used.
+    // The old TTBR may have left entries in the TLBs, those go before the stream is enabled.
+    //
+    for(sid = 0; sid < Dart->Nsid; sid++) {
+        if(DART_SID_IS_SET(SidMap, sid)) {
+            MmioWrite32(Dart->BaseAddress + DART_TTBR(*Dart, sid, 0), (Address >> DART_TTBR_SHIFT) | Dart->TtbrIsValid);
+            DART_SID_SET(Attach->SidMap, sid);
+            DART_SID_SET(Dart->SidMap, sid);
+        }
+    }
+    Dart->L1 = Domain->Table.L1;
+    Dart->Domain = Domain;
+    Dart->TlbFlush((VOID *)Dart, SidMap);
+
+    for(i = 0; i < DIV_ROUND_UP(Dart->Nsid, 32); i++) {
+        if(SidMap[i] != 0) {
+            MmioOr32(Dart->BaseAddress + DART_SID_ENABLE(*Dart, i), SidMap[i]);
+        }
+    }
+
+    for(sid = 0; sid < Dart->Nsid; sid++) {
+        if(DART_SID_IS_SET(SidMap, sid)) {
+            MmioWrite32(Dart->BaseAddress + DART_TCR(*Dart, sid), Dart->TcrTranslateEnable);
+        }
+    }
+    return EFI_SUCCESS;
+}
+
+//
+// Description:
+//   Flushes the TLBs of every stream attached to the domain, and only those.
+//
+
+VOID AppleDartDomainFlush(APPLE_DART_DOMAIN *Domain) {
+    for(UINT32 i = 0; i < Domain->AttachCount; i++) {
+        APPLE_DART_DOMAIN_ATTACH *Attach = &Domain->Attach[i];
+        Attach->Dart->TlbFlush((VOID *)Attach->Dart, Attach->SidMap);
+    }
+}
+
+//
+// Description:
+//   Takes every attached stream off the domain's tables: translation off, TTBRs cleared and the TLBs flushed,
+//   so nothing keeps walking the tables once they're freed. The streams are left enabled but without a
+//   translation, DMA from them faults until whoever comes next sets them up again.
+//
+
+VOID AppleDartDomainDetachAll(APPLE_DART_DOMAIN *Domain) {
+    for(UINT32 i = 0; i < Domain->AttachCount; i++) {
+        APPLE_DART_DOMAIN_ATTACH *Attach = &Domain->Attach[i];
+        APPLE_DART_INFO *Dart = Attach->Dart;
+        INT32 sid, j;
+
+        for(sid = 0; sid < Dart->Nsid; sid++) {
+            if(DART_SID_IS_SET(Attach->SidMap, sid)) {
+                MmioWrite32(Dart->BaseAddress + DART_TCR(*Dart, sid), 0);
+                for(j = 0; j < Dart->Nttbr; j++) {
+                    MmioWrite32(Dart->BaseAddress + DART_TTBR(*Dart, sid, j), 0);
+                }
+            }
+        }
+        Dart->TlbFlush((VOID *)Dart, Attach->SidMap);
+
+        for(j = 0; j < DART_MAX_SID / 32; j++) {
+            Dart->SidMap[j] &= ~Attach->SidMap[j];
+        }
+        ZeroMem(Attach->SidMap, sizeof(Attach->SidMap));
+        Dart->L1 = NULL;
+        Dart->Domain = NULL;
+    }
+    Domain->AttachCount = 0;
+}
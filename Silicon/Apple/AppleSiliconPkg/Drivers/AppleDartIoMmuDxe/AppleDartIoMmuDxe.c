@@ -35,7 +35,9 @@
 #include <Library/MemoryAllocationLib.h>
 #include <Library/UefiBootServicesTableLib.h>
 #include <Library/UefiLib.h>
+#if defined (MDE_CPU_AARCH64)
 #include <Library/ArmLib.h>
+#endif
 #include <Library/PrintLib.h>
 #include <Library/PcdLib.h>
 #include <Library/DxeServicesLib.h>
@@ -43,10 +45,35 @@
 #include <Library/AppleDTLib.h>
 
 #include <Protocol/IoMmu.h>
+#include <Protocol/AppleDartScatterGather.h>
 
 #include <Drivers/AppleDartIoMmuDxe.h>
 
-APPLE_DART_INFO DartInfo[FixedPcdGet32(PcdAppleNumDwc3Controllers) * 2];
+APPLE_DART_INFO *DartInfo;
+UINT32 DartCount;
+
+//
+// Domain behind the IOMMU protocol, every DART that can't bypass is attached to it, see APPLE_DART_DOMAIN.
+//
+STATIC APPLE_DART_DOMAIN mDefaultDomain;
+
+//
+// Unmaps waiting for a TLB flush, see APPLE_DART_PENDING_UNMAP.
+//
+STATIC APPLE_DART_PENDING_UNMAP mPendingUnmap[DART_MAX_PENDING_UNMAPS];
+STATIC UINT32 mPendingUnmapCount = 0;
+STATIC EFI_EVENT mPendingFlushEvent;
+
+//
+// Common buffers come from here, see APPLE_DART_DMA_POOL.
+//
+STATIC APPLE_DART_DMA_POOL mDartDmaPool;
+
+//
+// Everything else that gets mapped is remembered here, see APPLE_DART_MAP_CACHE.
+//
+STATIC APPLE_DART_MAP_CACHE mDartMapCache;
+STATIC EFI_EVENT mDartExitBootServicesEvent;
 
 // STATIC
 // PHYSICAL_ADDRESS
@@ -58,6 +85,124 @@ APPLE_DART_INFO DartInfo[FixedPcdGet32(PcdAppleNumDwc3Controllers) * 2];
 // //   return (PHYSICAL_ADDRESS)(UINTN)Address + PcdGet64 (PcdDmaDeviceOffset);
 // }
 
+//
+// Description:
+//   Flushes the TLBs of the streams attached to the default domain, then retires the pending unmaps:
+//   their IOVA ranges go back to the allocator and emptied L2 tables are freed.
+//   Callers must be at TPL_NOTIFY.
+//
+
+STATIC VOID AppleDartFlushTranslating(VOID) {
+    AppleDartDomainFlush(&mDefaultDomain);
+
+    AppleDartPageTableReclaim(&mDefaultDomain.Table);
+    for(UINT32 i = 0; i < mPendingUnmapCount; i++) {
+        AppleDartIovaFree(&mDefaultDomain.Table, mPendingUnmap[i].Iova, mPendingUnmap[i].Pages);
+    }
+    mPendingUnmapCount = 0;
+}
+
+//
+// Description:
+//   Periodic timer at TPL_CALLBACK, so it runs once whoever is mapping and unmapping (XHCI's
+//   async transfers run at TPL_NOTIFY) has dropped back down, and flushes whatever piled up meanwhile.
+//   It also picks up any faults the DARTs reported since the last tick.
+//
+
+STATIC VOID EFIAPI AppleDartPendingFlushNotify(IN EFI_EVENT Event, IN VOID *Context) {
+    EFI_TPL OldTpl = gBS->RaiseTPL(TPL_NOTIFY);
+
+    if(mPendingUnmapCount != 0) {
+        AppleDartFlushTranslating();
+    }
+    AppleDartCheckAllErrors();
+    gBS->RestoreTPL(OldTpl);
+}
+
+//
+// Description:
+//   Takes down the PTEs of a range and queues it for the next flush.
+//   The IOVA range stays allocated until the next flush so the stale TLB entries can't be hit
+//   by a new mapping. That's the next Map(), a full pending list or the timer.
+//   Callers must be at TPL_NOTIFY.
+//
+
+STATIC VOID AppleDartDeferUnmap(PHYSICAL_ADDRESS Iova, UINTN Pages) {
+    AppleDartPageTableUnmap(&mDefaultDomain.Table, Iova, Pages);
+    if(mPendingUnmapCount == DART_MAX_PENDING_UNMAPS) {
+        AppleDartFlushTranslating();
+    }
+    mPendingUnmap[mPendingUnmapCount].Iova = Iova;
+    mPendingUnmap[mPendingUnmapCount].Pages = Pages;
+    mPendingUnmapCount++;
+}
+
+//
+// Description:
+//   Evicts the least recently used idle mapping cache entry.
+//
+// Return values:
+//   TRUE - an entry was evicted and its range queued for unmapping.
+//   FALSE - every cached mapping is in use.
+//
+
+STATIC BOOLEAN AppleDartMapCacheEvictOne(VOID) {
+    APPLE_DART_MAP_CACHE_ENTRY *Victim = AppleDartMapCacheVictim(&mDartMapCache);
+
+    if(Victim == NULL) {
+        return FALSE;
+    }
+    AppleDartDeferUnmap(Victim->Iova, Victim->Pages);
+    return TRUE;
+}
+
+//
+// Description:
+//   Allocates Pages DART pages of IOVA space from the default domain. If it's all taken, idle cached
+//   mappings and pending unmaps, which still hold IOVA ranges, are all retired and it's tried again.
+//   Callers must be at TPL_NOTIFY.
+//
+
+STATIC EFI_STATUS AppleDartAllocIova(UINTN Pages, PHYSICAL_ADDRESS *Iova) {
+    EFI_STATUS Status = AppleDartIovaAlloc(&mDefaultDomain.Table, Pages, Iova);
+
+    if(EFI_ERROR(Status)) {
+        while(AppleDartMapCacheEvictOne()) {
+            continue;
+        }
+        AppleDartFlushTranslating();
+        Status = AppleDartIovaAlloc(&mDefaultDomain.Table, Pages, Iova);
+    }
+    return Status;
+}
+
+//
+// Description:
+//   Hands the DARTs over to the OS. The tables live in boot services memory, which the OS is free to reuse,
+//   so every stream translating through them is turned off first. Bypassing DARTs are left as they are.
+//
+
+STATIC VOID EFIAPI AppleDartExitBootServicesNotify(IN EFI_EVENT Event, IN VOID *Context) {
+    gBS->SetTimer(mPendingFlushEvent, TimerCancel, 0);
+    DEBUG((DEBUG_INFO, "DART map cache: %lu hits, %lu misses, %lu evictions\n",
+        mDartMapCache.Hits, mDartMapCache.Misses, mDartMapCache.Evictions));
+    DEBUG((DEBUG_INFO, "DART page tables: %lu maps (%lu pages), %lu unmaps\n",
+        mDefaultDomain.Table.Maps, mDefaultDomain.Table.MappedPages, mDefaultDomain.Table.Unmaps));
+    for(UINT32 i = 0; i < DartCount; i++) {
+        APPLE_DART_INFO *Dart = &DartInfo[i];
+        if(Dart->Counters.Flushes != 0 || Dart->Counters.Faults != 0) {
+            DEBUG((DEBUG_INFO, "DART %a reg[%d]: %lu flushes (%lu ticks waiting), %lu faults\n",
+                dt_node_prop(Dart->Node, "name", NULL), Dart->RegIndex, Dart->Counters.Flushes,
+                Dart->Counters.FlushWaitTicks, Dart->Counters.Faults));
+        }
+    }
+
+    if(mDefaultDomain.Ready) {
+        AppleDartDomainDetachAll(&mDefaultDomain);
+        mDefaultDomain.Ready = FALSE;
+    }
+}
+
 //
 // Description:
 //   Sets an attribute over memory that the DART manages.
@@ -82,9 +227,12 @@ STATIC EFI_STATUS EFIAPI AppleDartIoMmuSetAttribute (
 //
 // Description:
 //   Maps IOMMU managed memory so it becomes usable.
+//   The range gets its own IOVA range and is mapped behind every translating DART.
 //
 // Return values:
 //   EFI_SUCCESS - mapped the range successfully.
+//   EFI_INVALID_PARAMETER - bad operation or pointer.
+//   EFI_OUT_OF_RESOURCES - out of IOVA space or memory for the tables.
 //
 
 STATIC EFI_STATUS EFIAPI AppleDartIoMmuMap(
@@ -96,73 +244,115 @@ STATIC EFI_STATUS EFIAPI AppleDartIoMmuMap(
     OUT VOID **Mapping
     )
 {
+    EFI_STATUS Status;
+    APPLE_DART_MAPPING *DartMappingInfo;
+    APPLE_DART_MAP_CACHE_ENTRY *Entry;
+    APPLE_DART_ACCESS Access;
+    PHYSICAL_ADDRESS Iova;
+    UINTN Pages;
+    EFI_TPL OldTpl;
+
+    if(HostAddress == NULL || NumberOfBytes == NULL || DeviceAddress == NULL || Mapping == NULL || *NumberOfBytes == 0) {
+        return EFI_INVALID_PARAMETER;
+    }
 
-    // PHYSICAL_ADDRESS PhysAddr, DmaVirtAddr;
-    // unsigned long PhysSize, Off;
-    // INT32 i, idx;
-    // APPLE_DART_MAPPING *DartMappingInfo;
-    // UINTN NumBytes = *NumberOfBytes;
-
-    // DEBUG((DEBUG_INFO, "%a - mapping memory into IOMMU page tables, with host address 0x%p\n", __FUNCTION__, HostAddress));
-
-    // switch(Operation) {
-    //     //
-    //     // Treat everything as "common buffer" for now.
-    //     //
-    //     case EdkiiIoMmuOperationBusMasterRead:
-    //     case EdkiiIoMmuOperationBusMasterRead64:
-    //     case EdkiiIoMmuOperationBusMasterWrite:
-    //     case EdkiiIoMmuOperationBusMasterWrite64:
-    //     case EdkiiIoMmuOperationBusMasterCommonBuffer:
-    //     case EdkiiIoMmuOperationBusMasterCommonBuffer64:
-    //         //
-    //         // if we are in bypass mode, just return the address verbatim.
-    //         //
-    //         if(DartInfo->BypassMode == TRUE) {
-    //             *DeviceAddress = (PHYSICAL_ADDRESS)HostAddress;
-    //             *Mapping = NULL; // nothing to map
-    //             return EFI_SUCCESS;
-    //         }
-
-    //         //
-    //         // since the USB-A controller doesn't support bypass mode, the below code MUST work correctly.
-    //         //
-    //         DartMappingInfo = AllocateZeroPool(sizeof(APPLE_DART_MAPPING));
-    //         DartMappingInfo->HostAddr = (PHYSICAL_ADDRESS)HostAddress;
-    //         PhysAddr = ALIGN_DOWN((PHYSICAL_ADDRESS)HostAddress, DART_PAGE_SIZE);
-    //         DartMappingInfo->PhysAddress = PhysAddr;
-    //         Off = (PHYSICAL_ADDRESS)HostAddress - PhysAddr;
-    //         DartMappingInfo->Offset = Off;
-    //         PhysSize = ALIGN(NumBytes + Off, DART_PAGE_SIZE);
-    //         DartMappingInfo->PhysicalSize = PhysSize;
-    //         DmaVirtAddr = (PHYSICAL_ADDRESS)HostAddress;
-    //         DartMappingInfo->DmaVirtualAddr = DmaVirtAddr;
-
-    //         DartMappingInfo->NumBytes = *NumberOfBytes;
-
-    //         idx = DmaVirtAddr / DART_PAGE_SIZE;
-
-    //         for(i = 0; i < PhysSize / DART_PAGE_SIZE; i++) {
-    //             DartInfo->L2[idx + i] = (PhysAddr >> DartInfo->Shift) | DART_L2_VALID | DART_L2_START(0LL) | DART_L2_END(~0LL);
-    //             PhysAddr += DART_PAGE_SIZE;
-    //         }
-    //         WriteBackInvalidateDataCacheRange((VOID *)DartInfo->L2[idx], ((UINTN)DartInfo->L2[idx + i] - (UINTN)DartInfo->L2[idx]));
-
-
-    //         DartInfo->TlbFlush((VOID *)DartInfo);
-
-    //         *DeviceAddress = HostToDeviceAddress((VOID *)DmaVirtAddr + Off);
-    //         DEBUG((DEBUG_INFO, "%a - device address is 0x%llx, Off = 0x%llx, DVA: 0x%llx\n", __FUNCTION__, (DmaVirtAddr + Off), Off, DmaVirtAddr));
-    //         *Mapping = DartMappingInfo;
-    //         break;
-        
-    //     default:
-    //         // if we have an invalid operation, just return
-    //         break;
-
-    // }
+    switch(Operation) {
+        //
+        // The DART maps whole pages read/write either way, the access type only keys the mapping cache.
+        //
+        case EdkiiIoMmuOperationBusMasterRead:
+        case EdkiiIoMmuOperationBusMasterRead64:
+            Access = AppleDartAccessRead;
+            break;
+        case EdkiiIoMmuOperationBusMasterWrite:
+        case EdkiiIoMmuOperationBusMasterWrite64:
+            Access = AppleDartAccessWrite;
+            break;
+        case EdkiiIoMmuOperationBusMasterCommonBuffer:
+        case EdkiiIoMmuOperationBusMasterCommonBuffer64:
+            Access = AppleDartAccessCommon;
+            break;
+        default:
+            return EFI_INVALID_PARAMETER;
+    }
 
-    
+    DartMappingInfo = AllocateZeroPool(sizeof(APPLE_DART_MAPPING));
+    if(DartMappingInfo == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+    DartMappingInfo->HostAddr = (PHYSICAL_ADDRESS)(UINTN)HostAddress;
+    DartMappingInfo->PhysAddress = ALIGN_DOWN(DartMappingInfo->HostAddr, DART_PAGE_SIZE);
+    DartMappingInfo->Offset = DartMappingInfo->HostAddr - DartMappingInfo->PhysAddress;
+    DartMappingInfo->PhysicalSize = ALIGN(*NumberOfBytes + DartMappingInfo->Offset, DART_PAGE_SIZE);
+    DartMappingInfo->NumBytes = *NumberOfBytes;
+    Pages = DartMappingInfo->PhysicalSize / DART_PAGE_SIZE;
+
+    OldTpl = gBS->RaiseTPL(TPL_NOTIFY);
+
+    //
+    // Buffers from AllocateBuffer() are already mapped as part of their slab.
+    //
+    if(AppleDartDmaPoolLookup(&mDartDmaPool, DartMappingInfo->HostAddr, *NumberOfBytes, &Iova)) {
+        gBS->RestoreTPL(OldTpl);
+        DartMappingInfo->Pooled = TRUE;
+        DartMappingInfo->DmaVirtualAddr = Iova;
+        *DeviceAddress = Iova;
+        *Mapping = DartMappingInfo;
+        return EFI_SUCCESS;
+    }
+
+    //
+    // So are the pages this was last mapped for, if they haven't been evicted since.
+    //
+    Entry = AppleDartMapCacheLookup(&mDartMapCache, DartMappingInfo->PhysAddress, Pages, Access);
+    if(Entry != NULL) {
+        gBS->RestoreTPL(OldTpl);
+        DartMappingInfo->CacheEntry = Entry;
+        DartMappingInfo->DmaVirtualAddr = Entry->Iova + (DartMappingInfo->PhysAddress - Entry->PhysAddress);
+        *DeviceAddress = DartMappingInfo->DmaVirtualAddr + DartMappingInfo->Offset;
+        *Mapping = DartMappingInfo;
+        return EFI_SUCCESS;
+    }
+
+    Status = AppleDartAllocIova(Pages, &Iova);
+    if(EFI_ERROR(Status)) {
+        gBS->RestoreTPL(OldTpl);
+        DEBUG((DEBUG_ERROR, "%a - out of IOVA space mapping %lu bytes\n", __FUNCTION__, (UINT64)*NumberOfBytes));
+        FreePool(DartMappingInfo);
+        return Status;
+    }
+    Status = AppleDartPageTableMap(&mDefaultDomain.Table, Iova, DartMappingInfo->PhysAddress, Pages);
+    if(EFI_ERROR(Status)) {
+        //
+        // Whatever got mapped has been taken down again, make sure the DARTs forget it too.
+        //
+        AppleDartFlushTranslating();
+        AppleDartIovaFree(&mDefaultDomain.Table, Iova, Pages);
+        gBS->RestoreTPL(OldTpl);
+        FreePool(DartMappingInfo);
+        return Status;
+    }
+
+    //
+    // Make room in the cache if needed, the evicted range gets unmapped by the flush below.
+    // If every entry is busy the mapping just isn't cached.
+    //
+    Entry = AppleDartMapCacheInsert(&mDartMapCache, DartMappingInfo->PhysAddress, Pages, Access, Iova);
+    if(Entry == NULL && AppleDartMapCacheEvictOne()) {
+        Entry = AppleDartMapCacheInsert(&mDartMapCache, DartMappingInfo->PhysAddress, Pages, Access, Iova);
+    }
+    DartMappingInfo->CacheEntry = Entry;
+
+    //
+    // New PTEs need a flush before the device can use them. That flush also covers every
+    // pending unmap, so those get retired here for free.
+    //
+    AppleDartFlushTranslating();
+    gBS->RestoreTPL(OldTpl);
+
+    DartMappingInfo->DmaVirtualAddr = Iova;
+    *DeviceAddress = Iova + DartMappingInfo->Offset;
+    *Mapping = DartMappingInfo;
     return EFI_SUCCESS;
 }
 
@@ -172,54 +362,49 @@ STATIC EFI_STATUS EFIAPI AppleDartIoMmuMap(
 //
 // Return values:
 //   EFI_SUCCESS - unmapped the range successfully.
+//   EFI_INVALID_PARAMETER - Mapping is NULL.
 //
 
 STATIC EFI_STATUS EFIAPI AppleDartIoMmuUnmap(IN EDKII_IOMMU_PROTOCOL *This, IN VOID *Mapping) {
-    // PHYSICAL_ADDRESS DmaVirtAddr;
-    // unsigned long PhysSize;
-    // INT32 i, idx;
-    // APPLE_DART_MAPPING *DartMappingInfo;
-
-    // DartMappingInfo = (APPLE_DART_MAPPING *)Mapping;
-
-    // // DEBUG((DEBUG_INFO, "%a - Unmapping memory from IOMMU page tables\n", __FUNCTION__));
-
-    // //
-    // // if we are in bypass mode, there is no conception of unmapping, we're done.
-    // //
-    // if(DartInfo->BypassMode == TRUE) {
-    //     return EFI_SUCCESS;
-    // }
-
-    // //
-    // // since USB-A controller doesn't support bypass mode, the below code MUST work correctly if that controller is on.
-    // //
-
-    // DmaVirtAddr = ALIGN_DOWN(DartMappingInfo->PhysAddress, DART_PAGE_SIZE);
+    APPLE_DART_MAPPING *DartMappingInfo = (APPLE_DART_MAPPING *)Mapping;
+    UINTN Pages;
+    EFI_TPL OldTpl;
 
-    // PhysSize = (DartMappingInfo->NumBytes) + (DartMappingInfo->PhysAddress - DmaVirtAddr);
-    // PhysSize = ALIGN(PhysSize, DART_PAGE_SIZE);
-
-    // idx = DmaVirtAddr / DART_PAGE_SIZE;
-
-    // for(i = 0; i < PhysSize / DART_PAGE_SIZE; i++) {
-    //     DartInfo->L2[idx + i] = DART_L2_INVAL;
-    // }
+    if(DartMappingInfo == NULL) {
+        return EFI_INVALID_PARAMETER;
+    }
+    if(DartMappingInfo->Pooled) {
+        FreePool(DartMappingInfo);
+        return EFI_SUCCESS;
+    }
 
-    // WriteBackInvalidateDataCacheRange((VOID *)DartInfo->L2[idx], ((UINTN)DartInfo->L2[idx + i] - (UINTN)DartInfo->L2[idx]));
+    Pages = DartMappingInfo->PhysicalSize / DART_PAGE_SIZE;
+    OldTpl = gBS->RaiseTPL(TPL_NOTIFY);
+    if(DartMappingInfo->CacheEntry != NULL) {
+        //
+        // Cached mappings stay in place until they get evicted.
+        //
+        AppleDartMapCacheRelease(DartMappingInfo->CacheEntry);
+    }
+    else {
+        AppleDartDeferUnmap(DartMappingInfo->DmaVirtualAddr, Pages);
+    }
+    gBS->RestoreTPL(OldTpl);
 
-    // DartInfo->TlbFlush((VOID *)DartInfo);
-    // FreeAlignedPages((VOID *)DmaVirtAddr, PhysSize);
-    
+    FreePool(DartMappingInfo);
     return EFI_SUCCESS;
 }
 
 //
 // Description:
 //   Allocates a DMA buffer for the IOMMU.
+//   Boot services buffers up to 64KB come from the DMA pool and are mapped already. Anything else
+//   is rounded up to whole DART pages so that nothing else shares a page that gets mapped for the device.
 //
 // Return values:
 //   EFI_SUCCESS - allocated the buffer successfully.
+//   EFI_INVALID_PARAMETER - unsupported memory type.
+//   EFI_OUT_OF_RESOURCES - allocation failed.
 //
 
 STATIC EFI_STATUS EFIAPI AppleDartIoMmuAllocateBuffer (
@@ -231,32 +416,38 @@ STATIC EFI_STATUS EFIAPI AppleDartIoMmuAllocateBuffer (
     IN UINT64 Attributes
     )
 {
-    // UINTN NewPages;
-    // NewPages = Pages;
-    // //
-    // // The only valid memory types are EfiBootServicesData and EfiRuntimeServicesData.
-    // // Currently copied from CoherentDmaLib, atm we're just hardcoding DART_PAGE_SIZE as alignment so it should all be good
-    // //
-
-    // //
-    // // HACK: if this is needed, then because EFI is always allocating pages in increments of 4k, always map 4 times the number
-    // // of pages requested, so that we always end up with 16k pages from the IOMMU perspective.
-    // //
-    // NewPages = 4 * Pages;
-    // DEBUG((DEBUG_INFO, "%a - Allocating DMA buffer for IOMMU with %d pages\n", __FUNCTION__, NewPages));
-    // if (MemoryType == EfiBootServicesData) {
-    //     *HostAddress = AllocateAlignedPages (NewPages, DART_PAGE_SIZE);
-    // } else if (MemoryType == EfiRuntimeServicesData) {
-    //     *HostAddress = AllocateAlignedRuntimePages (NewPages, DART_PAGE_SIZE);
-    // } else {
-    //     return EFI_INVALID_PARAMETER;
-    // }
-
-    // DEBUG((DEBUG_INFO, "%a - HostAddress is 0x%p\n", __FUNCTION__, *HostAddress));
-
-    // if (*HostAddress == NULL) {
-    //     return EFI_OUT_OF_RESOURCES;
-    // }
+    UINTN NewPages = ALIGN(Pages, EFI_SIZE_TO_PAGES(DART_PAGE_SIZE));
+    EFI_STATUS Status;
+    EFI_TPL OldTpl;
+    BOOLEAN Grew;
+
+    if(HostAddress == NULL) {
+        return EFI_INVALID_PARAMETER;
+    }
+
+    //
+    // The only valid memory types are EfiBootServicesData and EfiRuntimeServicesData, same as CoherentDmaLib.
+    //
+    if (MemoryType == EfiBootServicesData) {
+        OldTpl = gBS->RaiseTPL(TPL_NOTIFY);
+        Status = AppleDartDmaPoolAlloc(&mDartDmaPool, &mDefaultDomain.Table, Pages, HostAddress, &Grew);
+        if(!EFI_ERROR(Status) && Grew) {
+            AppleDartFlushTranslating();
+        }
+        gBS->RestoreTPL(OldTpl);
+        if(Status != EFI_UNSUPPORTED) {
+            return Status;
+        }
+        *HostAddress = AllocateAlignedPages (NewPages, DART_PAGE_SIZE);
+    } else if (MemoryType == EfiRuntimeServicesData) {
+        *HostAddress = AllocateAlignedRuntimePages (NewPages, DART_PAGE_SIZE);
+    } else {
+        return EFI_INVALID_PARAMETER;
+    }
+
+    if (*HostAddress == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
     return EFI_SUCCESS;
 }
 
@@ -266,21 +457,19 @@ STATIC EFI_STATUS EFIAPI AppleDartIoMmuFreeBuffer (
     IN VOID *HostAddress
     )
 {
-    // UINTN NewPages;
-    // NewPages = Pages;
+    EFI_TPL OldTpl;
+    BOOLEAN Pooled;
 
-    // //
-    // // HACK: if this is needed, then because EFI is always allocating pages in increments of 4k, always map 4 times the number
-    // // of pages requested, so that we always end up with 16k pages from the IOMMU perspective.
-    // //
-    // NewPages = 4 * Pages;
-
-    // // DEBUG((DEBUG_INFO, "%a - Freeing DMA buffer at 0x%p, %d pages\n", __FUNCTION__, HostAddress, NewPages));
-    // if (HostAddress == NULL) {
-    //     return EFI_INVALID_PARAMETER;
-    // }
+    if (HostAddress == NULL) {
+        return EFI_INVALID_PARAMETER;
+    }
 
-    // FreeAlignedPages (HostAddress, NewPages);
+    OldTpl = gBS->RaiseTPL(TPL_NOTIFY);
+    Pooled = AppleDartDmaPoolFree(&mDartDmaPool, HostAddress, Pages);
+    gBS->RestoreTPL(OldTpl);
+    if(!Pooled) {
+        FreeAlignedPages (HostAddress, ALIGN(Pages, EFI_SIZE_TO_PAGES(DART_PAGE_SIZE)));
+    }
     return EFI_SUCCESS;
 }
 
@@ -293,24 +482,249 @@ EDKII_IOMMU_PROTOCOL mAppleDartIoMmuProtocol = {
     AppleDartIoMmuFreeBuffer,
 };
 
-STATIC VOID AppleDartT8020TlbFlush(VOID *DartInformation) {
+//
+// Description:
+//   Maps a list of host ranges into one contiguous IOVA range, see APPLE_DART_SCATTER_GATHER_MAP.
+//   Each range is mapped from the DART page it starts in, so ranges have to meet on DART page
+//   boundaries for the device addresses to line up. The mapping isn't cached, Unmap() takes it down.
+//
+
+STATIC EFI_STATUS EFIAPI AppleDartScatterGatherMap(
+    IN APPLE_DART_SCATTER_GATHER_PROTOCOL *This,
+    IN EDKII_IOMMU_OPERATION Operation,
+    IN CONST APPLE_DART_SG_ENTRY *List,
+    IN UINTN Count,
+    OUT EFI_PHYSICAL_ADDRESS *DeviceAddress,
+    OUT UINTN *NumberOfBytes,
+    OUT VOID **Mapping
+    )
+{
+    EFI_STATUS Status = EFI_SUCCESS;
+    APPLE_DART_MAPPING *DartMappingInfo;
+    PHYSICAL_ADDRESS Iova;
+    UINTN Pages = 0;
+    UINTN Bytes = 0;
+    UINTN Done = 0;
+    EFI_TPL OldTpl;
+
+    if(List == NULL || Count == 0 || DeviceAddress == NULL || NumberOfBytes == NULL || Mapping == NULL || Operation >= EdkiiIoMmuOperationMaximum) {
+        return EFI_INVALID_PARAMETER;
+    }
+    for(UINTN i = 0; i < Count; i++) {
+        PHYSICAL_ADDRESS Start = List[i].HostAddress;
+        PHYSICAL_ADDRESS End = List[i].HostAddress + List[i].Length;
+
+        if(List[i].Length == 0) {
+            return EFI_INVALID_PARAMETER;
+        }
+        if((i != 0 && (Start & DART_PAGE_MASK) != 0) || (i != Count - 1 && (End & DART_PAGE_MASK) != 0)) {
+            return EFI_INVALID_PARAMETER;
+        }
+        Pages += (ALIGN(End, DART_PAGE_SIZE) - ALIGN_DOWN(Start, DART_PAGE_SIZE)) / DART_PAGE_SIZE;
+        Bytes += List[i].Length;
+    }
+
+    DartMappingInfo = AllocateZeroPool(sizeof(APPLE_DART_MAPPING));
+    if(DartMappingInfo == NULL) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    OldTpl = gBS->RaiseTPL(TPL_NOTIFY);
+    Status = AppleDartAllocIova(Pages, &Iova);
+    if(EFI_ERROR(Status)) {
+        gBS->RestoreTPL(OldTpl);
+        DEBUG((DEBUG_ERROR, "%a - out of IOVA space mapping %lu bytes in %lu ranges\n", __FUNCTION__, (UINT64)Bytes, (UINT64)Count));
+        FreePool(DartMappingInfo);
+        return Status;
+    }
+    for(UINTN i = 0; i < Count; i++) {
+        PHYSICAL_ADDRESS Start = ALIGN_DOWN(List[i].HostAddress, DART_PAGE_SIZE);
+        UINTN RangePages = (ALIGN(List[i].HostAddress + List[i].Length, DART_PAGE_SIZE) - Start) / DART_PAGE_SIZE;
+
+        Status = AppleDartPageTableMap(&mDefaultDomain.Table, Iova + Done * DART_PAGE_SIZE, Start, RangePages);
+        if(EFI_ERROR(Status)) {
+            break;
+        }
+        Done += RangePages;
+    }
+    if(EFI_ERROR(Status)) {
+        //
+        // Take down the ranges that did get mapped, the failed one already cleaned up after itself.
+        //
+        if(Done != 0) {
+            AppleDartPageTableUnmap(&mDefaultDomain.Table, Iova, Done);
+        }
+        AppleDartFlushTranslating();
+        AppleDartIovaFree(&mDefaultDomain.Table, Iova, Pages);
+        gBS->RestoreTPL(OldTpl);
+        FreePool(DartMappingInfo);
+        return Status;
+    }
+    AppleDartFlushTranslating();
+    gBS->RestoreTPL(OldTpl);
+
+    DartMappingInfo->HostAddr = List[0].HostAddress;
+    DartMappingInfo->PhysAddress = ALIGN_DOWN(List[0].HostAddress, DART_PAGE_SIZE);
+    DartMappingInfo->Offset = List[0].HostAddress - DartMappingInfo->PhysAddress;
+    DartMappingInfo->PhysicalSize = Pages * DART_PAGE_SIZE;
+    DartMappingInfo->NumBytes = Bytes;
+    DartMappingInfo->DmaVirtualAddr = Iova;
+
+    *DeviceAddress = Iova + DartMappingInfo->Offset;
+    *NumberOfBytes = Bytes;
+    *Mapping = DartMappingInfo;
+    return EFI_SUCCESS;
+}
+
+STATIC EFI_STATUS EFIAPI AppleDartScatterGatherUnmap(IN APPLE_DART_SCATTER_GATHER_PROTOCOL *This, IN VOID *Mapping) {
+    return AppleDartIoMmuUnmap(&mAppleDartIoMmuProtocol, Mapping);
+}
+
+STATIC APPLE_DART_SCATTER_GATHER_PROTOCOL mAppleDartScatterGatherProtocol = {
+    APPLE_DART_SCATTER_GATHER_PROTOCOL_REVISION,
+    AppleDartScatterGatherMap,
+    AppleDartScatterGatherUnmap,
+};
+
+//
+// Description:
+//   Fills in the register layout of a DART from its type, quiesces it and puts it
+//   in bypass mode if it supports that.
+//
+
+STATIC VOID AppleDartSetupInstance(APPLE_DART_INFO *Dart) {
+    UINT32 Params2;
+    INT32 sid, i;
+
+    AppleDartDescribeRegisters(Dart);
+
+    Dart->DmaVirtAddrBase = DART_PAGE_SIZE;
+    Dart->DmaVirtAddrEnd = SIZE_4GB - DART_PAGE_SIZE;
+
+    //
+    // Whatever the firmware before us left in the TLBs goes, so the first flush covers every stream.
+    //
+    ASSERT(Dart->Nsid <= DART_MAX_SID);
+    for(sid = 0; sid < Dart->Nsid; sid++) {
+        Dart->SidMap[sid / 32] |= (1U << (sid % 32));
+    }
+
+    for(sid = 0; sid < Dart->Nsid; sid++) {
+        MmioWrite32(Dart->BaseAddress + DART_TCR(*Dart, sid), 0);
+    }
+    for(sid = 0; sid < Dart->Nsid; sid++) {
+        for(i = 0; i < Dart->Nttbr; i++) {
+            MmioWrite32(Dart->BaseAddress + DART_TTBR(*Dart, sid, i), 0);
+        }
+    }
+
+    Dart->TlbFlush((VOID *)Dart, Dart->SidMap);
 
-    APPLE_DART_INFO *DartInfoStruct = (APPLE_DART_INFO *)DartInformation;
-    __asm__("dsb sy");
-    //SpeculationBarrier();
-    MmioWrite32(DartInfoStruct->BaseAddress + DART_T8020_TLB_SIDMASK, DART_ALL_STREAMS(DartInfoStruct));
-    MmioWrite32(DartInfoStruct->BaseAddress + DART_T8020_TLB_CMD, DART_T8020_TLB_CMD_FLUSH);
-    while((MmioRead32(DartInfoStruct->BaseAddress + DART_T8020_TLB_CMD) & DART_T8020_TLB_CMD_BUSY) != 0) {
-        continue;
+    Params2 = MmioRead32(Dart->BaseAddress + DART_PARAMS2);
+    if((Params2 & DART_PARAMS2_BYPASS_SUPPORT) != 0) {
+        DEBUG((DEBUG_INFO, "%a - DART at 0x%llx supports bypass mode\n", __FUNCTION__, Dart->BaseAddress));
+        for(sid = 0; sid < Dart->Nsid; sid++) {
+            MmioWrite32(Dart->BaseAddress + DART_TCR(*Dart, sid), Dart->TcrBypass);
+        }
+        Dart->BypassMode = TRUE;
+        //
+        // Bypass mode means the controllers can just DMA right into physical memory, nothing to map for this one.
+        //
+        ZeroMem(Dart->SidMap, sizeof(Dart->SidMap));
     }
 }
 
-STATIC VOID AppleDartT8110TlbFlush(VOID *DartInformation) {
-    APPLE_DART_INFO *DartInfoStruct = (APPLE_DART_INFO *)DartInformation;
-    __asm__("dsb sy");
-    MmioWrite32(DartInfoStruct->BaseAddress + DART_T8110_TLB_CMD_FLUSH_ALL, DART_T8110_TLB_CMD_FLUSH_ALL);
-    while((MmioRead32(DartInfoStruct->BaseAddress + DART_T8110_TLB_CMD)) & DART_T8110_TLB_CMD_BUSY) {
-        continue;
+//
+// Description:
+//   Attaches every stream of a DART that can't bypass to the default domain, which turns on translation.
+//   The domain's tables are set up by the first DART that needs them.
+//
+// Return values:
+//   EFI_SUCCESS - DART is translating.
+//   EFI_UNSUPPORTED - the DART's PTE format doesn't match the one the tables were built for.
+//   EFI_OUT_OF_RESOURCES - couldn't allocate the tables.
+//
+
+STATIC EFI_STATUS AppleDartEnableTranslation(APPLE_DART_INFO *Dart) {
+    EFI_STATUS Status;
+    UINT32 SidMap[DART_MAX_SID / 32] = { 0 };
+    INT32 sid;
+
+    if(!mDefaultDomain.Ready) {
+        Status = AppleDartDomainInit(&mDefaultDomain, Dart->Shift, Dart->CoherentWalk, Dart->DmaVirtAddrBase, Dart->DmaVirtAddrEnd, DartCount);
+        if(EFI_ERROR(Status)) {
+            return Status;
+        }
+        AppleDartDmaPoolInit(&mDartDmaPool);
+    }
+
+    for(sid = 0; sid < Dart->Nsid; sid++) {
+        DART_SID_SET(SidMap, sid);
+    }
+    return AppleDartDomainAttach(&mDefaultDomain, Dart, SidMap);
+}
+
+//
+// Description:
+//   Marks the DARTs a device is wired to, going by its "iommu-parent" links, as managed by this driver.
+//
+// Return values:
+//   Number of streams the device has.
+//
+
+STATIC UINT32 AppleDartClaimDevice(dt_node_t *Device) {
+    CONST APPLE_DART_STREAM *Streams[DART_MAX_DEVICE_STREAMS];
+    UINT32 StreamCount;
+
+    StreamCount = AppleDartDeviceStreams(Device, Streams, ARRAY_SIZE(Streams));
+    for(UINT32 i = 0; i < StreamCount && i < ARRAY_SIZE(Streams); i++) {
+        for(UINT32 j = 0; j < Streams[i]->DartCount; j++) {
+            DartInfo[Streams[i]->DartIndex + j].Managed = TRUE;
+        }
+    }
+    return StreamCount;
+}
+
+//
+// Description:
+//   Decides which DARTs this driver takes over: the ones behind devices the firmware drives, the DWC3s
+//   AppleUsbTypeCBringupDxe brings up and the PCIe ports below apcie. Every other DART (display, ANS, DFU ports, ...)
+//   is still in use by whatever the firmware before us set up and is left alone.
+//
+
+STATIC VOID AppleDartFindManaged(VOID) {
+    dt_node_t *Devices[16];
+    dt_node_t *ApcieNode;
+    UINT32 MaxDwc3Controllers = PcdGet32(PcdAppleNumDwc3Controllers);
+    UINT32 DeviceCount;
+    INT32 Dwc3Index;
+
+    DeviceCount = dt_foreach_name_prefix(NULL, "usb-drd", Devices, ARRAY_SIZE(Devices));
+    for(UINT32 i = 0; i < DeviceCount && i < ARRAY_SIZE(Devices); i++) {
+        Dwc3Index = dt_node_name_index(Devices[i], "usb-drd");
+        if((Dwc3Index < 0) || ((UINT32)Dwc3Index >= MaxDwc3Controllers)) {
+            continue;
+        }
+        //
+        // to avoid killing the serial console from UART proxy - the DFU ports (usb-drd0 and usb-drd2) are left alone
+        // by AppleUsbTypeCBringupDxe, and so are their DARTs.
+        //
+        if((Dwc3Index == 0) || (Dwc3Index == 2)) {
+            continue;
+        }
+        if(AppleDartClaimDevice(Devices[i]) == 0) {
+            DEBUG((DEBUG_WARN, "%a - usb-drd%d has no iommu-parent\n", __FUNCTION__, Dwc3Index));
+        }
+    }
+
+    ApcieNode = dt_get("apcie");
+    if(ApcieNode == NULL) {
+        return;
+    }
+    AppleDartClaimDevice(ApcieNode);
+    DeviceCount = dt_foreach_name_prefix(ApcieNode, "pci-bridge", Devices, ARRAY_SIZE(Devices));
+    for(UINT32 i = 0; i < DeviceCount && i < ARRAY_SIZE(Devices); i++) {
+        AppleDartClaimDevice(Devices[i]);
     }
 }
 
@@ -320,37 +734,30 @@ AppleDartIoMmuDxeInitialize(
   IN EFI_SYSTEM_TABLE  *SystemTable
 )
 {
+#if defined (MDE_CPU_AARCH64)
     UINT32 Midr;
-    dt_node_t *DartNode[FixedPcdGet32(PcdAppleNumDwc3Controllers)];
-    UINT64 DartReg[FixedPcdGet32(PcdAppleNumDwc3Controllers) * 2];
-    UINT32 DartIndex = 0;
-    UINT32 Params4; // U-Boot does this
-    // PHYSICAL_ADDRESS Address;
-    // PHYSICAL_ADDRESS L2;
-    // INT32 Ntte;
-    // INT32 NL1, NL2;
-    INT32 sid, i;
-    UINT32 Params2;
-    CHAR8 DartNodeName[33];
-    // BOOLEAN DartFound = TRUE; // assume the DART exists to start.
-    //UINT32 Params4;
+#endif
+    UINT32 TranslatingCount = 0;
+    EFI_STATUS Status;
 
 
     //
-    // set up the IOMMU. for now, we should only be really setting up the DARTs for the USB controllers,
+    // set up the IOMMU. for now, we should only be really setting up the DARTs for the USB controllers and PCIe ports,
     // but very likely that this will change in the future.
     
     //
-    // Each DWC3 has two separate DARTs to manage requests but because the DWC3 DARTs are able to work in bypass mode, we can simply set bypass mode in this driver for each DART,
-    // and then simply not register the protocol for any of them. (UEFI assumes direct DMA access is possible if no IOMMU protocol is present)
-    // Note: this will NOT work for the USB-A controller, as that's on the PCIe bus (whose DARTs do NOT work in bypass mode), but other devices have a one device to one DART relation.
-    // Also this driver is NOT a secure driver by virtue of setting up bypass mode.
+    // Each DWC3 has two separate DARTs to manage requests but because the DWC3 DARTs are able to work in bypass mode, we can simply set bypass mode in this driver for each DART.
+    // The PCIe DARTs (which the USB-A controller sits behind) do NOT work in bypass mode, those get real page tables, and the IOMMU
+    // protocol is only installed if at least one of them was brought up (UEFI assumes direct DMA access is possible if no IOMMU protocol is present).
+    // Note that EDKII_IOMMU_PROTOCOL doesn't say which device a mapping is for, so every translating DART is attached to one default domain.
+    // Also this driver is NOT a secure driver by virtue of setting up bypass mode on the USB DARTs.
     //
 
 
+#if defined (MDE_CPU_AARCH64)
     //
     // Verify that we are on an Apple SoC by reading MIDR and checking the vendor ID bit,
-    // bail out if not found.
+    // bail out if not found. The host unit tests run this against fake DARTs and skip it.
     //
     Midr = ArmReadMidr();
     if(((Midr >> 24) & 0x61) == 0) {
@@ -359,161 +766,89 @@ AppleDartIoMmuDxeInitialize(
       ASSERT(FALSE);
       return EFI_NOT_FOUND;
     }
+#endif
 
     //
-    // Get the base addresses from the ADT. Right now there's no good way I know of to test for:
-    //   a. the number of dies a multi-die capable SoC has.
-    //   b. how many DARTs a given SoC die has.
-    // Given that this driver is mainly meant to bring up USB controller DARTs and was mostly designed for that purpose, for now
-    // only bring up the USB controller DARTs (which the following switch statement will assume hardcoded knowledge of for each SoC for now)
-    // TODO: make this a dynamic lookup to keep the code SoC-agnostic.
+    // Find every DART in the ADT. Only the ones behind devices we drive get set up, the rest (display,
+    // ANS, ...) are still in use by whatever the firmware before us set up and are left alone.
     //
+    Status = AppleDartDiscover(&DartInfo, &DartCount);
+    if(EFI_ERROR(Status)) {
+        return Status;
+    }
 
-    //
-    // USB-A DARTs used to be brought up in an earlier version of this driver, however due to issues with getting devices to enumerate
-    // on the USB-A ports on supported devices, that code is disabled for the moment.
-    //
+    AppleDartFindManaged();
 
-    for(INT32 DartNodeIndex = 0; DartNodeIndex < FixedPcdGet32(PcdAppleNumDwc3Controllers); DartNodeIndex++) {
-        AsciiSPrint(DartNodeName, ARRAY_SIZE(DartNodeName), "dart-usb%d", DartNodeIndex);
-        DartNode[DartNodeIndex] = dt_get(DartNodeName);
+    for(UINT32 DartIndex = 0; DartIndex < DartCount; DartIndex++) {
+        APPLE_DART_INFO *Dart = &DartInfo[DartIndex];
+        CHAR8 *NodeName = dt_node_prop(Dart->Node, "name", NULL);
 
-        if(DartNode[DartNodeIndex] == NULL) {
-            DEBUG((DEBUG_INFO, "Did not find node %a\n\n", DartNodeName));
-            DartIndex += 2;
+        if(!Dart->Managed) {
+            continue;
+        }
+        AppleDartSetupInstance(Dart);
+        if(Dart->BypassMode) {
             continue;
         }
 
-        dt_node_reg(DartNode[DartNodeIndex], 0, &DartReg[DartIndex++], NULL);
-        DEBUG((DEBUG_INFO, "DART reg[0] for %a is 0x%llx \n", DartNodeName, DartReg[DartIndex - 1]));
-        dt_node_reg(DartNode[DartNodeIndex], 1, &DartReg[DartIndex++], NULL);
-        DEBUG((DEBUG_INFO, "DART reg[1] for %a is 0x%llx \n", DartNodeName, DartReg[DartIndex - 1]));
-    }
-
-
-    for(DartIndex = 0; DartIndex < FixedPcdGet32(PcdAppleNumDwc3Controllers) * 2; DartIndex++) {
         //
-        // to avoid killing the serial console from UART proxy - leave darts for DFU ports alone.
+        // if there's no bypass mode available for this DART, set up translation.
         //
-        if(DartIndex == 0 || DartIndex == 1 || DartIndex == 4 || DartIndex == 5) {
-            DEBUG((DEBUG_INFO, "Skipping DFU port DART %d\n", DartIndex));
+        Status = AppleDartEnableTranslation(Dart);
+        if(EFI_ERROR(Status)) {
+            DEBUG((DEBUG_ERROR, "%a - failed to enable translation for %a reg[%d]: %r\n", __FUNCTION__, NodeName, Dart->RegIndex, Status));
             continue;
         }
-        //DEBUG((DEBUG_INFO, "Test0\n"));
-        DartInfo[DartIndex].BaseAddress = DartReg[DartIndex];
-
-        char *CompatibleStr;
-        size_t CompatibleStrLength = 0;
-        CompatibleStr = dt_node_prop(DartNode[DartIndex / 2], "compatible", &CompatibleStrLength);
-
-        if( !AsciiStrCmp(CompatibleStr ,"dart,t8110")) {
-            //
-            // T8110 compatible DARTs have different setup.
-            //
-            DEBUG((DEBUG_INFO, "%a - Setting up T8110-compatible DART\n", __FUNCTION__));
-            Params4 = MmioRead32(DartInfo[DartIndex].BaseAddress + DART_T8110_PARAMS4);
-            DartInfo[DartIndex].Nsid = Params4 & DART_T8110_PARAMS4_NSID_MASK;
-            DartInfo[DartIndex].Nttbr = 1;
-            DartInfo[DartIndex].SidEnableBase = DART_T8110_SID_ENABLE_BASE;
-            DartInfo[DartIndex].TcrBase = DART_T8110_TCR_BASE;
-            DartInfo[DartIndex].TcrTranslateEnable = DART_T8110_TCR_TRANSLATE_ENABLE;
-            DartInfo[DartIndex].TcrBypass = (DART_T8110_TCR_BYPASS_DAPF | DART_T8110_TCR_BYPASS_DART);
-            DartInfo[DartIndex].TtbrBase = DART_T8110_TTBR_BASE;
-            DartInfo[DartIndex].TtbrIsValid = DART_T8110_TTBR_VALID;
-            DartInfo[DartIndex].BypassMode = FALSE; // Assume there's no bypass mode by default.
-            DartInfo[DartIndex].TlbFlush = AppleDartT8110TlbFlush;
-
-        }
-        else {
-            DEBUG((DEBUG_INFO, "%a - Setting up T8020-compatible DART\n", __FUNCTION__));
-            DartInfo[DartIndex].Nsid = 16;
-            DartInfo[DartIndex].Nttbr = 4;
-            DartInfo[DartIndex].SidEnableBase = DART_T8020_SID_ENABLE;
-            DartInfo[DartIndex].TcrBase = DART_T8020_TCR_BASE;
-            DartInfo[DartIndex].TcrTranslateEnable = DART_T8020_TCR_TRANSLATE_ENABLE;
-            DartInfo[DartIndex].TcrBypass = (DART_T8020_TCR_BYPASS_DAPF | DART_T8020_TCR_BYPASS_DART);
-            DartInfo[DartIndex].TtbrBase = DART_T8020_TTBR_BASE;
-            DartInfo[DartIndex].TtbrIsValid = DART_T8020_TTBR_VALID;
-            DartInfo[DartIndex].BypassMode = FALSE; // Assume there's no bypass mode by default.
-            DartInfo[DartIndex].TlbFlush = AppleDartT8020TlbFlush;
-        }
-
-        if((AsciiStrCmp(CompatibleStr ,"dart,t8110") == 0) || (AsciiStrCmp(CompatibleStr ,"dart,t6000") == 0)) {
-            DartInfo[DartIndex].Shift = 4;
-        }
-
-        DartInfo[DartIndex].DmaVirtAddrBase = DART_PAGE_SIZE;
-        DartInfo[DartIndex].DmaVirtAddrEnd = SIZE_4GB - DART_PAGE_SIZE;
+        TranslatingCount++;
+    }
 
-        for(sid = 0; sid < DartInfo[DartIndex].Nsid; sid++) {
-            MmioWrite32(DartInfo[DartIndex].BaseAddress + DART_TCR(DartInfo[DartIndex], sid), 0);
-        }
-        for(sid = 0; sid < DartInfo[DartIndex].Nsid; sid++) {
-            for(i = 0; i < DartInfo[DartIndex].Nttbr; i++) {
-                MmioWrite32(DartInfo[DartIndex].BaseAddress + DART_TTBR(DartInfo[DartIndex], sid, i), 0);
-            }
-        }
+    //
+    // Batched unmaps are flushed, and DART faults picked up, at the latest one timer period later.
+    //
+    Status = gBS->CreateEvent (
+                    EVT_TIMER | EVT_NOTIFY_SIGNAL,
+                    TPL_CALLBACK,
+                    AppleDartPendingFlushNotify,
+                    NULL,
+                    &mPendingFlushEvent
+                    );
+    if(!EFI_ERROR(Status)) {
+        Status = gBS->SetTimer(mPendingFlushEvent, TimerPeriodic, DART_PENDING_FLUSH_PERIOD);
+    }
+    if(EFI_ERROR(Status)) {
+        DEBUG((DEBUG_ERROR, "%a - failed to set up the pending unmap flush timer: %r\n", __FUNCTION__, Status));
+        return Status;
+    }
 
-        DartInfo[DartIndex].TlbFlush((VOID *)&DartInfo[DartIndex]);
-
-        Params2 = MmioRead32(DartInfo[DartIndex].BaseAddress + DART_PARAMS2);
-        if((Params2 & DART_PARAMS2_BYPASS_SUPPORT) != 0) {
-            DEBUG((DEBUG_INFO, "AppleDartIoMmuDxeInitialize: USB DART%d supports bypass mode\n", DartIndex));
-            for(sid = 0; sid < DartInfo[DartIndex].Nsid; sid++) {
-                MmioWrite32(DartInfo[DartIndex].BaseAddress + DART_TCR(DartInfo[DartIndex], sid), DartInfo[DartIndex].TcrBypass);
-            }
-            DartInfo[DartIndex].BypassMode = TRUE;
-            //
-            // Bypass mode means the controllers can just DMA right into physical memory so we skip installing the IOMMU protocol.
-            //
-        }
+    Status = gBS->CreateEvent (
+                    EVT_SIGNAL_EXIT_BOOT_SERVICES,
+                    TPL_NOTIFY,
+                    AppleDartExitBootServicesNotify,
+                    NULL,
+                    &mDartExitBootServicesEvent
+                    );
+    ASSERT_EFI_ERROR(Status);
+
+    Status = AppleDartDiagnosticsInstall(&ImageHandle);
+    if(EFI_ERROR(Status)) {
+        DEBUG((DEBUG_ERROR, "%a - failed to install the DART diagnostics protocol: %r\n", __FUNCTION__, Status));
+    }
 
+    if(TranslatingCount == 0) {
         //
-        // if there's no bypass mode available for this DART, set up translation.
-        // Warning: might not work for some devices given page size shenanigans
-        // This code is disabled for now while I work out why USB-A DARTs aren't working.
+        // Everything bypasses, devices can DMA straight into physical memory.
         //
-        // Ntte = DIV_ROUND_UP(DartInfo->DmaVirtAddrEnd, DART_PAGE_SIZE);
-        // NL2 = DIV_ROUND_UP(Ntte, DART_PAGE_SIZE / sizeof(UINT64));
-        // NL1 = DIV_ROUND_UP(NL2, DART_PAGE_SIZE / sizeof(UINT64));
-
-        // DartInfo->L2 = AllocateAlignedPages(NL2 * DART_PAGE_SIZE, DART_PAGE_SIZE);
-        // memset(DartInfo->L2, 0, NL2 * DART_PAGE_SIZE);
-        // WriteBackInvalidateDataCacheRange((VOID *)DartInfo->L2, NL2 * DART_PAGE_SIZE);
-
-        // DartInfo->L1 = AllocateAlignedPages(NL1 * DART_PAGE_SIZE, DART_PAGE_SIZE);
-        // memset(DartInfo->L1, 0, NL1 * DART_PAGE_SIZE);
-        // L2 = (PHYSICAL_ADDRESS)DartInfo->L2;
-        // for(i = 0; i < NL2; i++) {
-        //     DartInfo->L1[i] = (L2 >> DartInfo->Shift) | DART_L1_TABLE;
-        //     L2 += DART_PAGE_SIZE;
-        // }
-        // WriteBackInvalidateDataCacheRange((VOID *)DartInfo->L1, NL1 * DART_PAGE_SIZE);
-
-        // for(sid = 0; sid < DartInfo->Nsid; sid++) {
-        //     Address = (PHYSICAL_ADDRESS)DartInfo->L1;
-        //     for(i = 0; i < NL1; i++) {
-        //         MmioWrite32(DartInfo->BaseAddress + DART_TTBR(DartInfo, sid, i), (Address >> DART_TTBR_SHIFT | DartInfo->TtbrIsValid));
-        //         Address += DART_PAGE_SIZE;
-        //     }
-        // }
-        // DartInfo->TlbFlush((VOID *)DartInfo);
-
-        // for(i = 0; i < DartInfo->Nsid / 32; i++) {
-        //     MmioWrite32(DartInfo->BaseAddress + DART_SID_ENABLE(DartInfo, i), ~0);
-        // }
-
-        // for(sid = 0; sid < DartInfo->Nsid; sid++) {
-        //     MmioWrite32(DartInfo->BaseAddress + DART_TCR(DartInfo, sid), DartInfo->TcrTranslateEnable);
-        // }
-
-        // return gBS->InstallMultipleProtocolInterfaces (
-        //                 &ImageHandle,
-        //                 &gEdkiiIoMmuProtocolGuid,
-        //                 &mAppleDartIoMmuProtocol,
-        //                 NULL
-        //                 );
-    }
-    DEBUG((DEBUG_INFO, "All done\n"));
-    return EFI_SUCCESS;
-}
\ No newline at end of file
+        DEBUG((DEBUG_INFO, "All done\n"));
+        return EFI_SUCCESS;
+    }
+
+    DEBUG((DEBUG_INFO, "%a - %u DARTs translating, installing IOMMU protocol\n", __FUNCTION__, TranslatingCount));
+    return gBS->InstallMultipleProtocolInterfaces (
+                    &ImageHandle,
+                    &gEdkiiIoMmuProtocolGuid,
+                    &mAppleDartIoMmuProtocol,
+                    &gAppleDartScatterGatherProtocolGuid,
+                    &mAppleDartScatterGatherProtocol,
+                    NULL
+                    );
+}
@@ -0,0 +1,115 @@
+/**
+ * Copyright (c) 2024, AppleWOA authors.
+ *
+ * Module Name:
+ *     AppleDartMapCache.c
+ *
+ * Abstract:
+ *     Cache of live DART mappings for buffers that get mapped over and over.
+ *
+ *     During a boot from USB, XhciDxe and UsbMassStorageDxe map the same few data buffers for
+ *     every transfer. Rather than tearing those mappings down on Unmap() and building them again
+ *     right after, the range stays mapped and the next Map() of it (same pages, same kind of
+ *     access) gets the same IOVA back. This file only does the bookkeeping, the driver maps and
+ *     unmaps the ranges.
+ *
+ * Environment:
+ *     UEFI DXE (Driver Execution Environment).
+ *
+ * License:
+ *     SPDX-License-Identifier: (BSD-2-Clause-Patent OR MIT) AND GPL-2.0
+*/
+
+#include <PiDxe.h>
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/DebugLib.h>
+
+#include <Drivers/AppleDartIoMmuDxe.h>
+
+//
+// Description:
+//   Finds a cached mapping that covers Pages DART pages from PhysAddress with the same access, and
+//   takes a reference to it.
+//
+// Return values:
+//   The entry, or NULL on a miss.
+//
+
+APPLE_DART_MAP_CACHE_ENTRY *AppleDartMapCacheLookup(APPLE_DART_MAP_CACHE *Cache, PHYSICAL_ADDRESS PhysAddress, UINTN Pages, APPLE_DART_ACCESS Access) {
+    PHYSICAL_ADDRESS End = PhysAddress + Pages * DART_PAGE_SIZE;
+
+    for(UINT32 i = 0; i < DART_MAP_CACHE_ENTRIES; i++) {
+        APPLE_DART_MAP_CACHE_ENTRY *Entry = &Cache->Entry[i];
+        if(!Entry->Valid || Entry->Access != Access) {
+            continue;
+        }
+        if(PhysAddress >= Entry->PhysAddress && End <= Entry->PhysAddress + Entry->Pages * DART_PAGE_SIZE) {
+            Entry->RefCount++;
+            Entry->LastUse = ++Cache->Clock;
+            Cache->Hits++;
+            return Entry;
+        }
+    }
+    Cache->Misses++;
+    return NULL;
+}
+
+//
+// Description:
+//   Records a new mapping, with one reference held by the caller.
+//
+// Return values:
+//   The entry, or NULL if every slot is taken. Evict one with AppleDartMapCacheVictim() first.
+//
+
+APPLE_DART_MAP_CACHE_ENTRY *AppleDartMapCacheInsert(APPLE_DART_MAP_CACHE *Cache, PHYSICAL_ADDRESS PhysAddress, UINTN Pages, APPLE_DART_ACCESS Access, PHYSICAL_ADDRESS Iova) {
+    for(UINT32 i = 0; i < DART_MAP_CACHE_ENTRIES; i++) {
+        APPLE_DART_MAP_CACHE_ENTRY *Entry = &Cache->Entry[i];
+        if(Entry->Valid) {
+            continue;
+        }
+        Entry->PhysAddress = PhysAddress;
+        Entry->Pages = Pages;
+        Entry->Iova = Iova;
+        Entry->Access = Access;
+        Entry->RefCount = 1;
+        Entry->LastUse = ++Cache->Clock;
+        Entry->Valid = TRUE;
+        return Entry;
+    }
+    return NULL;
+}
+
+//
+// Description:
+//   Picks the least recently used entry that nobody holds a reference to and drops it from the cache.
+//   Its Iova and Pages stay readable until the next insert, the caller has to unmap them.
+//
+// Return values:
+//   The evicted entry, or NULL if every entry is in use.
+//
+
+APPLE_DART_MAP_CACHE_ENTRY *AppleDartMapCacheVictim(APPLE_DART_MAP_CACHE *Cache) {
+    APPLE_DART_MAP_CACHE_ENTRY *Victim = NULL;
+
+    for(UINT32 i = 0; i < DART_MAP_CACHE_ENTRIES; i++) {
+        APPLE_DART_MAP_CACHE_ENTRY *Entry = &Cache->Entry[i];
+        if(!Entry->Valid || Entry->RefCount != 0) {
+            continue;
+        }
+        if(Victim == NULL || Entry->LastUse < Victim->LastUse) {
+            Victim = Entry;
+        }
+    }
+    if(Victim != NULL) {
+        Victim->Valid = FALSE;
+        Cache->Evictions++;
+    }
+    return Victim;
+}
+
+VOID AppleDartMapCacheRelease(APPLE_DART_MAP_CACHE_ENTRY *Entry) {
+    ASSERT(Entry->Valid && Entry->RefCount > 0);
+    Entry->RefCount--;
+}
@@ -0,0 +1,294 @@
+/**
+ * Copyright (c) 2024, AppleWOA authors.
+ *
+ * Module Name:
+ *     AppleDartPageTable.c
+ *
+ * Abstract:
+ *     IOVA allocator and L1/L2 page table management for DARTs running in translation mode.
+ *
+ *     The IOVA space is a bitmap with one bit per DART page. L2 tables are allocated the first time
+ *     something gets mapped into the 32MB they cover, and are handed back once the last mapping in them
+ *     is gone and the TLBs have been flushed.
+ *
+ *     When every DART walking the tables snoops the CPU caches, table updates only need a barrier
+ *     ahead of the TLB flush, otherwise each update is cleaned out to memory.
+ *
+ * Environment:
+ *     UEFI DXE (Driver Execution Environment).
+ *
+ * License:
+ *     SPDX-License-Identifier: (BSD-2-Clause-Patent OR MIT) AND GPL-2.0
+ *
+ *     Table layout is from the Asahi Linux project fork of u-boot, original copyright and author notices below.
+ *     Copyright (C) 2021 Mark Kettenis <kettenis@openbsd.org>
+*/
+
+#include <PiDxe.h>
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/CacheMaintenanceLib.h>
+#include <Library/DebugLib.h>
+#include <Library/MemoryAllocationLib.h>
+
+#include <Drivers/AppleDartIoMmuDxe.h>
+
+//
+// Description:
+//   Makes a table update visible to the DARTs walking Table, before their TLBs get flushed.
+//
+
+STATIC VOID AppleDartPageTableSync(APPLE_DART_PAGE_TABLE *Table, VOID *Address, UINTN Length) {
+    if(Table->Coherent) {
+        MemoryFence();
+        return;
+    }
+    WriteBackInvalidateDataCacheRange(Address, Length);
+}
+
+//
+// Description:
+//   Allocates the L1 table and the IOVA bitmap. L2 tables are allocated on demand.
+//
+// Return values:
+//   EFI_SUCCESS - tables are ready to be pointed at by the TTBRs.
+//   EFI_OUT_OF_RESOURCES - not enough memory.
+//
+
+EFI_STATUS AppleDartPageTableInit(APPLE_DART_PAGE_TABLE *Table, INT32 Shift, BOOLEAN Coherent, PHYSICAL_ADDRESS DmaVirtAddrBase, PHYSICAL_ADDRESS DmaVirtAddrEnd) {
+    ZeroMem(Table, sizeof(*Table));
+    Table->Shift = Shift;
+    Table->Coherent = Coherent;
+    Table->DmaVirtAddrBase = DmaVirtAddrBase;
+    Table->DmaVirtAddrEnd = DmaVirtAddrEnd;
+    Table->IovaPages = (DmaVirtAddrEnd - DmaVirtAddrBase) / DART_PAGE_SIZE;
+    Table->NumL1Entries = DIV_ROUND_UP(DmaVirtAddrEnd, DART_L2_COVERAGE);
+
+    //
+    // One L1 page covers 64GB of IOVA space, way more than the 4GB we hand out.
+    //
+    ASSERT(Table->NumL1Entries <= DART_PTES_PER_TABLE);
+
+    Table->L1 = AllocateAlignedPages(EFI_SIZE_TO_PAGES(DART_PAGE_SIZE), DART_PAGE_SIZE);
+    Table->L2 = AllocateZeroPool(Table->NumL1Entries * sizeof(UINT64 *));
+    Table->L2Live = AllocateZeroPool(Table->NumL1Entries * sizeof(UINT16));
+    Table->L2Dead = AllocateZeroPool(Table->NumL1Entries * sizeof(BOOLEAN));
+    Table->IovaBitmap = AllocateZeroPool(DIV_ROUND_UP(Table->IovaPages, 32) * sizeof(UINT32));
+    if(Table->L1 == NULL || Table->L2 == NULL || Table->L2Live == NULL || Table->L2Dead == NULL || Table->IovaBitmap == NULL) {
+        DEBUG((DEBUG_ERROR, "%a - failed to allocate DART page tables\n", __FUNCTION__));
+        return EFI_OUT_OF_RESOURCES;
+    }
+    ZeroMem(Table->L1, DART_PAGE_SIZE);
+    AppleDartPageTableSync(Table, (VOID *)Table->L1, DART_PAGE_SIZE);
+    return EFI_SUCCESS;
+}
+
+//
+// Description:
+//   Switches the tables to cleaning every update, for when a DART that doesn't snoop starts walking them.
+//   Whatever was written so far is cleaned out right away.
+//
+
+VOID AppleDartPageTableMakeNonCoherent(APPLE_DART_PAGE_TABLE *Table) {
+    Table->Coherent = FALSE;
+    WriteBackInvalidateDataCacheRange((VOID *)Table->L1, DART_PAGE_SIZE);
+    for(UINT32 i = 0; i < Table->NumL1Entries; i++) {
+        if(Table->L2[i] != NULL) {
+            WriteBackInvalidateDataCacheRange((VOID *)Table->L2[i], DART_PAGE_SIZE);
+        }
+    }
+}
+
+STATIC BOOLEAN AppleDartIovaTest(APPLE_DART_PAGE_TABLE *Table, UINTN Page) {
+    return (Table->IovaBitmap[Page / 32] & (1U << (Page % 32))) != 0;
+}
+
+STATIC VOID AppleDartIovaSet(APPLE_DART_PAGE_TABLE *Table, UINTN Page, UINTN Pages, BOOLEAN InUse) {
+    for(UINTN i = Page; i < Page + Pages; i++) {
+        if(InUse) {
+            Table->IovaBitmap[i / 32] |= (1U << (i % 32));
+        }
+        else {
+            Table->IovaBitmap[i / 32] &= ~(1U << (i % 32));
+        }
+    }
+}
+
+//
+// Description:
+//   Finds Pages free DART pages in a row, first fit starting after the last allocation.
+//
+// Return values:
+//   EFI_SUCCESS - *Iova is the start of the range, which is now marked in use.
+//   EFI_OUT_OF_RESOURCES - no free range that big.
+//
+
+EFI_STATUS AppleDartIovaAlloc(APPLE_DART_PAGE_TABLE *Table, UINTN Pages, PHYSICAL_ADDRESS *Iova) {
+    UINTN Start;
+    UINTN Run = 0;
+
+    if(Pages == 0 || Pages > Table->IovaPages) {
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    //
+    // Two passes at most: from the hint to the end, then from the start (a run can't wrap around).
+    //
+    Start = Table->IovaHint;
+    for(UINTN Scanned = 0, Page = Start; Scanned < Table->IovaPages + Pages; Scanned++, Page++) {
+        if(Page >= Table->IovaPages) {
+            Page = 0;
+            Run = 0;
+        }
+        //
+        // Skip fully used words in one go.
+        //
+        if((Page % 32) == 0 && Table->IovaBitmap[Page / 32] == MAX_UINT32 && Page + 32 <= Table->IovaPages) {
+            Scanned += 31;
+            Page += 31;
+            Run = 0;
+            continue;
+        }
+        if(AppleDartIovaTest(Table, Page)) {
+            Run = 0;
+            continue;
+        }
+        if(Run++ == 0) {
+            Start = Page;
+        }
+        if(Run == Pages) {
+            AppleDartIovaSet(Table, Start, Pages, TRUE);
+            Table->IovaHint = (Start + Pages) % Table->IovaPages;
+            *Iova = Table->DmaVirtAddrBase + Start * DART_PAGE_SIZE;
+            return EFI_SUCCESS;
+        }
+    }
+    return EFI_OUT_OF_RESOURCES;
+}
+
+VOID AppleDartIovaFree(APPLE_DART_PAGE_TABLE *Table, PHYSICAL_ADDRESS Iova, UINTN Pages) {
+    ASSERT(Iova >= Table->DmaVirtAddrBase && Iova + Pages * DART_PAGE_SIZE <= Table->DmaVirtAddrEnd);
+    AppleDartIovaSet(Table, (Iova - Table->DmaVirtAddrBase) / DART_PAGE_SIZE, Pages, FALSE);
+}
+
+//
+// Description:
+//   Returns the L2 table behind L1 entry L1Index, allocating it and hooking it into L1 if needed.
+//
+
+STATIC UINT64 *AppleDartPageTableGetL2(APPLE_DART_PAGE_TABLE *Table, UINTN L1Index) {
+    UINT64 *L2 = Table->L2[L1Index];
+
+    if(L2 == NULL) {
+        L2 = AllocateAlignedPages(EFI_SIZE_TO_PAGES(DART_PAGE_SIZE), DART_PAGE_SIZE);
+        if(L2 == NULL) {
+            return NULL;
+        }
+        ZeroMem(L2, DART_PAGE_SIZE);
+        AppleDartPageTableSync(Table, (VOID *)L2, DART_PAGE_SIZE);
+        Table->L2[L1Index] = L2;
+    }
+    else if(!Table->L2Dead[L1Index]) {
+        return L2;
+    }
+
+    //
+    // New table, or an emptied one that hasn't been freed yet, (re)hook it into L1.
+    //
+    Table->L2Dead[L1Index] = FALSE;
+    Table->L1[L1Index] = ((PHYSICAL_ADDRESS)(UINTN)L2 >> Table->Shift) | DART_L1_TABLE;
+    AppleDartPageTableSync(Table, (VOID *)&Table->L1[L1Index], sizeof(UINT64));
+    return L2;
+}
+
+//
+// Description:
+//   Maps Pages DART pages starting at PhysAddr to Iova. Doesn't flush the TLBs.
+//
+// Return values:
+//   EFI_SUCCESS - range mapped.
+//   EFI_OUT_OF_RESOURCES - couldn't allocate an L2 table, nothing is left mapped.
+//
+
+EFI_STATUS AppleDartPageTableMap(APPLE_DART_PAGE_TABLE *Table, PHYSICAL_ADDRESS Iova, PHYSICAL_ADDRESS PhysAddr, UINTN Pages) {
+    UINTN Index = Iova / DART_PAGE_SIZE;
+    UINTN Done = 0;
+
+    Table->Maps++;
+    Table->MappedPages += Pages;
+    while(Done < Pages) {
+        UINTN L1Index = Index / DART_PTES_PER_TABLE;
+        UINTN First = Index % DART_PTES_PER_TABLE;
+        UINTN Count = MIN(Pages - Done, DART_PTES_PER_TABLE - First);
+        UINT64 *L2 = AppleDartPageTableGetL2(Table, L1Index);
+
+        if(L2 == NULL) {
+            DEBUG((DEBUG_ERROR, "%a - out of memory for L2 tables\n", __FUNCTION__));
+            AppleDartPageTableUnmap(Table, Iova, Done);
+            return EFI_OUT_OF_RESOURCES;
+        }
+        for(UINTN i = First; i < First + Count; i++) {
+            ASSERT(L2[i] == DART_L2_INVAL);
+            L2[i] = (PhysAddr >> Table->Shift) | DART_L2_VALID | DART_L2_START(0LL) | DART_L2_END(~0LL);
+            PhysAddr += DART_PAGE_SIZE;
+        }
+        AppleDartPageTableSync(Table, (VOID *)&L2[First], Count * sizeof(UINT64));
+        Table->L2Live[L1Index] += Count;
+
+        Done += Count;
+        Index += Count;
+    }
+    return EFI_SUCCESS;
+}
+
+//
+// Description:
+//   Invalidates Pages DART pages starting at Iova. Doesn't flush the TLBs, L2 tables that became
+//   empty are unhooked from L1 but only freed by AppleDartPageTableReclaim() after the flush.
+//
+
+VOID AppleDartPageTableUnmap(APPLE_DART_PAGE_TABLE *Table, PHYSICAL_ADDRESS Iova, UINTN Pages) {
+    UINTN Index = Iova / DART_PAGE_SIZE;
+    UINTN Done = 0;
+
+    Table->Unmaps++;
+    while(Done < Pages) {
+        UINTN L1Index = Index / DART_PTES_PER_TABLE;
+        UINTN First = Index % DART_PTES_PER_TABLE;
+        UINTN Count = MIN(Pages - Done, DART_PTES_PER_TABLE - First);
+        UINT64 *L2 = Table->L2[L1Index];
+
+        ASSERT(L2 != NULL && !Table->L2Dead[L1Index] && Table->L2Live[L1Index] >= Count);
+        for(UINTN i = First; i < First + Count; i++) {
+            L2[i] = DART_L2_INVAL;
+        }
+        AppleDartPageTableSync(Table, (VOID *)&L2[First], Count * sizeof(UINT64));
+
+        Table->L2Live[L1Index] -= Count;
+        if(Table->L2Live[L1Index] == 0) {
+            Table->L1[L1Index] = 0;
+            AppleDartPageTableSync(Table, (VOID *)&Table->L1[L1Index], sizeof(UINT64));
+            Table->L2Dead[L1Index] = TRUE;
+        }
+
+        Done += Count;
+        Index += Count;
+    }
+}
+
+//
+// Description:
+//   Frees the L2 tables emptied by unmaps. Only call this once the TLBs have been flushed,
+//   before that the DART may still walk them.
+//
+
+VOID AppleDartPageTableReclaim(APPLE_DART_PAGE_TABLE *Table) {
+    for(UINT32 i = 0; i < Table->NumL1Entries; i++) {
+        if(Table->L2Dead[i]) {
+            FreeAlignedPages(Table->L2[i], EFI_SIZE_TO_PAGES(DART_PAGE_SIZE));
+            Table->L2[i] = NULL;
+            Table->L2Dead[i] = FALSE;
+        }
+    }
+}
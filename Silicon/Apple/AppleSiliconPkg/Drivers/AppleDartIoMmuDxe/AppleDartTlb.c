@@ -0,0 +1,153 @@
+/**
+ * Copyright (c) 2024, AppleWOA authors.
+ *
+ * Module Name:
+ *     AppleDartTlb.c
+ *
+ * Abstract:
+ *     Register layout and TLB maintenance of T8020 and T8110 style DARTs.
+ *
+ *     The two generations keep their stream tables at different offsets and flush differently:
+ *     T8020 takes a mask of up to 16 streams per command, T8110 flushes either everything or one
+ *     stream at a time. Everything here only goes through IoLib, so the host unit tests can run it
+ *     against a fake register file.
+ *
+ * Environment:
+ *     UEFI DXE (Driver Execution Environment).
+ *
+ * License:
+ *     SPDX-License-Identifier: (BSD-2-Clause-Patent OR MIT) AND GPL-2.0
+ *
+ *     Original code basis is from the Asahi Linux project fork of u-boot, original copyright and author notices below.
+ *     Copyright (C) 2021 Mark Kettenis <kettenis@openbsd.org>
+*/
+
+#include <PiDxe.h>
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/DebugLib.h>
+#include <Library/IoLib.h>
+#include <Library/TimerLib.h>
+#if defined (MDE_CPU_AARCH64)
+#include <Library/ArmLib.h>
+#endif
+
+#include <Drivers/AppleDartIoMmuDxe.h>
+
+//
+// Description:
+//   Makes the page table writes so far visible to the DART before a TLB command is issued.
+//
+
+STATIC VOID AppleDartTlbBarrier(VOID) {
+#if defined (MDE_CPU_AARCH64)
+    ArmDataSynchronizationBarrier();
+#else
+    MemoryFence();
+#endif
+}
+
+STATIC VOID AppleDartT8020TlbFlush(VOID *DartInformation, CONST UINT32 *SidMap) {
+
+    APPLE_DART_INFO *DartInfoStruct = (APPLE_DART_INFO *)DartInformation;
+    UINT32 SidMask = SidMap[0] & DartInfoStruct->SidMap[0] & DART_ALL_STREAMS(DartInfoStruct);
+
+    UINT64 Start;
+
+    if(SidMask == 0) {
+        return;
+    }
+    AppleDartTlbBarrier();
+    Start = GetPerformanceCounter();
+    MmioWrite32(DartInfoStruct->BaseAddress + DART_T8020_TLB_SIDMASK, SidMask);
+    MmioWrite32(DartInfoStruct->BaseAddress + DART_T8020_TLB_CMD, DART_T8020_TLB_CMD_FLUSH);
+    while((MmioRead32(DartInfoStruct->BaseAddress + DART_T8020_TLB_CMD) & DART_T8020_TLB_CMD_BUSY) != 0) {
+        continue;
+    }
+    DartInfoStruct->Counters.Flushes++;
+    DartInfoStruct->Counters.FlushWaitTicks += GetPerformanceCounter() - Start;
+}
+
+STATIC VOID AppleDartT8110TlbCmd(APPLE_DART_INFO *DartInfoStruct, UINT32 Cmd) {
+    UINT64 Start = GetPerformanceCounter();
+
+    MmioWrite32(DartInfoStruct->BaseAddress + DART_T8110_TLB_CMD, Cmd);
+    while((MmioRead32(DartInfoStruct->BaseAddress + DART_T8110_TLB_CMD)) & DART_T8110_TLB_CMD_BUSY) {
+        continue;
+    }
+    DartInfoStruct->Counters.Flushes++;
+    DartInfoStruct->Counters.FlushWaitTicks += GetPerformanceCounter() - Start;
+}
+
+STATIC VOID AppleDartT8110TlbFlush(VOID *DartInformation, CONST UINT32 *SidMap) {
+    APPLE_DART_INFO *DartInfoStruct = (APPLE_DART_INFO *)DartInformation;
+    UINT32 Flush[DART_MAX_SID / 32];
+    INT32 Count = 0;
+    INT32 sid;
+
+    for(sid = 0; sid < DART_MAX_SID / 32; sid++) {
+        Flush[sid] = SidMap[sid] & DartInfoStruct->SidMap[sid];
+    }
+    for(sid = 0; sid < DartInfoStruct->Nsid; sid++) {
+        Count += DART_SID_IS_SET(Flush, sid) ? 1 : 0;
+    }
+    if(Count == 0) {
+        return;
+    }
+    AppleDartTlbBarrier();
+
+    //
+    // T8110 has no stream mask, it's either every stream or one at a time.
+    //
+    if(Count == DartInfoStruct->Nsid) {
+        AppleDartT8110TlbCmd(DartInfoStruct, FIELD_PREP(DART_T8110_TLB_CMD_OP, DART_T8110_TLB_CMD_OP_FLUSH_ALL));
+        return;
+    }
+    for(sid = 0; sid < DartInfoStruct->Nsid; sid++) {
+        if(DART_SID_IS_SET(Flush, sid)) {
+            AppleDartT8110TlbCmd(DartInfoStruct, FIELD_PREP(DART_T8110_TLB_CMD_OP, DART_T8110_TLB_CMD_OP_FLUSH_SID) | FIELD_PREP(DART_T8110_TLB_CMD_STREAM, sid));
+        }
+    }
+}
+
+//
+// Description:
+//   Fills in the register layout and TLB flush routine of a DART from its type. T8110 DARTs
+//   report their stream count in PARAMS4, which is the only register read. Nothing is written.
+//
+
+VOID AppleDartDescribeRegisters(APPLE_DART_INFO *Dart) {
+    UINT32 Params4; // U-Boot does this
+
+    if(Dart->Type == AppleDartT8110Compatible) {
+        //
+        // T8110 compatible DARTs have different setup.
+        //
+        DEBUG((DEBUG_INFO, "%a - Setting up T8110-compatible DART\n", __FUNCTION__));
+        Params4 = MmioRead32(Dart->BaseAddress + DART_T8110_PARAMS4);
+        Dart->Nsid = Params4 & DART_T8110_PARAMS4_NSID_MASK;
+        Dart->Nttbr = 1;
+        Dart->SidEnableBase = DART_T8110_SID_ENABLE_BASE;
+        Dart->TcrBase = DART_T8110_TCR_BASE;
+        Dart->TcrTranslateEnable = DART_T8110_TCR_TRANSLATE_ENABLE;
+        Dart->TcrBypass = (DART_T8110_TCR_BYPASS_DAPF | DART_T8110_TCR_BYPASS_DART);
+        Dart->TtbrBase = DART_T8110_TTBR_BASE;
+        Dart->TtbrIsValid = DART_T8110_TTBR_VALID;
+        Dart->BypassMode = FALSE; // Assume there's no bypass mode by default.
+        Dart->TlbFlush = AppleDartT8110TlbFlush;
+
+    }
+    else {
+        DEBUG((DEBUG_INFO, "%a - Setting up T8020-compatible DART\n", __FUNCTION__));
+        Dart->Nsid = 16;
+        Dart->Nttbr = 4;
+        Dart->SidEnableBase = DART_T8020_SID_ENABLE;
+        Dart->TcrBase = DART_T8020_TCR_BASE;
+        Dart->TcrTranslateEnable = DART_T8020_TCR_TRANSLATE_ENABLE;
+        Dart->TcrBypass = (DART_T8020_TCR_BYPASS_DAPF | DART_T8020_TCR_BYPASS_DART);
+        Dart->TtbrBase = DART_T8020_TTBR_BASE;
+        Dart->TtbrIsValid = DART_T8020_TTBR_VALID;
+        Dart->BypassMode = FALSE; // Assume there's no bypass mode by default.
+        Dart->TlbFlush = AppleDartT8020TlbFlush;
+    }
+}
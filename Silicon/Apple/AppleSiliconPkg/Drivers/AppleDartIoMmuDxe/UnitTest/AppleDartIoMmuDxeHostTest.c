@@ -0,0 +1,1393 @@
+/*
+ * Copyright (c) 2024, AppleWOA authors.
+ *
+ * Module Name:
+ *     AppleDartIoMmuDxeHostTest.c
+ *
+ * Abstract:
+ *     Host based unit tests for the DART page tables, the domain and the TLB flushes.
+ *
+ *     AppleDartPageTable.c, AppleDartDomain.c and AppleDartTlb.c are linked against a fake register
+ *     file standing in for one T8020 and one T8110 DART. MMIO to either lands in an array of
+ *     registers, every TLB command is recorded and reads back busy once before it completes.
+ *     Mappings are checked by walking the tables the way the DART does, from the L1 entry down to
+ *     the PTE, and flushes by the commands the fake DARTs saw.
+ *
+ *     The rest of the driver is brought up once, from a small ADT, against the same fake DARTs, and
+ *     exercised through the IOMMU and scatter/gather protocols it installs in the host gBS.
+ *
+ * License:
+ *     SPDX-License-Identifier: (BSD-2-Clause-Patent OR MIT) AND GPL-2.0
+ */
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/DebugLib.h>
+#include <Library/IoLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/TimerLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/UnitTestLib.h>
+#include <Library/AppleDTLib.h>
+
+#include <Protocol/IoMmu.h>
+#include <Protocol/AppleDartScatterGather.h>
+
+#include <Drivers/AppleDartIoMmuDxe.h>
+
+#define UNIT_TEST_APP_NAME     "AppleDartIoMmuDxe Host Unit Tests"
+#define UNIT_TEST_APP_VERSION  "1.0"
+
+#define FAKE_DART_REG_SIZE  SIZE_8KB
+#define FAKE_DART_MAX_CMDS  64
+#define FAKE_T8110_NSID     64
+
+//
+// What the PTEs point at is never touched, so it can be anything below the 40 bit output address limit.
+//
+#define FAKE_PHYS_BASE  0x800000000ULL
+
+//
+// Output address bits of a PTE, the start/end fields sit above them.
+//
+#define TEST_PTE_OA_MASK(Shift)  ((1ULL << 40) - (1ULL << (14 - (Shift))))
+
+//
+// What a PTE can point at. Buffers the host allocates can sit above that, those are compared
+// in the bits the DART gets to see.
+//
+#define TEST_DART_OA(Address, Shift)  ((Address) & ((1ULL << (40 + (Shift))) - 1))
+
+//
+// Each benchmark round maps, unmaps and flushes once, fewer rounds than that make the numbers noise.
+//
+#define BENCH_ROUNDS  256
+
+//
+// Per page, the largest mapping may cost this many times what a single page does, going by the
+// faster of both DARTs, before mapping is no longer considered linear.
+//
+#define BENCH_MAX_GROWTH  3
+#define BENCH_MIN_NS      50
+
+#define ADT_SIZE  SIZE_4KB
+
+//
+// Phandles of the mapper-* streams in the ADT the driver is brought up from.
+//
+#define ADT_PHANDLE_USB1    0x100
+#define ADT_PHANDLE_APCIE0  0x101
+#define ADT_PHANDLE_DISP0   0x102
+
+typedef struct {
+  UINTN              Base;
+  APPLE_DART_TYPE    Type;
+  UINT32             Reg[FAKE_DART_REG_SIZE / sizeof (UINT32)];
+  UINT32             Cmd[FAKE_DART_MAX_CMDS];   // T8020: stream mask of each flush, T8110: each TLB command
+  UINT32             CmdCount;
+  UINT32             Polls;                     // reads of the TLB command register
+} FAKE_DART;
+
+//
+// One domain per DART, T8020 and T8110 PTEs are laid out differently and can't share tables.
+//
+typedef struct {
+  FAKE_DART            Fake[2];
+  APPLE_DART_INFO      Dart[2];
+  APPLE_DART_DOMAIN    Domain[2];
+} DART_FIXTURE;
+
+//
+// The driver under test, brought up once by DriverSuiteSetup() since its state is global.
+//
+typedef struct {
+  UINT8                                 Adt[ADT_SIZE];
+  UINTN                                 AdtOffset;
+  VOID                                  *Index;
+  UINTN                                 IndexPages;
+  VOID                                  *OldIndex;
+  BOOLEAN                               Ready;
+  EDKII_IOMMU_PROTOCOL                  *IoMmu;
+  APPLE_DART_SCATTER_GATHER_PROTOCOL    *ScatterGather;
+} DRIVER_FIXTURE;
+
+STATIC DART_FIXTURE    mFixture;
+STATIC DRIVER_FIXTURE  mDriver;
+
+STATIC CONST UINTN  mMapPages[] = { 1, 5, DART_PTES_PER_TABLE, DART_PTES_PER_TABLE + 952 };
+
+STATIC
+UINTN
+FakeDartTlbCmd (
+  IN FAKE_DART  *Fake
+  )
+{
+  return (Fake->Type == AppleDartT8110Compatible) ? DART_T8110_TLB_CMD : DART_T8020_TLB_CMD;
+}
+
+STATIC
+UINT32
+FakeDartTlbBusy (
+  IN FAKE_DART  *Fake
+  )
+{
+  return (Fake->Type == AppleDartT8110Compatible) ? DART_T8110_TLB_CMD_BUSY : DART_T8020_TLB_CMD_BUSY;
+}
+
+STATIC
+FAKE_DART *
+FakeDartFind (
+  IN  UINTN  Address,
+  OUT UINTN  *Offset
+  )
+{
+  for (UINTN i = 0; i < ARRAY_SIZE (mFixture.Fake); i++) {
+    FAKE_DART  *Fake = &mFixture.Fake[i];
+
+    if ((Address >= Fake->Base) && (Address < Fake->Base + FAKE_DART_REG_SIZE)) {
+      *Offset = Address - Fake->Base;
+      ASSERT ((*Offset % sizeof (UINT32)) == 0);
+      return Fake;
+    }
+  }
+
+  DEBUG ((DEBUG_ERROR, "%a - MMIO to 0x%lx isn't a fake DART\n", __FUNCTION__, (UINT64)Address));
+  ASSERT (FALSE);
+  return NULL;
+}
+
+UINT32
+EFIAPI
+MmioRead32 (
+  IN UINTN  Address
+  )
+{
+  FAKE_DART  *Fake;
+  UINTN      Offset;
+  UINT32     Value;
+
+  Fake = FakeDartFind (Address, &Offset);
+  if (Fake == NULL) {
+    return MAX_UINT32;
+  }
+
+  Value = Fake->Reg[Offset / sizeof (UINT32)];
+  if (Offset == FakeDartTlbCmd (Fake)) {
+    //
+    // Busy for one read, so the driver has to poll.
+    //
+    Fake->Polls++;
+    Fake->Reg[Offset / sizeof (UINT32)] &= ~FakeDartTlbBusy (Fake);
+  }
+
+  return Value;
+}
+
+UINT32
+EFIAPI
+MmioWrite32 (
+  IN UINTN   Address,
+  IN UINT32  Value
+  )
+{
+  FAKE_DART  *Fake;
+  UINTN      Offset;
+  BOOLEAN    Command;
+
+  Fake = FakeDartFind (Address, &Offset);
+  if (Fake == NULL) {
+    return Value;
+  }
+
+  Fake->Reg[Offset / sizeof (UINT32)] = Value;
+  if (Offset != FakeDartTlbCmd (Fake)) {
+    return Value;
+  }
+
+  Command = (Fake->Type == AppleDartT8110Compatible) || ((Value & DART_T8020_TLB_CMD_FLUSH) != 0);
+  if (Command) {
+    ASSERT (Fake->CmdCount < FAKE_DART_MAX_CMDS);
+    if (Fake->CmdCount < FAKE_DART_MAX_CMDS) {
+      Fake->Cmd[Fake->CmdCount] = (Fake->Type == AppleDartT8110Compatible) ? Value : Fake->Reg[DART_T8020_TLB_SIDMASK / sizeof (UINT32)];
+    }
+
+    Fake->CmdCount++;
+    Fake->Reg[Offset / sizeof (UINT32)] |= FakeDartTlbBusy (Fake);
+  }
+
+  return Value;
+}
+
+UINT32
+EFIAPI
+MmioOr32 (
+  IN UINTN   Address,
+  IN UINT32  OrData
+  )
+{
+  return MmioWrite32 (Address, MmioRead32 (Address) | OrData);
+}
+
+STATIC
+UINT32
+FakeDartReg (
+  IN APPLE_DART_INFO  *Dart,
+  IN UINTN            Offset
+  )
+{
+  return MmioRead32 (Dart->BaseAddress + Offset);
+}
+
+STATIC
+VOID
+FakeDartClearCmds (
+  IN DART_FIXTURE  *Fixture
+  )
+{
+  for (UINTN i = 0; i < ARRAY_SIZE (Fixture->Fake); i++) {
+    Fixture->Fake[i].CmdCount = 0;
+    Fixture->Fake[i].Polls    = 0;
+  }
+}
+
+STATIC
+VOID
+DomainFree (
+  IN APPLE_DART_DOMAIN  *Domain
+  )
+{
+  APPLE_DART_PAGE_TABLE  *Table;
+
+  Table = &Domain->Table;
+  if (Table->L2 != NULL) {
+    for (UINT32 i = 0; i < Table->NumL1Entries; i++) {
+      if (Table->L2[i] != NULL) {
+        FreeAlignedPages (Table->L2[i], EFI_SIZE_TO_PAGES (DART_PAGE_SIZE));
+      }
+    }
+
+    FreePool (Table->L2);
+  }
+
+  if (Table->L1 != NULL) {
+    FreeAlignedPages (Table->L1, EFI_SIZE_TO_PAGES (DART_PAGE_SIZE));
+  }
+
+  if (Table->L2Live != NULL) {
+    FreePool (Table->L2Live);
+  }
+
+  if (Table->L2Dead != NULL) {
+    FreePool (Table->L2Dead);
+  }
+
+  if (Table->IovaBitmap != NULL) {
+    FreePool (Table->IovaBitmap);
+  }
+
+  if (Domain->Attach != NULL) {
+    FreePool (Domain->Attach);
+  }
+
+  ZeroMem (Domain, sizeof (*Domain));
+}
+
+STATIC
+VOID
+EFIAPI
+FixtureCleanup (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  DART_FIXTURE  *Fixture;
+
+  Fixture = (DART_FIXTURE *)Context;
+  for (UINTN i = 0; i < ARRAY_SIZE (Fixture->Domain); i++) {
+    DomainFree (&Fixture->Domain[i]);
+  }
+}
+
+/**
+  A T8020 DART at 0x2000_0000 and a T8110 one with FAKE_T8110_NSID streams at 0x3000_0000, both
+  quiesced and without bypass support.
+**/
+STATIC
+VOID
+FakeDartReset (
+  IN DART_FIXTURE  *Fixture
+  )
+{
+  ZeroMem (Fixture->Fake, sizeof (Fixture->Fake));
+  Fixture->Fake[0].Base = 0x20000000;
+  Fixture->Fake[0].Type = AppleDartT8020Compatible;
+  Fixture->Fake[1].Base = 0x30000000;
+  Fixture->Fake[1].Type = AppleDartT8110Compatible;
+  Fixture->Fake[1].Reg[DART_T8110_PARAMS4 / sizeof (UINT32)] = FAKE_T8110_NSID;
+}
+
+/**
+  A T8020 DART walking the tables coherently with the old PTE layout, and a T8110 one that doesn't
+  snoop with the t6000 layout, each with a domain of its own and nothing attached yet.
+**/
+STATIC
+UNIT_TEST_STATUS
+EFIAPI
+FixtureSetup (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  DART_FIXTURE  *Fixture;
+
+  Fixture = (DART_FIXTURE *)Context;
+  ZeroMem (Fixture, sizeof (*Fixture));
+  FakeDartReset (Fixture);
+
+  Fixture->Dart[0].Shift        = 0;
+  Fixture->Dart[0].CoherentWalk = TRUE;
+  Fixture->Dart[1].Shift        = 4;
+  Fixture->Dart[1].CoherentWalk = FALSE;
+
+  for (UINTN i = 0; i < ARRAY_SIZE (Fixture->Dart); i++) {
+    APPLE_DART_INFO  *Dart = &Fixture->Dart[i];
+
+    Dart->BaseAddress     = Fixture->Fake[i].Base;
+    Dart->Type            = Fixture->Fake[i].Type;
+    Dart->Managed         = TRUE;
+    Dart->DmaVirtAddrBase = DART_PAGE_SIZE;
+    Dart->DmaVirtAddrEnd  = SIZE_4GB - DART_PAGE_SIZE;
+    AppleDartDescribeRegisters (Dart);
+
+    if (EFI_ERROR (AppleDartDomainInit (&Fixture->Domain[i], Dart->Shift, TRUE, Dart->DmaVirtAddrBase, Dart->DmaVirtAddrEnd, 1))) {
+      FixtureCleanup (Fixture);
+      return UNIT_TEST_ERROR_PREREQUISITE_NOT_MET;
+    }
+  }
+
+  return UNIT_TEST_PASSED;
+}
+
+STATIC
+EFI_STATUS
+AttachStreams (
+  IN DART_FIXTURE  *Fixture,
+  IN UINTN         Index,
+  IN CONST UINT32  *Sids,
+  IN UINTN         Count
+  )
+{
+  UINT32  SidMap[DART_MAX_SID / 32];
+
+  ZeroMem (SidMap, sizeof (SidMap));
+  for (UINTN i = 0; i < Count; i++) {
+    DART_SID_SET (SidMap, Sids[i]);
+  }
+
+  return AppleDartDomainAttach (&Fixture->Domain[Index], &Fixture->Dart[Index], SidMap);
+}
+
+STATIC
+EFI_STATUS
+AttachAllStreams (
+  IN DART_FIXTURE  *Fixture,
+  IN UINTN         Index
+  )
+{
+  UINT32  SidMap[DART_MAX_SID / 32];
+
+  ZeroMem (SidMap, sizeof (SidMap));
+  for (INT32 Sid = 0; Sid < Fixture->Dart[Index].Nsid; Sid++) {
+    DART_SID_SET (SidMap, Sid);
+  }
+
+  return AppleDartDomainAttach (&Fixture->Domain[Index], &Fixture->Dart[Index], SidMap);
+}
+
+/**
+  Translates Iova the way the DART does, from the L1 entry down to the PTE. Host pointers don't
+  fit in the 40 bit output address of an L1 entry, so those are decoded in full.
+
+  @retval TRUE   *PhysAddr is where Iova ends up.
+  @retval FALSE  The walk hit an invalid L1 entry or PTE, or a PTE that doesn't cover its whole page.
+**/
+STATIC
+BOOLEAN
+DartWalk (
+  IN  APPLE_DART_PAGE_TABLE  *Table,
+  IN  PHYSICAL_ADDRESS       Iova,
+  OUT PHYSICAL_ADDRESS       *PhysAddr
+  )
+{
+  UINTN   Index;
+  UINT64  Entry;
+  UINT64  *L2;
+
+  Index = (UINTN)(Iova / DART_PAGE_SIZE);
+  Entry = Table->L1[Index / DART_PTES_PER_TABLE];
+  if ((Entry & DART_L1_TABLE) != DART_L1_TABLE) {
+    return FALSE;
+  }
+
+  L2    = (UINT64 *)(UINTN)((Entry & ~(UINT64)DART_L1_TABLE) << Table->Shift);
+  Entry = L2[Index % DART_PTES_PER_TABLE];
+  if (((Entry & DART_L2_VALID) == 0) || ((Entry & ~TEST_PTE_OA_MASK (Table->Shift)) != (DART_L2_VALID | DART_L2_START (0ULL) | DART_L2_END (~0ULL)))) {
+    return FALSE;
+  }
+
+  *PhysAddr = ((Entry & TEST_PTE_OA_MASK (Table->Shift)) << Table->Shift) + (Iova & DART_PAGE_MASK);
+  return TRUE;
+}
+
+/**
+  Every stream gets the L1 table in its first TTBR and translation turned on, the rest of the
+  TTBRs stay clear, and the streams are enabled.
+**/
+STATIC
+UNIT_TEST_STATUS
+EFIAPI
+RegisterLayout (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  DART_FIXTURE  *Fixture;
+
+  Fixture = (DART_FIXTURE *)Context;
+  UT_ASSERT_EQUAL (Fixture->Dart[0].Nsid, 16);
+  UT_ASSERT_EQUAL (Fixture->Dart[0].Nttbr, 4);
+  UT_ASSERT_EQUAL (Fixture->Dart[1].Nsid, FAKE_T8110_NSID);
+  UT_ASSERT_EQUAL (Fixture->Dart[1].Nttbr, 1);
+
+  for (UINTN i = 0; i < ARRAY_SIZE (Fixture->Dart); i++) {
+    APPLE_DART_INFO  *Dart = &Fixture->Dart[i];
+    UINT32           Ttbr;
+
+    UT_ASSERT_NOT_EFI_ERROR (AttachAllStreams (Fixture, i));
+    UT_ASSERT_TRUE (Dart->Domain == &Fixture->Domain[i]);
+
+    Ttbr = (UINT32)RShiftU64 ((UINT64)(UINTN)Fixture->Domain[i].Table.L1, DART_TTBR_SHIFT) | Dart->TtbrIsValid;
+    for (INT32 Sid = 0; Sid < Dart->Nsid; Sid++) {
+      UT_ASSERT_EQUAL (FakeDartReg (Dart, DART_TCR (*Dart, Sid)), Dart->TcrTranslateEnable);
+      UT_ASSERT_EQUAL (FakeDartReg (Dart, DART_TTBR (*Dart, Sid, 0)), Ttbr);
+      for (INT32 Idx = 1; Idx < Dart->Nttbr; Idx++) {
+        UT_ASSERT_EQUAL (FakeDartReg (Dart, DART_TTBR (*Dart, Sid, Idx)), 0);
+      }
+    }
+
+    for (INT32 Word = 0; Word < DIV_ROUND_UP (Dart->Nsid, 32); Word++) {
+      INT32  Left = Dart->Nsid - Word * 32;
+
+      UT_ASSERT_EQUAL (FakeDartReg (Dart, DART_SID_ENABLE (*Dart, Word)), (Left >= 32) ? MAX_UINT32 : (1U << Left) - 1);
+    }
+  }
+
+  //
+  // A domain built for one PTE layout can't take a DART with the other.
+  //
+  UT_ASSERT_EQUAL (AppleDartDomainAttach (&Fixture->Domain[0], &Fixture->Dart[1], Fixture->Dart[1].SidMap), EFI_UNSUPPORTED);
+  return UNIT_TEST_PASSED;
+}
+
+/**
+  Mappings of a few sizes, one spanning two L2 tables, translate to the buffer page by page,
+  stop translating once unmapped, and leave no tables behind once reclaimed.
+**/
+STATIC
+UNIT_TEST_STATUS
+EFIAPI
+MapAndWalk (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  DART_FIXTURE  *Fixture;
+
+  Fixture = (DART_FIXTURE *)Context;
+  for (UINTN i = 0; i < ARRAY_SIZE (Fixture->Domain); i++) {
+    APPLE_DART_PAGE_TABLE  *Table = &Fixture->Domain[i].Table;
+
+    UT_ASSERT_NOT_EFI_ERROR (AttachAllStreams (Fixture, i));
+    UT_ASSERT_EQUAL (Table->Coherent, Fixture->Dart[i].CoherentWalk);
+
+    for (UINTN Size = 0; Size < ARRAY_SIZE (mMapPages); Size++) {
+      UINTN             Pages = mMapPages[Size];
+      PHYSICAL_ADDRESS  Host  = FAKE_PHYS_BASE + Size * SIZE_1GB;
+      PHYSICAL_ADDRESS  Iova;
+      PHYSICAL_ADDRESS  Phys;
+
+      UT_ASSERT_NOT_EFI_ERROR (AppleDartIovaAlloc (Table, Pages, &Iova));
+      UT_ASSERT_TRUE (Iova >= Table->DmaVirtAddrBase && Iova + Pages * DART_PAGE_SIZE <= Table->DmaVirtAddrEnd);
+      UT_ASSERT_NOT_EFI_ERROR (AppleDartPageTableMap (Table, Iova, Host, Pages));
+
+      for (UINTN Page = 0; Page < Pages; Page++) {
+        UT_ASSERT_TRUE (DartWalk (Table, Iova + Page * DART_PAGE_SIZE + 0x123, &Phys));
+        UT_ASSERT_EQUAL (Phys, Host + Page * DART_PAGE_SIZE + 0x123);
+      }
+
+      UT_ASSERT_TRUE (!DartWalk (Table, Iova + Pages * DART_PAGE_SIZE, &Phys));
+
+      AppleDartPageTableUnmap (Table, Iova, Pages);
+      for (UINTN Page = 0; Page < Pages; Page++) {
+        UT_ASSERT_TRUE (!DartWalk (Table, Iova + Page * DART_PAGE_SIZE, &Phys));
+      }
+
+      AppleDartDomainFlush (&Fixture->Domain[i]);
+      AppleDartPageTableReclaim (Table);
+      AppleDartIovaFree (Table, Iova, Pages);
+    }
+
+    for (UINT32 L1Index = 0; L1Index < Table->NumL1Entries; L1Index++) {
+      UT_ASSERT_EQUAL (Table->L1[L1Index], 0);
+      UT_ASSERT_TRUE (Table->L2[L1Index] == NULL);
+    }
+
+    for (UINTN Word = 0; Word < DIV_ROUND_UP (Table->IovaPages, 32); Word++) {
+      UT_ASSERT_EQUAL (Table->IovaBitmap[Word], 0);
+    }
+
+    UT_ASSERT_EQUAL (Table->Maps, ARRAY_SIZE (mMapPages));
+    UT_ASSERT_EQUAL (Table->Unmaps, ARRAY_SIZE (mMapPages));
+  }
+
+  return UNIT_TEST_PASSED;
+}
+
+/**
+  Operations per second for an average of Ns nanoseconds each.
+**/
+STATIC
+UINT64
+BenchRate (
+  IN UINT64  Ns
+  )
+{
+  return DivU64x64Remainder (1000000000ULL, MAX (Ns, 1), NULL);
+}
+
+/**
+  Map, unmap and flush throughput over the mMapPages sizes, timed with TimerLib and logged per DART.
+  Each round maps a range, unmaps it and flushes the streams, the way the driver does for an
+  uncached mapping. Mapping has to stay roughly linear in the number of pages.
+**/
+STATIC
+UNIT_TEST_STATUS
+EFIAPI
+MapBench (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  DART_FIXTURE  *Fixture;
+  UINT64        PerPage[ARRAY_SIZE (mFixture.Domain)][ARRAY_SIZE (mMapPages)];
+  UINT64        First;
+  UINT64        Last;
+
+  Fixture = (DART_FIXTURE *)Context;
+  for (UINTN i = 0; i < ARRAY_SIZE (Fixture->Domain); i++) {
+    APPLE_DART_PAGE_TABLE  *Table = &Fixture->Domain[i].Table;
+
+    UT_ASSERT_NOT_EFI_ERROR (AttachAllStreams (Fixture, i));
+    UT_LOG_INFO (
+      "%a DART, %a table walks, %u rounds\n",
+      (Fixture->Dart[i].Type == AppleDartT8110Compatible) ? "T8110" : "T8020",
+      Table->Coherent ? "coherent" : "non-coherent",
+      BENCH_ROUNDS
+      );
+    UT_LOG_INFO ("   pages      map/s    unmap/s    flush/s  map MB/s\n");
+
+    for (UINTN Size = 0; Size < ARRAY_SIZE (mMapPages); Size++) {
+      UINTN             Pages = mMapPages[Size];
+      PHYSICAL_ADDRESS  Iova;
+      UINT64            Start;
+      UINT64            MapTicks   = 0;
+      UINT64            UnmapTicks = 0;
+      UINT64            FlushTicks = 0;
+      UINT64            MapNs;
+      EFI_STATUS        Status;
+
+      UT_ASSERT_NOT_EFI_ERROR (AppleDartIovaAlloc (Table, Pages, &Iova));
+      for (UINTN Round = 0; Round < BENCH_ROUNDS; Round++) {
+        FakeDartClearCmds (Fixture);
+
+        Start     = GetPerformanceCounter ();
+        Status    = AppleDartPageTableMap (Table, Iova, FAKE_PHYS_BASE, Pages);
+        MapTicks += GetPerformanceCounter () - Start;
+        UT_ASSERT_NOT_EFI_ERROR (Status);
+
+        Start       = GetPerformanceCounter ();
+        AppleDartPageTableUnmap (Table, Iova, Pages);
+        UnmapTicks += GetPerformanceCounter () - Start;
+
+        Start       = GetPerformanceCounter ();
+        AppleDartDomainFlush (&Fixture->Domain[i]);
+        FlushTicks += GetPerformanceCounter () - Start;
+
+        AppleDartPageTableReclaim (Table);
+      }
+
+      AppleDartIovaFree (Table, Iova, Pages);
+
+      MapNs            = GetTimeInNanoSecond (MapTicks) / BENCH_ROUNDS;
+      PerPage[i][Size] = MapNs / Pages;
+      UT_LOG_INFO (
+        "%8lu %10lu %10lu %10lu %9lu\n",
+        (UINT64)Pages,
+        BenchRate (MapNs),
+        BenchRate (GetTimeInNanoSecond (UnmapTicks) / BENCH_ROUNDS),
+        BenchRate (GetTimeInNanoSecond (FlushTicks) / BENCH_ROUNDS),
+        DivU64x64Remainder (BenchRate (MapNs) * Pages * DART_PAGE_SIZE, SIZE_1MB, NULL)
+        );
+    }
+
+    UT_ASSERT_EQUAL (Table->Maps, BENCH_ROUNDS * ARRAY_SIZE (mMapPages));
+    UT_ASSERT_EQUAL (Table->Unmaps, BENCH_ROUNDS * ARRAY_SIZE (mMapPages));
+  }
+
+  First = MIN (PerPage[0][0], PerPage[1][0]);
+  Last  = MIN (PerPage[0][ARRAY_SIZE (mMapPages) - 1], PerPage[1][ARRAY_SIZE (mMapPages) - 1]);
+  UT_ASSERT_TRUE (Last <= BENCH_MAX_GROWTH * MAX (First, BENCH_MIN_NS));
+  return UNIT_TEST_PASSED;
+}
+
+/**
+  T8020 flushes the attached streams with one masked command, and waits for it.
+**/
+STATIC
+UNIT_TEST_STATUS
+EFIAPI
+T8020Flush (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  DART_FIXTURE         *Fixture;
+  FAKE_DART            *Fake;
+  STATIC CONST UINT32  First[]  = { 1, 3 };
+  STATIC CONST UINT32  Second[] = { 5 };
+
+  Fixture = (DART_FIXTURE *)Context;
+  Fake    = &Fixture->Fake[0];
+
+  UT_ASSERT_NOT_EFI_ERROR (AttachStreams (Fixture, 0, First, ARRAY_SIZE (First)));
+  UT_ASSERT_EQUAL (Fake->CmdCount, 1);
+  UT_ASSERT_EQUAL (Fake->Cmd[0], BIT1 | BIT3);
+
+  //
+  // Attaching more streams only flushes those, a domain flush covers all of them.
+  //
+  UT_ASSERT_NOT_EFI_ERROR (AttachStreams (Fixture, 0, Second, ARRAY_SIZE (Second)));
+  UT_ASSERT_EQUAL (Fake->CmdCount, 2);
+  UT_ASSERT_EQUAL (Fake->Cmd[1], BIT5);
+
+  FakeDartClearCmds (Fixture);
+  AppleDartDomainFlush (&Fixture->Domain[0]);
+  UT_ASSERT_EQUAL (Fake->CmdCount, 1);
+  UT_ASSERT_EQUAL (Fake->Cmd[0], BIT1 | BIT3 | BIT5);
+  UT_ASSERT_TRUE (Fake->Polls >= 2);
+  UT_ASSERT_EQUAL (Fake->Reg[DART_T8020_TLB_CMD / sizeof (UINT32)] & DART_T8020_TLB_CMD_BUSY, 0);
+  UT_ASSERT_EQUAL (Fixture->Dart[0].Counters.Flushes, 3);
+
+  //
+  // Streams that were never attached aren't TCR enabled.
+  //
+  UT_ASSERT_EQUAL (FakeDartReg (&Fixture->Dart[0], DART_TCR (Fixture->Dart[0], 0)), 0);
+  return UNIT_TEST_PASSED;
+}
+
+/**
+  T8110 flushes stream by stream, or everything at once when every stream is attached.
+**/
+STATIC
+UNIT_TEST_STATUS
+EFIAPI
+T8110Flush (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  DART_FIXTURE         *Fixture;
+  FAKE_DART            *Fake;
+  STATIC CONST UINT32  Sids[] = { 2, 40 };
+
+  Fixture = (DART_FIXTURE *)Context;
+  Fake    = &Fixture->Fake[1];
+
+  UT_ASSERT_NOT_EFI_ERROR (AttachStreams (Fixture, 1, Sids, ARRAY_SIZE (Sids)));
+  UT_ASSERT_EQUAL (Fake->CmdCount, 2);
+  for (UINTN i = 0; i < ARRAY_SIZE (Sids); i++) {
+    UT_ASSERT_EQUAL (FIELD_GET (DART_T8110_TLB_CMD_OP, Fake->Cmd[i]), DART_T8110_TLB_CMD_OP_FLUSH_SID);
+    UT_ASSERT_EQUAL (FIELD_GET (DART_T8110_TLB_CMD_STREAM, Fake->Cmd[i]), Sids[i]);
+  }
+
+  UT_ASSERT_TRUE (Fake->Polls >= 2 * ARRAY_SIZE (Sids));
+  UT_ASSERT_EQUAL (Fake->Reg[DART_T8110_TLB_CMD / sizeof (UINT32)] & DART_T8110_TLB_CMD_BUSY, 0);
+
+  FakeDartClearCmds (Fixture);
+  UT_ASSERT_NOT_EFI_ERROR (AttachAllStreams (Fixture, 1));
+  AppleDartDomainFlush (&Fixture->Domain[1]);
+  UT_ASSERT_EQUAL (Fake->CmdCount, 2);
+  for (UINTN i = 0; i < 2; i++) {
+    UT_ASSERT_EQUAL (FIELD_GET (DART_T8110_TLB_CMD_OP, Fake->Cmd[i]), DART_T8110_TLB_CMD_OP_FLUSH_ALL);
+  }
+
+  return UNIT_TEST_PASSED;
+}
+
+/**
+  Detaching turns translation off and clears every TTBR of the attached streams, then flushes
+  them, after which the domain has nothing left to flush.
+**/
+STATIC
+UNIT_TEST_STATUS
+EFIAPI
+DetachAll (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  DART_FIXTURE         *Fixture;
+  STATIC CONST UINT32  Sids[] = { 0, 7, 9 };
+
+  Fixture = (DART_FIXTURE *)Context;
+  for (UINTN i = 0; i < ARRAY_SIZE (Fixture->Dart); i++) {
+    APPLE_DART_INFO  *Dart = &Fixture->Dart[i];
+    FAKE_DART        *Fake = &Fixture->Fake[i];
+
+    UT_ASSERT_NOT_EFI_ERROR (AttachStreams (Fixture, i, Sids, ARRAY_SIZE (Sids)));
+    FakeDartClearCmds (Fixture);
+
+    AppleDartDomainDetachAll (&Fixture->Domain[i]);
+    UT_ASSERT_EQUAL (Fixture->Domain[i].AttachCount, 0);
+    UT_ASSERT_TRUE (Dart->Domain == NULL && Dart->L1 == NULL);
+    for (INT32 Sid = 0; Sid < Dart->Nsid; Sid++) {
+      UT_ASSERT_EQUAL (FakeDartReg (Dart, DART_TCR (*Dart, Sid)), 0);
+      for (INT32 Idx = 0; Idx < Dart->Nttbr; Idx++) {
+        UT_ASSERT_EQUAL (FakeDartReg (Dart, DART_TTBR (*Dart, Sid, Idx)), 0);
+      }
+
+      UT_ASSERT_TRUE (!DART_SID_IS_SET (Dart->SidMap, Sid));
+    }
+
+    if (Dart->Type == AppleDartT8020Compatible) {
+      UT_ASSERT_EQUAL (Fake->CmdCount, 1);
+      UT_ASSERT_EQUAL (Fake->Cmd[0], BIT0 | BIT7 | BIT9);
+    } else {
+      UT_ASSERT_EQUAL (Fake->CmdCount, ARRAY_SIZE (Sids));
+    }
+
+    FakeDartClearCmds (Fixture);
+    AppleDartDomainFlush (&Fixture->Domain[i]);
+    UT_ASSERT_EQUAL (Fake->CmdCount, 0);
+  }
+
+  return UNIT_TEST_PASSED;
+}
+
+//
+// Neither is in a public header: the driver's entry point, and AppleDTLib's hook for pointing
+// every lookup at a tree the host test built (AppleDTLibInternal.h).
+//
+EFI_STATUS
+EFIAPI
+AppleDartIoMmuDxeInitialize (
+  IN EFI_HANDLE        ImageHandle,
+  IN EFI_SYSTEM_TABLE  *SystemTable
+  );
+
+dt_index_t *
+dt_index_swap (
+  dt_index_t  *idx
+  );
+
+STATIC
+VOID
+AdtNode (
+  IN OUT DRIVER_FIXTURE  *Driver,
+  IN     UINT32          PropCount,
+  IN     UINT32          ChildCount
+  )
+{
+  dt_node_t  *Node;
+
+  ASSERT (Driver->AdtOffset + sizeof (dt_node_t) <= sizeof (Driver->Adt));
+  Node              = (dt_node_t *)(Driver->Adt + Driver->AdtOffset);
+  Node->nprop       = PropCount;
+  Node->nchld       = ChildCount;
+  Driver->AdtOffset += sizeof (dt_node_t);
+}
+
+STATIC
+VOID
+AdtProp (
+  IN OUT DRIVER_FIXTURE  *Driver,
+  IN     CONST CHAR8     *Key,
+  IN     CONST VOID      *Value,
+  IN     UINT32          Length
+  )
+{
+  dt_prop_t  *Prop;
+  UINTN      Size;
+
+  Size = sizeof (dt_prop_t) + ALIGN_VALUE (Length, 4);
+  ASSERT (Driver->AdtOffset + Size <= sizeof (Driver->Adt));
+  Prop = (dt_prop_t *)(Driver->Adt + Driver->AdtOffset);
+  ZeroMem (Prop, Size);
+  AsciiStrnCpyS (Prop->key, sizeof (Prop->key), Key, sizeof (Prop->key) - 1);
+  Prop->len = Length;
+  CopyMem (Prop->val, Value, Length);
+  Driver->AdtOffset += Size;
+}
+
+STATIC
+VOID
+AdtName (
+  IN OUT DRIVER_FIXTURE  *Driver,
+  IN     CONST CHAR8     *Name
+  )
+{
+  AdtProp (Driver, "name", Name, (UINT32)AsciiStrSize (Name));
+}
+
+STATIC
+VOID
+AdtU32 (
+  IN OUT DRIVER_FIXTURE  *Driver,
+  IN     CONST CHAR8     *Key,
+  IN     UINT32          Value
+  )
+{
+  AdtProp (Driver, Key, &Value, sizeof (Value));
+}
+
+/**
+  A DART node with one reg entry and one mapper stream.
+**/
+STATIC
+VOID
+AdtDart (
+  IN OUT DRIVER_FIXTURE  *Driver,
+  IN     CONST CHAR8     *Name,
+  IN     CONST CHAR8     *Compatible,
+  IN     UINT32          Base,
+  IN     CONST CHAR8     *Mapper,
+  IN     UINT32          Sid,
+  IN     UINT32          Phandle
+  )
+{
+  CONST UINT32  Reg[] = { Base, 0x0, 0x4000, 0x0 };
+
+  AdtNode (Driver, 3, 1);
+  AdtName (Driver, Name);
+  AdtProp (Driver, "compatible", Compatible, (UINT32)AsciiStrSize (Compatible));
+  AdtProp (Driver, "reg", Reg, sizeof (Reg));
+
+  AdtNode (Driver, 3, 0);
+  AdtName (Driver, Mapper);
+  AdtU32 (Driver, "reg", Sid);
+  AdtU32 (Driver, "AAPL,phandle", Phandle);
+}
+
+/**
+  device-tree                 #address-cells 2, #size-cells 2
+    arm-io                    0x0 -> 0x0, 4G
+      dart-usb1               dart,t8110 at the T8110 fake
+        mapper-usb1           SID 1
+      dart-apcie0             dart,t6000 at the T8020 fake
+        mapper-apcie0         SID 0
+      dart-disp0              dart,t8110 at 0x4000_0000, no fake DART there, so touching it fails the test
+        mapper-disp0          SID 0
+      usb-drd0                -> mapper-disp0, but a DFU port the firmware doesn't drive
+      usb-drd1                -> mapper-usb1
+      apcie
+        pci-bridge0           -> mapper-apcie0
+      disp0                   -> mapper-disp0
+**/
+STATIC
+VOID
+AdtBuild (
+  IN OUT DRIVER_FIXTURE  *Driver
+  )
+{
+  CONST UINT32  ArmIoRanges[] = { 0x0, 0x0, 0x0, 0x0, 0x0, 0x1 };
+
+  Driver->AdtOffset = 0;
+
+  AdtNode (Driver, 3, 1);
+  AdtName (Driver, "device-tree");
+  AdtU32 (Driver, "#address-cells", 2);
+  AdtU32 (Driver, "#size-cells", 2);
+
+  AdtNode (Driver, 4, 7);
+  AdtName (Driver, "arm-io");
+  AdtU32 (Driver, "#address-cells", 2);
+  AdtU32 (Driver, "#size-cells", 2);
+  AdtProp (Driver, "ranges", ArmIoRanges, sizeof (ArmIoRanges));
+
+  AdtDart (Driver, "dart-usb1", "dart,t8110", (UINT32)mFixture.Fake[1].Base, "mapper-usb1", 1, ADT_PHANDLE_USB1);
+  AdtDart (Driver, "dart-apcie0", "dart,t6000", (UINT32)mFixture.Fake[0].Base, "mapper-apcie0", 0, ADT_PHANDLE_APCIE0);
+  AdtDart (Driver, "dart-disp0", "dart,t8110", 0x40000000, "mapper-disp0", 0, ADT_PHANDLE_DISP0);
+
+  AdtNode (Driver, 2, 0);
+  AdtName (Driver, "usb-drd0");
+  AdtU32 (Driver, "iommu-parent", ADT_PHANDLE_DISP0);
+
+  AdtNode (Driver, 2, 0);
+  AdtName (Driver, "usb-drd1");
+  AdtU32 (Driver, "iommu-parent", ADT_PHANDLE_USB1);
+
+  AdtNode (Driver, 1, 1);
+  AdtName (Driver, "apcie");
+
+  AdtNode (Driver, 2, 0);
+  AdtName (Driver, "pci-bridge0");
+  AdtU32 (Driver, "iommu-parent", ADT_PHANDLE_APCIE0);
+
+  AdtNode (Driver, 2, 0);
+  AdtName (Driver, "disp0");
+  AdtU32 (Driver, "iommu-parent", ADT_PHANDLE_DISP0);
+}
+
+/**
+  Builds and indexes the ADT, then runs the driver's entry point against the fake DARTs and picks
+  up the protocols it installed. The driver keeps its state in globals, so this happens once.
+**/
+STATIC
+VOID
+EFIAPI
+DriverSuiteSetup (
+  VOID
+  )
+{
+  DRIVER_FIXTURE  *Driver;
+  UINTN           Need;
+  EFI_STATUS      Status;
+
+  Driver = &mDriver;
+  if (Driver->Ready) {
+    return;
+  }
+
+  FakeDartReset (&mFixture);
+  AdtBuild (Driver);
+  if (dt_check (Driver->Adt, Driver->AdtOffset, NULL) != 0) {
+    return;
+  }
+
+  Need               = dt_index_size (Driver->Adt, Driver->AdtOffset);
+  Driver->IndexPages = EFI_SIZE_TO_PAGES (Need);
+  Driver->Index      = AllocatePages (Driver->IndexPages);
+  if ((Need == 0) || (Driver->Index == NULL)) {
+    return;
+  }
+
+  if (dt_index_init (Driver->Index, EFI_PAGES_TO_SIZE (Driver->IndexPages), Driver->Adt, Driver->AdtOffset) != 0) {
+    return;
+  }
+
+  Driver->OldIndex = dt_index_swap (Driver->Index);
+
+  Status = AppleDartIoMmuDxeInitialize (gImageHandle, gST);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "%a - driver failed to start: %r\n", __FUNCTION__, Status));
+    return;
+  }
+
+  gBS->LocateProtocol (&gEdkiiIoMmuProtocolGuid, NULL, (VOID **)&Driver->IoMmu);
+  gBS->LocateProtocol (&gAppleDartScatterGatherProtocolGuid, NULL, (VOID **)&Driver->ScatterGather);
+  Driver->Ready = (Driver->IoMmu != NULL) && (Driver->ScatterGather != NULL);
+}
+
+STATIC
+UNIT_TEST_STATUS
+EFIAPI
+DriverSetup (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  DRIVER_FIXTURE  *Driver;
+
+  Driver = (DRIVER_FIXTURE *)Context;
+  if (!Driver->Ready) {
+    return UNIT_TEST_ERROR_PREREQUISITE_NOT_MET;
+  }
+
+  FakeDartClearCmds (&mFixture);
+  return UNIT_TEST_PASSED;
+}
+
+/**
+  The tables behind every DART the driver translates with. There is one default domain, so they
+  all have to agree.
+**/
+STATIC
+APPLE_DART_PAGE_TABLE *
+DriverTable (
+  VOID
+  )
+{
+  APPLE_DART_DOMAIN  *Domain;
+
+  Domain = NULL;
+  for (UINT32 i = 0; i < DartCount; i++) {
+    if (!DartInfo[i].Managed) {
+      continue;
+    }
+
+    if ((DartInfo[i].Domain == NULL) || ((Domain != NULL) && (DartInfo[i].Domain != Domain))) {
+      return NULL;
+    }
+
+    Domain = DartInfo[i].Domain;
+  }
+
+  return (Domain != NULL) ? &Domain->Table : NULL;
+}
+
+/**
+  DeviceAddress..DeviceAddress + Bytes translates, page by page and at its last byte, to what the
+  DART would see of HostAddress..HostAddress + Bytes.
+**/
+STATIC
+BOOLEAN
+DriverTranslates (
+  IN PHYSICAL_ADDRESS  DeviceAddress,
+  IN PHYSICAL_ADDRESS  HostAddress,
+  IN UINTN             Bytes
+  )
+{
+  APPLE_DART_PAGE_TABLE  *Table;
+  PHYSICAL_ADDRESS       Phys;
+  UINTN                  Offset;
+
+  Table = DriverTable ();
+  if (Table == NULL) {
+    return FALSE;
+  }
+
+  for (Offset = 0; Offset < Bytes; Offset = MIN (Offset + DART_PAGE_SIZE, Bytes - 1)) {
+    if (!DartWalk (Table, DeviceAddress + Offset, &Phys) || (Phys != TEST_DART_OA (HostAddress + Offset, Table->Shift))) {
+      return FALSE;
+    }
+
+    if (Offset == Bytes - 1) {
+      break;
+    }
+  }
+
+  return TRUE;
+}
+
+/**
+  Only the DARTs behind usb-drd1 and pci-bridge0 are taken over, both translate through the one
+  default domain, and dart-disp0 is left alone even though the DFU port points at it.
+**/
+STATIC
+UNIT_TEST_STATUS
+EFIAPI
+DriverManaged (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  UT_ASSERT_EQUAL (DartCount, 3);
+  UT_ASSERT_NOT_NULL (DriverTable ());
+
+  for (UINT32 i = 0; i < DartCount; i++) {
+    APPLE_DART_INFO  *Dart = &DartInfo[i];
+    CHAR8            *Name = dt_node_prop (Dart->Node, "name", NULL);
+
+    UT_ASSERT_NOT_NULL (Name);
+    if (AsciiStrCmp (Name, "dart-disp0") == 0) {
+      UT_ASSERT_FALSE (Dart->Managed);
+      UT_ASSERT_TRUE (Dart->Domain == NULL);
+      continue;
+    }
+
+    UT_ASSERT_TRUE (Dart->Managed);
+    UT_ASSERT_FALSE (Dart->BypassMode);
+    UT_ASSERT_EQUAL (Dart->Shift, 4);
+    for (INT32 Sid = 0; Sid < Dart->Nsid; Sid++) {
+      UT_ASSERT_EQUAL (FakeDartReg (Dart, DART_TCR (*Dart, Sid)), Dart->TcrTranslateEnable);
+    }
+  }
+
+  return UNIT_TEST_PASSED;
+}
+
+/**
+  Map() over the mMapPages sizes, page aligned and not, for each kind of operation. Every device
+  address it returns translates back to the host address, only after the DARTs were flushed, and
+  mapping the same pages or pages inside them again is a map cache hit that doesn't touch the DARTs.
+**/
+STATIC
+UNIT_TEST_STATUS
+EFIAPI
+DriverMapWalk (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  DRIVER_FIXTURE               *Driver;
+  EDKII_IOMMU_PROTOCOL         *IoMmu;
+  STATIC CONST EDKII_IOMMU_OPERATION  Ops[] = {
+    EdkiiIoMmuOperationBusMasterRead,
+    EdkiiIoMmuOperationBusMasterWrite,
+    EdkiiIoMmuOperationBusMasterCommonBuffer,
+  };
+  STATIC CONST UINTN           Offsets[] = { 0, 0x123 };
+  UINTN                        Range;
+
+  Driver = (DRIVER_FIXTURE *)Context;
+  IoMmu  = Driver->IoMmu;
+  Range  = 0;
+
+  for (UINTN Op = 0; Op < ARRAY_SIZE (Ops); Op++) {
+    for (UINTN Size = 0; Size < ARRAY_SIZE (mMapPages); Size++) {
+      for (UINTN Off = 0; Off < ARRAY_SIZE (Offsets); Off++) {
+        UINTN             Pages = mMapPages[Size];
+        PHYSICAL_ADDRESS  Host  = FAKE_PHYS_BASE + Range++ * SIZE_256MB + Offsets[Off];
+        UINTN             Bytes = Pages * DART_PAGE_SIZE - Offsets[Off];
+        PHYSICAL_ADDRESS  Device;
+        PHYSICAL_ADDRESS  Again;
+        VOID              *Mapping;
+        VOID              *Cached;
+
+        FakeDartClearCmds (&mFixture);
+        UT_ASSERT_NOT_EFI_ERROR (IoMmu->Map (IoMmu, Ops[Op], (VOID *)(UINTN)Host, &Bytes, &Device, &Mapping));
+        UT_ASSERT_EQUAL (Bytes, Pages * DART_PAGE_SIZE - Offsets[Off]);
+        UT_ASSERT_EQUAL (Device & DART_PAGE_MASK, Offsets[Off]);
+        UT_ASSERT_TRUE (mFixture.Fake[0].CmdCount != 0 && mFixture.Fake[1].CmdCount != 0);
+        UT_ASSERT_TRUE (DriverTranslates (Device, Host, Bytes));
+
+        FakeDartClearCmds (&mFixture);
+        UT_ASSERT_NOT_EFI_ERROR (IoMmu->Map (IoMmu, Ops[Op], (VOID *)(UINTN)Host, &Bytes, &Again, &Cached));
+        UT_ASSERT_EQUAL (Again, Device);
+        UT_ASSERT_NOT_EFI_ERROR (IoMmu->Unmap (IoMmu, Cached));
+
+        if (Pages > 2) {
+          PHYSICAL_ADDRESS  Inner      = Host - Offsets[Off] + DART_PAGE_SIZE + 0x10;
+          UINTN             InnerBytes = DART_PAGE_SIZE;
+
+          UT_ASSERT_NOT_EFI_ERROR (IoMmu->Map (IoMmu, Ops[Op], (VOID *)(UINTN)Inner, &InnerBytes, &Again, &Cached));
+          UT_ASSERT_EQUAL (Again, Device - Offsets[Off] + DART_PAGE_SIZE + 0x10);
+          UT_ASSERT_NOT_EFI_ERROR (IoMmu->Unmap (IoMmu, Cached));
+        }
+
+        UT_ASSERT_EQUAL (mFixture.Fake[0].CmdCount + mFixture.Fake[1].CmdCount, 0);
+
+        //
+        // Unmapping leaves a cached mapping in place for the next user.
+        //
+        UT_ASSERT_NOT_EFI_ERROR (IoMmu->Unmap (IoMmu, Mapping));
+        UT_ASSERT_TRUE (DriverTranslates (Device, Host, Bytes));
+      }
+    }
+  }
+
+  return UNIT_TEST_PASSED;
+}
+
+/**
+  Once more idle mappings are cached than there is room for, the oldest gets evicted, and its
+  device address stops translating.
+**/
+STATIC
+UNIT_TEST_STATUS
+EFIAPI
+DriverMapEvict (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  DRIVER_FIXTURE        *Driver;
+  EDKII_IOMMU_PROTOCOL  *IoMmu;
+  PHYSICAL_ADDRESS      Host;
+  PHYSICAL_ADDRESS      Device;
+  PHYSICAL_ADDRESS      First;
+  PHYSICAL_ADDRESS      Last;
+  UINTN                 Bytes;
+  VOID                  *Mapping;
+
+  Driver = (DRIVER_FIXTURE *)Context;
+  IoMmu  = Driver->IoMmu;
+  First  = 0;
+  Last   = 0;
+
+  //
+  // Twice the cache size, whatever earlier tests left in it is gone too by then.
+  //
+  for (UINTN i = 0; i < 2 * DART_MAP_CACHE_ENTRIES; i++) {
+    Host  = FAKE_PHYS_BASE + SIZE_16GB + i * DART_PAGE_SIZE;
+    Bytes = DART_PAGE_SIZE;
+    FakeDartClearCmds (&mFixture);
+    UT_ASSERT_NOT_EFI_ERROR (IoMmu->Map (IoMmu, EdkiiIoMmuOperationBusMasterRead, (VOID *)(UINTN)Host, &Bytes, &Device, &Mapping));
+    UT_ASSERT_TRUE (DriverTranslates (Device, Host, Bytes));
+    UT_ASSERT_NOT_EFI_ERROR (IoMmu->Unmap (IoMmu, Mapping));
+    if (i == 0) {
+      First = Device;
+    }
+
+    Last = Device;
+  }
+
+  UT_ASSERT_FALSE (DriverTranslates (First, FAKE_PHYS_BASE + SIZE_16GB, DART_PAGE_SIZE));
+  UT_ASSERT_TRUE (DriverTranslates (Last, FAKE_PHYS_BASE + SIZE_16GB + (2 * DART_MAP_CACHE_ENTRIES - 1) * DART_PAGE_SIZE, DART_PAGE_SIZE));
+  return UNIT_TEST_PASSED;
+}
+
+/**
+  Buffers from AllocateBuffer() small enough for the DMA pool are mapped as part of their slab,
+  Map() hands back where they sit in it. Bigger ones are mapped like any other buffer.
+**/
+STATIC
+UNIT_TEST_STATUS
+EFIAPI
+DriverPoolMap (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  DRIVER_FIXTURE        *Driver;
+  EDKII_IOMMU_PROTOCOL  *IoMmu;
+  STATIC CONST UINTN    BufferPages[] = {
+    1,
+    EFI_SIZE_TO_PAGES (DART_PAGE_SIZE),
+    EFI_SIZE_TO_PAGES (SIZE_64KB),
+    EFI_SIZE_TO_PAGES (SIZE_64KB) * 2,
+  };
+
+  Driver = (DRIVER_FIXTURE *)Context;
+  IoMmu  = Driver->IoMmu;
+
+  for (UINTN i = 0; i < ARRAY_SIZE (BufferPages); i++) {
+    VOID              *Buffer;
+    PHYSICAL_ADDRESS  Host;
+    PHYSICAL_ADDRESS  Device;
+    UINTN             Bytes;
+    VOID              *Mapping;
+
+    FakeDartClearCmds (&mFixture);
+    UT_ASSERT_NOT_EFI_ERROR (IoMmu->AllocateBuffer (IoMmu, AllocateAnyPages, EfiBootServicesData, BufferPages[i], &Buffer, 0));
+    Host  = (PHYSICAL_ADDRESS)(UINTN)Buffer + 0x40;
+    Bytes = EFI_PAGES_TO_SIZE (BufferPages[i]) - 0x40;
+
+    UT_ASSERT_NOT_EFI_ERROR (IoMmu->Map (IoMmu, EdkiiIoMmuOperationBusMasterCommonBuffer, (VOID *)(UINTN)Host, &Bytes, &Device, &Mapping));
+    UT_ASSERT_EQUAL (((APPLE_DART_MAPPING *)Mapping)->Pooled, BufferPages[i] <= EFI_SIZE_TO_PAGES (SIZE_64KB));
+    UT_ASSERT_EQUAL (Device & EFI_PAGE_MASK, 0x40);
+    UT_ASSERT_TRUE (DriverTranslates (Device, Host, Bytes));
+
+    UT_ASSERT_NOT_EFI_ERROR (IoMmu->Unmap (IoMmu, Mapping));
+    UT_ASSERT_NOT_EFI_ERROR (IoMmu->FreeBuffer (IoMmu, BufferPages[i], Buffer));
+  }
+
+  return UNIT_TEST_PASSED;
+}
+
+/**
+  Scatter/gather ranges end up back to back in one device range, and Unmap() takes the whole
+  range down right away, it is never cached.
+**/
+STATIC
+UNIT_TEST_STATUS
+EFIAPI
+DriverScatterGather (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  DRIVER_FIXTURE                      *Driver;
+  APPLE_DART_SCATTER_GATHER_PROTOCOL  *ScatterGather;
+  APPLE_DART_SG_ENTRY                 List[2];
+  PHYSICAL_ADDRESS                    Device;
+  UINTN                               Bytes;
+  VOID                                *Mapping;
+
+  Driver        = (DRIVER_FIXTURE *)Context;
+  ScatterGather = Driver->ScatterGather;
+
+  List[0].HostAddress = FAKE_PHYS_BASE + SIZE_16GB + SIZE_8GB + 0x100;
+  List[0].Length      = DART_PAGE_SIZE - 0x100;
+  List[1].HostAddress = FAKE_PHYS_BASE + SIZE_16GB + SIZE_8GB + SIZE_1GB;
+  List[1].Length      = 2 * DART_PAGE_SIZE + 0x10;
+
+  UT_ASSERT_NOT_EFI_ERROR (ScatterGather->Map (ScatterGather, EdkiiIoMmuOperationBusMasterWrite, List, ARRAY_SIZE (List), &Device, &Bytes, &Mapping));
+  UT_ASSERT_EQUAL (Bytes, List[0].Length + List[1].Length);
+  UT_ASSERT_EQUAL (Device & DART_PAGE_MASK, 0x100);
+  UT_ASSERT_TRUE (DriverTranslates (Device, List[0].HostAddress, List[0].Length));
+  UT_ASSERT_TRUE (DriverTranslates (Device + List[0].Length, List[1].HostAddress, List[1].Length));
+
+  UT_ASSERT_NOT_EFI_ERROR (ScatterGather->Unmap (ScatterGather, Mapping));
+  for (UINTN Page = 0; Page < 4; Page++) {
+    PHYSICAL_ADDRESS  Phys;
+
+    UT_ASSERT_FALSE (DartWalk (DriverTable (), (Device & ~(UINT64)DART_PAGE_MASK) + Page * DART_PAGE_SIZE, &Phys));
+  }
+
+  return UNIT_TEST_PASSED;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+UnitTestingEntry (
+  VOID
+  )
+{
+  EFI_STATUS                  Status;
+  UNIT_TEST_FRAMEWORK_HANDLE  Framework;
+  UNIT_TEST_SUITE_HANDLE      TableSuite;
+  UNIT_TEST_SUITE_HANDLE      FlushSuite;
+  UNIT_TEST_SUITE_HANDLE      DriverSuite;
+
+  Framework = NULL;
+
+  DEBUG ((DEBUG_INFO, "%a v%a\n", UNIT_TEST_APP_NAME, UNIT_TEST_APP_VERSION));
+
+  Status = InitUnitTestFramework (&Framework, UNIT_TEST_APP_NAME, gEfiCallerBaseName, UNIT_TEST_APP_VERSION);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "Failed in InitUnitTestFramework. Status = %r\n", Status));
+    goto EXIT;
+  }
+
+  Status = CreateUnitTestSuite (&TableSuite, Framework, "DART page tables", "AppleDartIoMmuDxe.PageTable", NULL, NULL);
+  if (EFI_ERROR (Status)) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto EXIT;
+  }
+
+  AddTestCase (TableSuite, "Attached streams point at the domain's tables", "Layout", RegisterLayout, FixtureSetup, FixtureCleanup, &mFixture);
+  AddTestCase (TableSuite, "Mappings translate page by page and go away when unmapped", "Walk", MapAndWalk, FixtureSetup, FixtureCleanup, &mFixture);
+  AddTestCase (TableSuite, "Map, unmap and flush throughput", "Bench", MapBench, FixtureSetup, FixtureCleanup, &mFixture);
+
+  Status = CreateUnitTestSuite (&FlushSuite, Framework, "DART TLB flushes", "AppleDartIoMmuDxe.Flush", NULL, NULL);
+  if (EFI_ERROR (Status)) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto EXIT;
+  }
+
+  AddTestCase (FlushSuite, "T8020 flushes the attached streams by mask", "T8020", T8020Flush, FixtureSetup, FixtureCleanup, &mFixture);
+  AddTestCase (FlushSuite, "T8110 flushes per stream or everything", "T8110", T8110Flush, FixtureSetup, FixtureCleanup, &mFixture);
+  AddTestCase (FlushSuite, "Detaching turns translation off", "Detach", DetachAll, FixtureSetup, FixtureCleanup, &mFixture);
+
+  //
+  // Last, the fake DARTs belong to the driver from here on.
+  //
+  Status = CreateUnitTestSuite (&DriverSuite, Framework, "DART IOMMU protocol", "AppleDartIoMmuDxe.Protocol", DriverSuiteSetup, NULL);
+  if (EFI_ERROR (Status)) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto EXIT;
+  }
+
+  AddTestCase (DriverSuite, "Only DARTs behind driven devices are taken over", "Managed", DriverManaged, DriverSetup, NULL, &mDriver);
+  AddTestCase (DriverSuite, "Every device address from Map() translates back", "MapWalk", DriverMapWalk, DriverSetup, NULL, &mDriver);
+  AddTestCase (DriverSuite, "Idle cached mappings get evicted", "Evict", DriverMapEvict, DriverSetup, NULL, &mDriver);
+  AddTestCase (DriverSuite, "DMA pool buffers map to their slab", "Pool", DriverPoolMap, DriverSetup, NULL, &mDriver);
+  AddTestCase (DriverSuite, "Scatter/gather maps back to back and unmaps at once", "ScatterGather", DriverScatterGather, DriverSetup, NULL, &mDriver);
+
+  Status = RunAllTestSuites (Framework);
+
+EXIT:
+  if (Framework != NULL) {
+    FreeUnitTestFramework (Framework);
+  }
+
+  return Status;
+}
+
+int
+main (
+  int   argc,
+  char  *argv[]
+  )
+{
+  return UnitTestingEntry ();
+}
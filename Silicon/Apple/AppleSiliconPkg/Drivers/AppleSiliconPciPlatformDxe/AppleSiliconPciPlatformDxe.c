@@ -68,12 +68,16 @@
 //   EFI_SUCCESS - GPIO number found
 
 STATIC EFI_STATUS AppleSiliconPciePlatformDxeGetResetGpios(dt_node_t *SubNode, INT32 Index, APPLE_PCIE_GPIO_DESC *Desc) {
-  UINTN len;
-  //
-  UINT32 *FunctionPerst = (UINT32 *)dt_node_prop(SubNode, "function-perst", &len);
+  UINT32 FunctionPerst[4];
+  dt_prop_desc_t PerstProp = { "function-perst", DT_PROP_U32, ARRAY_SIZE(FunctionPerst), FunctionPerst, 0 };
   //
   // Get the reset GPIO values from the node.
   //
+  if (dt_node_props_decode(SubNode, &PerstProp, 1) != 0) {
+    DEBUG((DEBUG_ERROR, "%a - no usable function-perst for port %d\n", __FUNCTION__, Index));
+    ASSERT(FALSE);
+    return EFI_NOT_FOUND;
+  }
 
   Desc->GpioNum = FunctionPerst[2];
   Desc->GpioActivePolarity = FunctionPerst[3] == 0;//TODO: properly handle this 
@@ -145,6 +149,9 @@ STATIC EFI_STATUS AppleSiliconPciePlatformDxeSetupPciePort(APPLE_PCIE_COMPLEX_IN
   PciePortInfo->PortSubNode = SubNode;
 
   Status = AppleSiliconPciePlatformDxeGetResetGpios(SubNode, Index, &ResetGpioStruct);
+  if (EFI_ERROR(Status)) {
+    return Status;
+  }
 
   DEBUG((DEBUG_INFO, "%a - Reset GPIO number is 0x%x\n", __FUNCTION__, ResetGpioStruct.GpioNum));
   PciePortInfo->ResetGpioDesc = ResetGpioStruct;
@@ -349,7 +356,10 @@ AppleSiliconPciPlatformDxeInitialize(
 {
     dt_node_t *ApcieNode = dt_get("apcie");
     APPLE_PCIE_COMPLEX_INFO *PcieComplexInfoStruct = AllocateZeroPool(sizeof(APPLE_PCIE_COMPLEX_INFO));
-    CHAR8 PcieBridgeName[31];
+    dt_node_t *PcieBridgeNodes[ARRAY_SIZE(PcieComplexInfoStruct->PortRegionBase)];
+    dt_node_t *PcieBridgeFound[ARRAY_SIZE(PcieComplexInfoStruct->PortRegionBase)];
+    UINT32 PcieBridgeCount;
+    UINTN PcieBridgeIndex;
     // CONST CHAR8 *PortStatus;
     // INT32 PortStatusLength;
     dt_node_t *PcieSubNode;
@@ -404,14 +414,28 @@ AppleSiliconPciPlatformDxeInitialize(
     DEBUG((DEBUG_INFO, "%a - PCIe RC base: 0x%llx\n", __FUNCTION__, PcieComplexInfoStruct->RcRegionBase));
     AppleSiliconPciePlatformDxeSetupPciePort(PcieComplexInfoStruct, NULL, 0);
 
+    //
+    // Collect the pci-bridgeN nodes below apcie in one pass, ordered by port number.
+    //
+    for(UINT32 i = 0; i < ARRAY_SIZE(PcieBridgeNodes); i++) {
+      PcieBridgeNodes[i] = NULL;
+    }
+    PcieBridgeCount = dt_foreach_name_prefix(ApcieNode, "pci-bridge", PcieBridgeFound, ARRAY_SIZE(PcieBridgeFound));
+    for(UINT32 i = 0; i < PcieBridgeCount && i < ARRAY_SIZE(PcieBridgeFound); i++) {
+      // a name without a number comes back as -1, which the bounds check rejects as MAX_UINTN
+      PcieBridgeIndex = (UINTN)dt_node_name_index(PcieBridgeFound[i], "pci-bridge");
+      if(PcieBridgeIndex < ARRAY_SIZE(PcieBridgeNodes)) {
+        PcieBridgeNodes[PcieBridgeIndex] = PcieBridgeFound[i];
+      }
+    }
+
     //
     // Pull the base address for each port
     //
     for(UINT32 i = 0; i <= 3; i++) {
       dt_node_reg(ApcieNode, 6 + i * 5, &PcieComplexInfoStruct->PortRegionBase[i], NULL);//TODO: check and improve
       
-      AsciiSPrint(PcieBridgeName, ARRAY_SIZE(PcieBridgeName), "pci-bridge%d", PciePortIndex);
-      PcieSubNode = dt_get(PcieBridgeName);
+      PcieSubNode = PcieBridgeNodes[PciePortIndex];
       if(PcieSubNode == NULL)
         break;
       
@@ -200,8 +200,10 @@ AppleUsbTypeCBringupDxeBringupCallback(IN EFI_EVENT Event, IN VOID *Context)
 {
   EFI_STATUS Status;
   UINT32 NumDwc3Controllers;
+  UINT32 MaxDwc3Controllers;
   UINT64 Dwc3ControllerBaseAddr;
-  CHAR8 Dwc3RegNodeName[31];
+  dt_node_t **Dwc3Nodes;
+  INT32 Dwc3Index;
   UINT32 Dwc3ControllerRegSize;
   //
   // Close the event so that we don't have duplicate events floating around.
@@ -210,9 +212,31 @@ AppleUsbTypeCBringupDxeBringupCallback(IN EFI_EVENT Event, IN VOID *Context)
 
   DEBUG((DEBUG_INFO, "AppleUsbTypeCBringupDxeBringupCallback started\n"));
 
-  NumDwc3Controllers = PcdGet32(PcdAppleNumDwc3Controllers);
+  //
+  // Collect all the usb-drdN nodes in one go rather than probing names until one is missing.
+  //
+  NumDwc3Controllers = dt_foreach_name_prefix(NULL, "usb-drd", NULL, 0);
+  if(NumDwc3Controllers == 0) {
+    DEBUG((DEBUG_ERROR, "AppleUsbTypeCBringupDxeBringupCallback: no DWC3 controllers found\n"));
+    return;
+  }
+  Dwc3Nodes = AllocateZeroPool(NumDwc3Controllers * sizeof(dt_node_t *));
+  if(Dwc3Nodes == NULL) {
+    return;
+  }
+  dt_foreach_name_prefix(NULL, "usb-drd", Dwc3Nodes, NumDwc3Controllers);
 
-  for(UINT32 Dwc3Index = 0; Dwc3Index < NumDwc3Controllers; Dwc3Index++) {
+  //
+  // The platform still decides how many of them get brought up, the ADT can list ports that aren't wired up.
+  //
+  MaxDwc3Controllers = PcdGet32(PcdAppleNumDwc3Controllers);
+
+  for(UINT32 Dwc3NodeIndex = 0; Dwc3NodeIndex < NumDwc3Controllers; Dwc3NodeIndex++) {
+    dt_node_t *Dwc3Node = Dwc3Nodes[Dwc3NodeIndex];
+    Dwc3Index = dt_node_name_index(Dwc3Node, "usb-drd");
+    if((Dwc3Index < 0) || ((UINT32)Dwc3Index >= MaxDwc3Controllers)) {
+      continue;
+    }
     if((Dwc3Index == 0) || (Dwc3Index == 2)) {
       //
       // skip DWC3 0, it seems to be in charge of the DFU port.
@@ -220,9 +244,6 @@ AppleUsbTypeCBringupDxeBringupCallback(IN EFI_EVENT Event, IN VOID *Context)
       continue;
     }
 
-    AsciiSPrint(Dwc3RegNodeName, ARRAY_SIZE(Dwc3RegNodeName), "usb-drd%d", Dwc3Index);
-    dt_node_t *Dwc3Node = dt_get(Dwc3RegNodeName);
- 
     dt_node_reg(Dwc3Node, 0, &Dwc3ControllerBaseAddr, NULL);
 
     Dwc3ControllerRegSize = 0x100000;//TODO: get from ADT
@@ -240,6 +261,7 @@ AppleUsbTypeCBringupDxeBringupCallback(IN EFI_EVENT Event, IN VOID *Context)
              Dwc3ControllerBaseAddr,
              Dwc3ControllerRegSize);
   }
+  FreePool(Dwc3Nodes);
   return;
 } 
 
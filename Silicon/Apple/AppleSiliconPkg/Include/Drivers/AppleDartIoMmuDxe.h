@@ -6,8 +6,9 @@
  * 
  * Abstract:
  *     Platform specific driver for Apple silicon platforms to set up the DARTs.
- *     Note that the DARTs as of right now are being configured in bypass mode, so
- *     security of device memory acccesses is not as strong as it could be.
+ *     DARTs that support it are configured in bypass mode, so security of device
+ *     memory acccesses is not as strong as it could be. The rest translate through
+ *     page tables managed by this driver.
  * 
  * 
  * Environment:
@@ -24,18 +25,50 @@
 #define APPLE_DART_IOMMU_DXE_H
 
 #include <Library/ConvenienceMacros.h>
+#include <Library/AppleDTLib.h>
+#include <Protocol/AppleDartDiagnostics.h>
 
 //
 // Type definitions. Ported from AsahiLinux/u-boot project
 //
 
+//
+// T8110 style DARTs can have up to 256 streams (PARAMS4 NSID is 9 bits, but nothing uses more than this).
+//
+#define DART_MAX_SID		256
+
+//
+// Most "iommu-parent" links a device is expected to have, the DWC3s have two.
+//
+#define DART_MAX_DEVICE_STREAMS	8
+
 typedef enum {
 	AppleDartT8020Compatible = 0,
 	AppleDartT8110Compatible
 } APPLE_DART_TYPE;
 
+struct AppleDartDomainStruct;
+
+//
+// Per-DART counters behind APPLE_DART_DIAGNOSTICS_PROTOCOL.
+//
+typedef struct AppleDartCountersStruct {
+	UINT64 Flushes;
+	UINT64 FlushWaitTicks;
+	UINT64 Faults;
+	UINT32 LastFaultError;
+	UINT32 LastFaultKind;
+	UINT32 LastFaultSid;
+	UINT64 LastFaultIova;
+} APPLE_DART_COUNTERS;
+
 typedef struct AppleDartInfoStruct {
 	UINT64 BaseAddress;
+	dt_node_t *Node;	// ADT node this DART was found under, which may describe several of them
+	UINT32 RegIndex;	// which reg entry of Node this one is
+	APPLE_DART_TYPE Type;
+	BOOLEAN Managed;	// set up by this driver, the rest are only known about and left as the firmware left them
+	BOOLEAN CoherentWalk;	// table walks snoop the CPU caches
 	UINT64 *L1;
 	UINT64 *L2;
 	BOOLEAN BypassMode;
@@ -52,11 +85,19 @@ typedef struct AppleDartInfoStruct {
 	INT32 TtbrBase;
 	UINT32 TtbrIsValid;
 	//
+	// Streams that may have TLB entries for our tables, TlbFlush invalidates these if it isn't given a narrower set.
+	//
+	UINT32 SidMap[DART_MAX_SID / 32];
+	//
 	// This is needed due to different peripherals potentially having different types of DARTs. (T8110 style and T8020 style DARTs flush the TLB differently.)
 	//
-	void (*TlbFlush)(VOID *DartInfoStruct);
+	void (*TlbFlush)(VOID *DartInfoStruct, CONST UINT32 *SidMap);
+	struct AppleDartDomainStruct *Domain;	// domain this DART's streams are attached to, if any
+	APPLE_DART_COUNTERS Counters;
 } APPLE_DART_INFO;
 
+struct AppleDartMapCacheEntryStruct;
+
 typedef struct AppleDartMapping {
 	PHYSICAL_ADDRESS HostAddr;
 	PHYSICAL_ADDRESS DmaVirtualAddr;
@@ -64,8 +105,130 @@ typedef struct AppleDartMapping {
 	unsigned long PhysicalSize;
 	unsigned long Offset;
 	UINTN NumBytes;
+	BOOLEAN Pooled;		// lives in a DMA pool slab, which stays mapped, nothing to undo on unmap
+	struct AppleDartMapCacheEntryStruct *CacheEntry;	// mapping cache entry this is a reference to, if any
 } APPLE_DART_MAPPING;
 
+//
+// A stream of a DART node that some device is wired to. The ADT describes these as "mapper-*" children of the
+// DART node, with the stream ID as their reg. Devices point at the mapper through "iommu-parent".
+//
+typedef struct AppleDartStreamStruct {
+	dt_node_t *Mapper;
+	UINT32 Phandle;		// AAPL,phandle of the mapper
+	UINT32 Sid;
+	UINT32 DartIndex;	// first DartInfo entry of the DART node, the stream exists on each of its DartCount DARTs
+	UINT32 DartCount;
+} APPLE_DART_STREAM;
+
+//
+// Translation tables and IOVA space for DARTs that can't bypass.
+// EDKII_IOMMU_PROTOCOL doesn't tell us which device a mapping is for, so every translating DART
+// points its TTBRs at the same tables and a device address is valid behind all of them.
+//
+typedef struct AppleDartPageTableStruct {
+	UINT64 *L1;
+	UINT64 **L2;		// CPU view of the table behind each L1 entry, NULL until something is mapped there
+	UINT16 *L2Live;		// number of valid PTEs in each L2 table
+	BOOLEAN *L2Dead;	// emptied and unhooked from L1, can be freed after the next TLB flush
+	UINT32 NumL1Entries;
+	INT32 Shift;
+	BOOLEAN Coherent;	// every DART walking these is cache coherent, PTE writes only need a barrier
+	UINT32 *IovaBitmap;	// one bit per DART page between DmaVirtAddrBase and DmaVirtAddrEnd, set if in use
+	UINTN IovaPages;
+	UINTN IovaHint;
+	PHYSICAL_ADDRESS DmaVirtAddrBase;
+	PHYSICAL_ADDRESS DmaVirtAddrEnd;
+	UINT64 Maps;		// AppleDartPageTableMap() calls
+	UINT64 MappedPages;
+	UINT64 Unmaps;		// AppleDartPageTableUnmap() calls
+} APPLE_DART_PAGE_TABLE;
+
+//
+// IOMMU domain: one L1/L2 tree and the DART streams that walk it. There is one, shared by every translating
+// DART, and each DART/SID pair attached to it points its TTBRs at the same tree, so a mapping costs one set of
+// tables and one round of cache maintenance however many DARTs see it, and only the attached streams get flushed.
+//
+typedef struct AppleDartDomainAttachStruct {
+	APPLE_DART_INFO *Dart;
+	UINT32 SidMap[DART_MAX_SID / 32];
+} APPLE_DART_DOMAIN_ATTACH;
+
+typedef struct AppleDartDomainStruct {
+	APPLE_DART_PAGE_TABLE Table;
+	BOOLEAN Ready;
+	APPLE_DART_DOMAIN_ATTACH *Attach;	// one per DART with streams in this domain
+	UINT32 AttachCount;
+	UINT32 AttachMax;
+} APPLE_DART_DOMAIN;
+
+//
+// An unmapped IOVA range whose PTEs are gone but that the DART TLBs may still hold.
+// It stays allocated until the next flush, so it can't be handed out again before then.
+//
+typedef struct AppleDartPendingUnmapStruct {
+	PHYSICAL_ADDRESS Iova;
+	UINTN Pages;
+} APPLE_DART_PENDING_UNMAP;
+
+//
+// DMA pool for common buffers. Slabs are allocated and mapped into the DART page tables once,
+// buffers are carved out of them in fixed size chunks so AllocateBuffer/Map/Unmap/FreeBuffer of
+// a common buffer never touch the page tables.
+//
+#define DART_DMA_POOL_CLASSES		3
+#define DART_DMA_SLAB_CHUNKS		16
+
+typedef struct AppleDartDmaSlabStruct {
+	struct AppleDartDmaSlabStruct *Next;
+	VOID *Base;
+	PHYSICAL_ADDRESS Iova;
+	UINT32 InUse;		// one bit per chunk
+} APPLE_DART_DMA_SLAB;
+
+typedef struct AppleDartDmaClassStruct {
+	UINTN ChunkPages;	// in EFI pages, a slab is DART_DMA_SLAB_CHUNKS of these and a multiple of DART_PAGE_SIZE
+	APPLE_DART_DMA_SLAB *Slabs;
+} APPLE_DART_DMA_CLASS;
+
+typedef struct AppleDartDmaPoolStruct {
+	APPLE_DART_DMA_CLASS Class[DART_DMA_POOL_CLASSES];
+} APPLE_DART_DMA_POOL;
+
+//
+// Mapping cache. Unmapped ranges stay mapped in the DART for a while, so that drivers that map
+// the same buffers over and over (XHCI, USB mass storage reads) get the same IOVA back without
+// a page table update or TLB flush. Idle entries are evicted least recently used first.
+//
+#define DART_MAP_CACHE_ENTRIES		64
+
+typedef enum {
+	AppleDartAccessRead = 0,
+	AppleDartAccessWrite,
+	AppleDartAccessCommon
+} APPLE_DART_ACCESS;
+
+typedef struct AppleDartMapCacheEntryStruct {
+	PHYSICAL_ADDRESS PhysAddress;	// DART page aligned
+	UINTN Pages;			// in DART pages
+	PHYSICAL_ADDRESS Iova;
+	APPLE_DART_ACCESS Access;
+	BOOLEAN Valid;
+	UINT32 RefCount;		// live mappings using this entry, only idle (0) entries can be evicted
+	UINT64 LastUse;
+} APPLE_DART_MAP_CACHE_ENTRY;
+
+typedef struct AppleDartMapCacheStruct {
+	APPLE_DART_MAP_CACHE_ENTRY Entry[DART_MAP_CACHE_ENTRIES];
+	UINT64 Clock;
+	UINT64 Hits;
+	UINT64 Misses;
+	UINT64 Evictions;
+} APPLE_DART_MAP_CACHE;
+
+#define DART_MAX_PENDING_UNMAPS		64
+#define DART_PENDING_FLUSH_PERIOD	(10 * 1000 * 10)	// 10ms in 100ns units
+
 
 //
 // Definitions taken from AsahiLinux/u-boot/drivers/iommu/apple_dart.c
@@ -79,6 +242,13 @@ typedef struct AppleDartMapping {
 #define  DART_T8020_TLB_CMD_BUSY		BIT(2)
 #define DART_T8020_TLB_SIDMASK		0x0034
 #define DART_T8020_ERROR		0x0040
+#define  DART_T8020_ERROR_FLAG			BIT(31)
+#define  DART_T8020_ERROR_STREAM		GENMASK(27, 24)
+#define  DART_T8020_ERROR_READ_FAULT		BIT(4)
+#define  DART_T8020_ERROR_WRITE_FAULT		BIT(3)
+#define  DART_T8020_ERROR_NO_PTE		BIT(2)
+#define  DART_T8020_ERROR_NO_PMD		BIT(1)
+#define  DART_T8020_ERROR_NO_TTBR		BIT(0)
 #define DART_T8020_ERROR_ADDR_LO	0x0050
 #define DART_T8020_ERROR_ADDR_HI	0x0054
 #define DART_T8020_CONFIG		0x0060
@@ -95,8 +265,19 @@ typedef struct AppleDartMapping {
 #define  DART_T8110_PARAMS4_NSID_MASK		(0x1ff << 0)
 #define DART_T8110_TLB_CMD		0x0080
 #define  DART_T8110_TLB_CMD_BUSY		BIT(31)
-#define  DART_T8110_TLB_CMD_FLUSH_ALL		BIT(8)
+#define  DART_T8110_TLB_CMD_OP			GENMASK(10, 8)
+#define   DART_T8110_TLB_CMD_OP_FLUSH_ALL	0
+#define   DART_T8110_TLB_CMD_OP_FLUSH_SID	1
+#define  DART_T8110_TLB_CMD_STREAM		GENMASK(7, 0)
 #define DART_T8110_ERROR		0x0100
+#define  DART_T8110_ERROR_FLAG			BIT(31)
+#define  DART_T8110_ERROR_STREAM		GENMASK(27, 20)
+#define  DART_T8110_ERROR_READ_FAULT		BIT(5)
+#define  DART_T8110_ERROR_WRITE_FAULT		BIT(4)
+#define  DART_T8110_ERROR_NO_PTE		BIT(3)
+#define  DART_T8110_ERROR_NO_PMD		BIT(2)
+#define  DART_T8110_ERROR_NO_PGD		BIT(1)
+#define  DART_T8110_ERROR_NO_TTBR		BIT(0)
 #define DART_T8110_ERROR_MASK		0x0104
 #define DART_T8110_ERROR_ADDR_LO	0x0170
 #define DART_T8110_ERROR_ADDR_HI	0x0174
@@ -118,6 +299,8 @@ typedef struct AppleDartMapping {
 #define  DART_TTBR_SHIFT	12
 
 #define DART_ALL_STREAMS(DartInfo)	((1U << (DartInfo)->Nsid) - 1)
+#define DART_SID_IS_SET(SidMap, sid)	(((SidMap)[(sid) / 32] & (1U << ((sid) % 32))) != 0)
+#define DART_SID_SET(SidMap, sid)	((SidMap)[(sid) / 32] |= (1U << ((sid) % 32)))
 
 #define DART_PAGE_SIZE		SIZE_16KB
 #define DART_PAGE_MASK		(DART_PAGE_SIZE - 1)
@@ -129,6 +312,76 @@ typedef struct AppleDartMapping {
 #define DART_L2_START(addr)	((((addr) & DART_PAGE_MASK) >> 2) << 52)
 #define DART_L2_END(addr)	((((addr) & DART_PAGE_MASK) >> 2) << 40)
 
+#define DART_PTES_PER_TABLE	(DART_PAGE_SIZE / sizeof(UINT64))
+#define DART_L2_COVERAGE	(DART_PTES_PER_TABLE * DART_PAGE_SIZE)
+
+//
+// ADT discovery, AppleDartDiscovery.c
+//
+
+EFI_STATUS AppleDartDiscover(APPLE_DART_INFO **Info, UINT32 *Count);
+UINT32 AppleDartDeviceStreams(dt_node_t *Device, CONST APPLE_DART_STREAM **Streams, UINT32 Max);
+
+//
+// Domains, AppleDartDomain.c
+//
+
+EFI_STATUS AppleDartDomainInit(APPLE_DART_DOMAIN *Domain, INT32 Shift, BOOLEAN Coherent, PHYSICAL_ADDRESS DmaVirtAddrBase, PHYSICAL_ADDRESS DmaVirtAddrEnd, UINT32 MaxDarts);
+EFI_STATUS AppleDartDomainAttach(APPLE_DART_DOMAIN *Domain, APPLE_DART_INFO *Dart, CONST UINT32 *SidMap);
+VOID AppleDartDomainFlush(APPLE_DART_DOMAIN *Domain);
+VOID AppleDartDomainDetachAll(APPLE_DART_DOMAIN *Domain);
+
+//
+// Every DART in the ADT, AppleDartIoMmuDxe.c
+//
+
+extern APPLE_DART_INFO *DartInfo;
+extern UINT32 DartCount;
+
+//
+// Fault polling and the diagnostics protocol, AppleDartDiagnostics.c
+//
+
+BOOLEAN AppleDartCheckErrors(APPLE_DART_INFO *Dart);
+VOID AppleDartCheckAllErrors(VOID);
+EFI_STATUS AppleDartDiagnosticsInstall(EFI_HANDLE *Handle);
+
+//
+// Register layout and TLB flushes, AppleDartTlb.c
+//
+
+VOID AppleDartDescribeRegisters(APPLE_DART_INFO *Dart);
+
+//
+// Page table management, AppleDartPageTable.c
+//
+
+EFI_STATUS AppleDartPageTableInit(APPLE_DART_PAGE_TABLE *Table, INT32 Shift, BOOLEAN Coherent, PHYSICAL_ADDRESS DmaVirtAddrBase, PHYSICAL_ADDRESS DmaVirtAddrEnd);
+VOID AppleDartPageTableMakeNonCoherent(APPLE_DART_PAGE_TABLE *Table);
+EFI_STATUS AppleDartIovaAlloc(APPLE_DART_PAGE_TABLE *Table, UINTN Pages, PHYSICAL_ADDRESS *Iova);
+VOID AppleDartIovaFree(APPLE_DART_PAGE_TABLE *Table, PHYSICAL_ADDRESS Iova, UINTN Pages);
+EFI_STATUS AppleDartPageTableMap(APPLE_DART_PAGE_TABLE *Table, PHYSICAL_ADDRESS Iova, PHYSICAL_ADDRESS PhysAddr, UINTN Pages);
+VOID AppleDartPageTableUnmap(APPLE_DART_PAGE_TABLE *Table, PHYSICAL_ADDRESS Iova, UINTN Pages);
+VOID AppleDartPageTableReclaim(APPLE_DART_PAGE_TABLE *Table);
+
+//
+// DMA pool, AppleDartDmaPool.c
+//
+
+VOID AppleDartDmaPoolInit(APPLE_DART_DMA_POOL *Pool);
+EFI_STATUS AppleDartDmaPoolAlloc(APPLE_DART_DMA_POOL *Pool, APPLE_DART_PAGE_TABLE *Table, UINTN Pages, VOID **HostAddress, BOOLEAN *Grew);
+BOOLEAN AppleDartDmaPoolFree(APPLE_DART_DMA_POOL *Pool, VOID *HostAddress, UINTN Pages);
+BOOLEAN AppleDartDmaPoolLookup(APPLE_DART_DMA_POOL *Pool, PHYSICAL_ADDRESS HostAddr, UINTN NumBytes, PHYSICAL_ADDRESS *Iova);
+
+//
+// Mapping cache, AppleDartMapCache.c
+//
+
+APPLE_DART_MAP_CACHE_ENTRY *AppleDartMapCacheLookup(APPLE_DART_MAP_CACHE *Cache, PHYSICAL_ADDRESS PhysAddress, UINTN Pages, APPLE_DART_ACCESS Access);
+APPLE_DART_MAP_CACHE_ENTRY *AppleDartMapCacheInsert(APPLE_DART_MAP_CACHE *Cache, PHYSICAL_ADDRESS PhysAddress, UINTN Pages, APPLE_DART_ACCESS Access, PHYSICAL_ADDRESS Iova);
+APPLE_DART_MAP_CACHE_ENTRY *AppleDartMapCacheVictim(APPLE_DART_MAP_CACHE *Cache);
+VOID AppleDartMapCacheRelease(APPLE_DART_MAP_CACHE_ENTRY *Entry);
+
 
 
 #endif //APPLE_DART_IOMMU_DXE_H
\ No newline at end of file
@@ -100,7 +100,7 @@ extern AIC_INFO_STRUCT *AicInfoStruct;
 // IRQ Mask macros
 
 #define AIC_MASK_REG(num) (4 * ((num) >> 5))
-#define AIC_MASK_BIT(num) BIT(num) & GENMASK(4, 0)
+#define AIC_MASK_BIT(num) BIT((num) & GENMASK(4, 0))
 
 /* Function prototypes */
 
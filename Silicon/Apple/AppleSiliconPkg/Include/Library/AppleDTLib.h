@@ -104,6 +104,39 @@ struct memmap
     uint64_t size;
 };
 
+// ========== Traversal ==========
+
+// Deepest DeviceTree the traversal code handles, real ADTs are well under 16 levels deep.
+#ifndef DT_MAX_DEPTH
+#define DT_MAX_DEPTH 32
+#endif
+
+/*
+ * Preorder walk over a subtree without recursion. The cursor is plain data, so a walk can be
+ * stopped, saved and picked up again later, e.g. dt_cursor_find() in a loop continues from the
+ * last match instead of restarting at the root.
+ */
+typedef struct
+{
+    dt_node_t *root;
+    dt_node_t *next;                // next node to return, NULL once done
+    uintptr_t end;                  // end of the buffer to check against, 0 if trusted
+    size_t off;                     // bytes from root walked over so far
+    int depth;                      // depth of the last returned node, root is 0
+    int next_depth;
+    int err;                        // -1 if the tree is malformed or too deep
+    uint32_t left[DT_MAX_DEPTH];    // nodes not yet returned on each level of the current path
+    dt_node_t *path[DT_MAX_DEPTH];  // ancestors of the last returned node, path[depth] is the node itself
+} dt_cursor_t;
+
+// `size` bounds-checks the walk against a buffer of that size, 0 trusts the tree.
+void dt_cursor_init(dt_cursor_t *cur, dt_node_t *root, size_t size);
+dt_node_t* dt_cursor_next(dt_cursor_t *cur);
+// Don't descend into the node last returned.
+void dt_cursor_skip(dt_cursor_t *cur);
+// Next node with the given "name", continuing from where the cursor is.
+dt_node_t* dt_cursor_find(dt_cursor_t *cur, const char *name);
+
 dt_node_t* dt_node(dt_node_t *node, const char *name);
 dt_node_t* dt_node_parent(dt_node_t *node);
 dt_node_t* dt_get(const char *name);
@@ -114,5 +147,131 @@ uint32_t dt_get_u32(const char *device, const char *prop, uint32_t idx);
 uint64_t dt_node_u64(dt_node_t *node, const char *prop, uint32_t idx);
 uint64_t dt_get_u64(const char *device, const char *prop, uint32_t idx);
 int dt_node_reg(dt_node_t *node, uint32_t idx, uint64_t *paddr, uint64_t *psize);
+int dt_node_regs(dt_node_t *node, struct memmap *regs, uint32_t max);
+dt_node_t* dt_node_child(dt_node_t *node);
+dt_node_t* dt_node_sibling(dt_node_t *node);
+
+// ========== Batched properties ==========
+
+/*
+ * Look up `count` properties of a node in a single pass over its property list. vals[i] and
+ * lens[i] (lens may be NULL) get the value and length of keys[i], or NULL/0 if it's missing.
+ * Returns the number of properties found.
+ */
+uint32_t dt_node_props(dt_node_t *node, const char * const *keys, void **vals, size_t *lens, uint32_t count);
+
+typedef enum
+{
+    DT_PROP_U32,
+    DT_PROP_U64,
+} dt_prop_type_t;
+
+#define DT_PROP_OPTIONAL 0x1
+
+/*
+ * Decodes the first `count` cells of property `key` into `out`, which points to an array of
+ * uint32_t or uint64_t depending on `type`. `out` is left untouched if the property is missing
+ * or too short.
+ */
+typedef struct
+{
+    const char *key;
+    dt_prop_type_t type;
+    uint32_t count;
+    void *out;
+    uint32_t flags;
+} dt_prop_desc_t;
+
+// Returns 0 if every non-optional property was decoded, -1 otherwise.
+int dt_node_props_decode(dt_node_t *node, const dt_prop_desc_t *desc, uint32_t count);
+
+// ========== Enumeration ==========
+
+/*
+ * Collect the nodes below `node` (the whole DeviceTree if NULL) in one traversal, in tree order.
+ * Up to `max` of them are stored to `nodes`, the return value is the total number of matches,
+ * so passing NULL/0 first gives the size to allocate.
+ */
+uint32_t dt_foreach_child(dt_node_t *node, dt_node_t **nodes, uint32_t max);
+uint32_t dt_foreach_compatible(dt_node_t *node, const char *compat, dt_node_t **nodes, uint32_t max);
+// Nodes compatible with any of `ncompat` strings, still one traversal.
+uint32_t dt_foreach_compatible_list(dt_node_t *node, const char * const *compats, uint32_t ncompat, dt_node_t **nodes, uint32_t max);
+uint32_t dt_foreach_name_prefix(dt_node_t *node, const char *prefix, dt_node_t **nodes, uint32_t max);
+// Instance number of a node named `prefix` followed by a decimal number ("usb-drd3" -> 3), -1 otherwise.
+int dt_node_name_index(dt_node_t *node, const char *prefix);
+
+// ========== Index ==========
+
+/*
+ * Flat index over a DeviceTree, built once so that parent/child/property lookups
+ * don't have to re-walk the whole tree from the root.
+ * Nodes are stored in tree (pre-)order, links between them are node numbers and
+ * everything pointing into the DeviceTree is a byte offset from its base, so the
+ * index is one relocatable blob.
+ */
+
+#define DT_INDEX_NONE 0xffffffffU
+
+typedef struct
+{
+    uint32_t off;       // offset of the dt_node_t from the DeviceTree base
+    uint32_t parent;    // DT_INDEX_NONE for the root
+    uint32_t child;     // first child
+    uint32_t sibling;   // next sibling
+    uint32_t end;       // one past the last node of this subtree
+    uint32_t prop;      // first entry in the property table
+    uint32_t nprop;
+    uint32_t depth;
+    uint32_t name;      // offset of the "name" dt_prop_t, DT_INDEX_NONE if unnamed
+} dt_index_node_t;
+
+typedef struct
+{
+    uint32_t hash;
+    uint32_t node;      // DT_INDEX_NONE for an empty slot
+} dt_index_hash_t;
+
+typedef struct
+{
+    uint32_t hash;      // of the property key
+    uint32_t prop;      // entry in the property table
+} dt_index_key_t;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t size;      // size of the whole blob, header included
+    uint64_t base;      // DeviceTree the offsets are relative to
+    uint64_t dt_size;
+    uint32_t nnode;
+    uint32_t nprop;
+    uint32_t node_off;  // dt_index_node_t[nnode], relative to the header
+    uint32_t prop_off;  // uint32_t[nprop] property offsets, relative to the header
+    uint32_t nhash;     // slots per hash table, power of two
+    uint32_t name_off;  // dt_index_hash_t[nhash] by node name, relative to the header
+    uint32_t path_off;  // dt_index_hash_t[nhash] by absolute path, relative to the header
+    uint32_t dir_off;   // dt_index_key_t[nprop] per-node property directory, relative to the header
+} dt_index_t;
+
+/*
+ * PrePi builds the index once and hands it to every later phase through a GUIDed HOB
+ * (gAppleSiliconPkgAdtIndexHobGuid), whose payload is this. The index itself lives in
+ * its own pages since HOBs are limited to 64K.
+ */
+typedef struct
+{
+    uint64_t index;     // dt_index_t*
+    uint64_t pages;
+} dt_index_hob_t;
+
+size_t dt_index_size(void *mem, size_t size);
+int dt_index_init(dt_index_t *idx, size_t idx_size, void *mem, size_t size);
+// NULL until the MMU is on, callers fall back to walking the ADT.
+dt_index_t* dt_index_get(void);
+dt_index_t* dt_index_publish(void);
+int dt_index_attach(void);
+uint32_t dt_index_find(dt_index_t *idx, dt_node_t *node);
+dt_node_t* dt_index_node(dt_index_t *idx, uint32_t i);
+uint32_t dt_index_lookup(dt_index_t *idx, uint32_t start, const char *name);
 
 #endif /* APPLEDTLIB_H */
@@ -31,6 +31,9 @@
 //not sure if we need this, but better to have it just in case...
 #define APPLE_FAST_IPI_COUNTDOWN_REG_EL1 S3_5_C15_C3_1
 
+//write 1 to clear
+#define APPLE_FAST_IPI_STATUS_PENDING BIT(0)
+
 
 //EL1 FIQ timer enablement register (not helpful when we're running in EL1 but when outside the m1n1 hypervisor will be helpful)
 #define APPLE_EL1_TIMER_FIQ_ENABLE S3_5_C15_C1_3
@@ -0,0 +1,102 @@
+/**
+ * @file AppleAicDiagnostics.h
+ * @author amarioguy (Arminder Singh)
+ * @brief
+ *
+ * Interrupt accounting for AIC, produced by AppleAicDxe when it's built with PcdAppleAicStats.
+ *
+ * Every IRQ (and timer FIQ) that gets dispatched is counted per source, together with how long
+ * its handler ran. Durations are in generic timer ticks (CNTPCT), CounterFrequency converts them.
+ *
+ * @copyright Copyright (c) amarioguy (Arminder Singh), 2022.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause-Patent
+ *
+ */
+
+#ifndef APPLE_AIC_DIAGNOSTICS_H
+#define APPLE_AIC_DIAGNOSTICS_H
+
+#define APPLE_AIC_DIAGNOSTICS_PROTOCOL_GUID \
+    { 0x175f0eb6, 0xc3d9, 0x4d7f, { 0xae, 0x49, 0x1e, 0x1b, 0xb4, 0x0f, 0x84, 0x05 } }
+
+#define APPLE_AIC_DIAGNOSTICS_PROTOCOL_REVISION 0x00010000
+
+/**
+ * Handler durations are binned by power of two: bucket n counts the ones that took
+ * 2^n to 2^(n+1) - 1 ticks (bucket 0 includes 0), the last bucket everything longer.
+ */
+#define APPLE_AIC_DIAGNOSTICS_HISTOGRAM_BUCKETS 20
+
+typedef struct _APPLE_AIC_DIAGNOSTICS_PROTOCOL APPLE_AIC_DIAGNOSTICS_PROTOCOL;
+
+typedef struct {
+    UINT64 CounterFrequency;    // generic timer ticks per second
+    UINT64 Spurious;            // IRQs/FIQs taken with nothing pending
+    UINT64 Unassigned;          // IRQs without a registered handler
+    UINT64 FastIpisIgnored;     // fast IPI FIQs acked but not acted on
+    UINT64 PmcIgnored;          // PMC FIQs acked but not acted on
+    UINT64 UncorePmcIgnored;    // uncore PMC FIQs acked but not acted on
+} APPLE_AIC_DIAGNOSTICS_SUMMARY;
+
+typedef struct {
+    UINT32 Source;              // IRQ number, 17/18 are the physical/virtual timer FIQs
+    UINT64 Count;
+    UINT64 TotalTicks;
+    UINT64 MaxTicks;
+    UINT64 Histogram[APPLE_AIC_DIAGNOSTICS_HISTOGRAM_BUCKETS];
+} APPLE_AIC_DIAGNOSTICS_IRQ_STATS;
+
+/**
+ * Reads the counters that aren't per source.
+ *
+ * @param This - protocol instance pointer
+ * @param Summary - receives the counters
+ * @return EFI_SUCCESS if successful, EFI_INVALID_PARAMETER if Summary is NULL.
+ */
+typedef
+EFI_STATUS
+(EFIAPI *APPLE_AIC_DIAGNOSTICS_GET_SUMMARY)(
+    IN APPLE_AIC_DIAGNOSTICS_PROTOCOL *This,
+    OUT APPLE_AIC_DIAGNOSTICS_SUMMARY *Summary
+    );
+
+/**
+ * Reads the counters of every source that has been dispatched at least once.
+ *
+ * @param This - protocol instance pointer
+ * @param Count - in: number of entries Stats has room for, out: number of sources with counts
+ * @param Stats - receives the counters, in IRQ number order
+ * @return EFI_SUCCESS if successful, EFI_BUFFER_TOO_SMALL if *Count was too small (*Count is updated),
+ *         EFI_INVALID_PARAMETER if Count is NULL, or Stats is NULL while *Count isn't 0.
+ */
+typedef
+EFI_STATUS
+(EFIAPI *APPLE_AIC_DIAGNOSTICS_GET_IRQ_STATS)(
+    IN APPLE_AIC_DIAGNOSTICS_PROTOCOL *This,
+    IN OUT UINTN *Count,
+    OUT APPLE_AIC_DIAGNOSTICS_IRQ_STATS *Stats OPTIONAL
+    );
+
+/**
+ * Zeroes every counter.
+ *
+ * @param This - protocol instance pointer
+ * @return EFI_SUCCESS
+ */
+typedef
+EFI_STATUS
+(EFIAPI *APPLE_AIC_DIAGNOSTICS_RESET)(
+    IN APPLE_AIC_DIAGNOSTICS_PROTOCOL *This
+    );
+
+struct _APPLE_AIC_DIAGNOSTICS_PROTOCOL {
+    UINT64 Revision;
+    APPLE_AIC_DIAGNOSTICS_GET_SUMMARY GetSummary;
+    APPLE_AIC_DIAGNOSTICS_GET_IRQ_STATS GetIrqStats;
+    APPLE_AIC_DIAGNOSTICS_RESET Reset;
+};
+
+extern EFI_GUID gAppleAicDiagnosticsProtocolGuid;
+
+#endif //APPLE_AIC_DIAGNOSTICS_H
@@ -0,0 +1,84 @@
+/**
+ * @file AppleAicMask.h
+ * @author amarioguy (Arminder Singh)
+ * @brief
+ *
+ * Bulk IRQ masking for AIC, produced by AppleAicDxe next to EFI_HARDWARE_INTERRUPT_PROTOCOL.
+ *
+ * EFI_HARDWARE_INTERRUPT_PROTOCOL can only mask or unmask one source at a time, which is one
+ * uncached MMIO write per IRQ. These work on whole 32-bit MASK_SET/MASK_CLR words instead.
+ *
+ * IRQ numbers are the same as the interrupt protocol's: IRQ n of CPU die d is d * MaxIrqs + n.
+ *
+ * @copyright Copyright (c) amarioguy (Arminder Singh), 2022.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause-Patent
+ *
+ */
+
+#ifndef APPLE_AIC_MASK_H
+#define APPLE_AIC_MASK_H
+
+#define APPLE_AIC_MASK_PROTOCOL_GUID \
+    { 0xf7d28ca6, 0x9cbd, 0x410b, { 0xbc, 0xae, 0x5c, 0xfa, 0x89, 0x1a, 0x01, 0xaa } }
+
+#define APPLE_AIC_MASK_PROTOCOL_REVISION 0x00010000
+
+typedef struct _APPLE_AIC_MASK_PROTOCOL APPLE_AIC_MASK_PROTOCOL;
+
+/**
+ * Masks every IRQ on every CPU die.
+ *
+ * @param This - protocol instance pointer
+ * @return EFI_SUCCESS
+ */
+typedef
+EFI_STATUS
+(EFIAPI *APPLE_AIC_MASK_ALL)(
+    IN APPLE_AIC_MASK_PROTOCOL *This
+    );
+
+/**
+ * Unmasks Count IRQs starting at First.
+ *
+ * @param This - protocol instance pointer
+ * @param First - first IRQ number
+ * @param Count - number of IRQs
+ * @return EFI_SUCCESS if successful, EFI_INVALID_PARAMETER if the range goes past the last IRQ.
+ */
+typedef
+EFI_STATUS
+(EFIAPI *APPLE_AIC_UNMASK_RANGE)(
+    IN APPLE_AIC_MASK_PROTOCOL *This,
+    IN UINTN First,
+    IN UINTN Count
+    );
+
+/**
+ * Sets the mask state of IRQs 0 to NumIrqs - 1 from a bitmap.
+ *
+ * Bit n of MaskBitmap[i] is IRQ i * 32 + n. A set bit masks the IRQ, a clear bit unmasks it.
+ *
+ * @param This - protocol instance pointer
+ * @param MaskBitmap - DIV_ROUND_UP(NumIrqs, 32) words
+ * @param NumIrqs - number of IRQs covered by MaskBitmap
+ * @return EFI_SUCCESS if successful, EFI_INVALID_PARAMETER if MaskBitmap is NULL or NumIrqs goes past the last IRQ.
+ */
+typedef
+EFI_STATUS
+(EFIAPI *APPLE_AIC_SET_MASK_STATE)(
+    IN APPLE_AIC_MASK_PROTOCOL *This,
+    IN CONST UINT32 *MaskBitmap,
+    IN UINTN NumIrqs
+    );
+
+struct _APPLE_AIC_MASK_PROTOCOL {
+    UINT64 Revision;
+    APPLE_AIC_MASK_ALL MaskAll;
+    APPLE_AIC_UNMASK_RANGE UnmaskRange;
+    APPLE_AIC_SET_MASK_STATE SetMaskState;
+};
+
+extern EFI_GUID gAppleAicMaskProtocolGuid;
+
+#endif //APPLE_AIC_MASK_H
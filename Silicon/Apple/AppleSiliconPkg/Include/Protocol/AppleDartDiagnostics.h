@@ -0,0 +1,115 @@
+/**
+ * Copyright (c) 2024, AppleWOA authors.
+ *
+ * Module Name:
+ *     AppleDartDiagnostics.h
+ *
+ * Abstract:
+ *     Protocol produced by AppleDartIoMmuDxe to read out per-DART counters and the last
+ *     translation fault each DART reported.
+ *
+ * Environment:
+ *     UEFI DXE (Driver Execution Environment).
+ *
+ * License:
+ *     SPDX-License-Identifier: (BSD-2-Clause-Patent OR MIT) AND GPL-2.0
+*/
+
+#ifndef APPLE_DART_DIAGNOSTICS_H
+#define APPLE_DART_DIAGNOSTICS_H
+
+#define APPLE_DART_DIAGNOSTICS_PROTOCOL_GUID \
+	{ 0x93ace725, 0x6a58, 0x4a35, { 0xb8, 0x56, 0xd1, 0x28, 0x10, 0x01, 0x0e, 0x6d } }
+
+#define APPLE_DART_DIAGNOSTICS_PROTOCOL_REVISION	0x00010000
+
+typedef struct _APPLE_DART_DIAGNOSTICS_PROTOCOL APPLE_DART_DIAGNOSTICS_PROTOCOL;
+
+//
+// Fault kinds, decoded from the DART error register.
+//
+#define APPLE_DART_FAULT_READ		BIT0
+#define APPLE_DART_FAULT_WRITE		BIT1
+#define APPLE_DART_FAULT_NO_PTE		BIT2
+#define APPLE_DART_FAULT_NO_L2		BIT3
+#define APPLE_DART_FAULT_NO_L1		BIT4
+#define APPLE_DART_FAULT_NO_TTBR	BIT5
+
+typedef struct {
+	UINT64 BaseAddress;
+	CHAR8 Name[32];		// ADT node name
+	UINT32 RegIndex;	// which DART of that node
+	UINT32 Nsid;
+	BOOLEAN Managed;
+	BOOLEAN Bypass;
+	BOOLEAN Translating;
+
+	//
+	// Maps and unmaps are counted per page table, DARTs sharing one report the same numbers.
+	//
+	UINT64 Maps;
+	UINT64 MappedPages;
+	UINT64 Unmaps;
+	UINT64 Flushes;
+	UINT64 FlushWaitTicks;	// performance counter ticks spent waiting for TLB flushes to finish
+	UINT64 Faults;
+
+	//
+	// Last fault, only valid if Faults != 0.
+	//
+	UINT32 LastFaultError;	// raw error register
+	UINT32 LastFaultKind;	// APPLE_DART_FAULT_*
+	UINT32 LastFaultSid;
+	UINT64 LastFaultIova;
+} APPLE_DART_DIAGNOSTICS_STATS;
+
+//
+// Description:
+//   Returns the counters of every DART the driver knows about.
+//
+// Return values:
+//   EFI_SUCCESS - *Count entries were written to Stats.
+//   EFI_BUFFER_TOO_SMALL - *Count was too small and has been set to the number of DARTs.
+//   EFI_INVALID_PARAMETER - Count is NULL, or Stats is NULL with *Count != 0.
+//
+typedef
+EFI_STATUS
+(EFIAPI *APPLE_DART_DIAGNOSTICS_GET_STATS)(
+	IN APPLE_DART_DIAGNOSTICS_PROTOCOL *This,
+	IN OUT UINTN *Count,
+	OUT APPLE_DART_DIAGNOSTICS_STATS *Stats
+	);
+
+//
+// Description:
+//   Reads the error registers of every DART now rather than at the next poll.
+//
+// Return values:
+//   EFI_SUCCESS - always, new faults are in the counters.
+//
+typedef
+EFI_STATUS
+(EFIAPI *APPLE_DART_DIAGNOSTICS_POLL_FAULTS)(
+	IN APPLE_DART_DIAGNOSTICS_PROTOCOL *This
+	);
+
+//
+// Description:
+//   Zeroes every counter, so the next GetStats() shows only what happened since.
+//
+typedef
+EFI_STATUS
+(EFIAPI *APPLE_DART_DIAGNOSTICS_RESET_STATS)(
+	IN APPLE_DART_DIAGNOSTICS_PROTOCOL *This
+	);
+
+struct _APPLE_DART_DIAGNOSTICS_PROTOCOL {
+	UINT64 Revision;
+	APPLE_DART_DIAGNOSTICS_GET_STATS GetStats;
+	APPLE_DART_DIAGNOSTICS_POLL_FAULTS PollFaults;
+	APPLE_DART_DIAGNOSTICS_RESET_STATS ResetStats;
+};
+
+extern EFI_GUID gAppleDartDiagnosticsProtocolGuid;
+
+#endif //APPLE_DART_DIAGNOSTICS_H
@@ -0,0 +1,86 @@
+/**
+ * Copyright (c) 2024, AppleWOA authors.
+ *
+ * Module Name:
+ *     AppleDartScatterGather.h
+ *
+ * Abstract:
+ *     Scatter-gather extension to EDKII_IOMMU_PROTOCOL, produced by AppleDartIoMmuDxe next to it.
+ *
+ *     EDKII_IOMMU_PROTOCOL.Map() takes one contiguous host range. The DART can put physically
+ *     discontiguous pages behind one contiguous device address range though, so a buffer made of
+ *     several host ranges can be handed to a device in one piece instead of being bounced.
+ *
+ *     The DART maps 16KB pages, so every range but the first has to start on a 16KB boundary,
+ *     and every range but the last has to end on one. Ranges that don't are rejected, callers
+ *     fall back to mapping (or bouncing) them one at a time.
+ *
+ * Environment:
+ *     UEFI DXE (Driver Execution Environment).
+ *
+ * License:
+ *     SPDX-License-Identifier: (BSD-2-Clause-Patent OR MIT) AND GPL-2.0
+*/
+
+#ifndef APPLE_DART_SCATTER_GATHER_H
+#define APPLE_DART_SCATTER_GATHER_H
+
+#include <Protocol/IoMmu.h>
+
+#define APPLE_DART_SCATTER_GATHER_PROTOCOL_GUID \
+	{ 0xcdcc5f98, 0xfdbb, 0x4df7, { 0x83, 0xb5, 0xbf, 0xed, 0xf1, 0xe0, 0x53, 0x99 } }
+
+#define APPLE_DART_SCATTER_GATHER_PROTOCOL_REVISION	0x00010000
+
+//
+// Device addresses only line up if ranges meet on this boundary.
+//
+#define APPLE_DART_SCATTER_GATHER_ALIGNMENT	SIZE_16KB
+
+typedef struct _APPLE_DART_SCATTER_GATHER_PROTOCOL APPLE_DART_SCATTER_GATHER_PROTOCOL;
+
+typedef struct {
+	EFI_PHYSICAL_ADDRESS HostAddress;
+	UINTN Length;
+} APPLE_DART_SG_ENTRY;
+
+//
+// Description:
+//   Maps Count host ranges back to back into one contiguous device address range.
+//   The mapping is undone with Unmap() here or EDKII_IOMMU_PROTOCOL.Unmap(), either works.
+//
+// Return values:
+//   EFI_SUCCESS - *DeviceAddress is where List[0].HostAddress is seen by the device, the rest
+//                 follow without gaps. *NumberOfBytes is the total length.
+//   EFI_INVALID_PARAMETER - bad operation or pointer, empty list or range, or ranges that don't
+//                           meet on APPLE_DART_SCATTER_GATHER_ALIGNMENT.
+//   EFI_OUT_OF_RESOURCES - out of device address space or memory for the page tables.
+//
+typedef
+EFI_STATUS
+(EFIAPI *APPLE_DART_SCATTER_GATHER_MAP)(
+	IN APPLE_DART_SCATTER_GATHER_PROTOCOL *This,
+	IN EDKII_IOMMU_OPERATION Operation,
+	IN CONST APPLE_DART_SG_ENTRY *List,
+	IN UINTN Count,
+	OUT EFI_PHYSICAL_ADDRESS *DeviceAddress,
+	OUT UINTN *NumberOfBytes,
+	OUT VOID **Mapping
+	);
+
+typedef
+EFI_STATUS
+(EFIAPI *APPLE_DART_SCATTER_GATHER_UNMAP)(
+	IN APPLE_DART_SCATTER_GATHER_PROTOCOL *This,
+	IN VOID *Mapping
+	);
+
+struct _APPLE_DART_SCATTER_GATHER_PROTOCOL {
+	UINT64 Revision;
+	APPLE_DART_SCATTER_GATHER_MAP Map;
+	APPLE_DART_SCATTER_GATHER_UNMAP Unmap;
+};
+
+extern EFI_GUID gAppleDartScatterGatherProtocolGuid;
+
+#endif //APPLE_DART_SCATTER_GATHER_H
@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2024, AppleWOA authors.
+ *
+ * Module Name:
+ *     AppleDTEnum.c
+ *
+ * Abstract:
+ *     Enumeration helpers for the Apple DeviceTree.
+ *
+ *     Drivers used to discover instances by formatting "foo%d" names and calling dt_get() until it
+ *     failed, which is one full tree walk per instance. These collect every match in a single pass
+ *     over the subtree instead.
+ *
+ * License:
+ *     SPDX-License-Identifier: MIT
+ */
+
+#include <Base.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/DebugLib.h>
+#include <Library/PcdLib.h>
+#include <Library/AppleDTLib.h>
+
+#include "AppleDTLibInternal.h"
+
+typedef int (*dt_match_t)(dt_node_t *node, const char *name, size_t len, const void *arg);
+
+typedef struct
+{
+    dt_match_t match;
+    const void *arg;
+    int children;
+    dt_node_t **nodes;
+    uint32_t max;
+    uint32_t count;
+} dt_collect_cb_t;
+
+static void dt_collect_add(dt_collect_cb_t *arg, dt_node_t *node)
+{
+    if(arg->count < arg->max) arg->nodes[arg->count] = node;
+    arg->count++;
+}
+
+static int dt_collect_cb(void *a, dt_node_t *node, int depth)
+{
+    dt_collect_cb_t *arg = a;
+    if(depth == 0 || (arg->children && depth != 1)) return 0;
+    size_t len = 0;
+    const char *name = dt_prop(node, "name", &len);
+    if(!arg->match || arg->match(node, name, len, arg->arg))
+    {
+        dt_collect_add(arg, node);
+    }
+    return 0;
+}
+
+static uint32_t dt_collect(dt_node_t *node, int children, dt_match_t match, const void *match_arg, dt_node_t **nodes, uint32_t max)
+{
+    if(!node) node = dt_root();
+    dt_collect_cb_t arg = { .match = match, .arg = match_arg, .children = children, .nodes = nodes, .max = nodes ? max : 0 };
+
+    dt_index_t *idx = dt_index_get();
+    uint32_t i = dt_index_find(idx, node);
+    if(i == DT_INDEX_NONE)
+    {
+        dt_parse(node, 0, NULL, &dt_collect_cb, &arg, NULL, NULL);
+        return arg.count;
+    }
+
+    // Subtrees are contiguous in the index, so this is a flat loop instead of a tree walk.
+    dt_index_node_t *e = dt_index_nodes(idx);
+    for(uint32_t j = children ? e[i].child : i + 1; j != DT_INDEX_NONE && j < e[i].end; j = children ? e[j].sibling : j + 1)
+    {
+        dt_node_t *cur = dt_index_node(idx, j);
+        const char *name = NULL;
+        size_t len = 0;
+        if(e[j].name != DT_INDEX_NONE)
+        {
+            dt_prop_t *prop = (dt_prop_t*)((uintptr_t)idx->base + e[j].name);
+            name = prop->val;
+            len = prop->len & 0xffffff;
+        }
+        if(!match || match(cur, name, len, match_arg))
+        {
+            dt_collect_add(&arg, cur);
+        }
+    }
+    return arg.count;
+}
+
+static int dt_match_prefix(dt_node_t *node, const char *name, size_t len, const void *arg)
+{
+    const char *prefix = arg;
+    size_t plen = AsciiStrLen(prefix);
+    return name && len > plen && CompareMem(name, prefix, plen) == 0;
+}
+
+static int dt_compatible_has(const char *list, size_t len, const char *compat)
+{
+    size_t clen = AsciiStrLen(compat);
+    // "compatible" is a list of NUL separated strings, any of them can match.
+    for(size_t off = 0; off < len; )
+    {
+        size_t l = AsciiStrnLenS(list + off, len - off);
+        if(l == clen && CompareMem(list + off, compat, clen) == 0) return 1;
+        off += l + 1;
+    }
+    return 0;
+}
+
+static int dt_match_compatible(dt_node_t *node, const char *name, size_t len, const void *arg)
+{
+    const char *list = dt_prop(node, "compatible", &len);
+    return list && dt_compatible_has(list, len, arg);
+}
+
+typedef struct
+{
+    const char * const *compats;
+    uint32_t count;
+} dt_compat_list_t;
+
+static int dt_match_compatible_list(dt_node_t *node, const char *name, size_t len, const void *arg)
+{
+    const dt_compat_list_t *cl = arg;
+    const char *list = dt_prop(node, "compatible", &len);
+    if(!list) return 0;
+    for(uint32_t i = 0; i < cl->count; ++i)
+    {
+        if(dt_compatible_has(list, len, cl->compats[i])) return 1;
+    }
+    return 0;
+}
+
+uint32_t dt_foreach_child(dt_node_t *node, dt_node_t **nodes, uint32_t max)
+{
+    return dt_collect(node, 1, NULL, NULL, nodes, max);
+}
+
+uint32_t dt_foreach_compatible(dt_node_t *node, const char *compat, dt_node_t **nodes, uint32_t max)
+{
+    return dt_collect(node, 0, &dt_match_compatible, compat, nodes, max);
+}
+
+uint32_t dt_foreach_compatible_list(dt_node_t *node, const char * const *compats, uint32_t ncompat, dt_node_t **nodes, uint32_t max)
+{
+    dt_compat_list_t cl = { .compats = compats, .count = ncompat };
+    return dt_collect(node, 0, &dt_match_compatible_list, &cl, nodes, max);
+}
+
+uint32_t dt_foreach_name_prefix(dt_node_t *node, const char *prefix, dt_node_t **nodes, uint32_t max)
+{
+    return dt_collect(node, 0, &dt_match_prefix, prefix, nodes, max);
+}
+
+int dt_node_name_index(dt_node_t *node, const char *prefix)
+{
+    size_t len = 0;
+    const char *name = node ? dt_prop(node, "name", &len) : NULL;
+    size_t plen = AsciiStrLen(prefix);
+    if(!name || len < plen + 2 || CompareMem(name, prefix, plen) != 0) return -1;
+    int val = 0;
+    for(size_t i = plen; i < len - 1; ++i)
+    {
+        if(name[i] < '0' || name[i] > '9' || val > 0xffffff) return -1;
+        val = val * 10 + (name[i] - '0');
+    }
+    return name[len - 1] == '\0' ? val : -1;
+}
@@ -0,0 +1,494 @@
+/*
+ * Copyright (c) 2024, AppleWOA authors.
+ *
+ * Module Name:
+ *     AppleDTIndex.c
+ *
+ * Abstract:
+ *     Flat node/property index over the Apple DeviceTree.
+ *
+ *     The ADT is a serialized tree without any back links, so finding the parent of a node
+ *     (or anything else that isn't "walk forward from here") used to mean parsing the tree again
+ *     from the root. This builds a node table with parent/child/sibling links plus a per-node
+ *     property table once, after which those lookups are constant time (or linear in depth).
+ *
+ *     On top of that there are two hash tables, one by node name and one by absolute path,
+ *     so dt_find()/dt_get() become a hash probe plus a compare against the real "name" property.
+ *
+ * License:
+ *     SPDX-License-Identifier: MIT
+ */
+
+#include <Base.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/DebugLib.h>
+#include <Library/HobLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/PcdLib.h>
+#include <Library/AppleDTLib.h>
+
+#include "AppleDTLibInternal.h"
+
+// The host unit tests build the library for the machine they run on, which has no ArmLib.
+#if defined (MDE_CPU_AARCH64)
+#include <Library/ArmLib.h>
+#endif
+
+// Lays out the index blob for the given counts, returns its total size.
+static size_t dt_index_layout(dt_index_t *idx, uint32_t nnode, uint32_t nprop)
+{
+    uint32_t nhash = 16;
+    while(nhash < nnode * 2) nhash <<= 1; // keep the load factor at or below 1/2
+
+    idx->nnode    = nnode;
+    idx->nprop    = nprop;
+    idx->nhash    = nhash;
+    idx->node_off = sizeof(dt_index_t);
+    idx->prop_off = idx->node_off + nnode * sizeof(dt_index_node_t);
+    idx->name_off = idx->prop_off + nprop * sizeof(uint32_t);
+    idx->path_off = idx->name_off + nhash * sizeof(dt_index_hash_t);
+    idx->dir_off  = idx->path_off + nhash * sizeof(dt_index_hash_t);
+    return idx->dir_off + nprop * sizeof(dt_index_key_t);
+}
+
+typedef struct
+{
+    uint32_t nnode;
+    uint32_t nprop;
+} dt_index_count_cb_t;
+
+static int dt_index_count_cb(void *a, dt_node_t *node, int depth)
+{
+    dt_index_count_cb_t *arg = a;
+    arg->nnode++;
+    arg->nprop += node->nprop;
+    return 0;
+}
+
+size_t dt_index_size(void *mem, size_t size)
+{
+    if(dt_check(mem, size, NULL) != 0) return 0;
+    dt_index_count_cb_t arg = { 0, 0 };
+    dt_parse((dt_node_t*)mem, 0, NULL, &dt_index_count_cb, &arg, NULL, NULL);
+    dt_index_t tmp;
+    return dt_index_layout(&tmp, arg.nnode, arg.nprop);
+}
+
+static int dt_index_name_is(dt_index_t *idx, uint32_t i, const char *name, size_t len)
+{
+    uint32_t off = dt_index_nodes(idx)[i].name;
+    if(off == DT_INDEX_NONE) return 0;
+    dt_prop_t *prop = (dt_prop_t*)((uintptr_t)idx->base + off);
+    return (prop->len & 0xffffff) == len + 1 && CompareMem(prop->val, name, len) == 0;
+}
+
+typedef struct
+{
+    dt_index_t *idx;
+    dt_index_node_t *nodes;
+    uint32_t *props;
+    uint32_t nnode;
+    uint32_t nprop;
+    uint32_t last[DT_MAX_DEPTH];  // last node seen at each depth, for sibling links
+    uint32_t phash[DT_MAX_DEPTH]; // path hash of the current node at each depth
+    uint8_t reach[DT_MAX_DEPTH];  // whether that node is what dt_find() resolves its path to
+} dt_index_build_cb_t;
+
+static int dt_index_build_node_cb(void *a, dt_node_t *node, int depth)
+{
+    dt_index_build_cb_t *arg = a;
+    if(depth >= DT_MAX_DEPTH || arg->nnode >= arg->idx->nnode || arg->nprop + node->nprop > arg->idx->nprop)
+    {
+        return -1;
+    }
+    uint32_t i = arg->nnode++;
+    dt_index_node_t *e = &arg->nodes[i];
+    e->off     = (uint32_t)((uintptr_t)node - (uintptr_t)arg->idx->base);
+    e->parent  = depth > 0 ? arg->last[depth - 1] : DT_INDEX_NONE;
+    e->child   = DT_INDEX_NONE;
+    e->sibling = DT_INDEX_NONE;
+    e->end     = 1; // subtree size for now, turned into an end index once the walk is done
+    e->prop    = arg->nprop;
+    e->nprop   = node->nprop;
+    e->depth   = depth;
+    e->name    = DT_INDEX_NONE;
+    if(depth > 0)
+    {
+        dt_index_node_t *parent = &arg->nodes[e->parent];
+        uint32_t prev = arg->last[depth];
+        if(parent->child == DT_INDEX_NONE)
+        {
+            parent->child = i;
+        }
+        else if(prev != DT_INDEX_NONE && arg->nodes[prev].parent == e->parent)
+        {
+            arg->nodes[prev].sibling = i;
+        }
+    }
+    arg->last[depth] = i;
+    if(depth + 1 < DT_MAX_DEPTH)
+    {
+        arg->last[depth + 1] = DT_INDEX_NONE;
+    }
+    // Absolute paths don't include the root, so it's always "reached" with an empty path.
+    arg->reach[depth] = depth == 0;
+    arg->phash[depth] = DT_HASH_INIT;
+    return 0;
+}
+
+static void dt_index_build_name(dt_index_build_cb_t *arg, int depth, uint32_t i, const char *name, size_t len)
+{
+    dt_index_t *idx = arg->idx;
+    uint32_t mask = idx->nhash - 1;
+
+    dt_index_hash_t *names = dt_index_names(idx);
+    uint32_t h = dt_hash(DT_HASH_INIT, name, len);
+    uint32_t s = h & mask;
+    while(names[s].node != DT_INDEX_NONE) s = (s + 1) & mask;
+    names[s].hash = h;
+    names[s].node = i;
+
+    // dt_find() resolves "/a/b" greedily: the first "a" below the root, then the first "b" below that.
+    // Only nodes reachable that way go into the path table, so a path hit never needs a tie break.
+    if(depth == 0 || !arg->reach[depth - 1]) return;
+    uint32_t parent = arg->nodes[i].parent;
+    dt_index_hash_t *paths = dt_index_paths(idx);
+    h = dt_hash(dt_hash(arg->phash[depth - 1], "/", 1), name, len);
+    s = h & mask;
+    for(; paths[s].node != DT_INDEX_NONE; s = (s + 1) & mask)
+    {
+        uint32_t j = paths[s].node;
+        if(paths[s].hash == h && arg->nodes[j].parent == parent && dt_index_name_is(idx, j, name, len))
+        {
+            return; // an earlier sibling has the same name
+        }
+    }
+    paths[s].hash = h;
+    paths[s].node = i;
+    arg->reach[depth] = 1;
+    arg->phash[depth] = h;
+}
+
+static int dt_index_build_prop_cb(void *a, dt_node_t *node, int depth, const char *key, void *val, size_t len)
+{
+    dt_index_build_cb_t *arg = a;
+    // dt_prop_t starts with the key, so the key pointer is the property pointer.
+    uint32_t off = (uint32_t)((uintptr_t)key - (uintptr_t)arg->idx->base);
+    arg->props[arg->nprop++] = off;
+
+    uint32_t i = arg->nnode - 1;
+    if(arg->nodes[i].name == DT_INDEX_NONE && AsciiStrnCmp(key, "name", DT_KEY_LEN) == 0)
+    {
+        // Names with embedded or missing terminators can never match in dt_find() either, so just skip them.
+        if(len == 0 || AsciiStrnLenS(val, len) != len - 1) return 0;
+        arg->nodes[i].name = off;
+        dt_index_build_name(arg, depth, i, val, len - 1);
+    }
+    return 0;
+}
+
+int dt_index_init(dt_index_t *idx, size_t idx_size, void *mem, size_t size)
+{
+    if(idx_size < sizeof(dt_index_t)) return -1;
+    if(dt_check(mem, size, &size) != 0) return -1;
+
+    dt_index_count_cb_t count = { 0, 0 };
+    dt_parse((dt_node_t*)mem, 0, NULL, &dt_index_count_cb, &count, NULL, NULL);
+
+    idx->magic   = 0;
+    idx->base    = (uintptr_t)mem;
+    idx->dt_size = size;
+    size_t need  = dt_index_layout(idx, count.nnode, count.nprop);
+    if(idx_size < need) return -1;
+    idx->size    = (uint32_t)need;
+
+    SetMem(dt_index_names(idx), idx->nhash * sizeof(dt_index_hash_t), 0xff);
+    SetMem(dt_index_paths(idx), idx->nhash * sizeof(dt_index_hash_t), 0xff);
+
+    dt_index_build_cb_t arg = { .idx = idx, .nodes = dt_index_nodes(idx), .props = dt_index_props(idx) };
+    SetMem(arg.last, sizeof(arg.last), 0xff);
+    if(dt_parse((dt_node_t*)mem, 0, NULL, &dt_index_build_node_cb, &arg, &dt_index_build_prop_cb, &arg) != 0 ||
+       arg.nnode != count.nnode || arg.nprop != count.nprop)
+    {
+        DEBUG((DEBUG_ERROR, "DeviceTree index build failed at node %u\n", arg.nnode));
+        return -1;
+    }
+
+    // Per-node property directory, sorted by key hash and then by position so the first match wins like in dt_prop().
+    // Nodes have at most a few dozen properties, insertion sort is plenty.
+    dt_index_key_t *dir = dt_index_dir(idx);
+    for(uint32_t p = 0; p < count.nprop; ++p)
+    {
+        dir[p].hash = dt_key_hash(dt_index_prop(idx, p)->key);
+        dir[p].prop = p;
+    }
+    for(uint32_t i = 0; i < count.nnode; ++i)
+    {
+        dt_index_key_t *d = &dir[arg.nodes[i].prop];
+        for(uint32_t a = 1; a < arg.nodes[i].nprop; ++a)
+        {
+            dt_index_key_t e = d[a];
+            uint32_t b = a;
+            for(; b > 0 && d[b - 1].hash > e.hash; --b) d[b] = d[b - 1];
+            d[b] = e;
+        }
+    }
+
+    // Children always come after their parent, so walking backwards sums up every subtree before it's needed.
+    for(uint32_t i = count.nnode; i-- > 1; )
+    {
+        arg.nodes[arg.nodes[i].parent].end += arg.nodes[i].end;
+    }
+    for(uint32_t i = 0; i < count.nnode; ++i)
+    {
+        arg.nodes[i].end += i;
+    }
+
+    idx->magic = DT_INDEX_MAGIC;
+    return 0;
+}
+
+static dt_index_t *g_dt_index = NULL;
+static uint64_t g_dt_index_pages = 0;
+
+dt_index_t* dt_index_get(void)
+{
+    if(g_dt_index) return g_dt_index;
+
+    // The build touches every node and property of the ADT, which is slow with the MMU and caches
+    // still off. The first lookups in PrePi's MemoryPeim run before InitMmu, those walk the ADT
+    // instead, and PrePi builds (and publishes) the index once MemoryPeim has turned the MMU on.
+#if defined (MDE_CPU_AARCH64)
+    if(!ArmMmuEnabled()) return NULL;
+#endif
+
+    void *mem = (void*)FixedPcdGet64(PcdAdtPointer);
+    size_t size = ((struct boot_args*)FixedPcdGet64(PcdBootArgsPointer))->devtree_size;
+    size_t need = dt_index_size(mem, size);
+    if(need == 0) return NULL;
+
+    // Not AllocatePool(), PrePi can't hand out pool allocations this big.
+    dt_index_t *idx = AllocatePages(EFI_SIZE_TO_PAGES(need));
+    if(!idx) return NULL;
+    if(dt_index_init(idx, EFI_PAGES_TO_SIZE(EFI_SIZE_TO_PAGES(need)), mem, size) != 0)
+    {
+        FreePages(idx, EFI_SIZE_TO_PAGES(need));
+        return NULL;
+    }
+    DEBUG((DEBUG_INFO, "DeviceTree index: %u nodes, %u props, %u bytes\n", idx->nnode, idx->nprop, idx->size));
+    g_dt_index = idx;
+    g_dt_index_pages = EFI_SIZE_TO_PAGES(need);
+    return idx;
+}
+
+dt_index_t* dt_index_publish(void)
+{
+    dt_index_t *idx = dt_index_get();
+    if(!idx) return NULL;
+    if(GetFirstGuidHob(&gAppleSiliconPkgAdtIndexHobGuid)) return idx;
+
+    // The pages were allocated as boot services data, so DXE core keeps them around for us.
+    dt_index_hob_t hob = { .index = (uintptr_t)idx, .pages = g_dt_index_pages };
+    if(!BuildGuidDataHob(&gAppleSiliconPkgAdtIndexHobGuid, &hob, sizeof(hob)))
+    {
+        DEBUG((DEBUG_ERROR, "Failed to publish DeviceTree index\n"));
+    }
+    return idx;
+}
+
+int dt_index_attach(void)
+{
+    if(g_dt_index) return 0;
+
+    void *raw = GetFirstGuidHob(&gAppleSiliconPkgAdtIndexHobGuid);
+    if(!raw || GET_GUID_HOB_DATA_SIZE(raw) < sizeof(dt_index_hob_t)) return -1;
+    dt_index_hob_t *hob = GET_GUID_HOB_DATA(raw);
+    dt_index_t *idx = (dt_index_t*)(uintptr_t)hob->index;
+
+    // Only take it if it still describes the DeviceTree we're looking at.
+    struct boot_args *args = (struct boot_args*)FixedPcdGet64(PcdBootArgsPointer);
+    if(!idx || idx->magic != DT_INDEX_MAGIC || idx->base != FixedPcdGet64(PcdAdtPointer) ||
+       idx->dt_size > args->devtree_size || idx->size > EFI_PAGES_TO_SIZE(hob->pages))
+    {
+        DEBUG((DEBUG_ERROR, "Ignoring stale DeviceTree index at 0x%llx\n", hob->index));
+        return -1;
+    }
+    g_dt_index = idx;
+    g_dt_index_pages = hob->pages;
+    return 0;
+}
+
+uint32_t dt_index_find(dt_index_t *idx, dt_node_t *node)
+{
+    if(!idx || !dt_index_contains(idx, node)) return DT_INDEX_NONE;
+    dt_index_node_t *nodes = dt_index_nodes(idx);
+    uint32_t off = (uint32_t)((uintptr_t)node - (uintptr_t)idx->base);
+    uint32_t lo = 0, hi = idx->nnode;
+    while(lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if(nodes[mid].off < off)      lo = mid + 1;
+        else if(nodes[mid].off > off) hi = mid;
+        else                          return mid;
+    }
+    return DT_INDEX_NONE;
+}
+
+dt_node_t* dt_index_node(dt_index_t *idx, uint32_t i)
+{
+    if(!idx || i >= idx->nnode) return NULL;
+    return (dt_node_t*)((uintptr_t)idx->base + dt_index_nodes(idx)[i].off);
+}
+
+dt_node_t* dt_node_child(dt_node_t *node)
+{
+    dt_index_t *idx = dt_index_get();
+    uint32_t i = dt_index_find(idx, node);
+    if(i == DT_INDEX_NONE) return NULL;
+    return dt_index_node(idx, dt_index_nodes(idx)[i].child);
+}
+
+dt_node_t* dt_node_sibling(dt_node_t *node)
+{
+    dt_index_t *idx = dt_index_get();
+    uint32_t i = dt_index_find(idx, node);
+    if(i == DT_INDEX_NONE) return NULL;
+    return dt_index_node(idx, dt_index_nodes(idx)[i].sibling);
+}
+
+dt_prop_t* dt_index_prop_find(dt_index_t *idx, uint32_t i, const dt_key_t *k)
+{
+    dt_index_node_t *node = &dt_index_nodes(idx)[i];
+    dt_index_key_t *dir = &dt_index_dir(idx)[node->prop];
+    uint32_t lo = 0, hi = node->nprop;
+    while(lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if(dir[mid].hash < k->hash) lo = mid + 1;
+        else                        hi = mid;
+    }
+    for(; lo < node->nprop && dir[lo].hash == k->hash; ++lo)
+    {
+        dt_prop_t *prop = dt_index_prop(idx, dir[lo].prop);
+        if(dt_key_eq(k, prop->key)) return prop;
+    }
+    return NULL;
+}
+
+// First node named `name` in the subtree of `start`, in tree order.
+static uint32_t dt_index_lookup_name(dt_index_t *idx, uint32_t start, uint32_t h, const char *name, size_t len)
+{
+    dt_index_hash_t *names = dt_index_names(idx);
+    uint32_t end = dt_index_nodes(idx)[start].end;
+    uint32_t mask = idx->nhash - 1;
+    // Linear probing keeps entries of the same name in insertion (= tree) order along the probe sequence.
+    for(uint32_t s = h & mask; names[s].node != DT_INDEX_NONE; s = (s + 1) & mask)
+    {
+        uint32_t i = names[s].node;
+        if(names[s].hash != h || i < start || !dt_index_name_is(idx, i, name, len)) continue;
+        return i < end ? i : DT_INDEX_NONE;
+    }
+    return DT_INDEX_NONE;
+}
+
+// Whether node `i` sits at absolute path `path`, checked against the real names bottom up.
+static int dt_index_path_is(dt_index_t *idx, uint32_t i, const char *path, size_t len)
+{
+    dt_index_node_t *nodes = dt_index_nodes(idx);
+    while(i != 0)
+    {
+        size_t s = len;
+        while(s > 0 && path[s - 1] != '/') --s;
+        if(s == 0 || !dt_index_name_is(idx, i, path + s, len - s)) return 0;
+        len = s - 1;
+        i = nodes[i].parent;
+    }
+    return len == 0;
+}
+
+static uint32_t dt_index_lookup_path(dt_index_t *idx, uint32_t start, uint32_t h, const char *path, size_t len)
+{
+    dt_index_node_t *nodes = dt_index_nodes(idx);
+    if(start == 0)
+    {
+        dt_index_hash_t *paths = dt_index_paths(idx);
+        uint32_t mask = idx->nhash - 1;
+        for(uint32_t s = h & mask; paths[s].node != DT_INDEX_NONE; s = (s + 1) & mask)
+        {
+            if(paths[s].hash == h && dt_index_path_is(idx, paths[s].node, path, len)) return paths[s].node;
+        }
+        return DT_INDEX_NONE;
+    }
+    // Paths relative to some inner node aren't hashed, walk down the child lists instead.
+    uint32_t cur = start;
+    while(*path == '/')
+    {
+        const char *seg = path + 1;
+        const char *next = AsciiStrStr(seg, "/");
+        size_t seglen = next ? (size_t)(next - seg) : AsciiStrLen(seg);
+        uint32_t c = nodes[cur].child;
+        while(c != DT_INDEX_NONE && !dt_index_name_is(idx, c, seg, seglen)) c = nodes[c].sibling;
+        if(c == DT_INDEX_NONE || !next) return c;
+        cur = c;
+        path = next;
+    }
+    return DT_INDEX_NONE;
+}
+
+// Direct mapped cache of recent failed lookups, drivers probe "foo%d" until the first miss.
+#define DT_MISS_CACHE_SIZE 16
+#define DT_MISS_NAME_LEN   64
+
+typedef struct
+{
+    uint32_t hash;
+    uint32_t start;
+    char name[DT_MISS_NAME_LEN];
+} dt_miss_t;
+
+static dt_miss_t g_dt_miss[DT_MISS_CACHE_SIZE];
+
+dt_node_t* dt_root(void)
+{
+    // The index always describes PcdAdtPointer in firmware, only a swapped in one can differ.
+    if(g_dt_index) return (dt_node_t*)(uintptr_t)g_dt_index->base;
+    return (dt_node_t*)FixedPcdGet64(PcdAdtPointer);
+}
+
+dt_index_t* dt_index_swap(dt_index_t *idx)
+{
+    dt_index_t *old = g_dt_index;
+    g_dt_index = idx;
+    // Everything cached is keyed by node number or pointer of the tree that was in use.
+    ZeroMem(g_dt_miss, sizeof(g_dt_miss));
+    dt_cache_flush();
+    return old;
+}
+
+uint32_t dt_index_lookup(dt_index_t *idx, uint32_t start, const char *name)
+{
+    if(!idx || start >= idx->nnode) return DT_INDEX_NONE;
+    size_t len = AsciiStrLen(name);
+    uint32_t h = dt_hash(DT_HASH_INIT, name, len);
+
+    // Only the global index shares the cache, any other one would alias its node numbers.
+    dt_miss_t *miss = NULL;
+    if(idx == g_dt_index && len < DT_MISS_NAME_LEN)
+    {
+        miss = &g_dt_miss[(h ^ start) & (DT_MISS_CACHE_SIZE - 1)];
+        if(miss->hash == h && miss->start == start && AsciiStrCmp(miss->name, name) == 0)
+        {
+            return DT_INDEX_NONE;
+        }
+    }
+
+    uint32_t i = name[0] == '/' ? dt_index_lookup_path(idx, start, h, name, len) : dt_index_lookup_name(idx, start, h, name, len);
+    if(i == DT_INDEX_NONE && miss)
+    {
+        miss->hash  = h;
+        miss->start = start;
+        CopyMem(miss->name, name, len + 1);
+    }
+    return i;
+}
@@ -26,13 +26,14 @@
  */
 
 #include <Base.h>
-#include <Library/ArmLib.h>
 #include <Library/BaseLib.h>
 #include <Library/BaseMemoryLib.h>
 #include <Library/PcdLib.h>
 #include <Library/DebugLib.h>
 #include <Library/AppleDTLib.h>
 
+#include "AppleDTLibInternal.h"
+
 
 #include <stdbool.h>
 #include <stddef.h>
@@ -41,6 +42,8 @@
 
 
 EFI_STATUS EFIAPI AppleDTLibInitialize(VOID) {
+    // Pick up the index PrePi published, if there's none it gets built on first use instead.
+    dt_index_attach();
     return EFI_SUCCESS;
 }
 
@@ -51,154 +54,234 @@ static void get_cells(uint64_t *dst, const uint32_t **src, int cells)
         *dst |= ((uint64_t) * ((*src)++)) << (32 * i);
 }
 
+// ========== Traversal ==========
+
+/*
+ * The ADT is serialized in preorder, so walking it is just stepping over one node's properties
+ * to get to the next one. All the cursor has to remember is how many nodes are left on each level
+ * of the current path to know the depth of what comes next, no recursion and a fixed stack size.
+ */
+void dt_cursor_init(dt_cursor_t *cur, dt_node_t *root, size_t size)
+{
+    cur->root = root;
+    cur->next = root;
+    cur->end = size ? (uintptr_t)root + size : 0;
+    cur->off = 0;
+    cur->depth = -1;
+    cur->next_depth = 0;
+    cur->err = 0;
+    cur->left[0] = 1;
+}
+
+static dt_node_t* dt_cursor_fail(dt_cursor_t *cur)
+{
+    cur->err = -1;
+    cur->next = NULL;
+    return NULL;
+}
+
+dt_node_t* dt_cursor_next(dt_cursor_t *cur)
+{
+    dt_node_t *node = cur->next;
+    if(!node) return NULL;
+    int depth = cur->next_depth;
+    uintptr_t p = (uintptr_t)node;
+    if(cur->end && cur->end - p < sizeof(dt_node_t)) return dt_cursor_fail(cur);
+    p += sizeof(dt_node_t);
+    for(size_t i = 0, max = node->nprop; i < max; ++i)
+    {
+        if(cur->end && cur->end - p < sizeof(dt_prop_t)) return dt_cursor_fail(cur);
+        size_t l = ((dt_prop_t*)p)->len & 0xffffff;
+        p += sizeof(dt_prop_t) + ((l + 0x3) & ~0x3);
+        if(cur->end && p > cur->end) return dt_cursor_fail(cur);
+    }
+    cur->path[depth] = node;
+    cur->depth = depth;
+    --cur->left[depth];
+    if(node->nchld > 0)
+    {
+        if(depth + 1 >= DT_MAX_DEPTH)
+        {
+            DEBUG((DEBUG_ERROR, "DeviceTree deeper than %d levels\n", DT_MAX_DEPTH));
+            return dt_cursor_fail(cur);
+        }
+        cur->left[++depth] = node->nchld;
+    }
+    else
+    {
+        while(depth >= 0 && cur->left[depth] == 0) --depth;
+    }
+    cur->next = depth >= 0 ? (dt_node_t*)p : NULL;
+    cur->next_depth = depth;
+    cur->off = p - (uintptr_t)cur->root;
+    return node;
+}
+
+void dt_cursor_skip(dt_cursor_t *cur)
+{
+    int depth = cur->depth;
+    while(cur->next && cur->next_depth > depth)
+    {
+        dt_cursor_next(cur);
+    }
+    cur->depth = depth;
+}
+
+static dt_prop_t* dt_prop_scan(dt_node_t *node, const dt_key_t *k)
+{
+    size_t off = sizeof(dt_node_t);
+    for(size_t i = 0, max = node->nprop; i < max; ++i)
+    {
+        dt_prop_t *prop = (dt_prop_t*)((uintptr_t)node + off);
+        if(dt_key_eq(k, prop->key)) return prop;
+        off += sizeof(dt_prop_t) + (((prop->len & 0xffffff) + 0x3) & ~0x3);
+    }
+    return NULL;
+}
+
+
+static int dt_node_name_eq(dt_node_t *node, const dt_key_t *k, const char *name, size_t size)
+{
+    dt_prop_t *prop = dt_prop_scan(node, k);
+    if(!prop) return 0;
+    size_t len = prop->len & 0xffffff;
+    return size + 1 == len && AsciiStrnCmp(name, prop->val, size) == 0 && prop->val[size] == '\0';
+}
+
+dt_node_t* dt_cursor_find(dt_cursor_t *cur, const char *name)
+{
+    dt_key_t k;
+    dt_key_init(&k, "name");
+    size_t size = AsciiStrLen(name);
+    for(dt_node_t *node; (node = dt_cursor_next(cur)) != NULL; )
+    {
+        if(dt_node_name_eq(node, &k, name, size)) return node;
+    }
+    return NULL;
+}
+
 int dt_check(void *mem, size_t size, size_t *offp)
 {
     if(size < sizeof(dt_node_t)) return -1;
-    dt_node_t *node = mem;
+    dt_cursor_t cur;
+    dt_cursor_init(&cur, mem, size);
+    while(dt_cursor_next(&cur)) {}
+    if(cur.err != 0) return cur.err;
+    if(offp) *offp = cur.off;
+    return 0;
+}
+
+static int dt_parse_props(dt_node_t *node, int depth, int (*cb_prop)(void*, dt_node_t*, int, const char*, void*, size_t), void *cbp_arg)
+{
     size_t off = sizeof(dt_node_t);
     for(size_t i = 0, max = node->nprop; i < max; ++i)
     {
-        if(size < off + sizeof(dt_prop_t)) return -1;
-        dt_prop_t *prop = (dt_prop_t*)((uintptr_t)mem + off);
+        dt_prop_t *prop = (dt_prop_t*)((uintptr_t)node + off);
         size_t l = prop->len & 0xffffff;
         off += sizeof(dt_prop_t) + ((l + 0x3) & ~0x3);
-        if(size < off) return -1;
-    }
-    for(size_t i = 0, max = node->nchld; i < max; ++i)
-    {
-        size_t add = 0;
-        int r = dt_check((void*)((uintptr_t)mem + off), size - off, &add);
+        int r = cb_prop(cbp_arg, node, depth, prop->key, prop->val, l);
         if(r != 0) return r;
-        off += add;
     }
-    if(offp) *offp = off;
     return 0;
 }
 
 int dt_parse(dt_node_t *node, int depth, size_t *offp, int (*cb_node)(void*, dt_node_t*, int), void *cbn_arg, int (*cb_prop)(void*, dt_node_t*, int, const char*, void*, size_t), void *cbp_arg)
 {
-    if(cb_node)
+    // Negative depth means just this node, not its children.
+    if(depth < 0)
     {
-        int r = cb_node(cbn_arg, node, depth);
-        if(r != 0) return r;
+        int r = cb_node ? cb_node(cbn_arg, node, depth) : 0;
+        if(r == 0 && cb_prop) r = dt_parse_props(node, depth, cb_prop, cbp_arg);
+        return r;
     }
-    if(depth >= 0 || cb_prop)
+    dt_cursor_t cur;
+    dt_cursor_init(&cur, node, 0);
+    for(dt_node_t *n; (n = dt_cursor_next(&cur)) != NULL; )
     {
-        size_t off = sizeof(dt_node_t);
-        for(size_t i = 0, max = node->nprop; i < max; ++i)
+        if(cb_node)
         {
-            dt_prop_t *prop = (dt_prop_t*)((uintptr_t)node + off);
-            size_t l = prop->len & 0xffffff;
-            off += sizeof(dt_prop_t) + ((l + 0x3) & ~0x3);
-            if(cb_prop)
-            {
-                int r = cb_prop(cbp_arg, node, depth, prop->key, prop->val, l);
-                if(r != 0) return r;
-            }
+            int r = cb_node(cbn_arg, n, depth + cur.depth);
+            if(r != 0) return r;
         }
-        if(depth >= 0)
+        if(cb_prop)
         {
-            for(size_t i = 0, max = node->nchld; i < max; ++i)
-            {
-                size_t add = 0;
-                int r = dt_parse((dt_node_t*)((uintptr_t)node + off), depth + 1, &add, cb_node, cbn_arg, cb_prop, cbp_arg);
-                if(r != 0) return r;
-                off += add;
-            }
-            if(offp) *offp = off;
+            int r = dt_parse_props(n, depth + cur.depth, cb_prop, cbp_arg);
+            if(r != 0) return r;
         }
     }
+    if(cur.err != 0) return cur.err;
+    if(offp) *offp = cur.off;
     return 0;
 }
 
-typedef struct
-{
-    const char *name;
-    dt_node_t *node;
-    int matchdepth;
-} dt_find_cb_t;
-
-static int dt_find_cb(void *a, dt_node_t *node, int depth, const char *key, void *val, size_t len)
+// Absolute paths resolve greedily, the first node matching a segment is the only one whose children are looked at.
+static dt_node_t* dt_find_path(dt_node_t *node, const char *name)
 {
-    dt_find_cb_t *arg = a;
-    if(AsciiStrCmp(key, "name") != 0)
+    dt_key_t k;
+    dt_key_init(&k, "name");
+    dt_cursor_t cur;
+    dt_cursor_init(&cur, node, 0);
+    // Don't require "/device-tree" prefix for everything.
+    dt_cursor_next(&cur);
+    int matchdepth = 1;
+    while(name[0] == '/')
     {
-        return 0;
-    }
-    const char *name = arg->name;
-    if(name[0] == '/') // Absolute path
-    {
-        // Don't require "/device-tree" prefix for everything.
-        if(depth == 0)
-        {
-            return 0;
-        }
-        // If we're in the subtree of a node we didn't match against, then ignore everything.
-        if(depth > arg->matchdepth)
-        {
-            return 0;
-        }
-        // If this condition is ever true, then we traversed back out of an entry
-        // that we matched against, without finding a matching child node.
-        if(depth < arg->matchdepth)
-        {
-            return -1;
-        }
         ++name;
         const char *end = AsciiStrStr(name, "/");
-        if(end) // Handle non-leaf segment
+        size_t size = end ? (size_t)(end - name) : AsciiStrLen(name);
+        dt_node_t *n = NULL;
+        while((n = dt_cursor_next(&cur)) != NULL && cur.depth == matchdepth)
         {
-            size_t size = end - name;
-            if(AsciiStrnCmp(name, val, size) == 0 && size + 1 == len && ((const char*)val)[size] == '\0')
-            {
-                arg->name = end;
-                arg->matchdepth = depth + 1;
-            }
-            return 0;
+            if(dt_node_name_eq(n, &k, name, size)) break;
+            dt_cursor_skip(&cur);
         }
-        // Leaf segment can fall through
+        // Walked back out of the last match without finding the segment.
+        if(!n || cur.depth != matchdepth) return NULL;
+        if(!end) return n;
+        name = end;
+        ++matchdepth;
     }
-    // Simple name
-    if(AsciiStrnCmp(name, val, len) == 0 && AsciiStrLen(name) + 1 == len)
-    {
-        arg->node = node;
-        return 1;
-    }
-    return 0;
+    return NULL;
 }
 
 dt_node_t* dt_find(dt_node_t *node, const char *name)
 {
-    dt_find_cb_t arg = { name, NULL, 1 };
-    dt_parse(node, 0, NULL, NULL, NULL, &dt_find_cb, &arg);
-    return arg.node;
-}
-
-typedef struct
-{
-    const char *key;
-    void *val;
-    size_t len;
-} dt_prop_cb_t;
-
-static int dt_prop_cb(void *a, dt_node_t *node, int depth, const char *key, void *val, size_t len)
-{
-    dt_prop_cb_t *arg = a;
-    if(AsciiStrnCmp(arg->key, key, DT_KEY_LEN) == 0)
+    dt_index_t *idx = dt_index_get();
+    uint32_t i = dt_index_find(idx, node);
+    if(i != DT_INDEX_NONE)
     {
-        arg->val = val;
-        arg->len = len;
-        return 1;
+        return dt_index_node(idx, dt_index_lookup(idx, i, name));
     }
-    return 0;
+    if(name[0] == '/') return dt_find_path(node, name);
+    dt_cursor_t cur;
+    dt_cursor_init(&cur, node, 0);
+    return dt_cursor_find(&cur, name);
 }
 
 void* dt_prop(dt_node_t *node, const char *key, size_t *lenp)
 {
-    dt_prop_cb_t arg = { key, NULL, 0 };
-    dt_parse(node, -1, NULL, NULL, NULL, &dt_prop_cb, &arg);
-    if(arg.val && lenp) *lenp = arg.len;
-    return arg.val;
+    dt_key_t k;
+    dt_key_init(&k, key);
+    dt_prop_t *prop = NULL;
+    dt_index_t *idx = NULL;
+    uint32_t i = DT_INDEX_NONE;
+    // Big nodes (pmgr, aic, apcie...) go through the sorted per-node directory.
+    if(node->nprop >= DT_PROP_DIR_MIN)
+    {
+        idx = dt_index_get();
+        i = dt_index_find(idx, node);
+    }
+    if(i != DT_INDEX_NONE)
+    {
+        prop = dt_index_prop_find(idx, i, &k);
+    }
+    else
+    {
+        prop = dt_prop_scan(node, &k);
+    }
+    if(!prop) return NULL;
+    if(lenp) *lenp = prop->len & 0xffffff;
+    return prop->val;
 }
 
 
@@ -276,49 +359,29 @@ dt_node_t* dt_node(dt_node_t *node, const char *name)
     return dev;
 }
 
-typedef struct
-{
-    dt_node_t *path[8];
-    dt_node_t *target;
-    dt_node_t *parent;
-} dt_node_parent_cb_t;
-
-static int dt_node_parent_cb(void *a, dt_node_t *node, int depth)
+dt_node_t* dt_node_parent(dt_node_t *node)
 {
-    dt_node_parent_cb_t *arg = a;
-    if(node == arg->target)
+    // The index only records structure and offsets, values are still read from the DeviceTree itself,
+    // so clients modifying DeviceTree values in place doesn't invalidate it.
+    dt_index_t *idx = dt_index_get();
+    uint32_t i = dt_index_find(idx, node);
+    if(i != DT_INDEX_NONE)
     {
-        if(depth < 1)
-        {
-            DEBUG((DEBUG_INFO, "DeviceTree parent depth underflow: %d\n", depth));
-        }
-        arg->parent = arg->path[depth - 1];
-        return 1;
+        return dt_index_node(idx, dt_index_nodes(idx)[i].parent);
     }
-    if(depth < 0 || depth >= 8)
+    // Not indexed (no memory for the index yet, or not part of the ADT), walk the tree again to find the parent.
+    dt_cursor_t cur;
+    dt_cursor_init(&cur, dt_root(), 0);
+    for(dt_node_t *n; (n = dt_cursor_next(&cur)) != NULL; )
     {
-        DEBUG((DEBUG_INFO, "DeviceTree parent depth out of bunds: %d\n", depth));
+        if(n == node) return cur.depth > 0 ? cur.path[cur.depth - 1] : NULL;
     }
-    arg->path[depth] = node;
-    return 0;
-}
-
-dt_node_t* dt_node_parent(dt_node_t *node)
-{
-    // Parsing the tree again just to find the parent node is really ugly and inefficient, but for now we're stuck with this.
-    // Ideally we'd parse the DeviceTree entirely into heap memory, so we can:
-    // a) traverse it faster and in either direction
-    // b) overwrite/relocate the original DeviceTree in memory (e.g. for loading a bigger kernel)
-    // The problem is that we currently allow clients to directly modify DeviceTree velues and we will need that
-    // in one form or another regardless, so we'd have to think about how to design such a writeback.
-    dt_node_parent_cb_t arg = { .target = node };
-    dt_parse((dt_node_t*)FixedPcdGet64(PcdAdtPointer), 0, NULL, &dt_node_parent_cb, &arg, NULL, NULL);
-    return arg.parent;
+    return NULL;
 }
 
 dt_node_t* dt_get(const char *name)
 {
-    return dt_node((dt_node_t*)FixedPcdGet64(PcdAdtPointer), name);
+    return dt_node(dt_root(), name);
 }
 
 void* dt_node_prop(dt_node_t *node, const char *prop, size_t *size)
@@ -370,6 +433,112 @@ uint64_t dt_get_u64(const char *device, const char *prop, uint32_t idx)
     return dt_node_u64(dt_get(device), prop, idx);
 }
 
+// Keys handled per pass over a small node's property list, more than that takes another pass.
+#define DT_PROPS_BATCH 16
+
+uint32_t dt_node_props(dt_node_t *node, const char * const *keys, void **vals, size_t *lens, uint32_t count)
+{
+    uint32_t found = 0;
+    for(uint32_t n = 0; n < count; ++n)
+    {
+        vals[n] = NULL;
+        if(lens) lens[n] = 0;
+    }
+    if(!node) return 0;
+
+    dt_index_t *idx = NULL;
+    uint32_t i = DT_INDEX_NONE;
+    if(node->nprop >= DT_PROP_DIR_MIN)
+    {
+        idx = dt_index_get();
+        i = dt_index_find(idx, node);
+    }
+    dt_key_t k[DT_PROPS_BATCH];
+    for(uint32_t base = 0; base < count; base += DT_PROPS_BATCH)
+    {
+        uint32_t nkey = count - base < DT_PROPS_BATCH ? count - base : DT_PROPS_BATCH;
+        for(uint32_t n = 0; n < nkey; ++n)
+        {
+            dt_key_init(&k[n], keys[base + n]);
+        }
+        if(i != DT_INDEX_NONE)
+        {
+            // Big nodes have a directory, a lookup per key beats walking all of their properties.
+            for(uint32_t n = 0; n < nkey; ++n)
+            {
+                dt_prop_t *prop = dt_index_prop_find(idx, i, &k[n]);
+                if(!prop) continue;
+                vals[base + n] = prop->val;
+                if(lens) lens[base + n] = prop->len & 0xffffff;
+                ++found;
+            }
+            continue;
+        }
+        uint32_t left = nkey;
+        size_t off = sizeof(dt_node_t);
+        for(size_t p = 0, max = node->nprop; p < max && left > 0; ++p)
+        {
+            dt_prop_t *prop = (dt_prop_t*)((uintptr_t)node + off);
+            for(uint32_t n = 0; n < nkey; ++n)
+            {
+                // First match wins, same as dt_prop().
+                if(vals[base + n] || !dt_key_eq(&k[n], prop->key)) continue;
+                vals[base + n] = prop->val;
+                if(lens) lens[base + n] = prop->len & 0xffffff;
+                ++found;
+                --left;
+            }
+            off += sizeof(dt_prop_t) + (((prop->len & 0xffffff) + 0x3) & ~0x3);
+        }
+    }
+    return found;
+}
+
+int dt_node_props_decode(dt_node_t *node, const dt_prop_desc_t *desc, uint32_t count)
+{
+    int ret = 0;
+    for(uint32_t base = 0; base < count; base += DT_PROPS_BATCH)
+    {
+        uint32_t nkey = count - base < DT_PROPS_BATCH ? count - base : DT_PROPS_BATCH;
+        const char *keys[DT_PROPS_BATCH];
+        void *vals[DT_PROPS_BATCH];
+        size_t lens[DT_PROPS_BATCH];
+        for(uint32_t n = 0; n < nkey; ++n)
+        {
+            keys[n] = desc[base + n].key;
+        }
+        dt_node_props(node, keys, vals, lens, nkey);
+        for(uint32_t n = 0; n < nkey; ++n)
+        {
+            const dt_prop_desc_t *d = &desc[base + n];
+            const uint32_t *cell = vals[n];
+            size_t size = d->type == DT_PROP_U64 ? sizeof(uint64_t) : sizeof(uint32_t);
+            if(!cell || lens[n] < d->count * size)
+            {
+                if(!(d->flags & DT_PROP_OPTIONAL))
+                {
+                    DEBUG((DEBUG_INFO, "Missing DeviceTree prop: %a\n", d->key));
+                    ret = -1;
+                }
+                continue;
+            }
+            for(uint32_t c = 0; c < d->count; ++c)
+            {
+                // Values are only 4-byte aligned, so u64s are put together from two aligned loads.
+                if(d->type == DT_PROP_U64)
+                {
+                    ((uint64_t*)d->out)[c] = (uint64_t)cell[2 * c] | ((uint64_t)cell[2 * c + 1] << 32);
+                }
+                else
+                {
+                    ((uint32_t*)d->out)[c] = cell[c];
+                }
+            }
+        }
+    }
+    return ret;
+}
+
 void* dt_get_prop_32(const char *device, const char *prop, uint32_t *size) __asm__("_dt_get_prop$32");
 void* dt_get_prop_32(const char *device, const char *prop, uint32_t *size)
 {
@@ -379,61 +548,131 @@ void* dt_get_prop_32(const char *device, const char *prop, uint32_t *size)
     return val;
 }
 
-//borrowed from m1n1
-int dt_node_reg(dt_node_t *node, uint32_t idx, uint64_t *paddr, uint64_t *psize)
+// Decoded "#address-cells"/"#size-cells"/"ranges" of a node, i.e. what it looks like as a bus to its children.
+#define DT_CELLS_NONE 0xff
+
+// One "ranges" entry of a bus, with the parent address already translated all the way up to the CPU.
+typedef struct
 {
-    dt_node_t *parent = dt_node_parent(node);
-    dt_node_t *cur = node;
+    uint64_t c_addr;
+    uint64_t c_size;
+    uint64_t cpu_addr;
+    // every window inside [c_addr, c_addr + c_size) lands at the same offset from cpu_addr, otherwise walk
+    bool linear;
+} dt_bus_range_t;
 
-    uint32_t a_cells = dt_node_u32(parent, "#address-cells", 0);
-    uint32_t s_cells = dt_node_u32(parent, "#size-cells", 0);
+typedef struct
+{
+    dt_node_t *node;
+    dt_node_t *parent;
+    const uint32_t *ranges;
+    size_t ranges_len;
+    // bus to CPU ranges in "ranges" order, NULL if they didn't fit in g_dt_bus_ranges or the cells are bad
+    dt_bus_range_t *cpu_ranges;
+    uint32_t cpu_range_cnt;
+    uint8_t a_cells;
+    uint8_t s_cells;
+} dt_bus_t;
+
+// Both caches are keyed by pointer and never invalidated, "reg"/"ranges" don't get rewritten after boot.
+// Bus entries are never evicted either, so pointers into g_dt_bus stay valid, once it's full buses are decoded on the stack.
+#define DT_BUS_CACHE_SIZE 32
+#define DT_BUS_RANGE_POOL 128
+#define DT_REG_CACHE_SIZE 64
 
-    if (a_cells < 1 || a_cells > 2 || s_cells > 2)
-    {
-        DEBUG((DEBUG_ERROR, "bad n-cells\n"));
-        return 1;
-    }
+typedef struct
+{
+    dt_node_t *node;
+    uint32_t idx;
+    uint64_t addr;
+    uint64_t size;
+} dt_reg_cache_t;
 
-    size_t reg_len = 0;
-    const uint32_t *reg = dt_node_prop(node, "reg", &reg_len);
+static dt_bus_t g_dt_bus[DT_BUS_CACHE_SIZE];
+static dt_bus_range_t g_dt_bus_ranges[DT_BUS_RANGE_POOL];
+static uint32_t g_dt_bus_ranges_used;
+static dt_reg_cache_t g_dt_reg[DT_REG_CACHE_SIZE];
 
-    if (!reg || !reg_len)
-    {
-        DEBUG((DEBUG_ERROR, "reg not found or empty\n"));
-        return 1;
-    }
+void dt_cache_flush(void)
+{
+    ZeroMem(g_dt_bus, sizeof(g_dt_bus));
+    ZeroMem(g_dt_bus_ranges, sizeof(g_dt_bus_ranges));
+    g_dt_bus_ranges_used = 0;
+    ZeroMem(g_dt_reg, sizeof(g_dt_reg));
+}
+
+static uint8_t dt_bus_cells(dt_node_t *node, const char *prop)
+{
+    size_t len = 0;
+    uint32_t *val = dt_prop(node, prop, &len);
+    return val && len >= sizeof(*val) && *val < DT_CELLS_NONE ? (uint8_t)*val : DT_CELLS_NONE;
+}
+
+static void dt_bus_decode(dt_bus_t *bus, dt_node_t *node)
+{
+    bus->node          = node;
+    bus->parent        = dt_node_parent(node);
+    bus->a_cells       = dt_bus_cells(node, "#address-cells");
+    bus->s_cells       = dt_bus_cells(node, "#size-cells");
+    bus->ranges_len    = 0;
+    bus->ranges        = dt_prop(node, "ranges", &bus->ranges_len);
+    bus->cpu_ranges    = NULL;
+    bus->cpu_range_cnt = 0;
+}
+
+static void dt_bus_flatten(dt_bus_t *bus);
 
-    if (reg_len < (idx + 1) * (a_cells + s_cells) * 4)
+// Returns the cached bus for node, or decodes it into *tmp when the cache is full.
+static const dt_bus_t* dt_bus_get(dt_node_t *node, dt_bus_t *tmp)
+{
+    if(!node) return NULL;
+    uint32_t slot = ((uintptr_t)node >> 2) % DT_BUS_CACHE_SIZE;
+    for(uint32_t i = 0; i < DT_BUS_CACHE_SIZE; ++i)
     {
-        DEBUG((DEBUG_ERROR, "bad reg property length %d\n", reg_len));
-        return 1;
+        dt_bus_t *bus = &g_dt_bus[(slot + i) % DT_BUS_CACHE_SIZE];
+        if(bus->node == node) return bus;
+        if(!bus->node)
+        {
+            // claim the slot before flattening, that looks up (and may cache) the parent buses
+            dt_bus_decode(bus, node);
+            dt_bus_flatten(bus);
+            return bus;
+        }
     }
+    dt_bus_decode(tmp, node);
+    return tmp;
+}
 
-    reg += idx * (a_cells + s_cells);
+static dt_reg_cache_t* dt_reg_cache_slot(dt_node_t *node, uint32_t idx)
+{
+    return &g_dt_reg[(((uintptr_t)node >> 2) * 31 + idx) % DT_REG_CACHE_SIZE];
+}
 
-    uint64_t addr, size = 0;
-    get_cells(&addr, &reg, a_cells);
-    get_cells(&size, &reg, s_cells);
+//borrowed from m1n1, walks the "ranges" of every bus up to the root
+static int dt_reg_walk(const dt_bus_t *bus, uint64_t *paddr, uint64_t size)
+{
+    // buses are copied, a cache miss further up may decode into the same buffer
+    dt_bus_t cur = *bus, tmp;
+    uint32_t a_cells = cur.a_cells;
+    uint32_t s_cells = cur.s_cells;
+    uint64_t addr = *paddr;
 
-    while (parent)
+    while (true)
     {
-        cur = parent;
-        parent = dt_node_parent(cur);
-
-        size_t ranges_len;
-        const uint32_t *ranges = dt_node_prop(cur, "ranges", &ranges_len);
+        const uint32_t *ranges = cur.ranges;
         if (!ranges)
             break;
 
-        uint32_t pa_cells = dt_node_u32(parent, "#address-cells", 0);
+        const dt_bus_t *parent = dt_bus_get(cur.parent, &tmp);
+        uint32_t pa_cells = parent ? parent->a_cells : DT_CELLS_NONE;
 
         if (pa_cells < 1 || pa_cells > 2 || s_cells > 2)
         {
-            DEBUG((DEBUG_ERROR, "bad reg property length %d\n", reg_len));
+            DEBUG((DEBUG_ERROR, "bad n-cells in ranges\n"));
             return 1;
         }
 
-        int range_cnt = ranges_len / (4 * (pa_cells + a_cells + s_cells));
+        int range_cnt = cur.ranges_len / (4 * (pa_cells + a_cells + s_cells));
 
         while (range_cnt--)
         {
@@ -442,26 +681,204 @@ int dt_node_reg(dt_node_t *node, uint32_t idx, uint64_t *paddr, uint64_t *psize)
             get_cells(&p_addr, &ranges, pa_cells);
             get_cells(&c_size, &ranges, s_cells);
 
-            //dprintf(" ranges %lx %lx %lx\n", c_addr, p_addr, c_size);
-
             if (addr >= c_addr && (addr + size) <= (c_addr + c_size)) {
-                //dprintf(" translate %lx", addr);
                 addr = addr - c_addr + p_addr;
-                //dprintf(" -> %lx\n", addr);
                 break;
             }
         }
 
-        s_cells = dt_node_u32(parent, "#size-cells", 0);
-
+        s_cells = parent->s_cells;
         a_cells = pa_cells;
+        cur = *parent;
+    }
+
+    *paddr = addr;
+    return 0;
+}
+
+// First bus to CPU range that holds the whole window, or NULL if the window has to go through dt_reg_walk.
+static const dt_bus_range_t* dt_bus_range_find(const dt_bus_t *bus, uint64_t addr, uint64_t size)
+{
+    for (uint32_t i = 0; i < bus->cpu_range_cnt; i++)
+    {
+        const dt_bus_range_t *r = &bus->cpu_ranges[i];
+        if (addr >= r->c_addr && (addr + size) <= (r->c_addr + r->c_size))
+            return r->linear ? r : NULL;
+    }
+    return NULL;
+}
+
+static int dt_reg_translate(const dt_bus_t *bus, uint64_t *paddr, uint64_t size)
+{
+    if (!bus->ranges)
+        return 0;
+
+    const dt_bus_range_t *r = dt_bus_range_find(bus, *paddr, size);
+    if (r)
+    {
+        *paddr = *paddr - r->c_addr + r->cpu_addr;
+        return 0;
     }
+    return dt_reg_walk(bus, paddr, size);
+}
+
+// Decodes "ranges" once and composes every entry with the buses above it, so translating a reg is one lookup.
+static void dt_bus_flatten(dt_bus_t *bus)
+{
+    if (!bus->ranges)
+        return;
+
+    dt_bus_t tmp;
+    const dt_bus_t *parent = dt_bus_get(bus->parent, &tmp);
+    uint32_t a_cells = bus->a_cells;
+    uint32_t s_cells = bus->s_cells;
+    uint32_t pa_cells = parent ? parent->a_cells : DT_CELLS_NONE;
+
+    // left for dt_reg_walk to report
+    if (a_cells < 1 || a_cells > 2 || pa_cells < 1 || pa_cells > 2 || s_cells > 2)
+        return;
+
+    uint32_t range_cnt = bus->ranges_len / (4 * (pa_cells + a_cells + s_cells));
+    if (range_cnt > DT_BUS_RANGE_POOL - g_dt_bus_ranges_used)
+        return;
+
+    dt_bus_range_t *out = &g_dt_bus_ranges[g_dt_bus_ranges_used];
+    const uint32_t *ranges = bus->ranges;
+    for (uint32_t i = 0; i < range_cnt; i++)
+    {
+        uint64_t p_addr;
+        get_cells(&out[i].c_addr, &ranges, a_cells);
+        get_cells(&p_addr, &ranges, pa_cells);
+        get_cells(&out[i].c_size, &ranges, s_cells);
+        out[i].cpu_addr = p_addr;
+        out[i].linear   = false;
+
+        if (!parent->ranges)
+        {
+            out[i].linear = true;
+            continue;
+        }
+
+        // The parent resolves any window inside this one the same way only if the first parent range
+        // touching it holds all of it. Anything else (no match, overlaps) keeps the exact walk.
+        for (uint32_t j = 0; j < parent->cpu_range_cnt; j++)
+        {
+            const dt_bus_range_t *pr = &parent->cpu_ranges[j];
+            if (p_addr >= pr->c_addr + pr->c_size || p_addr + out[i].c_size <= pr->c_addr)
+                continue;
+            if (pr->linear && p_addr >= pr->c_addr && p_addr + out[i].c_size <= pr->c_addr + pr->c_size)
+            {
+                out[i].cpu_addr = p_addr - pr->c_addr + pr->cpu_addr;
+                out[i].linear   = true;
+            }
+            break;
+        }
+    }
+
+    g_dt_bus_ranges_used += range_cnt;
+    bus->cpu_ranges    = out;
+    bus->cpu_range_cnt = range_cnt;
+}
+
+int dt_node_regs(dt_node_t *node, struct memmap *regs, uint32_t max)
+{
+    dt_bus_t tmp;
+    const dt_bus_t *parent = dt_bus_get(dt_node_parent(node), &tmp);
+    if (!parent)
+    {
+        DEBUG((DEBUG_ERROR, "reg on a node without parent\n"));
+        return -1;
+    }
+
+    uint32_t a_cells = parent->a_cells;
+    uint32_t s_cells = parent->s_cells;
+
+    if (a_cells < 1 || a_cells > 2 || s_cells > 2)
+    {
+        DEBUG((DEBUG_ERROR, "bad n-cells\n"));
+        return -1;
+    }
+
+    size_t reg_len = 0;
+    const uint32_t *reg = dt_node_prop(node, "reg", &reg_len);
+
+    if (!reg || !reg_len)
+    {
+        DEBUG((DEBUG_ERROR, "reg not found or empty\n"));
+        return -1;
+    }
+
+    uint32_t count = reg_len / ((a_cells + s_cells) * 4);
+    for (uint32_t i = 0; i < count && i < max; i++)
+    {
+        uint64_t addr, size = 0;
+        get_cells(&addr, &reg, a_cells);
+        get_cells(&size, &reg, s_cells);
+        if (dt_reg_translate(parent, &addr, size) != 0)
+            return -1;
+
+        regs[i].addr = addr;
+        regs[i].size = size;
+
+        dt_reg_cache_t *slot = dt_reg_cache_slot(node, i);
+        slot->node = node;
+        slot->idx  = i;
+        slot->addr = addr;
+        slot->size = size;
+    }
+
+    return count;
+}
+
+int dt_node_reg(dt_node_t *node, uint32_t idx, uint64_t *paddr, uint64_t *psize)
+{
+    dt_reg_cache_t *slot = dt_reg_cache_slot(node, idx);
+    if (!node || slot->node != node || slot->idx != idx)
+    {
+        dt_bus_t tmp;
+        const dt_bus_t *parent = dt_bus_get(dt_node_parent(node), &tmp);
+        uint32_t a_cells = parent ? parent->a_cells : DT_CELLS_NONE;
+        uint32_t s_cells = parent ? parent->s_cells : DT_CELLS_NONE;
+
+        if (a_cells < 1 || a_cells > 2 || s_cells > 2)
+        {
+            DEBUG((DEBUG_ERROR, "bad n-cells\n"));
+            return 1;
+        }
+
+        size_t reg_len = 0;
+        const uint32_t *reg = dt_node_prop(node, "reg", &reg_len);
+
+        if (!reg || !reg_len)
+        {
+            DEBUG((DEBUG_ERROR, "reg not found or empty\n"));
+            return 1;
+        }
+
+        if (reg_len < (idx + 1) * (a_cells + s_cells) * 4)
+        {
+            DEBUG((DEBUG_ERROR, "bad reg property length %d\n", reg_len));
+            return 1;
+        }
+
+        reg += idx * (a_cells + s_cells);
 
+        uint64_t addr, size = 0;
+        get_cells(&addr, &reg, a_cells);
+        get_cells(&size, &reg, s_cells);
+        if (dt_reg_translate(parent, &addr, size) != 0)
+            return 1;
+
+        slot->node = node;
+        slot->idx  = idx;
+        slot->addr = addr;
+        slot->size = size;
+    }
 
     if (paddr)
-        *paddr = addr;
+        *paddr = slot->addr;
     if (psize)
-        *psize = size;
+        *psize = slot->size;
 
     return 0;
-}
\ No newline at end of file
+}
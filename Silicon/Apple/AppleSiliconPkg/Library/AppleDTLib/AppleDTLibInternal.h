@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2024, AppleWOA authors.
+ *
+ * Module Name:
+ *     AppleDTLibInternal.h
+ *
+ * Abstract:
+ *     Definitions shared between the AppleDTLib source files, not meant for library users.
+ *
+ * License:
+ *     SPDX-License-Identifier: MIT
+ */
+#ifndef APPLEDTLIB_INTERNAL_H
+#define APPLEDTLIB_INTERNAL_H
+
+#include <Library/AppleDTLib.h>
+
+#define DT_INDEX_MAGIC 0x58444e49 // "INDX"
+
+// Nodes with fewer properties than this are scanned linearly, it's cheaper than finding them in the index.
+#define DT_PROP_DIR_MIN 8
+
+// FNV-1a, good enough for a few thousand short node names and cheap with the MMU off.
+#define DT_HASH_INIT  0x811c9dc5U
+#define DT_HASH_PRIME 0x01000193U
+
+static inline uint32_t dt_hash(uint32_t h, const char *str, size_t len)
+{
+    for(size_t i = 0; i < len; ++i)
+    {
+        h = (h ^ (uint8_t)str[i]) * DT_HASH_PRIME;
+    }
+    return h;
+}
+
+/*
+ * Property keys are fixed DT_KEY_LEN byte fields, so a query key gets padded once and then
+ * compared against them one aligned 32-bit word at a time. Wider loads aren't an option:
+ * keys are only 4-byte aligned and we get called with the MMU (and thus unaligned access) off.
+ * Only bytes up to and including the terminator are compared, same as AsciiStrnCmp().
+ */
+typedef struct
+{
+    uint32_t w[DT_KEY_LEN / sizeof(uint32_t)];
+    uint32_t nword;     // words compared in full
+    uint32_t mask;      // significant bytes of w[nword], if nword is in range
+    uint32_t hash;
+} dt_key_t;
+
+static inline void dt_key_init(dt_key_t *k, const char *key)
+{
+    uint8_t *b = (uint8_t*)k->w;
+    uint8_t *m = (uint8_t*)&k->mask;
+    size_t len = 0;
+    while(len < DT_KEY_LEN && key[len] != '\0') ++len;
+    for(size_t i = 0; i < DT_KEY_LEN; ++i)
+    {
+        b[i] = i < len ? (uint8_t)key[i] : 0;
+    }
+    k->nword = (uint32_t)(len / sizeof(uint32_t));
+    k->mask = 0;
+    for(size_t i = 0; i <= len % sizeof(uint32_t); ++i)
+    {
+        m[i] = 0xff;
+    }
+    k->hash = dt_hash(DT_HASH_INIT, key, len);
+}
+
+static inline int dt_key_eq(const dt_key_t *k, const char *key)
+{
+    const uint32_t *p = (const uint32_t*)key;
+    for(uint32_t i = 0; i < k->nword; ++i)
+    {
+        if(p[i] != k->w[i]) return 0;
+    }
+    return k->nword >= DT_KEY_LEN / sizeof(uint32_t) || ((p[k->nword] ^ k->w[k->nword]) & k->mask) == 0;
+}
+
+static inline uint32_t dt_key_hash(const char *key)
+{
+    size_t len = 0;
+    while(len < DT_KEY_LEN && key[len] != '\0') ++len;
+    return dt_hash(DT_HASH_INIT, key, len);
+}
+
+static inline dt_index_node_t* dt_index_nodes(dt_index_t *idx)
+{
+    return (dt_index_node_t*)((uintptr_t)idx + idx->node_off);
+}
+
+static inline uint32_t* dt_index_props(dt_index_t *idx)
+{
+    return (uint32_t*)((uintptr_t)idx + idx->prop_off);
+}
+
+static inline dt_index_hash_t* dt_index_names(dt_index_t *idx)
+{
+    return (dt_index_hash_t*)((uintptr_t)idx + idx->name_off);
+}
+
+static inline dt_index_hash_t* dt_index_paths(dt_index_t *idx)
+{
+    return (dt_index_hash_t*)((uintptr_t)idx + idx->path_off);
+}
+
+static inline dt_index_key_t* dt_index_dir(dt_index_t *idx)
+{
+    return (dt_index_key_t*)((uintptr_t)idx + idx->dir_off);
+}
+
+static inline dt_prop_t* dt_index_prop(dt_index_t *idx, uint32_t p)
+{
+    return (dt_prop_t*)((uintptr_t)idx->base + dt_index_props(idx)[p]);
+}
+
+static inline int dt_index_contains(dt_index_t *idx, const void *ptr)
+{
+    return (uintptr_t)ptr >= (uintptr_t)idx->base && (uintptr_t)ptr < (uintptr_t)idx->base + idx->dt_size;
+}
+
+dt_prop_t* dt_index_prop_find(dt_index_t *idx, uint32_t i, const dt_key_t *k);
+
+// Point the global index (and thus every lookup) at another tree, returns the one that was in use.
+// Only for the host unit tests, nothing else may run while it's swapped.
+dt_index_t* dt_index_swap(dt_index_t *idx);
+// Root node of the tree lookups without a starting node go through.
+dt_node_t* dt_root(void);
+// Drop the bus and reg caches.
+void dt_cache_flush(void);
+
+#endif /* APPLEDTLIB_INTERNAL_H */
@@ -0,0 +1,322 @@
+/*
+ * Copyright (c) 2024, AppleWOA authors.
+ *
+ * Module Name:
+ *     AppleDTBench.c
+ *
+ * Abstract:
+ *     Self-test and benchmark for the DeviceTree lookups.
+ *
+ *     Every node of a tree is looked up through the public API and through a plain reference
+ *     walk that doesn't use the index or any cache, the results are compared and the time spent
+ *     on both sides is logged. The API is timed in a second pass of its own, so the reference
+ *     walks don't leave it with cold caches. Only built into the host unit tests (AppleDTLibHostTest.c), which
+ *     run it over fixture trees, so that lookup changes come with a number and a correctness check.
+ *
+ * License:
+ *     SPDX-License-Identifier: MIT
+ */
+
+#include <Base.h>
+#include <Library/BaseLib.h>
+#include <Library/DebugLib.h>
+#include <Library/TimerLib.h>
+#include <Library/AppleDTLib.h>
+
+#include "AppleDTBench.h"
+
+static const char *g_dt_bench_name[DT_BENCH_MAX] =
+{
+    [DT_BENCH_GET]    = "dt_get",
+    [DT_BENCH_PROP]   = "dt_node_prop",
+    [DT_BENCH_PARENT] = "dt_node_parent",
+    [DT_BENCH_REG]    = "dt_node_reg",
+};
+
+typedef struct
+{
+    uint64_t ticks;     // API calls, timed on their own
+    uint64_t ref_ticks;
+    uint32_t calls;     // checked against the reference
+    uint32_t timed;
+    uint32_t bad;
+} dt_bench_t;
+
+// ========== Reference ==========
+
+// What dt_prop() used to be: compare every key, first match wins.
+static void* dt_ref_prop(dt_node_t *node, const char *key, size_t *lenp)
+{
+    size_t off = sizeof(dt_node_t);
+    for(size_t i = 0, max = node->nprop; i < max; ++i)
+    {
+        dt_prop_t *prop = (dt_prop_t*)((uintptr_t)node + off);
+        size_t l = prop->len & 0xffffff;
+        if(AsciiStrnCmp(key, prop->key, DT_KEY_LEN) == 0)
+        {
+            if(lenp) *lenp = l;
+            return prop->val;
+        }
+        off += sizeof(dt_prop_t) + ((l + 0x3) & ~0x3);
+    }
+    return NULL;
+}
+
+static dt_node_t* dt_ref_find(dt_node_t *root, const char *name)
+{
+    size_t size = AsciiStrLen(name);
+    dt_cursor_t cur;
+    dt_cursor_init(&cur, root, 0);
+    for(dt_node_t *node; (node = dt_cursor_next(&cur)) != NULL; )
+    {
+        size_t len = 0;
+        const char *val = dt_ref_prop(node, "name", &len);
+        if(val && len == size + 1 && AsciiStrnCmp(name, val, len) == 0) return node;
+    }
+    return NULL;
+}
+
+static dt_node_t* dt_ref_parent(dt_node_t *root, dt_node_t *target)
+{
+    dt_cursor_t cur;
+    dt_cursor_init(&cur, root, 0);
+    for(dt_node_t *node; (node = dt_cursor_next(&cur)) != NULL; )
+    {
+        if(node == target) return cur.depth > 0 ? cur.path[cur.depth - 1] : NULL;
+    }
+    return NULL;
+}
+
+static int dt_ref_u32(dt_node_t *node, const char *key, uint32_t *val)
+{
+    size_t len = 0;
+    uint32_t *p = node ? dt_ref_prop(node, key, &len) : NULL;
+    if(!p || len < sizeof(*p)) return -1;
+    *val = *p;
+    return 0;
+}
+
+static uint64_t dt_ref_cells(const uint32_t **src, uint32_t cells)
+{
+    uint64_t val = 0;
+    for(uint32_t i = 0; i < cells; i++)
+        val |= ((uint64_t)*((*src)++)) << (32 * i);
+    return val;
+}
+
+// The m1n1 translation dt_node_reg() started out as, one parent walk per call.
+static int dt_ref_reg(dt_node_t *root, dt_node_t *node, uint32_t idx, uint64_t *paddr, uint64_t *psize)
+{
+    dt_node_t *parent = dt_ref_parent(root, node);
+    uint32_t a_cells, s_cells;
+    if (dt_ref_u32(parent, "#address-cells", &a_cells) != 0 || dt_ref_u32(parent, "#size-cells", &s_cells) != 0)
+        return 1;
+    if (a_cells < 1 || a_cells > 2 || s_cells > 2)
+        return 1;
+
+    size_t reg_len = 0;
+    const uint32_t *reg = dt_ref_prop(node, "reg", &reg_len);
+    if (!reg || reg_len < (idx + 1) * (a_cells + s_cells) * 4)
+        return 1;
+
+    reg += idx * (a_cells + s_cells);
+    uint64_t addr = dt_ref_cells(&reg, a_cells);
+    uint64_t size = dt_ref_cells(&reg, s_cells);
+
+    while (parent)
+    {
+        dt_node_t *cur = parent;
+        parent = dt_ref_parent(root, cur);
+
+        size_t ranges_len = 0;
+        const uint32_t *ranges = dt_ref_prop(cur, "ranges", &ranges_len);
+        if (!ranges)
+            break;
+
+        uint32_t pa_cells;
+        if (dt_ref_u32(parent, "#address-cells", &pa_cells) != 0 || pa_cells < 1 || pa_cells > 2 || s_cells > 2)
+            return 1;
+
+        int range_cnt = ranges_len / (4 * (pa_cells + a_cells + s_cells));
+        while (range_cnt--)
+        {
+            uint64_t c_addr = dt_ref_cells(&ranges, a_cells);
+            uint64_t p_addr = dt_ref_cells(&ranges, pa_cells);
+            uint64_t c_size = dt_ref_cells(&ranges, s_cells);
+            if (addr >= c_addr && (addr + size) <= (c_addr + c_size)) {
+                addr = addr - c_addr + p_addr;
+                break;
+            }
+        }
+
+        if (dt_ref_u32(parent, "#size-cells", &s_cells) != 0)
+            return 1;
+        a_cells = pa_cells;
+    }
+
+    *paddr = addr;
+    *psize = size;
+    return 0;
+}
+
+// ========== Checks ==========
+
+static void dt_bench_check(dt_bench_t *b, int ok, dt_node_t *node, const char *what)
+{
+    b->calls++;
+    if(ok) return;
+    b->bad++;
+    size_t len = 0;
+    const char *name = dt_ref_prop(node, "name", &len);
+    DEBUG((DEBUG_ERROR, "DeviceTree self-test: %a mismatch on %a\n", what, name ? name : "<unnamed>"));
+}
+
+// Checks every lookup on `node` against the reference, timing only the reference.
+static void dt_bench_node(dt_bench_t *b, dt_node_t *root, dt_node_t *node)
+{
+    uint64_t t0, t1;
+
+    // Only the first node with a name is what dt_get() returns for it, but every name gets looked up.
+    size_t len = 0;
+    const char *name = dt_ref_prop(node, "name", &len);
+    if(name && len > 0 && name[len - 1] == '\0')
+    {
+        dt_node_t *got = dt_find(root, name);
+        t0 = GetPerformanceCounter();
+        dt_node_t *ref = dt_ref_find(root, name);
+        t1 = GetPerformanceCounter();
+        b[DT_BENCH_GET].ref_ticks += t1 - t0;
+        dt_bench_check(&b[DT_BENCH_GET], got == ref, node, g_dt_bench_name[DT_BENCH_GET]);
+    }
+
+    size_t off = sizeof(dt_node_t);
+    for(size_t i = 0, max = node->nprop; i < max; ++i)
+    {
+        dt_prop_t *prop = (dt_prop_t*)((uintptr_t)node + off);
+        off += sizeof(dt_prop_t) + (((prop->len & 0xffffff) + 0x3) & ~0x3);
+        // Keys aren't guaranteed to be terminated, the API can't ask for those.
+        char key[DT_KEY_LEN];
+        AsciiStrnCpyS(key, sizeof(key), prop->key, sizeof(key) - 1);
+        size_t got_len = 0, ref_len = 0;
+        void *got = dt_node_prop(node, key, &got_len);
+        t0 = GetPerformanceCounter();
+        void *ref = dt_ref_prop(node, key, &ref_len);
+        t1 = GetPerformanceCounter();
+        b[DT_BENCH_PROP].ref_ticks += t1 - t0;
+        dt_bench_check(&b[DT_BENCH_PROP], got == ref && got_len == ref_len, node, key);
+    }
+
+    dt_node_t *parent = dt_node_parent(node);
+    t0 = GetPerformanceCounter();
+    dt_node_t *ref_parent = dt_ref_parent(root, node);
+    t1 = GetPerformanceCounter();
+    b[DT_BENCH_PARENT].ref_ticks += t1 - t0;
+    dt_bench_check(&b[DT_BENCH_PARENT], parent == ref_parent, node, g_dt_bench_name[DT_BENCH_PARENT]);
+
+    // Only compare reg where the reference can decode it, the failure paths are noisy on both sides.
+    uint64_t ref_addr, ref_size;
+    for(uint32_t idx = 0; ref_parent; ++idx)
+    {
+        uint64_t addr = 0, size = 0;
+        t0 = GetPerformanceCounter();
+        int ref_r = dt_ref_reg(root, node, idx, &ref_addr, &ref_size);
+        t1 = GetPerformanceCounter();
+        if(ref_r != 0) break;
+        int r = dt_node_reg(node, idx, &addr, &size);
+        b[DT_BENCH_REG].ref_ticks += t1 - t0;
+        dt_bench_check(&b[DT_BENCH_REG], r == 0 && addr == ref_addr && size == ref_size, node, g_dt_bench_name[DT_BENCH_REG]);
+    }
+}
+
+/*
+ * Times the same lookups as dt_bench_node() without the reference walks in between, which would
+ * push the tree out of the caches before every call and make the bigger trees look slower.
+ */
+static void dt_bench_time(dt_bench_t *b, dt_node_t *root, dt_node_t *node)
+{
+    uint64_t t0, t1;
+
+    size_t len = 0;
+    const char *name = dt_ref_prop(node, "name", &len);
+    if(name && len > 0 && name[len - 1] == '\0')
+    {
+        t0 = GetPerformanceCounter();
+        dt_find(root, name);
+        t1 = GetPerformanceCounter();
+        b[DT_BENCH_GET].ticks += t1 - t0;
+        b[DT_BENCH_GET].timed++;
+    }
+
+    size_t off = sizeof(dt_node_t);
+    for(size_t i = 0, max = node->nprop; i < max; ++i)
+    {
+        dt_prop_t *prop = (dt_prop_t*)((uintptr_t)node + off);
+        off += sizeof(dt_prop_t) + (((prop->len & 0xffffff) + 0x3) & ~0x3);
+        char key[DT_KEY_LEN];
+        AsciiStrnCpyS(key, sizeof(key), prop->key, sizeof(key) - 1);
+        t0 = GetPerformanceCounter();
+        dt_node_prop(node, key, NULL);
+        t1 = GetPerformanceCounter();
+        b[DT_BENCH_PROP].ticks += t1 - t0;
+        b[DT_BENCH_PROP].timed++;
+    }
+
+    t0 = GetPerformanceCounter();
+    dt_node_t *parent = dt_node_parent(node);
+    t1 = GetPerformanceCounter();
+    b[DT_BENCH_PARENT].ticks += t1 - t0;
+    b[DT_BENCH_PARENT].timed++;
+
+    for(uint32_t idx = 0; parent; ++idx)
+    {
+        uint64_t addr, size;
+        t0 = GetPerformanceCounter();
+        int r = dt_node_reg(node, idx, &addr, &size);
+        t1 = GetPerformanceCounter();
+        if(r != 0) break;
+        b[DT_BENCH_REG].ticks += t1 - t0;
+        b[DT_BENCH_REG].timed++;
+    }
+}
+
+uint32_t dt_selftest(dt_node_t *root, dt_bench_result_t *res)
+{
+    dt_bench_t b[DT_BENCH_MAX] = { 0 };
+    uint32_t nodes = 0;
+
+    dt_cursor_t cur;
+    dt_cursor_init(&cur, root, 0);
+    for(dt_node_t *node; (node = dt_cursor_next(&cur)) != NULL; ++nodes)
+    {
+        dt_bench_node(b, root, node);
+    }
+    dt_cursor_init(&cur, root, 0);
+    for(dt_node_t *node; (node = dt_cursor_next(&cur)) != NULL; )
+    {
+        dt_bench_time(b, root, node);
+    }
+
+    uint32_t bad = 0;
+    DEBUG((DEBUG_INFO, "DeviceTree self-test: %u nodes, index %a\n", nodes, dt_index_find(dt_index_get(), root) != DT_INDEX_NONE ? "used" : "not used"));
+    for(uint32_t i = 0; i < DT_BENCH_MAX; ++i)
+    {
+        uint32_t calls = b[i].calls ? b[i].calls : 1;
+        uint32_t timed = b[i].timed ? b[i].timed : 1;
+        DEBUG((DEBUG_INFO, "  %-16a %6u calls %6u bad %8lu ns/call (reference %lu ns/call)\n",
+            g_dt_bench_name[i], b[i].calls, b[i].bad,
+            GetTimeInNanoSecond(b[i].ticks) / timed, GetTimeInNanoSecond(b[i].ref_ticks) / calls));
+        bad += b[i].bad;
+        if(res)
+        {
+            res->calls[i] = b[i].calls;
+            res->ns[i] = GetTimeInNanoSecond(b[i].ticks) / timed;
+            res->ref_ns[i] = GetTimeInNanoSecond(b[i].ref_ticks) / calls;
+        }
+    }
+    if(res)
+    {
+        res->nodes = nodes;
+        res->bad = bad;
+    }
+    return bad;
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2024, AppleWOA authors.
+ *
+ * Module Name:
+ *     AppleDTBench.h
+ *
+ * Abstract:
+ *     DeviceTree lookup self-test and benchmark for the host unit tests, see AppleDTBench.c.
+ *
+ * License:
+ *     SPDX-License-Identifier: MIT
+ */
+
+#ifndef APPLEDTBENCH_H
+#define APPLEDTBENCH_H
+
+#include <Library/AppleDTLib.h>
+
+enum
+{
+    DT_BENCH_GET,
+    DT_BENCH_PROP,
+    DT_BENCH_PARENT,
+    DT_BENCH_REG,
+    DT_BENCH_MAX,
+};
+
+// What one dt_selftest() run measured, times are averages per call.
+typedef struct
+{
+    uint32_t nodes;
+    uint32_t bad;
+    uint32_t calls[DT_BENCH_MAX];
+    uint64_t ns[DT_BENCH_MAX];
+    uint64_t ref_ns[DT_BENCH_MAX];
+} dt_bench_result_t;
+
+/*
+ * Compares dt_get(), dt_node_prop(), dt_node_parent() and dt_node_reg() against a plain
+ * reference walk for every node below `root`, and logs how long both took. Returns the number
+ * of mismatches, `res` (may be NULL) gets the numbers.
+ */
+uint32_t dt_selftest(dt_node_t *root, dt_bench_result_t *res);
+
+#endif /* APPLEDTBENCH_H */
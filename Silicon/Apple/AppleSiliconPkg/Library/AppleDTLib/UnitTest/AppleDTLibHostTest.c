@@ -0,0 +1,930 @@
+/*
+ * Copyright (c) 2024, AppleWOA authors.
+ *
+ * Module Name:
+ *     AppleDTLibHostTest.c
+ *
+ * Abstract:
+ *     Host based unit tests for the DeviceTree lookups.
+ *
+ *     The fixture is a cut down ADT laid out like the real one: arm-io with two "ranges" windows,
+ *     a nested PCIe bus with one-cell addresses below it, the cpus node with size-less "reg"s and
+ *     a bus with bad cells. It's indexed and swapped in the way PrePi would publish it, then
+ *     dt_selftest() checks every lookup against the reference walk and a few translations are
+ *     checked against the addresses worked out by hand.
+ *
+ *     A second hand-built tree carries the quirks real ADTs have: a 32-byte property key without
+ *     a terminator, a placeholder flag in the top bits of a property length, two nodes with the
+ *     same name and a chain of six nested "ranges" buses.
+ *
+ *     The capture suite runs the same check over ADTs captured from real machines (T8103, T6000,
+ *     T6002 and T8112), read from UnitTest/Fixtures or $ADT_FIXTURE_DIR, see Fixtures/README.md.
+ *     A capture that isn't there is reported as skipped.
+ *
+ *     The scaling suite runs the same check on synthetic trees (AppleDTSynth.c) of doubling size,
+ *     generated one after the other into a single buffer sized for the biggest of them. It logs a
+ *     table of the per call cost of each lookup at every size and fails if any of them grows with
+ *     the tree, which is what a lookup that walks the tree would do.
+ *
+ * License:
+ *     SPDX-License-Identifier: MIT
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <Uefi.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/DebugLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/PrintLib.h>
+#include <Library/UnitTestLib.h>
+#include <Library/AppleDTLib.h>
+
+#include "../AppleDTLibInternal.h"
+#include "AppleDTBench.h"
+#include "AppleDTSynth.h"
+
+#define UNIT_TEST_APP_NAME     "AppleDTLib Host Unit Tests"
+#define UNIT_TEST_APP_VERSION  "1.0"
+
+#define FIXTURE_SIZE  SIZE_16KB
+
+// Node count of the first synthetic tree, each step doubles it.
+#define SYNTH_NODES  1024
+#define SYNTH_STEPS  3
+
+// Lookups should cost the same per call however big the tree is. Over SYNTH_STEPS the tree grows
+// 4x, a lookup that walks the tree would get about that much slower per call.
+#define SYNTH_MAX_GROWTH  3
+// Per call times below this are mostly timer overhead, growth is measured from at least this.
+#define SYNTH_MIN_NS  50
+
+// Placeholder flag iBoot leaves in the top bits of a property length.
+#define ADT_PROP_PLACEHOLDER  BIT31
+
+typedef struct DT_FIXTURE DT_FIXTURE;
+
+typedef VOID (*DT_FIXTURE_BUILD)(
+  IN OUT DT_FIXTURE  *Fixture
+  );
+
+struct DT_FIXTURE {
+  DT_FIXTURE_BUILD    Build;
+  UINT8               *Buffer;
+  UINTN               Size;
+  UINTN               Offset;
+  dt_index_t          *Index;
+  UINTN               IndexPages;
+  dt_index_t          *OldIndex;
+};
+
+typedef struct {
+  CONST CHAR8    *File;
+  CONST CHAR8    *Soc;
+  DT_FIXTURE     Fixture;
+} DT_CAPTURE;
+
+typedef struct {
+  dt_synth_t    Shape;
+  UINT8         *Tree;
+  UINTN         TreePages;
+  dt_index_t    *Index;
+  UINTN         IndexPages;
+} DT_SYNTH;
+
+STATIC VOID
+FixtureBuild (
+  IN OUT DT_FIXTURE  *Fixture
+  );
+
+STATIC VOID
+QuirksBuild (
+  IN OUT DT_FIXTURE  *Fixture
+  );
+
+STATIC DT_FIXTURE  mFixture = { .Build = FixtureBuild };
+STATIC DT_FIXTURE  mQuirks  = { .Build = QuirksBuild };
+
+STATIC DT_CAPTURE  mCaptures[] = {
+  { "t8103.adt", "T8103" },
+  { "t6000.adt", "T6000" },
+  { "t6002.adt", "T6002" },
+  { "t8112.adt", "T8112" },
+};
+
+STATIC DT_SYNTH  mSynth = {
+  .Shape     = {
+    .nodes     = SYNTH_NODES,
+    .depth     = 3,
+    .fanout    = 4,
+    .props     = 4,
+    .prop_size = 16,
+    .seed      = 0x41444654,
+  },
+};
+
+STATIC
+VOID
+FixtureNode (
+  IN OUT DT_FIXTURE  *Fixture,
+  IN     UINT32      PropCount,
+  IN     UINT32      ChildCount
+  )
+{
+  dt_node_t  *Node;
+
+  ASSERT (Fixture->Offset + sizeof (dt_node_t) <= Fixture->Size);
+  Node             = (dt_node_t *)(Fixture->Buffer + Fixture->Offset);
+  Node->nprop      = PropCount;
+  Node->nchld      = ChildCount;
+  Fixture->Offset += sizeof (dt_node_t);
+}
+
+STATIC
+VOID
+FixtureProp (
+  IN OUT DT_FIXTURE  *Fixture,
+  IN     CONST CHAR8 *Key,
+  IN     CONST VOID  *Value,
+  IN     UINT32      Length
+  )
+{
+  dt_prop_t  *Prop;
+  UINTN      Size;
+
+  Size = sizeof (dt_prop_t) + ALIGN_VALUE (Length, 4);
+  ASSERT (Fixture->Offset + Size <= Fixture->Size);
+  Prop = (dt_prop_t *)(Fixture->Buffer + Fixture->Offset);
+  ZeroMem (Prop, Size);
+  AsciiStrnCpyS (Prop->key, sizeof (Prop->key), Key, sizeof (Prop->key) - 1);
+  Prop->len = Length;
+  CopyMem (Prop->val, Value, Length);
+  Fixture->Offset += Size;
+}
+
+/**
+  Property with up to DT_KEY_LEN bytes of key, so a full length key isn't terminated, and Flags
+  in the top bits of the length, like the ADT templates iBoot fills in.
+**/
+STATIC
+VOID
+FixturePropRaw (
+  IN OUT DT_FIXTURE  *Fixture,
+  IN     CONST CHAR8 *Key,
+  IN     CONST VOID  *Value,
+  IN     UINT32      Length,
+  IN     UINT32      Flags
+  )
+{
+  dt_prop_t  *Prop;
+  UINTN      Size;
+
+  Size = sizeof (dt_prop_t) + ALIGN_VALUE (Length, 4);
+  ASSERT (Fixture->Offset + Size <= Fixture->Size);
+  ASSERT (AsciiStrLen (Key) <= DT_KEY_LEN);
+  Prop = (dt_prop_t *)(Fixture->Buffer + Fixture->Offset);
+  ZeroMem (Prop, Size);
+  CopyMem (Prop->key, Key, AsciiStrLen (Key));
+  Prop->len = Length | Flags;
+  CopyMem (Prop->val, Value, Length);
+  Fixture->Offset += Size;
+}
+
+STATIC
+VOID
+FixtureName (
+  IN OUT DT_FIXTURE  *Fixture,
+  IN     CONST CHAR8 *Name
+  )
+{
+  FixtureProp (Fixture, "name", Name, (UINT32)AsciiStrSize (Name));
+}
+
+STATIC
+VOID
+FixtureU32 (
+  IN OUT DT_FIXTURE  *Fixture,
+  IN     CONST CHAR8 *Key,
+  IN     UINT32      Value
+  )
+{
+  FixtureProp (Fixture, Key, &Value, sizeof (Value));
+}
+
+/**
+  device-tree                 #address-cells 2, #size-cells 2
+    arm-io                    0x0 -> 0x2_0000_0000 and 0x1_0000_0000 -> 0x5_0000_0000, 4G each
+      uart0                   0x3520_0000
+      dart-usb0               0x8_2f00_0000 (not in any window), 0x3_8200_0000 (not in any window)
+      apcie                   #address-cells 1, #size-cells 1, 0x0 -> 0x1_9000_0000, 256M
+        pci-bridge0           0x10_0000
+        pci-bridge1           0x20_0000
+      bad-bus                 #address-cells 3
+        bad-dev
+    cpus                      #address-cells 1, #size-cells 0, no ranges
+      cpu0                    0x0
+      cpu1                    0x10100
+**/
+STATIC
+VOID
+FixtureBuild (
+  IN OUT DT_FIXTURE  *Fixture
+  )
+{
+  CONST UINT32  ArmIoRanges[] = {
+    0x00000000, 0x0, 0x00000000, 0x2, 0x00000000, 0x1,
+    0x00000000, 0x1, 0x00000000, 0x5, 0x00000000, 0x1,
+  };
+  CONST UINT32  UartReg[]    = { 0x35200000, 0x0, 0x4000, 0x0 };
+  CONST UINT32  DartReg[]    = { 0x2f000000, 0x8, 0x4000, 0x0, 0x82000000, 0x3, 0x4000, 0x0 };
+  CONST UINT32  ApcieRanges[] = { 0x0, 0x90000000, 0x1, 0x10000000 };
+  CONST UINT32  Bridge0Reg[] = { 0x100000, 0x1000 };
+  CONST UINT32  Bridge1Reg[] = { 0x200000, 0x1000 };
+  CONST UINT32  BadReg[]     = { 0x1000, 0x0, 0x0, 0x100 };
+  CONST UINT32  Cpu1Reg[]    = { 0x10100 };
+  UINT32        Zero         = 0;
+
+  Fixture->Offset = 0;
+
+  FixtureNode (Fixture, 3, 2);
+  FixtureName (Fixture, "device-tree");
+  FixtureU32 (Fixture, "#address-cells", 2);
+  FixtureU32 (Fixture, "#size-cells", 2);
+
+  FixtureNode (Fixture, 4, 4);
+  FixtureName (Fixture, "arm-io");
+  FixtureU32 (Fixture, "#address-cells", 2);
+  FixtureU32 (Fixture, "#size-cells", 2);
+  FixtureProp (Fixture, "ranges", ArmIoRanges, sizeof (ArmIoRanges));
+
+  FixtureNode (Fixture, 3, 0);
+  FixtureName (Fixture, "uart0");
+  FixtureProp (Fixture, "compatible", "uart-1,samsung", sizeof ("uart-1,samsung"));
+  FixtureProp (Fixture, "reg", UartReg, sizeof (UartReg));
+
+  FixtureNode (Fixture, 2, 0);
+  FixtureName (Fixture, "dart-usb0");
+  FixtureProp (Fixture, "reg", DartReg, sizeof (DartReg));
+
+  FixtureNode (Fixture, 4, 2);
+  FixtureName (Fixture, "apcie");
+  FixtureU32 (Fixture, "#address-cells", 1);
+  FixtureU32 (Fixture, "#size-cells", 1);
+  FixtureProp (Fixture, "ranges", ApcieRanges, sizeof (ApcieRanges));
+
+  FixtureNode (Fixture, 2, 0);
+  FixtureName (Fixture, "pci-bridge0");
+  FixtureProp (Fixture, "reg", Bridge0Reg, sizeof (Bridge0Reg));
+
+  FixtureNode (Fixture, 2, 0);
+  FixtureName (Fixture, "pci-bridge1");
+  FixtureProp (Fixture, "reg", Bridge1Reg, sizeof (Bridge1Reg));
+
+  FixtureNode (Fixture, 3, 1);
+  FixtureName (Fixture, "bad-bus");
+  FixtureU32 (Fixture, "#address-cells", 3);
+  FixtureU32 (Fixture, "#size-cells", 1);
+
+  FixtureNode (Fixture, 2, 0);
+  FixtureName (Fixture, "bad-dev");
+  FixtureProp (Fixture, "reg", BadReg, sizeof (BadReg));
+
+  FixtureNode (Fixture, 3, 2);
+  FixtureName (Fixture, "cpus");
+  FixtureU32 (Fixture, "#address-cells", 1);
+  FixtureU32 (Fixture, "#size-cells", 0);
+
+  FixtureNode (Fixture, 2, 0);
+  FixtureName (Fixture, "cpu0");
+  FixtureProp (Fixture, "reg", &Zero, sizeof (Zero));
+
+  FixtureNode (Fixture, 2, 0);
+  FixtureName (Fixture, "cpu1");
+  FixtureProp (Fixture, "reg", Cpu1Reg, sizeof (Cpu1Reg));
+}
+
+/**
+  device-tree                 #address-cells 2, #size-cells 2
+    arm-io                    0x0 -> 0x2_0000_0000, 4G, unterminated key, placeholder property
+      dup                     first node named "dup"
+      bus0                    #address-cells 1, #size-cells 1, 0x0 -> 0x1000_0000, 16M
+        bus1 .. bus5          0x0 -> 0x10_0000, 0x1_0000, 0x1000, 0x100 and 0x10 of the parent
+          leaf                0x4, ends up at 0x2_1011_1114
+    cpus
+      dup                     second node named "dup"
+**/
+STATIC
+VOID
+QuirksBuild (
+  IN OUT DT_FIXTURE  *Fixture
+  )
+{
+  CONST UINT32  ArmIoRanges[] = { 0x0, 0x0, 0x0, 0x2, 0x0, 0x1 };
+  CONST UINT32  Bus0Ranges[]  = { 0x0, 0x10000000, 0x0, 0x1000000 };
+  CONST UINT32  LeafReg[]     = { 0x4, 0x4 };
+  UINT32        BusRanges[3];
+  CHAR8         BusName[8];
+  UINT32        Level;
+
+  Fixture->Offset = 0;
+
+  FixtureNode (Fixture, 3, 2);
+  FixtureName (Fixture, "device-tree");
+  FixtureU32 (Fixture, "#address-cells", 2);
+  FixtureU32 (Fixture, "#size-cells", 2);
+
+  FixtureNode (Fixture, 6, 2);
+  FixtureName (Fixture, "arm-io");
+  FixtureU32 (Fixture, "#address-cells", 2);
+  FixtureU32 (Fixture, "#size-cells", 2);
+  FixtureProp (Fixture, "ranges", ArmIoRanges, sizeof (ArmIoRanges));
+  FixturePropRaw (Fixture, "AAPL,unterminated-property-key!!", "x", 2, 0);
+  FixturePropRaw (Fixture, "AAPL,placeholder", "y", 2, ADT_PROP_PLACEHOLDER);
+
+  FixtureNode (Fixture, 1, 0);
+  FixtureName (Fixture, "dup");
+
+  FixtureNode (Fixture, 4, 1);
+  FixtureName (Fixture, "bus0");
+  FixtureU32 (Fixture, "#address-cells", 1);
+  FixtureU32 (Fixture, "#size-cells", 1);
+  FixtureProp (Fixture, "ranges", Bus0Ranges, sizeof (Bus0Ranges));
+
+  for (Level = 1; Level <= 5; Level++) {
+    BusRanges[0] = 0;
+    BusRanges[1] = 0x1000000 >> (4 * Level);
+    BusRanges[2] = BusRanges[1];
+    AsciiSPrint (BusName, sizeof (BusName), "bus%u", Level);
+    FixtureNode (Fixture, 4, 1);
+    FixtureName (Fixture, BusName);
+    FixtureU32 (Fixture, "#address-cells", 1);
+    FixtureU32 (Fixture, "#size-cells", 1);
+    FixtureProp (Fixture, "ranges", BusRanges, sizeof (BusRanges));
+  }
+
+  FixtureNode (Fixture, 2, 0);
+  FixtureName (Fixture, "leaf");
+  FixtureProp (Fixture, "reg", LeafReg, sizeof (LeafReg));
+
+  FixtureNode (Fixture, 1, 1);
+  FixtureName (Fixture, "cpus");
+
+  FixtureNode (Fixture, 1, 0);
+  FixtureName (Fixture, "dup");
+}
+
+/**
+  Index the tree in Fixture->Buffer and make it the one every lookup goes through.
+**/
+STATIC
+EFI_STATUS
+FixtureIndex (
+  IN OUT DT_FIXTURE  *Fixture
+  )
+{
+  UINTN  Need;
+
+  if (dt_check (Fixture->Buffer, Fixture->Offset, NULL) != 0) {
+    return EFI_VOLUME_CORRUPTED;
+  }
+
+  Need = dt_index_size (Fixture->Buffer, Fixture->Offset);
+  if (Need == 0) {
+    return EFI_VOLUME_CORRUPTED;
+  }
+
+  Fixture->IndexPages = EFI_SIZE_TO_PAGES (Need);
+  Fixture->Index      = AllocatePages (Fixture->IndexPages);
+  if (Fixture->Index == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  if (dt_index_init (Fixture->Index, EFI_PAGES_TO_SIZE (Fixture->IndexPages), Fixture->Buffer, Fixture->Offset) != 0) {
+    return EFI_VOLUME_CORRUPTED;
+  }
+
+  Fixture->OldIndex = dt_index_swap (Fixture->Index);
+  return EFI_SUCCESS;
+}
+
+STATIC
+VOID
+EFIAPI
+FixtureCleanup (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  DT_FIXTURE  *Fixture;
+
+  Fixture = (DT_FIXTURE *)Context;
+  if (Fixture->Index != NULL) {
+    dt_index_swap (Fixture->OldIndex);
+    FreePages (Fixture->Index, Fixture->IndexPages);
+    Fixture->Index = NULL;
+  }
+}
+
+STATIC
+UNIT_TEST_STATUS
+EFIAPI
+FixtureSetup (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  DT_FIXTURE  *Fixture;
+
+  Fixture = (DT_FIXTURE *)Context;
+  Fixture->Build (Fixture);
+  if (EFI_ERROR (FixtureIndex (Fixture))) {
+    FixtureCleanup (Fixture);
+    return UNIT_TEST_ERROR_PREREQUISITE_NOT_MET;
+  }
+
+  return UNIT_TEST_PASSED;
+}
+
+STATIC
+dt_node_t *
+FixtureFind (
+  IN DT_FIXTURE   *Fixture,
+  IN CONST CHAR8  *Name
+  )
+{
+  return dt_find ((dt_node_t *)Fixture->Buffer, Name);
+}
+
+/**
+  Every node, property, parent and reg lookup agrees with the reference walk.
+**/
+STATIC
+UNIT_TEST_STATUS
+EFIAPI
+LookupsMatchReference (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  DT_FIXTURE  *Fixture;
+
+  Fixture = (DT_FIXTURE *)Context;
+  UT_ASSERT_EQUAL (dt_selftest ((dt_node_t *)Fixture->Buffer, NULL), 0);
+
+  // Again with the bus and reg caches warm.
+  UT_ASSERT_EQUAL (dt_selftest ((dt_node_t *)Fixture->Buffer, NULL), 0);
+  return UNIT_TEST_PASSED;
+}
+
+STATIC
+UNIT_TEST_STATUS
+EFIAPI
+RegTranslation (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  DT_FIXTURE     *Fixture;
+  dt_node_t      *Node;
+  UINT64         Addr;
+  UINT64         Size;
+  struct memmap  Regs[4];
+
+  Fixture = (DT_FIXTURE *)Context;
+
+  Node = FixtureFind (Fixture, "uart0");
+  UT_ASSERT_NOT_NULL (Node);
+  UT_ASSERT_EQUAL (dt_node_reg (Node, 0, &Addr, &Size), 0);
+  UT_ASSERT_EQUAL (Addr, 0x235200000ULL);
+  UT_ASSERT_EQUAL (Size, 0x4000);
+  UT_ASSERT_NOT_EQUAL (dt_node_reg (Node, 1, &Addr, &Size), 0);
+
+  // Outside of every arm-io window, the address passes through untranslated.
+  Node = FixtureFind (Fixture, "dart-usb0");
+  UT_ASSERT_NOT_NULL (Node);
+  UT_ASSERT_EQUAL (dt_node_regs (Node, Regs, ARRAY_SIZE (Regs)), 2);
+  UT_ASSERT_EQUAL (Regs[0].addr, 0x82f000000ULL);
+  UT_ASSERT_EQUAL (Regs[1].addr, 0x382000000ULL);
+
+  // Two levels of ranges, the second with one-cell addresses.
+  Node = FixtureFind (Fixture, "pci-bridge1");
+  UT_ASSERT_NOT_NULL (Node);
+  UT_ASSERT_EQUAL (dt_node_reg (Node, 0, &Addr, &Size), 0);
+  UT_ASSERT_EQUAL (Addr, 0x590200000ULL);
+  UT_ASSERT_EQUAL (Size, 0x1000);
+
+  Node = FixtureFind (Fixture, "cpu1");
+  UT_ASSERT_NOT_NULL (Node);
+  UT_ASSERT_EQUAL (dt_node_reg (Node, 0, &Addr, &Size), 0);
+  UT_ASSERT_EQUAL (Addr, 0x10100);
+  UT_ASSERT_EQUAL (Size, 0);
+
+  Node = FixtureFind (Fixture, "bad-dev");
+  UT_ASSERT_NOT_NULL (Node);
+  UT_ASSERT_NOT_EQUAL (dt_node_reg (Node, 0, &Addr, &Size), 0);
+  return UNIT_TEST_PASSED;
+}
+
+STATIC
+UNIT_TEST_STATUS
+EFIAPI
+Enumeration (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  DT_FIXTURE  *Fixture;
+  dt_node_t   *Nodes[4];
+  dt_node_t   *Apcie;
+
+  Fixture = (DT_FIXTURE *)Context;
+  Apcie   = FixtureFind (Fixture, "apcie");
+  UT_ASSERT_NOT_NULL (Apcie);
+
+  UT_ASSERT_EQUAL (dt_foreach_name_prefix (Apcie, "pci-bridge", Nodes, ARRAY_SIZE (Nodes)), 2);
+  UT_ASSERT_EQUAL (dt_node_name_index (Nodes[0], "pci-bridge"), 0);
+  UT_ASSERT_EQUAL (dt_node_name_index (Nodes[1], "pci-bridge"), 1);
+  UT_ASSERT_TRUE (dt_node_parent (Nodes[1]) == Apcie);
+
+  UT_ASSERT_EQUAL (dt_foreach_child (FixtureFind (Fixture, "cpus"), NULL, 0), 2);
+  UT_ASSERT_EQUAL (dt_foreach_compatible ((dt_node_t *)Fixture->Buffer, "uart-1,samsung", Nodes, 1), 1);
+  UT_ASSERT_TRUE (Nodes[0] == FixtureFind (Fixture, "uart0"));
+  return UNIT_TEST_PASSED;
+}
+
+STATIC
+UNIT_TEST_STATUS
+EFIAPI
+Quirks (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  DT_FIXTURE  *Fixture;
+  dt_node_t   *Node;
+  dt_node_t   *Dup[2];
+  UINT64      Addr;
+  UINT64      Size;
+  size_t      Len;
+
+  Fixture = (DT_FIXTURE *)Context;
+  UT_ASSERT_EQUAL (dt_selftest ((dt_node_t *)Fixture->Buffer, NULL), 0);
+
+  // The first of two nodes with the same name wins, enumeration still finds both.
+  UT_ASSERT_EQUAL (dt_foreach_name_prefix ((dt_node_t *)Fixture->Buffer, "dup", Dup, ARRAY_SIZE (Dup)), 2);
+  UT_ASSERT_TRUE (FixtureFind (Fixture, "dup") == Dup[0]);
+  UT_ASSERT_TRUE (dt_node_parent (Dup[1]) == FixtureFind (Fixture, "cpus"));
+
+  // No prefix match on an unterminated key, and the placeholder flag isn't part of the length.
+  Node = FixtureFind (Fixture, "arm-io");
+  UT_ASSERT_NOT_NULL (Node);
+  UT_ASSERT_TRUE (dt_node_prop (Node, "AAPL,unterminated-property-key!", NULL) == NULL);
+  Len = 0;
+  UT_ASSERT_NOT_NULL (dt_node_prop (Node, "AAPL,placeholder", &Len));
+  UT_ASSERT_EQUAL (Len, 2);
+
+  Node = FixtureFind (Fixture, "leaf");
+  UT_ASSERT_NOT_NULL (Node);
+  UT_ASSERT_EQUAL (dt_node_reg (Node, 0, &Addr, &Size), 0);
+  UT_ASSERT_EQUAL (Addr, 0x210111114ULL);
+  UT_ASSERT_EQUAL (Size, 0x4);
+  return UNIT_TEST_PASSED;
+}
+
+STATIC
+VOID
+EFIAPI
+CaptureCleanup (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  DT_CAPTURE  *Capture;
+
+  Capture = (DT_CAPTURE *)Context;
+  FixtureCleanup (&Capture->Fixture);
+  if (Capture->Fixture.Buffer != NULL) {
+    FreePool (Capture->Fixture.Buffer);
+    Capture->Fixture.Buffer = NULL;
+  }
+}
+
+/**
+  Read Capture->File from $ADT_FIXTURE_DIR, or from the Fixtures directory next to this file.
+  Leaves Capture->Fixture.Buffer NULL if it isn't there.
+**/
+STATIC
+EFI_STATUS
+CaptureLoad (
+  IN OUT DT_CAPTURE  *Capture
+  )
+{
+  CHAR8       Path[512];
+  CONST CHAR8 *Dir;
+  CONST CHAR8 *Slash;
+  FILE        *File;
+  long        Size;
+
+  Dir = getenv ("ADT_FIXTURE_DIR");
+  if (Dir != NULL) {
+    AsciiSPrint (Path, sizeof (Path), "%a/%a", Dir, Capture->File);
+  } else {
+    Slash = AsciiStrStr (__FILE__, "AppleDTLibHostTest.c");
+    AsciiSPrint (Path, sizeof (Path), "%.*aFixtures/%a", (UINTN)(Slash - __FILE__), __FILE__, Capture->File);
+  }
+
+  File = fopen (Path, "rb");
+  if (File == NULL) {
+    UT_LOG_WARNING ("%a: no capture at %a\n", Capture->Soc, Path);
+    return EFI_NOT_FOUND;
+  }
+
+  Size = -1;
+  if (fseek (File, 0, SEEK_END) == 0) {
+    Size = ftell (File);
+  }
+
+  if ((Size <= 0) || (fseek (File, 0, SEEK_SET) != 0)) {
+    fclose (File);
+    return EFI_VOLUME_CORRUPTED;
+  }
+
+  Capture->Fixture.Size   = (UINTN)Size;
+  Capture->Fixture.Offset = (UINTN)Size;
+  Capture->Fixture.Buffer = AllocatePool (Capture->Fixture.Size);
+  if (Capture->Fixture.Buffer == NULL) {
+    fclose (File);
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  if (fread (Capture->Fixture.Buffer, 1, Capture->Fixture.Size, File) != Capture->Fixture.Size) {
+    fclose (File);
+    return EFI_VOLUME_CORRUPTED;
+  }
+
+  fclose (File);
+  UT_LOG_INFO ("%a: %a, %u bytes\n", Capture->Soc, Path, (UINT32)Size);
+  return EFI_SUCCESS;
+}
+
+/**
+  A capture that isn't there passes setup and is skipped by the test, a broken one fails setup.
+**/
+STATIC
+UNIT_TEST_STATUS
+EFIAPI
+CaptureSetup (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  DT_CAPTURE  *Capture;
+  EFI_STATUS  Status;
+
+  Capture = (DT_CAPTURE *)Context;
+  Status  = CaptureLoad (Capture);
+  if (Status == EFI_NOT_FOUND) {
+    return UNIT_TEST_PASSED;
+  }
+
+  if (EFI_ERROR (Status) || EFI_ERROR (FixtureIndex (&Capture->Fixture))) {
+    CaptureCleanup (Capture);
+    return UNIT_TEST_ERROR_PREREQUISITE_NOT_MET;
+  }
+
+  return UNIT_TEST_PASSED;
+}
+
+STATIC
+UNIT_TEST_STATUS
+EFIAPI
+CaptureLookups (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  DT_CAPTURE  *Capture;
+  dt_node_t   *Root;
+  dt_node_t   *Cpus;
+
+  Capture = (DT_CAPTURE *)Context;
+  if (Capture->Fixture.Buffer == NULL) {
+    return UNIT_TEST_SKIPPED;
+  }
+
+  Root = (dt_node_t *)Capture->Fixture.Buffer;
+  UT_ASSERT_NOT_NULL (dt_find (Root, "arm-io"));
+  Cpus = dt_find (Root, "cpus");
+  UT_ASSERT_NOT_NULL (Cpus);
+  UT_ASSERT_NOT_EQUAL (dt_foreach_name_prefix (Cpus, "cpu", NULL, 0), 0);
+
+  UT_ASSERT_EQUAL (dt_selftest (Root, NULL), 0);
+  UT_ASSERT_EQUAL (dt_selftest (Root, NULL), 0);
+  return UNIT_TEST_PASSED;
+}
+
+STATIC
+VOID
+EFIAPI
+SynthCleanup (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  DT_SYNTH  *Synth;
+
+  Synth = (DT_SYNTH *)Context;
+  if (Synth->Tree != NULL) {
+    FreePages (Synth->Tree, Synth->TreePages);
+    Synth->Tree = NULL;
+  }
+
+  if (Synth->Index != NULL) {
+    FreePages (Synth->Index, Synth->IndexPages);
+    Synth->Index = NULL;
+  }
+}
+
+/**
+  Allocate the tree and index buffers once, for the biggest tree, every step reuses them.
+**/
+STATIC
+UNIT_TEST_STATUS
+EFIAPI
+SynthSetup (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  DT_SYNTH    *Synth;
+  dt_synth_t  Shape;
+  UINTN       Size;
+
+  Synth       = (DT_SYNTH *)Context;
+  Shape       = Synth->Shape;
+  Shape.nodes = Synth->Shape.nodes << (SYNTH_STEPS - 1);
+
+  Size = dt_synth (NULL, 0, &Shape);
+  if (Size == 0) {
+    return UNIT_TEST_ERROR_PREREQUISITE_NOT_MET;
+  }
+
+  Synth->TreePages = EFI_SIZE_TO_PAGES (Size);
+  Synth->Tree      = AllocatePages (Synth->TreePages);
+  if ((Synth->Tree == NULL) || (dt_synth (Synth->Tree, Size, &Shape) != Size)) {
+    SynthCleanup (Synth);
+    return UNIT_TEST_ERROR_PREREQUISITE_NOT_MET;
+  }
+
+  Size = dt_index_size (Synth->Tree, Size);
+  if (Size == 0) {
+    SynthCleanup (Synth);
+    return UNIT_TEST_ERROR_PREREQUISITE_NOT_MET;
+  }
+
+  Synth->IndexPages = EFI_SIZE_TO_PAGES (Size);
+  Synth->Index      = AllocatePages (Synth->IndexPages);
+  if (Synth->Index == NULL) {
+    SynthCleanup (Synth);
+    return UNIT_TEST_ERROR_PREREQUISITE_NOT_MET;
+  }
+
+  return UNIT_TEST_PASSED;
+}
+
+STATIC
+UNIT_TEST_STATUS
+EFIAPI
+SynthScaling (
+  IN UNIT_TEST_CONTEXT  Context
+  )
+{
+  DT_SYNTH           *Synth;
+  dt_synth_t         Shape;
+  dt_index_t         *OldIndex;
+  dt_bench_result_t  Result[SYNTH_STEPS];
+  dt_bench_result_t  Warm;
+  UINTN              Size;
+  UINT32             Op;
+
+  Synth = (DT_SYNTH *)Context;
+  Shape = Synth->Shape;
+
+  for (UINT32 Step = 0; Step < SYNTH_STEPS; Step++, Shape.nodes *= 2) {
+    Size = dt_synth (Synth->Tree, EFI_PAGES_TO_SIZE (Synth->TreePages), &Shape);
+    UT_ASSERT_NOT_EQUAL (Size, 0);
+    UT_ASSERT_EQUAL (dt_check (Synth->Tree, Size, NULL), 0);
+    UT_ASSERT_EQUAL (dt_index_init (Synth->Index, EFI_PAGES_TO_SIZE (Synth->IndexPages), Synth->Tree, Size), 0);
+
+    UT_LOG_INFO ("Synthetic DeviceTree: %u nodes, %u props, %u bytes\n", Synth->Index->nnode, Synth->Index->nprop, (UINT32)Size);
+    OldIndex = dt_index_swap (Synth->Index);
+    dt_selftest ((dt_node_t *)Synth->Tree, &Result[Step]);
+    dt_selftest ((dt_node_t *)Synth->Tree, &Warm);
+    dt_index_swap (OldIndex);
+    UT_ASSERT_EQUAL (Result[Step].bad, 0);
+    UT_ASSERT_EQUAL (Warm.bad, 0);
+
+    // The faster of a cold and a warm run, the other one is noise.
+    for (Op = 0; Op < DT_BENCH_MAX; Op++) {
+      Result[Step].ns[Op] = MIN (Result[Step].ns[Op], Warm.ns[Op]);
+    }
+  }
+
+  UT_LOG_INFO ("   nodes  dt_get ns  dt_node_prop ns  dt_node_parent ns  dt_node_reg ns\n");
+  for (UINT32 Step = 0; Step < SYNTH_STEPS; Step++) {
+    UT_LOG_INFO (
+      "%8u  %9lu  %15lu  %17lu  %14lu\n",
+      Result[Step].nodes,
+      Result[Step].ns[DT_BENCH_GET],
+      Result[Step].ns[DT_BENCH_PROP],
+      Result[Step].ns[DT_BENCH_PARENT],
+      Result[Step].ns[DT_BENCH_REG]
+      );
+  }
+
+  for (Op = 0; Op < DT_BENCH_MAX; Op++) {
+    UT_ASSERT_TRUE (Result[SYNTH_STEPS - 1].ns[Op] <= SYNTH_MAX_GROWTH * MAX (Result[0].ns[Op], SYNTH_MIN_NS));
+  }
+
+  return UNIT_TEST_PASSED;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+UnitTestingEntry (
+  VOID
+  )
+{
+  EFI_STATUS                  Status;
+  UNIT_TEST_FRAMEWORK_HANDLE  Framework;
+  UNIT_TEST_SUITE_HANDLE      LookupSuite;
+  UNIT_TEST_SUITE_HANDLE      CaptureSuite;
+  UNIT_TEST_SUITE_HANDLE      SynthSuite;
+  UINTN                       Index;
+
+  Framework = NULL;
+
+  DEBUG ((DEBUG_INFO, "%a v%a\n", UNIT_TEST_APP_NAME, UNIT_TEST_APP_VERSION));
+
+  Status = InitUnitTestFramework (&Framework, UNIT_TEST_APP_NAME, gEfiCallerBaseName, UNIT_TEST_APP_VERSION);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((DEBUG_ERROR, "Failed in InitUnitTestFramework. Status = %r\n", Status));
+    goto EXIT;
+  }
+
+  mFixture.Size   = FIXTURE_SIZE;
+  mFixture.Buffer = AllocateZeroPool (mFixture.Size);
+  mQuirks.Size    = FIXTURE_SIZE;
+  mQuirks.Buffer  = AllocateZeroPool (mQuirks.Size);
+  if ((mFixture.Buffer == NULL) || (mQuirks.Buffer == NULL)) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto EXIT;
+  }
+
+  Status = CreateUnitTestSuite (&LookupSuite, Framework, "DeviceTree lookups", "AppleDTLib.Lookup", NULL, NULL);
+  if (EFI_ERROR (Status)) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto EXIT;
+  }
+
+  AddTestCase (LookupSuite, "Lookups match the reference walk", "Reference", LookupsMatchReference, FixtureSetup, FixtureCleanup, &mFixture);
+  AddTestCase (LookupSuite, "reg is translated through every bus", "Reg", RegTranslation, FixtureSetup, FixtureCleanup, &mFixture);
+  AddTestCase (LookupSuite, "Enumeration finds every instance", "Enum", Enumeration, FixtureSetup, FixtureCleanup, &mFixture);
+  AddTestCase (LookupSuite, "ADT quirks match the reference walk", "Quirks", Quirks, FixtureSetup, FixtureCleanup, &mQuirks);
+
+  Status = CreateUnitTestSuite (&CaptureSuite, Framework, "DeviceTree lookups on captured ADTs", "AppleDTLib.Capture", NULL, NULL);
+  if (EFI_ERROR (Status)) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto EXIT;
+  }
+
+  for (Index = 0; Index < ARRAY_SIZE (mCaptures); Index++) {
+    AddTestCase (CaptureSuite, "Lookups match the reference walk on a captured ADT", mCaptures[Index].Soc, CaptureLookups, CaptureSetup, CaptureCleanup, &mCaptures[Index]);
+  }
+
+  Status = CreateUnitTestSuite (&SynthSuite, Framework, "DeviceTree lookups on synthetic trees", "AppleDTLib.Synth", NULL, NULL);
+  if (EFI_ERROR (Status)) {
+    Status = EFI_OUT_OF_RESOURCES;
+    goto EXIT;
+  }
+
+  AddTestCase (SynthSuite, "Lookups match the reference walk as the tree grows", "Scaling", SynthScaling, SynthSetup, SynthCleanup, &mSynth);
+
+  Status = RunAllTestSuites (Framework);
+
+EXIT:
+  if (mFixture.Buffer != NULL) {
+    FreePool (mFixture.Buffer);
+  }
+
+  if (mQuirks.Buffer != NULL) {
+    FreePool (mQuirks.Buffer);
+  }
+
+  if (Framework != NULL) {
+    FreeUnitTestFramework (Framework);
+  }
+
+  return Status;
+}
+
+int
+main (
+  int   argc,
+  char  *argv[]
+  )
+{
+  return UnitTestingEntry ();
+}
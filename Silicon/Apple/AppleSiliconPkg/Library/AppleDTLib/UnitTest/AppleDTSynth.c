@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2024, AppleWOA authors.
+ *
+ * Module Name:
+ *     AppleDTSynth.c
+ *
+ * Abstract:
+ *     Synthetic DeviceTree generator for scaling tests.
+ *
+ *     Multi-die SoCs have about twice (or four times) the ADT nodes of their single die siblings.
+ *     This produces valid trees in the dt_node_t/dt_prop_t layout with a configurable size and
+ *     shape, so the host unit tests can check how lookup and reg translation cost grow with the
+ *     tree before a bigger machine shows up.
+ *
+ *     The generated tree is a root with `depth` levels of nested buses below it. Each bus has
+ *     `fanout` child buses and a "ranges" mapping its window into its parent's window. The
+ *     deepest buses get enough "reg" carrying leaf devices to reach the requested node count.
+ *
+ * License:
+ *     SPDX-License-Identifier: MIT
+ */
+
+#include <Base.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/DebugLib.h>
+#include <Library/PrintLib.h>
+#include <Library/AppleDTLib.h>
+
+#include "AppleDTSynth.h"
+
+// Every bus level splits its window 16 ways, this keeps the deepest window non-empty with 32-bit cells.
+#define DT_SYNTH_MAX_DEPTH  6
+#define DT_SYNTH_MAX_FANOUT 16
+#define DT_SYNTH_NAME_LEN   16
+
+typedef struct
+{
+    uint8_t *buf;       // NULL to only count the bytes needed
+    size_t size;
+    size_t off;
+    uint32_t rnd;
+    uint32_t id;
+    uint32_t leaves;    // leaves per deepest bus
+    const dt_synth_t *p;
+} dt_synth_ctx_t;
+
+static const dt_synth_t g_dt_synth_default =
+{
+    .nodes     = 2048,
+    .depth     = 3,
+    .fanout    = 4,
+    .props     = 4,
+    .prop_size = 16,
+    .seed      = 0x41444654,
+};
+
+static uint32_t dt_synth_rnd(dt_synth_ctx_t *ctx)
+{
+    // xorshift32, only needs to look less regular than a counter.
+    uint32_t x = ctx->rnd;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    ctx->rnd = x;
+    return x;
+}
+
+static void* dt_synth_put(dt_synth_ctx_t *ctx, size_t len)
+{
+    void *ptr = NULL;
+    if(ctx->buf && ctx->off + len <= ctx->size)
+    {
+        ptr = ctx->buf + ctx->off;
+    }
+    ctx->off += len;
+    return ptr;
+}
+
+static void dt_synth_node(dt_synth_ctx_t *ctx, uint32_t nprop, uint32_t nchld)
+{
+    dt_node_t *node = dt_synth_put(ctx, sizeof(dt_node_t));
+    if(!node) return;
+    node->nprop = nprop;
+    node->nchld = nchld;
+}
+
+static void dt_synth_prop(dt_synth_ctx_t *ctx, const char *key, const void *val, uint32_t len)
+{
+    dt_prop_t *prop = dt_synth_put(ctx, sizeof(dt_prop_t) + ((len + 0x3) & ~0x3));
+    if(!prop) return;
+    ZeroMem(prop, sizeof(dt_prop_t) + ((len + 0x3) & ~0x3));
+    CopyMem(prop->key, key, AsciiStrnLenS(key, DT_KEY_LEN - 1));
+    prop->len = len;
+    if(val) CopyMem(prop->val, val, len);
+}
+
+static void dt_synth_str(dt_synth_ctx_t *ctx, const char *key, const char *str)
+{
+    dt_synth_prop(ctx, key, str, (uint32_t)AsciiStrLen(str) + 1);
+}
+
+static void dt_synth_u32(dt_synth_ctx_t *ctx, const char *key, uint32_t val)
+{
+    dt_synth_prop(ctx, key, &val, sizeof(val));
+}
+
+// Stores `val` as `cells` 32-bit cells, least significant first like get_cells() reads them.
+static uint32_t dt_synth_cells(uint32_t *dst, uint64_t val, uint32_t cells)
+{
+    for(uint32_t i = 0; i < cells; ++i)
+    {
+        dst[i] = (uint32_t)(val >> (32 * i));
+    }
+    return cells;
+}
+
+static void dt_synth_filler(dt_synth_ctx_t *ctx)
+{
+    for(uint32_t i = 0; i < ctx->p->props; ++i)
+    {
+        char key[DT_KEY_LEN];
+        AsciiSPrint(key, sizeof(key), "synth-prop-%u", i);
+        dt_prop_t *prop = ctx->buf ? (dt_prop_t*)(ctx->buf + ctx->off) : NULL;
+        dt_synth_prop(ctx, key, NULL, ctx->p->prop_size);
+        if(!prop || ctx->off > ctx->size) continue;
+        for(uint32_t b = 0; b < ctx->p->prop_size; ++b)
+        {
+            prop->val[b] = (char)dt_synth_rnd(ctx);
+        }
+    }
+}
+
+// Bus levels alternate between one and two cells, so translation sees both.
+static uint32_t dt_synth_level_cells(uint32_t level)
+{
+    return level == 0 || (level & 1) == 0 ? 2 : 1;
+}
+
+static uint64_t dt_synth_level_window(uint32_t level)
+{
+    return 1ULL << (32 - 4 * level);
+}
+
+static void dt_synth_leaf(dt_synth_ctx_t *ctx, uint32_t level, uint32_t i)
+{
+    char name[DT_SYNTH_NAME_LEN];
+    uint32_t cells = dt_synth_level_cells(level);
+    uint64_t slot = dt_synth_level_window(level) / 16;
+    uint32_t reg[8];
+    uint32_t n = 0;
+    // Two reg entries, the second one starting half way into the slot.
+    n += dt_synth_cells(reg + n, (i % 16) * slot, cells);
+    n += dt_synth_cells(reg + n, slot / 2, cells);
+    n += dt_synth_cells(reg + n, (i % 16) * slot + slot / 2, cells);
+    n += dt_synth_cells(reg + n, slot / 2, cells);
+
+    // Some devices share a name, like the per-die instances on real machines do.
+    if((ctx->id & 0x7) == 0)
+    {
+        AsciiSPrint(name, sizeof(name), "dart%u", ctx->id & 0x3f);
+    }
+    else
+    {
+        AsciiSPrint(name, sizeof(name), "dev%u", ctx->id);
+    }
+    ctx->id++;
+
+    dt_synth_node(ctx, 3 + ctx->p->props, 0);
+    dt_synth_str(ctx, "name", name);
+    dt_synth_str(ctx, "compatible", "synth,dev");
+    dt_synth_prop(ctx, "reg", reg, n * sizeof(uint32_t));
+    dt_synth_filler(ctx);
+}
+
+static void dt_synth_bus(dt_synth_ctx_t *ctx, uint32_t level, uint32_t i)
+{
+    char name[DT_SYNTH_NAME_LEN];
+    uint32_t cells = dt_synth_level_cells(level);
+    uint32_t pcells = dt_synth_level_cells(level - 1);
+    uint64_t window = dt_synth_level_window(level);
+    uint32_t ranges[6];
+    uint32_t n = 0;
+    n += dt_synth_cells(ranges + n, 0, cells);
+    n += dt_synth_cells(ranges + n, i * window, pcells);
+    n += dt_synth_cells(ranges + n, window, cells);
+
+    AsciiSPrint(name, sizeof(name), "bus%u", ctx->id++);
+    uint32_t leaf = level == ctx->p->depth;
+    uint32_t nchld = leaf ? ctx->leaves : ctx->p->fanout;
+
+    dt_synth_node(ctx, 5 + ctx->p->props, nchld);
+    dt_synth_str(ctx, "name", name);
+    dt_synth_str(ctx, "compatible", "synth,bus");
+    dt_synth_u32(ctx, "#address-cells", cells);
+    dt_synth_u32(ctx, "#size-cells", cells);
+    dt_synth_prop(ctx, "ranges", ranges, n * sizeof(uint32_t));
+    dt_synth_filler(ctx);
+
+    for(uint32_t c = 0; c < nchld; ++c)
+    {
+        if(leaf) dt_synth_leaf(ctx, level, c);
+        else dt_synth_bus(ctx, level + 1, c);
+    }
+}
+
+size_t dt_synth(void *buf, size_t size, const dt_synth_t *p)
+{
+    if(!p) p = &g_dt_synth_default;
+    if(p->depth < 1 || p->depth > DT_SYNTH_MAX_DEPTH || p->fanout < 1 || p->fanout > DT_SYNTH_MAX_FANOUT)
+    {
+        DEBUG((DEBUG_ERROR, "Bad synthetic DeviceTree shape: depth %u fanout %u\n", p->depth, p->fanout));
+        return 0;
+    }
+    dt_synth_ctx_t ctx = { .buf = buf, .size = size, .rnd = p->seed | 1, .p = p };
+
+    // A single bus hangs off the root, every level below it multiplies by the fanout.
+    uint32_t buses = 1;
+    for(uint32_t l = 1; l < p->depth; ++l) buses *= p->fanout;
+    ctx.leaves = p->nodes > buses ? p->nodes / buses : 1;
+
+    dt_synth_node(&ctx, 3 + p->props, 1);
+    dt_synth_str(&ctx, "name", "device-tree");
+    dt_synth_u32(&ctx, "#address-cells", 2);
+    dt_synth_u32(&ctx, "#size-cells", 2);
+    dt_synth_filler(&ctx);
+    dt_synth_bus(&ctx, 1, 0);
+
+    if(buf && ctx.off > size) return 0;
+    return ctx.off;
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2024, AppleWOA authors.
+ *
+ * Module Name:
+ *     AppleDTSynth.h
+ *
+ * Abstract:
+ *     Synthetic DeviceTree generator for the host unit tests, see AppleDTSynth.c.
+ *
+ * License:
+ *     SPDX-License-Identifier: MIT
+ */
+
+#ifndef APPLEDTSYNTH_H
+#define APPLEDTSYNTH_H
+
+#include <Library/AppleDTLib.h>
+
+// Shape of a synthetic DeviceTree.
+typedef struct
+{
+    uint32_t nodes;     // roughly how many nodes to generate
+    uint32_t depth;     // levels of nested buses with "ranges" below the root, 1 to 6
+    uint32_t fanout;    // child buses per bus, 1 to 16
+    uint32_t props;     // filler properties per node
+    uint32_t prop_size; // bytes per filler property
+    uint32_t seed;
+} dt_synth_t;
+
+/*
+ * Generate a DeviceTree shaped like `p` (a default shape if NULL) into `buf`. Returns the size of
+ * the tree, or 0 if it didn't fit. A NULL `buf` only returns the size needed.
+ */
+size_t dt_synth(void *buf, size_t size, const dt_synth_t *p);
+
+#endif /* APPLEDTSYNTH_H */
@@ -18,6 +18,7 @@
 #include <Pi/PiHob.h>
 #include <PiDxe.h>
 #include <PiPei.h>
+#include <Library/AppleDTLib.h>
 #include <Library/ArmLib.h>
 #include <Library/BaseMemoryLib.h>
 #include <Library/CacheMaintenanceLib.h>
@@ -98,6 +99,13 @@ VOID Main(IN VOID *StackBase, IN UINTN StackSize, IN VOID *DeviceTreePtr, IN UIN
         CpuDeadLoop();
     }
 
+    // Index the ADT once and hand it over to DXE, so every driver linking AppleDTLib doesn't redo it.
+    // Lookups before this point (in MemoryPeim) walk the ADT, the index is only built with the MMU on.
+    if(dt_index_publish() == NULL)
+    {
+        DEBUG((DEBUG_WARN, "PrePi: DeviceTree index unavailable, lookups will parse the ADT\n"));
+    }
+
     //set up stack and CPU HOBs
     DEBUG((EFI_D_INFO | EFI_D_LOAD, "Building up Stack/CPU HOBs\n"));
     DEBUG((EFI_D_INFO | EFI_D_LOAD, "Stack Base: 0x%llx, Stack Size: 0x%llx\n", (UINT64)StackBase, StackSize));
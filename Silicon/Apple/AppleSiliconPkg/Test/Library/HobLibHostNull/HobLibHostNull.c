@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2024, AppleWOA authors.
+ *
+ * Module Name:
+ *     HobLibHostNull.c
+ *
+ * Abstract:
+ *     HobLib for the host unit tests, only the part AppleDTLib calls. There is no HOB list on
+ *     the host, so the index is never handed over and always built (or swapped in) by the test.
+ *
+ * License:
+ *     SPDX-License-Identifier: MIT
+ */
+
+#include <PiPei.h>
+#include <Library/HobLib.h>
+
+VOID *
+EFIAPI
+GetHobList (
+  VOID
+  )
+{
+  return NULL;
+}
+
+VOID *
+EFIAPI
+GetNextHob (
+  IN UINT16      Type,
+  IN CONST VOID  *HobStart
+  )
+{
+  return NULL;
+}
+
+VOID *
+EFIAPI
+GetFirstHob (
+  IN UINT16  Type
+  )
+{
+  return NULL;
+}
+
+VOID *
+EFIAPI
+GetNextGuidHob (
+  IN CONST EFI_GUID  *Guid,
+  IN CONST VOID      *HobStart
+  )
+{
+  return NULL;
+}
+
+VOID *
+EFIAPI
+GetFirstGuidHob (
+  IN CONST EFI_GUID  *Guid
+  )
+{
+  return NULL;
+}
+
+VOID *
+EFIAPI
+BuildGuidHob (
+  IN CONST EFI_GUID  *Guid,
+  IN UINTN           DataLength
+  )
+{
+  return NULL;
+}
+
+VOID *
+EFIAPI
+BuildGuidDataHob (
+  IN CONST EFI_GUID  *Guid,
+  IN VOID            *Data,
+  IN UINTN           DataLength
+  )
+{
+  return NULL;
+}
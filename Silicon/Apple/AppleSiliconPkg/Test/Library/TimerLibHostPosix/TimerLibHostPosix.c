@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2024, AppleWOA authors.
+ *
+ * Module Name:
+ *     TimerLibHostPosix.c
+ *
+ * Abstract:
+ *     TimerLib for the host unit tests. The performance counter is CLOCK_MONOTONIC in nanoseconds,
+ *     delays sleep with nanosleep().
+ *
+ * License:
+ *     SPDX-License-Identifier: MIT
+ */
+
+#include <time.h>
+
+#include <Base.h>
+#include <Library/TimerLib.h>
+
+#define NS_PER_SECOND  1000000000ULL
+
+STATIC
+VOID
+HostSleep (
+  IN UINT64  NanoSeconds
+  )
+{
+  struct timespec  Request;
+
+  Request.tv_sec  = (time_t)(NanoSeconds / NS_PER_SECOND);
+  Request.tv_nsec = (long)(NanoSeconds % NS_PER_SECOND);
+  while (nanosleep (&Request, &Request) != 0) {
+  }
+}
+
+UINTN
+EFIAPI
+MicroSecondDelay (
+  IN UINTN  MicroSeconds
+  )
+{
+  HostSleep ((UINT64)MicroSeconds * 1000);
+  return MicroSeconds;
+}
+
+UINTN
+EFIAPI
+NanoSecondDelay (
+  IN UINTN  NanoSeconds
+  )
+{
+  HostSleep (NanoSeconds);
+  return NanoSeconds;
+}
+
+UINT64
+EFIAPI
+GetPerformanceCounter (
+  VOID
+  )
+{
+  struct timespec  Now;
+
+  clock_gettime (CLOCK_MONOTONIC, &Now);
+  return (UINT64)Now.tv_sec * NS_PER_SECOND + (UINT64)Now.tv_nsec;
+}
+
+UINT64
+EFIAPI
+GetPerformanceCounterProperties (
+  OUT UINT64  *StartValue OPTIONAL,
+  OUT UINT64  *EndValue OPTIONAL
+  )
+{
+  if (StartValue != NULL) {
+    *StartValue = 0;
+  }
+
+  if (EndValue != NULL) {
+    *EndValue = MAX_UINT64;
+  }
+
+  return NS_PER_SECOND;
+}
+
+UINT64
+EFIAPI
+GetTimeInNanoSecond (
+  IN UINT64  Ticks
+  )
+{
+  return Ticks;
+}
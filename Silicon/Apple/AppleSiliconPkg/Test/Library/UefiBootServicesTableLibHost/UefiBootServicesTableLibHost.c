@@ -0,0 +1,279 @@
+/*
+ * Copyright (c) 2024, AppleWOA authors.
+ *
+ * Module Name:
+ *     UefiBootServicesTableLibHost.c
+ *
+ * Abstract:
+ *     UefiBootServicesTableLib for the host unit tests. Everything runs on one thread, so TPLs are
+ *     only tracked, events are notified when signalled, and installed protocols go in a flat table
+ *     LocateProtocol() searches. The rest of gBS is left NULL, a driver calling it crashes the test.
+ *
+ * License:
+ *     SPDX-License-Identifier: MIT
+ */
+
+#include <Uefi.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/DebugLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+
+#define HOST_MAX_PROTOCOLS  32
+
+typedef struct {
+  UINT32              Type;
+  EFI_TPL             NotifyTpl;
+  EFI_EVENT_NOTIFY    NotifyFunction;
+  VOID                *NotifyContext;
+} HOST_EVENT;
+
+typedef struct {
+  EFI_HANDLE    Handle;
+  EFI_GUID      *Protocol;
+  VOID          *Interface;
+} HOST_PROTOCOL;
+
+STATIC EFI_TPL        mHostTpl = TPL_APPLICATION;
+STATIC HOST_PROTOCOL  mHostProtocols[HOST_MAX_PROTOCOLS];
+STATIC UINTN          mHostProtocolCount;
+STATIC UINTN          mHostHandleCount;
+
+STATIC
+EFI_TPL
+EFIAPI
+HostRaiseTpl (
+  IN EFI_TPL  NewTpl
+  )
+{
+  EFI_TPL  OldTpl;
+
+  ASSERT (NewTpl >= mHostTpl);
+  OldTpl   = mHostTpl;
+  mHostTpl = NewTpl;
+  return OldTpl;
+}
+
+STATIC
+VOID
+EFIAPI
+HostRestoreTpl (
+  IN EFI_TPL  OldTpl
+  )
+{
+  ASSERT (OldTpl <= mHostTpl);
+  mHostTpl = OldTpl;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostCreateEvent (
+  IN  UINT32            Type,
+  IN  EFI_TPL           NotifyTpl,
+  IN  EFI_EVENT_NOTIFY  NotifyFunction OPTIONAL,
+  IN  VOID              *NotifyContext OPTIONAL,
+  OUT EFI_EVENT         *Event
+  )
+{
+  HOST_EVENT  *HostEvent;
+
+  if (Event == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  HostEvent = AllocateZeroPool (sizeof (HOST_EVENT));
+  if (HostEvent == NULL) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  HostEvent->Type           = Type;
+  HostEvent->NotifyTpl      = NotifyTpl;
+  HostEvent->NotifyFunction = NotifyFunction;
+  HostEvent->NotifyContext  = NotifyContext;
+  *Event                    = HostEvent;
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostCreateEventEx (
+  IN  UINT32            Type,
+  IN  EFI_TPL           NotifyTpl,
+  IN  EFI_EVENT_NOTIFY  NotifyFunction OPTIONAL,
+  IN  CONST VOID        *NotifyContext OPTIONAL,
+  IN  CONST EFI_GUID    *EventGroup OPTIONAL,
+  OUT EFI_EVENT         *Event
+  )
+{
+  return HostCreateEvent (Type, NotifyTpl, NotifyFunction, (VOID *)NotifyContext, Event);
+}
+
+/**
+  Timers never fire on the host, a test that wants the notify function to run signals the event.
+**/
+STATIC
+EFI_STATUS
+EFIAPI
+HostSetTimer (
+  IN EFI_EVENT        Event,
+  IN EFI_TIMER_DELAY  Type,
+  IN UINT64           TriggerTime
+  )
+{
+  return (Event == NULL) ? EFI_INVALID_PARAMETER : EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostSignalEvent (
+  IN EFI_EVENT  Event
+  )
+{
+  HOST_EVENT  *HostEvent;
+  EFI_TPL     OldTpl;
+
+  HostEvent = (HOST_EVENT *)Event;
+  if (HostEvent == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if (HostEvent->NotifyFunction != NULL) {
+    OldTpl = HostRaiseTpl (HostEvent->NotifyTpl);
+    HostEvent->NotifyFunction (Event, HostEvent->NotifyContext);
+    HostRestoreTpl (OldTpl);
+  }
+
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostCloseEvent (
+  IN EFI_EVENT  Event
+  )
+{
+  if (Event == NULL) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  FreePool (Event);
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostInstallProtocolInterface (
+  IN OUT EFI_HANDLE          *Handle,
+  IN     EFI_GUID            *Protocol,
+  IN     EFI_INTERFACE_TYPE  InterfaceType,
+  IN     VOID                *Interface
+  )
+{
+  if ((Handle == NULL) || (Protocol == NULL)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  if (mHostProtocolCount == HOST_MAX_PROTOCOLS) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  if (*Handle == NULL) {
+    //
+    // Handles are only compared, any unique non-NULL value does.
+    //
+    *Handle = (EFI_HANDLE)(UINTN)++mHostHandleCount;
+  }
+
+  mHostProtocols[mHostProtocolCount].Handle    = *Handle;
+  mHostProtocols[mHostProtocolCount].Protocol  = Protocol;
+  mHostProtocols[mHostProtocolCount].Interface = Interface;
+  mHostProtocolCount++;
+  return EFI_SUCCESS;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostInstallMultipleProtocolInterfaces (
+  IN OUT EFI_HANDLE  *Handle,
+  ...
+  )
+{
+  VA_LIST     Args;
+  EFI_GUID    *Protocol;
+  VOID        *Interface;
+  EFI_STATUS  Status;
+
+  Status = EFI_SUCCESS;
+  VA_START (Args, Handle);
+  for (Protocol = VA_ARG (Args, EFI_GUID *); Protocol != NULL; Protocol = VA_ARG (Args, EFI_GUID *)) {
+    Interface = VA_ARG (Args, VOID *);
+    Status    = HostInstallProtocolInterface (Handle, Protocol, EFI_NATIVE_INTERFACE, Interface);
+    if (EFI_ERROR (Status)) {
+      break;
+    }
+  }
+
+  VA_END (Args);
+  return Status;
+}
+
+STATIC
+EFI_STATUS
+EFIAPI
+HostLocateProtocol (
+  IN  EFI_GUID  *Protocol,
+  IN  VOID      *Registration OPTIONAL,
+  OUT VOID      **Interface
+  )
+{
+  if ((Protocol == NULL) || (Interface == NULL)) {
+    return EFI_INVALID_PARAMETER;
+  }
+
+  for (UINTN i = 0; i < mHostProtocolCount; i++) {
+    if (CompareGuid (mHostProtocols[i].Protocol, Protocol)) {
+      *Interface = mHostProtocols[i].Interface;
+      return EFI_SUCCESS;
+    }
+  }
+
+  *Interface = NULL;
+  return EFI_NOT_FOUND;
+}
+
+STATIC EFI_BOOT_SERVICES  mHostBootServices = {
+  .Hdr                               = {
+    .Signature  = EFI_BOOT_SERVICES_SIGNATURE,
+    .Revision   = EFI_BOOT_SERVICES_REVISION,
+    .HeaderSize = sizeof (EFI_BOOT_SERVICES),
+  },
+  .RaiseTPL                          = HostRaiseTpl,
+  .RestoreTPL                        = HostRestoreTpl,
+  .CreateEvent                       = HostCreateEvent,
+  .CreateEventEx                     = HostCreateEventEx,
+  .SetTimer                          = HostSetTimer,
+  .SignalEvent                       = HostSignalEvent,
+  .CloseEvent                        = HostCloseEvent,
+  .InstallProtocolInterface          = HostInstallProtocolInterface,
+  .InstallMultipleProtocolInterfaces = HostInstallMultipleProtocolInterfaces,
+  .LocateProtocol                    = HostLocateProtocol,
+};
+
+STATIC EFI_SYSTEM_TABLE  mHostSystemTable = {
+  .Hdr          = {
+    .Signature  = EFI_SYSTEM_TABLE_SIGNATURE,
+    .Revision   = EFI_SYSTEM_TABLE_REVISION,
+    .HeaderSize = sizeof (EFI_SYSTEM_TABLE),
+  },
+  .BootServices = &mHostBootServices,
+};
+
+EFI_HANDLE         gImageHandle = (EFI_HANDLE)(UINTN)MAX_UINTN;
+EFI_SYSTEM_TABLE   *gST         = &mHostSystemTable;
+EFI_BOOT_SERVICES  *gBS         = &mHostBootServices;